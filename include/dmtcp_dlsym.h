@@ -19,6 +19,9 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#ifndef DMTCP_DLSYM_H
+#define DMTCP_DLSYM_H
+
 #include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -45,6 +48,16 @@ EXTERNC void *dmtcp_dlsym_lib(const char *libname, const char *symbol);
 EXTERNC ptrdiff_t dmtcp_dlsym_lib_fnc_offset(const char *libname,
                                              const char *symbol);
 
+/*
+ * Used internally by DMTCP: maps the node-wide cache of symbol lookups from
+ * the given directory (NULL disables it).  The mapping is not saved in the
+ * checkpoint image: it is detached while the image is written, so that the
+ * image holds no pointer to it, and attached again on resume.
+ */
+EXTERNC void dmtcp_dlsym_cache_init(const char *dir);
+EXTERNC void *dmtcp_dlsym_cache_detach(void);
+EXTERNC void dmtcp_dlsym_cache_attach(void *cache);
+
 #ifndef STANDALONE
 
 // This implementation mirrors dmtcp.h:NEXT_FNC() for DMTCP.
@@ -127,3 +140,4 @@ main()
   return 0;
 }
 #endif // ifdef STANDALONE
+#endif // ifndef DMTCP_DLSYM_H
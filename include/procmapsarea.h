@@ -56,7 +56,9 @@ typedef char *VA;  /* VA = virtual address */
 
 typedef enum ProcMapsAreaProperties {
   DMTCP_ZERO_PAGE = 0x0001,
-  DMTCP_SKIP_WRITING_TEXT_SEGMENTS = 0x0002
+  DMTCP_SKIP_WRITING_TEXT_SEGMENTS = 0x0002,
+  DMTCP_SYSV_SHM_AREA = 0x0004,
+  DMTCP_SHARED_AREA_REF = 0x0008
 } ProcMapsAreaProperties;
 
 typedef union ProcMapsArea {
@@ -100,6 +102,16 @@ typedef union ProcMapsArea {
 
     uint64_t properties;
 
+    // For DMTCP_SYSV_SHM_AREA: the SysV shared memory segment that this area
+    // is part of.
+    union {
+      VA shmAddr;
+      uint64_t __shmAddr;
+    };
+    uint64_t shmSize;
+    int32_t shmKey;
+    int32_t shmMode;
+
     char name[FILENAMESIZE];
   };
   char _padding[4096];
@@ -31,6 +31,7 @@
 
 #include "dmtcp.h"
 #include "dmtcpalloc.h"
+#include "procmapsarea.h"
 
 #define PTS_PATH_MAX             32
 #define MAX_PID_MAPS             32768
@@ -39,10 +40,19 @@
 #define MAX_PTRACE_ID_MAPS       256
 #define MAX_INCOMING_CONNECTIONS 10240
 #define MAX_INODE_PID_MAPS       10240
+
+// Capacities of the open-addressing hash tables in the shared area.  These
+// must be powers of two and are kept well above the MAX_*_MAPS limits to
+// keep probe sequences short.
+#define PID_MAP_TABLE_SIZE       (2 * MAX_PID_MAPS)
+#define IPC_ID_MAP_TABLE_SIZE    (2 * MAX_IPC_ID_MAPS)
+#define INODE_CONN_ID_TABLE_SIZE 16384
+#define SHARED_AREA_TABLE_SIZE   4096
+#define SYSV_LEADER_TABLE_SIZE   (4 * IPC_ID_MAP_TABLE_SIZE)
 #define CON_ID_LEN \
   (sizeof(DmtcpUniqueProcessId) + sizeof(int64_t))
 
-#define SHM_VERSION_STR          "DMTCP_GLOBAL_AREA_V0.99"
+#define SHM_VERSION_STR          "DMTCP_GLOBAL_AREA_V1.00"
 #define VIRT_PTS_PREFIX_STR      "/dev/pts/v"
 
 #define SYSV_SHM_ID              1
@@ -62,14 +72,21 @@ typedef struct CoordinatorInfo {
 namespace SharedData
 {
 // All structs should be 64-bit aligned.
+
+// Hash table slots start with a 'tag' word that is claimed with an atomic
+// compare-and-swap by the inserting process.  See shareddata.cpp.
 struct PidMap {
+  uint32_t tag;
   pid_t virt;
   pid_t real;
+  uint32_t _pad;
 };
 
 struct IPCIdMap {
+  uint32_t tag;
   int32_t virt;
   int32_t real;
+  uint32_t _pad;
 };
 
 struct PtyNameMap {
@@ -94,6 +111,38 @@ typedef struct InodeConnIdMap {
   char id[CON_ID_LEN];
 } InodeConnIdMap;
 
+struct InodeConnIdSlot {
+  uint32_t tag;
+  uint32_t _pad;
+  InodeConnIdMap map;
+};
+
+// The process elected to write the contents of a range of a MAP_SHARED file
+// mapping into its checkpoint image.
+typedef struct SharedAreaMap {
+  uint64_t devnum;
+  uint64_t inode;
+  uint64_t offset;
+  uint64_t size;
+  DmtcpUniqueProcessId leader;
+} SharedAreaMap;
+
+struct SharedAreaSlot {
+  uint32_t tag;
+  uint32_t _pad;
+  SharedAreaMap map;
+};
+
+// The process elected to save a SysV shm segment, semaphore set or message
+// queue, identified by its real id.
+struct SysVLeaderSlot {
+  uint32_t tag;
+  int32_t type;
+  int32_t realId;
+  uint32_t _pad;
+  DmtcpUniqueProcessId leader;
+};
+
 struct BarrierInfo {
   uint64_t numCkptPeers;
 
@@ -124,6 +173,10 @@ struct Header {
   uint32_t numPidMaps;
   uint32_t numPtraceIdMaps;
 
+  // Incremented by every update of pidMap.
+  uint32_t pidMapVersion;
+  uint32_t _pad0;
+
   uint32_t numSysVShmIdMaps;
   uint32_t numSysVSemIdMaps;
   uint32_t numSysVMsqIdMaps;
@@ -134,20 +187,24 @@ struct Header {
 
   uint32_t numIncomingConMaps;
   uint32_t numInodeConnIdMaps;
+  uint32_t numSharedAreaMaps;
+  uint32_t numSysVLeaders;
 
   union {
     struct BarrierInfo barrierInfo;
     char pad[128];
   };
 
-  struct PidMap pidMap[MAX_PID_MAPS];
-  struct IPCIdMap sysvShmIdMap[MAX_IPC_ID_MAPS];
-  struct IPCIdMap sysvSemIdMap[MAX_IPC_ID_MAPS];
-  struct IPCIdMap sysvMsqIdMap[MAX_IPC_ID_MAPS];
+  struct PidMap pidMap[PID_MAP_TABLE_SIZE];
+  struct IPCIdMap sysvShmIdMap[IPC_ID_MAP_TABLE_SIZE];
+  struct IPCIdMap sysvSemIdMap[IPC_ID_MAP_TABLE_SIZE];
+  struct IPCIdMap sysvMsqIdMap[IPC_ID_MAP_TABLE_SIZE];
   struct PtraceIdMaps ptraceIdMap[MAX_PTRACE_ID_MAPS];
   struct PtyNameMap ptyNameMap[MAX_PTY_NAME_MAPS];
   struct IncomingConMap incomingConMap[MAX_INCOMING_CONNECTIONS];
-  InodeConnIdMap inodeConnIdMap[MAX_INODE_PID_MAPS];
+  struct InodeConnIdSlot inodeConnIdMap[INODE_CONN_ID_TABLE_SIZE];
+  struct SharedAreaSlot sharedAreaMap[SHARED_AREA_TABLE_SIZE];
+  struct SysVLeaderSlot sysvLeaderMap[SYSV_LEADER_TABLE_SIZE];
 
   char versionStr[32];
   DmtcpUniqueProcessId compId;
@@ -205,6 +262,7 @@ void setIPCIdMap(int type, int32_t virt, int32_t real);
 
 pid_t getRealPid(pid_t virt);
 void setPidMap(pid_t virt, pid_t real);
+uint32_t getPidMapVersion();
 
 pid_t getPtraceVirtualId(pid_t tracerId);
 void setPtraceVirtualId(pid_t tracerId, pid_t childId);
@@ -221,6 +279,12 @@ void getMissingConMaps(struct IncomingConMap **map, uint32_t *nmaps);
 
 void insertInodeConnIdMaps(vector<InodeConnIdMap> &maps);
 bool getCkptLeaderForFile(dev_t devnum, ino_t inode, void *id);
+bool electSharedAreaLeader(const ProcMapsArea &area,
+                           const DmtcpUniqueProcessId &candidate);
+bool getSharedAreaLeader(const ProcMapsArea &area,
+                         DmtcpUniqueProcessId *leader);
+bool electSysVLeader(int type, int32_t realId,
+                     const DmtcpUniqueProcessId &candidate);
 }
 }
 #endif // ifndef SHARED_DATA_H
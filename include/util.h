@@ -71,6 +71,7 @@ EXTERNC void initializeJalib();
 
 EXTERNC int dmtcp_infiniband_enabled(void) __attribute__((weak));
 EXTERNC int dmtcp_alloc_enabled(void) __attribute__((weak));
+EXTERNC int dmtcp_alloc_defer_suspend(void) __attribute__((weak));
 EXTERNC int dmtcp_dl_enabled(void) __attribute__((weak));
 EXTERNC int dmtcp_batch_queue_enabled(void) __attribute__((weak));
 EXTERNC int dmtcp_modify_env_enabled(void) __attribute__((weak));
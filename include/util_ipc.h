@@ -21,9 +21,14 @@
 #ifndef __DMTCP_UTIL_H__
 #define __DMTCP_UTIL_H__
 
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+// The kernel limit (SCM_MAX_FD) on the number of fds in one SCM_RIGHTS
+// message.
+#define SCM_MAX_FDS 253
+
 namespace dmtcp
 {
 namespace Util
@@ -95,6 +100,98 @@ receiveFd(int restoreFd, void *data, size_t len)
 
   return fd;
 }
+
+// Sends up to SCM_MAX_FDS fds in a single message, along with len bytes of
+// data.  Returns the number of bytes of data sent, or -1 on error.
+static inline ssize_t
+sendFds(int restoreFd,
+        const int32_t *fds,
+        size_t nfds,
+        void *data,
+        size_t len,
+        struct sockaddr_un &addr,
+        socklen_t addrLen,
+        int flags)
+{
+  struct iovec iov;
+  struct msghdr hdr;
+  struct cmsghdr *cmsg;
+  char cms[CMSG_SPACE(SCM_MAX_FDS * sizeof(int32_t))];
+
+  if (nfds == 0 || nfds > SCM_MAX_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  iov.iov_base = data;
+  iov.iov_len = len;
+
+  memset(&hdr, 0, sizeof hdr);
+  hdr.msg_name = &addr;
+  hdr.msg_namelen = addrLen;
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = (caddr_t)cms;
+  hdr.msg_controllen = CMSG_SPACE(nfds * sizeof(int32_t));
+
+  cmsg = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int32_t));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int32_t));
+
+  return sendmsg(restoreFd, &hdr, flags);
+}
+
+// Receives a message sent by sendFds().  Stores up to maxFds fds in fds and
+// the data in data.  Returns the number of fds received, or -1 on error; the
+// number of bytes of data received is returned in *dataLen.
+static inline ssize_t
+receiveFds(int restoreFd,
+           int32_t *fds,
+           size_t maxFds,
+           void *data,
+           size_t *dataLen,
+           int flags)
+{
+  struct iovec iov;
+  struct msghdr hdr;
+  struct cmsghdr *cmsg;
+  char cms[CMSG_SPACE(SCM_MAX_FDS * sizeof(int32_t))];
+  ssize_t ret;
+  size_t nfds;
+
+  iov.iov_base = data;
+  iov.iov_len = *dataLen;
+
+  memset(&hdr, 0, sizeof hdr);
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = (caddr_t)cms;
+  hdr.msg_controllen = sizeof cms;
+
+  ret = recvmsg(restoreFd, &hdr, flags);
+  if (ret == -1) {
+    return -1;
+  }
+  *dataLen = ret;
+
+  cmsg = CMSG_FIRSTHDR(&hdr);
+  if (cmsg == NULL || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    errno = EPROTO;
+    return -1;
+  }
+  nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32_t);
+  if (nfds > maxFds) {
+    errno = EPROTO;
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int32_t));
+
+  return nfds;
+}
 }
 }
 #endif // #ifndef __DMTCP_UTIL_H__
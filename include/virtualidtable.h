@@ -35,8 +35,28 @@
 
 #define MAX_VIRTUAL_ID 999
 
+// Number of slots in each of the lookup hash tables.  Must be a power of two.
+// The hash tables are only used while they are at most half full; beyond
+// that, lookups fall back to the mutex-protected maps.
+#define VIRTUAL_ID_HASH_SIZE 2048
+
+// Number of times a reader retries an inconsistent snapshot before waiting
+// for the writer on the table mutex.
+#define VIRTUAL_ID_READ_RETRIES 64
+
 namespace dmtcp
 {
+/*
+ * The virtual-to-real mappings live in '_idMapTable', which is only modified
+ * with 'tblLock' held.  Every modification is mirrored into two fixed-size
+ * open-addressing hash tables (virtual->real and real->virtual) that are
+ * protected by a sequence lock: writers bump '_seq' to an odd value before
+ * and back to an even value after updating them, and readers retry if they
+ * observe an odd or changed sequence number.  Writes (thread creation, exit,
+ * restart) are rare, while translations happen on nearly every pid, timer and
+ * IPC wrapper, so virtualToReal() and realToVirtual() never take the mutex in
+ * the common case.
+ */
 template<typename IdType>
 class VirtualIdTable
 {
@@ -51,6 +71,73 @@ class VirtualIdTable
       JASSERT(pthread_mutex_unlock(&tblLock) == 0) (JASSERT_ERRNO);
     }
 
+    // The following must be called with tblLock held.
+    void _addMappingLocked(IdType virtualId, IdType realId)
+    {
+      id_iterator i = _idMapTable.find(virtualId);
+      bool hadOldReal = i != _idMapTable.end();
+      IdType oldRealId = hadOldReal ? i->second : realId;
+
+      _idMapTable[virtualId] = realId;
+
+      _beginWrite();
+      if (_hashOverflow) {
+        if (_idMapTable.size() <= VIRTUAL_ID_HASH_SIZE / 2) {
+          _rebuildHashLocked();
+        }
+      } else {
+        if (hadOldReal && oldRealId != realId) {
+          _dropReverseLocked(oldRealId, virtualId);
+        }
+        _hashInsert(_virtToRealHash, virtualId, realId);
+        _hashInsert(_realToVirtHash, realId, virtualId);
+        if (_idMapTable.size() > VIRTUAL_ID_HASH_SIZE / 2 ||
+            _hashTombstones > VIRTUAL_ID_HASH_SIZE / 4) {
+          _rebuildHashLocked();
+        }
+      }
+      _endWrite();
+    }
+
+    void _eraseMappingLocked(IdType virtualId)
+    {
+      id_iterator i = _idMapTable.find(virtualId);
+
+      if (i == _idMapTable.end()) {
+        return;
+      }
+      IdType realId = i->second;
+      _idMapTable.erase(i);
+
+      _beginWrite();
+      if (_hashOverflow) {
+        if (_idMapTable.size() <= VIRTUAL_ID_HASH_SIZE / 2) {
+          _rebuildHashLocked();
+        }
+      } else {
+        _hashErase(_virtToRealHash, virtualId);
+        _dropReverseLocked(realId, virtualId);
+      }
+      _endWrite();
+    }
+
+    void _clearMappingsLocked()
+    {
+      _idMapTable.clear();
+      _beginWrite();
+      _rebuildHashLocked();
+      _endWrite();
+    }
+
+    // Resynchronizes the hash tables after '_idMapTable' was modified
+    // directly (e.g., by deserialization).
+    void _syncHashLocked()
+    {
+      _beginWrite();
+      _rebuildHashLocked();
+      _endWrite();
+    }
+
   public:
 #ifdef JALIB_ALLOCATOR
     static void *operator new(size_t nbytes, void *p) { return p; }
@@ -64,8 +151,9 @@ class VirtualIdTable
       pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
       tblLock = lock;
+      _seq = 0;
       _do_lock_tbl();
-      _idMapTable.clear();
+      _clearMappingsLocked();
       _do_unlock_tbl();
       _typeStr = typeStr;
       _base = base;
@@ -100,7 +188,7 @@ class VirtualIdTable
     void clear()
     {
       _do_lock_tbl();
-      _idMapTable.clear();
+      _clearMappingsLocked();
       resetNextVirtualId();
       _do_unlock_tbl();
     }
@@ -108,7 +196,7 @@ class VirtualIdTable
     void postRestart()
     {
       _do_lock_tbl();
-      _idMapTable.clear();
+      _clearMappingsLocked();
       resetNextVirtualId();
       _do_unlock_tbl();
     }
@@ -118,6 +206,12 @@ class VirtualIdTable
       _base = newBase;
       pthread_mutex_t newlock = PTHREAD_MUTEX_INITIALIZER;
       tblLock = newlock;
+
+      // Another thread of the parent might have been in the middle of an
+      // update at the time of fork.  Move on to an even value not seen
+      // before, so that translations cached before the fork are dropped.
+      _seq = (_seq | 1) + 1;
+      _rebuildHashLocked();
       resetNextVirtualId();
     }
 
@@ -151,46 +245,35 @@ class VirtualIdTable
              (size_t)id <= (size_t)getpid() + _max;
     }
 
+    // Changes whenever the mappings change, and is odd while they change, so
+    // that callers can cache translations.
+    uint32_t sequence() { return __atomic_load_n(&_seq, __ATOMIC_ACQUIRE); }
+
     bool virtualIdExists(IdType id)
     {
-      bool retVal = false;
+      IdType realId;
 
-      _do_lock_tbl();
-      id_iterator j = _idMapTable.find(id);
-      if (j != _idMapTable.end()) {
-        retVal = true;
-      }
-
-      _do_unlock_tbl();
-      return retVal;
+      return _lookup(false, id, &realId);
     }
 
     bool realIdExists(IdType id)
     {
-      bool retval = false;
+      IdType virtualId;
 
-      _do_lock_tbl();
-      for (id_iterator i = _idMapTable.begin(); i != _idMapTable.end(); ++i) {
-        if (i->second == id) {
-          retval = true;
-          break;
-        }
-      }
-      _do_unlock_tbl();
-      return retval;
+      return _lookup(true, id, &virtualId);
     }
 
     void updateMapping(IdType virtualId, IdType realId)
     {
       _do_lock_tbl();
-      _idMapTable[virtualId] = realId;
+      _addMappingLocked(virtualId, realId);
       _do_unlock_tbl();
     }
 
     void erase(IdType virtualId)
     {
       _do_lock_tbl();
-      _idMapTable.erase(virtualId);
+      _eraseMappingLocked(virtualId);
       _do_unlock_tbl();
     }
 
@@ -226,32 +309,23 @@ class VirtualIdTable
       /* This code is called from MTCP while the checkpoint thread is holding
          the JASSERT log lock. Therefore, don't call JTRACE/JASSERT/JINFO/etc. in
          this function. */
-      _do_lock_tbl();
-      id_iterator i = _idMapTable.find(virtualId);
-      if (i == _idMapTable.end()) {
+      if (!_lookup(false, virtualId, &retVal)) {
         retVal = virtualId;
-      } else {
-        retVal = i->second;
       }
-      _do_unlock_tbl();
       return retVal;
     }
 
     virtual IdType realToVirtual(IdType realId)
     {
+      IdType retVal = 0;
+
       /* This code is called from MTCP while the checkpoint thread is holding
          the JASSERT log lock. Therefore, don't call JTRACE/JASSERT/JINFO/etc. in
          this function. */
-      _do_lock_tbl();
-      for (id_iterator i = _idMapTable.begin(); i != _idMapTable.end(); ++i) {
-        if (realId == i->second) {
-          _do_unlock_tbl();
-          return i->first;
-        }
+      if (!_lookup(true, realId, &retVal)) {
+        retVal = realId;
       }
-
-      _do_unlock_tbl();
-      return realId;
+      return retVal;
     }
 
     void serialize(jalib::JBinarySerializer &o)
@@ -259,6 +333,11 @@ class VirtualIdTable
       JSERIALIZE_ASSERT_POINT("VirtualIdTable:");
       o.serializeMap(_idMapTable);
       JSERIALIZE_ASSERT_POINT("EOF");
+      if (o.isReader()) {
+        _do_lock_tbl();
+        _syncHashLocked();
+        _do_unlock_tbl();
+      }
       printMaps();
     }
 
@@ -300,6 +379,7 @@ class VirtualIdTable
       while (!maprd.isEOF()) {
         maprd.serializeMap(_idMapTable);
       }
+      _syncHashLocked();
 
       _do_unlock_tbl();
 
@@ -309,9 +389,193 @@ class VirtualIdTable
     }
 
   private:
+    enum HashSlotState {
+      HASH_SLOT_EMPTY = 0,
+      HASH_SLOT_USED,
+      HASH_SLOT_DELETED
+    };
+
+    struct HashSlot {
+      IdType key;
+      IdType value;
+      uint32_t state;
+    };
+
+    static size_t _hashIndex(IdType key)
+    {
+      uint64_t k = (uint64_t)(unsigned long)key;
+
+      return (size_t)((uint32_t)(k ^ (k >> 32)) * 2654435761U) &
+             (VIRTUAL_ID_HASH_SIZE - 1);
+    }
+
+    static bool _hashFind(const HashSlot *table, IdType key, IdType *value)
+    {
+      size_t idx = _hashIndex(key);
+
+      for (size_t n = 0; n < VIRTUAL_ID_HASH_SIZE; n++) {
+        const volatile HashSlot *slot = &table[idx];
+        uint32_t state = slot->state;
+        if (state == HASH_SLOT_EMPTY) {
+          return false;
+        }
+        if (state == HASH_SLOT_USED && slot->key == key) {
+          *value = slot->value;
+          return true;
+        }
+        idx = (idx + 1) & (VIRTUAL_ID_HASH_SIZE - 1);
+      }
+      return false;
+    }
+
+    void _hashInsert(HashSlot *table, IdType key, IdType value)
+    {
+      size_t idx = _hashIndex(key);
+      HashSlot *freeSlot = NULL;
+
+      for (size_t n = 0; n < VIRTUAL_ID_HASH_SIZE; n++) {
+        HashSlot *slot = &table[idx];
+        if (slot->state == HASH_SLOT_EMPTY) {
+          if (freeSlot == NULL) {
+            freeSlot = slot;
+          }
+          break;
+        }
+        if (slot->state == HASH_SLOT_DELETED) {
+          if (freeSlot == NULL) {
+            freeSlot = slot;
+          }
+        } else if (slot->key == key) {
+          slot->value = value;
+          return;
+        }
+        idx = (idx + 1) & (VIRTUAL_ID_HASH_SIZE - 1);
+      }
+
+      // The tables are kept at most half full, so there is always room.
+      if (freeSlot->state == HASH_SLOT_DELETED) {
+        _hashTombstones--;
+      }
+      freeSlot->key = key;
+      freeSlot->value = value;
+      freeSlot->state = HASH_SLOT_USED;
+    }
+
+    void _hashErase(HashSlot *table, IdType key)
+    {
+      size_t idx = _hashIndex(key);
+
+      for (size_t n = 0; n < VIRTUAL_ID_HASH_SIZE; n++) {
+        HashSlot *slot = &table[idx];
+        if (slot->state == HASH_SLOT_EMPTY) {
+          return;
+        }
+        if (slot->state == HASH_SLOT_USED && slot->key == key) {
+          slot->state = HASH_SLOT_DELETED;
+          _hashTombstones++;
+          return;
+        }
+        idx = (idx + 1) & (VIRTUAL_ID_HASH_SIZE - 1);
+      }
+    }
+
+    // Removes the reverse mapping realId->virtualId.  If some other virtual
+    // id still maps to realId, the reverse mapping is pointed at it instead.
+    void _dropReverseLocked(IdType realId, IdType virtualId)
+    {
+      IdType curVirtualId;
+
+      if (!_hashFind(_realToVirtHash, realId, &curVirtualId) ||
+          curVirtualId != virtualId) {
+        return;
+      }
+      _hashErase(_realToVirtHash, realId);
+      for (id_iterator i = _idMapTable.begin(); i != _idMapTable.end(); ++i) {
+        if (i->second == realId) {
+          _hashInsert(_realToVirtHash, realId, i->first);
+          break;
+        }
+      }
+    }
+
+    void _rebuildHashLocked()
+    {
+      memset(_virtToRealHash, 0, sizeof(_virtToRealHash));
+      memset(_realToVirtHash, 0, sizeof(_realToVirtHash));
+      _hashTombstones = 0;
+      _hashOverflow = _idMapTable.size() > VIRTUAL_ID_HASH_SIZE / 2;
+      if (_hashOverflow) {
+        return;
+      }
+      for (id_iterator i = _idMapTable.begin(); i != _idMapTable.end(); ++i) {
+        _hashInsert(_virtToRealHash, i->first, i->second);
+        IdType virtualId;
+        if (!_hashFind(_realToVirtHash, i->second, &virtualId)) {
+          _hashInsert(_realToVirtHash, i->second, i->first);
+        }
+      }
+    }
+
+    void _beginWrite()
+    {
+      __atomic_store_n(&_seq, _seq + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void _endWrite()
+    {
+      __atomic_store_n(&_seq, _seq + 1, __ATOMIC_RELEASE);
+    }
+
+    bool _lookupLocked(bool reverse, IdType key, IdType *value)
+    {
+      bool found = false;
+
+      _do_lock_tbl();
+      for (id_iterator i = _idMapTable.begin(); i != _idMapTable.end(); ++i) {
+        if (reverse ? i->second == key : i->first == key) {
+          *value = reverse ? i->first : i->second;
+          found = true;
+          break;
+        }
+      }
+      _do_unlock_tbl();
+      return found;
+    }
+
+    bool _lookup(bool reverse, IdType key, IdType *value)
+    {
+      for (int tries = 0; tries < VIRTUAL_ID_READ_RETRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+          continue;
+        }
+        if (_hashOverflow) {
+          break;
+        }
+        IdType result = 0;
+        bool found = _hashFind(reverse ? _realToVirtHash : _virtToRealHash,
+                               key, &result);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&_seq, __ATOMIC_RELAXED) == seq) {
+          if (found) {
+            *value = result;
+          }
+          return found;
+        }
+      }
+      return _lookupLocked(reverse, key, value);
+    }
+
     string _typeStr;
     pthread_mutex_t tblLock;
 
+    uint32_t _seq;
+    bool _hashOverflow;
+    size_t _hashTombstones;
+    HashSlot _virtToRealHash[VIRTUAL_ID_HASH_SIZE];
+    HashSlot _realToVirtHash[VIRTUAL_ID_HASH_SIZE];
+
   protected:
     typedef typename map<IdType, IdType>::iterator id_iterator;
     map<IdType, IdType>_idMapTable;
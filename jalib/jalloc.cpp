@@ -24,12 +24,22 @@
 #include "jalloc.h"
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 
+// Chunk sizes are powers of two from MIN_CHUNKSIZE to MAX_CHUNKSIZE.
 // Make highest chunk size large; avoid a raw_alloc calling mmap()
 // during /proc/self/maps
-#define MAX_CHUNKSIZE (4 * 1024)
+#define MIN_CHUNKSIZE_LOG2 5
+#define MIN_CHUNKSIZE      (1 << MIN_CHUNKSIZE_LOG2)
+#define MAX_CHUNKSIZE      (4 * 1024)
+#define NUM_SIZE_CLASSES   8
+
+// A thread caches at most THREAD_CACHE_CHUNKS chunks, and THREAD_CACHE_BYTES
+// bytes, of each size class (but always at least four chunks).
+#define THREAD_CACHE_CHUNKS 32
+#define THREAD_CACHE_BYTES  (16 * 1024)
 
 using namespace jalib;
 
@@ -121,65 +131,84 @@ _dealloc_raw(void *ptr, size_t n)
 # endif // ifdef JALIB_USE_MALLOC
 }
 
-template<size_t _N>
+/* Each size class has a lock-free stack of free chunks shared by all threads,
+ * and a small per-thread cache (magazine) in front of it.  Most allocations
+ * and deallocations only touch the calling thread's cache; chunks move
+ * between the cache and the shared stack in batches.
+ *
+ * The stack root is a tagged pointer: the tag is incremented on every update,
+ * so that a compare-and-swap fails if the root was popped and pushed back in
+ * between (the ABA problem).
+ */
+# if __SIZEOF_POINTER__ == 8
+
+// User-space addresses fit in 48 bits, unless the process asks mmap() for a
+// higher address.  The top 16 bits hold the tag.
+#  define TAG_SHIFT 48
+# else // if __SIZEOF_POINTER__ == 8
+#  define TAG_SHIFT 32
+# endif // if __SIZEOF_POINTER__ == 8
+# define TAG_ONE  (((uint64_t)1) << TAG_SHIFT)
+# define PTR_MASK (TAG_ONE - 1)
+
 class JFixedAllocStack
 {
   public:
-    enum { N = _N };
-    JFixedAllocStack()
-    {
-      if (_blockSize == 0) {
-        _blockSize = 4 * MAX_CHUNKSIZE;
-      }
-      _root = NULL;
-      _numExpands = 0;
-    }
-
-    void initialize(int blockSize)
+    void initialize(size_t chunkSize, size_t blockSize)
     {
+      _chunkSize = chunkSize;
       _blockSize = blockSize;
     }
 
-    size_t chunkSize() { return N; }
+    size_t chunkSize() { return _chunkSize; }
 
-    // allocate a chunk of size N
+    // allocate a chunk
     void *allocate()
     {
-      FreeItem *item = NULL;
-
-      do {
-        if (_root == NULL) {
-          expand();
-        }
+      void *item;
 
-        // NOTE: _root could still be NULL (if other threads consumed all
-        // blocks that were made available from expand().  In such case, we
-        // loop once again.
+      // NOTE: pop() could still fail after expand() if other threads consumed
+      // all chunks that were made available.  In such case, we loop again.
+      while ((item = pop()) == NULL) {
+        expand();
+      }
+      return item;
+    }
 
-        /* Atomically does the following operation:
-         *   item = _root;
-         *   _root = item->next;
-         */
-        item = _root;
-      } while (!item ||
-               !__sync_bool_compare_and_swap(&_root, item, item->next));
+    // Allocates between 1 and n chunks into items.  Only expands the stack if
+    // it is empty.
+    size_t allocateBatch(void **items, size_t n)
+    {
+      size_t count = 0;
 
-      item->next = NULL;
-      return item;
+      while (count == 0) {
+        while (count < n && (items[count] = pop()) != NULL) {
+          count++;
+        }
+        if (count == 0) {
+          expand();
+        }
+      }
+      __sync_fetch_and_add(&_numRefills, 1);
+      return count;
     }
 
-    // deallocate a chunk of size N
+    // deallocate a chunk
     void deallocate(void *ptr)
     {
       if (ptr == NULL) { return; }
-      FreeItem *item = static_cast<FreeItem *>(ptr);
-      do {
-        /* Atomically does the following operation:
-         *   item->next = _root;
-         *   _root = item;
-         */
-        item->next = _root;
-      } while (!__sync_bool_compare_and_swap(&_root, item->next, item));
+      push(ptr, ptr);
+    }
+
+    // Deallocates n chunks with a single update of the stack.
+    void deallocateBatch(void **items, size_t n)
+    {
+      for (size_t i = 0; i + 1 < n; i++) {
+        static_cast<FreeItem *>(items[i])->next =
+          static_cast<FreeItem *>(items[i + 1]);
+      }
+      push(items[0], items[n - 1]);
+      __sync_fetch_and_add(&_numFlushes, 1);
     }
 
     int numExpands()
@@ -197,18 +226,76 @@ class JFixedAllocStack
         allocatedItem[i] = allocate();
       }
 
-      // if (_root == NULL) { expand(); }
       for (int i = 0; i < numAllocs; i++) {
         deallocate(allocatedItem[i]);
       }
     }
 
+    void getStats(JAllocStats *stats)
+    {
+      stats->chunkSize = _chunkSize;
+      stats->numExpands = _numExpands;
+      stats->bytesMapped = _numExpands * _blockSize;
+      stats->numRefills = _numRefills;
+      stats->numFlushes = _numFlushes;
+    }
+
   protected:
+    struct FreeItem {
+      FreeItem *next;
+    };
+
+    static FreeItem *itemOf(uint64_t root)
+    {
+      return (FreeItem *)(uintptr_t)(root & PTR_MASK);
+    }
+
+    static uint64_t nextRoot(uint64_t oldRoot, void *item)
+    {
+      return ((oldRoot & ~PTR_MASK) + TAG_ONE) | (uint64_t)(uintptr_t)item;
+    }
+
+    void *pop()
+    {
+      uint64_t root;
+      FreeItem *item;
+
+      do {
+        root = _root;
+        item = itemOf(root);
+        if (item == NULL) {
+          return NULL;
+        }
+
+        // Another thread may pop and reuse item before our compare-and-swap,
+        // in which case item->next is garbage, but the tag makes the
+        // compare-and-swap fail.  Chunks are never unmapped, so the read
+        // itself is safe.
+      } while (!__sync_bool_compare_and_swap(&_root, root,
+                                             nextRoot(root, item->next)));
+
+      item->next = NULL;
+      return item;
+    }
+
+    // Pushes the chain of chunks first..last, already linked through their
+    // next fields.
+    void push(void *first, void *last)
+    {
+      uint64_t root;
+
+      do {
+        root = _root;
+        static_cast<FreeItem *>(last)->next = itemOf(root);
+      } while (!__sync_bool_compare_and_swap(&_root, root,
+                                             nextRoot(root, first)));
+    }
+
     // allocate more raw memory when stack is empty
     void expand()
     {
-      _numExpands++;
-      if (_root != NULL &&
+      __sync_fetch_and_add(&_numExpands, 1);
+      if (itemOf(_root) != NULL &&
           fred_record_replay_enabled && fred_record_replay_enabled()) {
         // TODO: why is expand being called? If you see this message, raise lvl2
         // allocation level.
@@ -218,61 +305,110 @@ class JFixedAllocStack
         // jalib::fflush(stderr);
         abort();
       }
-      FreeItem *bufs = static_cast<FreeItem *>(_alloc_raw(_blockSize));
-      int count = _blockSize / sizeof(FreeItem);
-      for (int i = 0; i < count - 1; ++i) {
-        bufs[i].next = bufs + i + 1;
+      char *bufs = static_cast<char *>(_alloc_raw(_blockSize));
+      size_t count = _blockSize / _chunkSize;
+      for (size_t i = 0; i < count - 1; ++i) {
+        ((FreeItem *)(bufs + i * _chunkSize))->next =
+          (FreeItem *)(bufs + (i + 1) * _chunkSize);
       }
-
-      do {
-        /* Atomically does the following operation:
-         *   bufs[count-1].next = _root;
-         *   _root = bufs;
-         */
-        bufs[count - 1].next = _root;
-      } while (!__sync_bool_compare_and_swap(&_root, bufs[count - 1].next,
-                                             bufs));
+      push(bufs, bufs + (count - 1) * _chunkSize);
     }
 
-  protected:
-    struct FreeItem {
-      union {
-        FreeItem *next;
-        char buf[N];
-      };
-    };
-
   private:
-    FreeItem *volatile _root;
+    uint64_t volatile _root;
+    size_t _chunkSize;
     size_t _blockSize;
-    char padding[128];
     int volatile _numExpands;
+    size_t volatile _numRefills;
+    size_t volatile _numFlushes;
+    char padding[128];
+};
+
+// Per-thread cache of free chunks.  A signal handler that allocates while
+// the interrupted code is updating the cache (busy is set) goes straight to
+// the shared stack instead.
+struct ThreadCache {
+  volatile sig_atomic_t busy;
+  bool registered;
+  size_t count[NUM_SIZE_CLASSES];
+  void *chunks[NUM_SIZE_CLASSES][THREAD_CACHE_CHUNKS];
 };
 } // namespace jalib
 
-jalib::JFixedAllocStack<64>lvl1;
-jalib::JFixedAllocStack<256>lvl2;
-jalib::JFixedAllocStack<1024>lvl3;
-# if MAX_CHUNKSIZE <= 1024
-#  error MAX_CHUNKSIZE must be larger
-# endif // if MAX_CHUNKSIZE <= 1024
-jalib::JFixedAllocStack<MAX_CHUNKSIZE>lvl4;
+// Zero-initialized, and without constructors, so that the allocator works
+// before static constructors have run.
+static jalib::JFixedAllocStack stacks[NUM_SIZE_CLASSES];
+static size_t cacheCapacity[NUM_SIZE_CLASSES];
+static __thread jalib::ThreadCache threadCache;
+static pthread_key_t threadCacheKey;
+static bool haveThreadCacheKey = false;
+
+# define COMPILER_BARRIER() asm volatile ("" ::: "memory")
+
+// Returns NUM_SIZE_CLASSES if n is larger than MAX_CHUNKSIZE.
+static inline size_t
+sizeClass(size_t n)
+{
+  if (n <= MIN_CHUNKSIZE) {
+    return 0;
+  }
+  if (n > MAX_CHUNKSIZE) {
+    return NUM_SIZE_CLASSES;
+  }
+
+  // ceil(log2(n)) - log2(MIN_CHUNKSIZE)
+  return sizeof(long) * 8 - __builtin_clzl(n - 1) - MIN_CHUNKSIZE_LOG2;
+}
+
+// Returns the cached chunks of an exiting thread to the shared stacks.
+static void
+flushThreadCache(void *arg)
+{
+  jalib::ThreadCache *tc = (jalib::ThreadCache *)arg;
+
+  tc->busy = 1;
+  COMPILER_BARRIER();
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    if (tc->count[i] > 0) {
+      stacks[i].deallocateBatch(tc->chunks[i], tc->count[i]);
+      tc->count[i] = 0;
+    }
+  }
+  tc->registered = false;
+  COMPILER_BARRIER();
+  tc->busy = 0;
+}
 
 void
 jalib::JAllocDispatcher::initialize(void)
 {
-  if (fred_record_replay_enabled != 0 && fred_record_replay_enabled()) {
-    /* We need a greater arena size to eliminate mmap() calls that could happen
-       at different times for record vs. replay. */
-    lvl1.initialize(1024 * 1024 * 16);
-    lvl2.initialize(1024 * 1024 * 16);
-    lvl3.initialize(1024 * 32 * 16);
-    lvl4.initialize(1024 * 32 * 16);
-  } else {
-    lvl1.initialize(1024 * 16);
-    lvl2.initialize(1024 * 16);
-    lvl3.initialize(1024 * 32);
-    lvl4.initialize(1024 * 32);
+  bool fred = fred_record_replay_enabled != 0 && fred_record_replay_enabled();
+
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    size_t chunkSize = MIN_CHUNKSIZE << i;
+    size_t blockSize;
+    if (chunkSize <= 256) {
+      /* We need a greater arena size to eliminate mmap() calls that could
+         happen at different times for record vs. replay. */
+      blockSize = fred ? 1024 * 1024 * 16 : 1024 * 16;
+    } else {
+      blockSize = fred ? 1024 * 32 * 16 : 1024 * 32;
+    }
+    stacks[i].initialize(chunkSize, blockSize);
+
+    cacheCapacity[i] = THREAD_CACHE_BYTES / chunkSize;
+    if (cacheCapacity[i] > THREAD_CACHE_CHUNKS) {
+      cacheCapacity[i] = THREAD_CACHE_CHUNKS;
+    } else if (cacheCapacity[i] < 4) {
+      cacheCapacity[i] = 4;
+    }
+  }
+
+  // FReD needs the same sequence of expansions on record and replay, which
+  // the thread caches would perturb.
+  if (!fred && !haveThreadCacheKey) {
+    haveThreadCacheKey =
+      ::pthread_key_create(&threadCacheKey, flushThreadCache) == 0;
   }
   _initialized = true;
 }
@@ -283,18 +419,30 @@ jalib::JAllocDispatcher::allocate(size_t n)
   if (!_initialized) {
     initialize();
   }
-  void *retVal;
-  if (n <= lvl1.chunkSize()) {
-    retVal = lvl1.allocate();
-  } else if (n <= lvl2.chunkSize()) {
-    retVal = lvl2.allocate();
-  } else if (n <= lvl3.chunkSize()) {
-    retVal = lvl3.allocate();
-  } else if (n <= lvl4.chunkSize()) {
-    retVal = lvl4.allocate();
-  } else {
-    retVal = _alloc_raw(n);
+  size_t idx = sizeClass(n);
+  if (idx == NUM_SIZE_CLASSES) {
+    return _alloc_raw(n);
   }
+
+  ThreadCache *tc = &threadCache;
+  if (tc->busy || !haveThreadCacheKey) {
+    return stacks[idx].allocate();
+  }
+
+  tc->busy = 1;
+  COMPILER_BARRIER();
+  if (tc->count[idx] == 0) {
+    if (!tc->registered) {
+      // The destructor only runs for a non-NULL value.
+      tc->registered = true;
+      ::pthread_setspecific(threadCacheKey, tc);
+    }
+    tc->count[idx] = stacks[idx].allocateBatch(tc->chunks[idx],
+                                               cacheCapacity[idx] / 2);
+  }
+  void *retVal = tc->chunks[idx][--tc->count[idx]];
+  COMPILER_BARRIER();
+  tc->busy = 0;
   return retVal;
 }
 
@@ -306,33 +454,65 @@ jalib::JAllocDispatcher::deallocate(void *ptr, size_t n)
     jalib::write(2, msg, sizeof(msg));
     abort();
   }
-  if (n <= lvl1.N) {
-    lvl1.deallocate(ptr);
-  } else if (n <= lvl2.N) {
-    lvl2.deallocate(ptr);
-  } else if (n <= lvl3.N) {
-    lvl3.deallocate(ptr);
-  } else if (n <= lvl4.N) {
-    lvl4.deallocate(ptr);
-  } else {
+  size_t idx = sizeClass(n);
+  if (idx == NUM_SIZE_CLASSES) {
     _dealloc_raw(ptr, n);
+    return;
+  }
+  if (ptr == NULL) {
+    return;
+  }
+
+  ThreadCache *tc = &threadCache;
+  if (tc->busy || !haveThreadCacheKey) {
+    stacks[idx].deallocate(ptr);
+    return;
+  }
+
+  tc->busy = 1;
+  COMPILER_BARRIER();
+  if (tc->count[idx] == cacheCapacity[idx]) {
+    size_t half = cacheCapacity[idx] / 2;
+    tc->count[idx] -= half;
+    stacks[idx].deallocateBatch(&tc->chunks[idx][tc->count[idx]], half);
   }
+  tc->chunks[idx][tc->count[idx]++] = ptr;
+  COMPILER_BARRIER();
+  tc->busy = 0;
 }
 
 int
 jalib::JAllocDispatcher::numExpands()
 {
-  return lvl1.numExpands() + lvl2.numExpands() +
-         lvl3.numExpands() + lvl4.numExpands();
+  int n = 0;
+
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    n += stacks[i].numExpands();
+  }
+  return n;
 }
 
 void
 jalib::JAllocDispatcher::preExpand()
 {
-  lvl1.preExpand();
-  lvl2.preExpand();
-  lvl3.preExpand();
-  lvl4.preExpand();
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    stacks[i].preExpand();
+  }
+}
+
+size_t
+jalib::JAllocDispatcher::numSizeClasses()
+{
+  return NUM_SIZE_CLASSES;
+}
+
+void
+jalib::JAllocDispatcher::getStats(size_t sizeClass, JAllocStats *stats)
+{
+  if (!_initialized) {
+    initialize();
+  }
+  stacks[sizeClass].getStats(stats);
 }
 
 #else // ifdef JALIB_ALLOCATOR
@@ -28,6 +28,15 @@
 
 namespace jalib
 {
+// Allocation statistics of one size class, for tuning.
+struct JAllocStats {
+  size_t chunkSize;
+  size_t numExpands;  // Blocks of memory mapped
+  size_t bytesMapped;
+  size_t numRefills;  // Batches moved from the shared stack to a thread cache
+  size_t numFlushes;  // Batches moved from a thread cache to the shared stack
+};
+
 class JAllocDispatcher
 {
   private:
@@ -55,6 +64,9 @@ class JAllocDispatcher
 
     static int numExpands();
     static void preExpand();
+
+    static size_t numSizeClasses();
+    static void getStats(size_t sizeClass, JAllocStats *stats);
 };
 
 class JAlloc
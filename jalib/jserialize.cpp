@@ -22,19 +22,31 @@
 #include "jalib.h"
 #include "jassert.h"
 #include "jserialize.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#define SERIALIZE_BUFFER_SIZE (16 * 1024)
 
 jalib::JBinarySerializeWriterRaw::JBinarySerializeWriterRaw(
   const jalib::string &path, int fd)
   : JBinarySerializer(path)
   , _fd(fd)
+  , _buf(NULL)
+  , _bufLen(0)
 {
   JASSERT(_fd >= 0)(path)(JASSERT_ERRNO).Text("open(path) failed");
 }
 
+jalib::JBinarySerializeWriterRaw::~JBinarySerializeWriterRaw()
+{
+  setBuffered(false);
+}
+
 jalib::JBinarySerializeWriter::JBinarySerializeWriter(const jalib::string &path)
   : JBinarySerializeWriterRaw(path,
                               jalib::open(path.c_str(),
@@ -45,24 +57,93 @@ jalib::JBinarySerializeReaderRaw::JBinarySerializeReaderRaw(
   const jalib::string &path, int fd)
   : JBinarySerializer(path)
   , _fd(fd)
+  , _buf(NULL)
+  , _bufPos(0)
+  , _bufEnd(0)
 {
   JASSERT(_fd >= 0)(path)(JASSERT_ERRNO).Text("open(path) failed");
 }
 
+jalib::JBinarySerializeReaderRaw::~JBinarySerializeReaderRaw()
+{
+  setBuffered(false);
+}
+
 jalib::JBinarySerializeReader::JBinarySerializeReader(const jalib::string &path)
   : JBinarySerializeReaderRaw(path, jalib::open(path.c_str(), O_RDONLY, 0))
 {}
 
 jalib::JBinarySerializeWriter::~JBinarySerializeWriter()
 {
+  setBuffered(false);
   close(_fd);
 }
 
 jalib::JBinarySerializeReader::~JBinarySerializeReader()
 {
+  setBuffered(false);
   close(_fd);
 }
 
+void
+jalib::JBinarySerializeWriterRaw::setBuffered(bool buffered)
+{
+  if (buffered && _buf == NULL) {
+    _buf = (char *)JAllocDispatcher::malloc(SERIALIZE_BUFFER_SIZE);
+    _bufLen = 0;
+  } else if (!buffered && _buf != NULL) {
+    flush();
+    JAllocDispatcher::free(_buf);
+    _buf = NULL;
+  }
+}
+
+void
+jalib::JBinarySerializeWriterRaw::flush()
+{
+  if (_bufLen > 0) {
+    size_t ret = jalib::writeAll(_fd, _buf, _bufLen);
+    JASSERT(ret == _bufLen) (filename()) (_bufLen) (JASSERT_ERRNO)
+    .Text("write() failed");
+    _bufLen = 0;
+  }
+}
+
+void
+jalib::JBinarySerializeReaderRaw::setBuffered(bool buffered)
+{
+  if (buffered && _buf == NULL) {
+    _buf = (char *)JAllocDispatcher::malloc(SERIALIZE_BUFFER_SIZE);
+    _bufPos = _bufEnd = 0;
+  } else if (!buffered && _buf != NULL) {
+    sync();
+    JAllocDispatcher::free(_buf);
+    _buf = NULL;
+  }
+}
+
+void
+jalib::JBinarySerializeReaderRaw::sync()
+{
+  if (_bufEnd > _bufPos) {
+    off_t unread = _bufEnd - _bufPos;
+    JASSERT(lseek(_fd, -unread, SEEK_CUR) != -1) (filename()) (JASSERT_ERRNO);
+  }
+  _bufPos = _bufEnd = 0;
+}
+
+void
+jalib::JBinarySerializeReaderRaw::skip(size_t len)
+{
+  if (_bufEnd - _bufPos >= len) {
+    _bufPos += len;
+  } else {
+    sync();
+    JASSERT(lseek(_fd, len, SEEK_CUR) != -1) (filename()) (JASSERT_ERRNO);
+  }
+  _bytes += len;
+}
+
 bool
 jalib::JBinarySerializeWriterRaw::isReader() { return false; }
 
@@ -73,12 +154,14 @@ jalib::JBinarySerializeReaderRaw::isReader() { return true; }
 void
 jalib::JBinarySerializeWriterRaw::rewind()
 {
+  flush();
   JASSERT(lseek(_fd, 0, SEEK_SET) == 0)(strerror(errno)).Text("Cannot rewind");
 }
 
 void
 jalib::JBinarySerializeReaderRaw::rewind()
 {
+  _bufPos = _bufEnd = 0;
   JASSERT(lseek(_fd, 0, SEEK_SET) == 0)(strerror(errno)).Text("Cannot rewind");
 }
 
@@ -87,6 +170,7 @@ jalib::JBinarySerializeWriterRaw::isempty()
 {
   struct stat buf;
 
+  flush();
   JASSERT(fstat(_fd, &buf) == 0);
   return buf.st_size == 0;
 }
@@ -107,6 +191,7 @@ jalib::JBinarySerializeReaderRaw::isEOF()
 
   JASSERT(fstat(_fd, &buf) == 0);
 
+  sync();
   off_t cur = lseek(_fd, 0, SEEK_CUR);
   JASSERT(cur != -1);
 
@@ -116,6 +201,18 @@ jalib::JBinarySerializeReaderRaw::isEOF()
 void
 jalib::JBinarySerializeWriterRaw::readOrWrite(void *buffer, size_t len)
 {
+  if (_buf != NULL) {
+    if (_bufLen + len > SERIALIZE_BUFFER_SIZE) {
+      flush();
+    }
+    if (len < SERIALIZE_BUFFER_SIZE) {
+      memcpy(_buf + _bufLen, buffer, len);
+      _bufLen += len;
+      _bytes += len;
+      return;
+    }
+  }
+
   size_t ret = jalib::writeAll(_fd, buffer, len);
 
   JASSERT(ret == len) (filename()) (len) (JASSERT_ERRNO)
@@ -126,9 +223,70 @@ jalib::JBinarySerializeWriterRaw::readOrWrite(void *buffer, size_t len)
 void
 jalib::JBinarySerializeReaderRaw::readOrWrite(void *buffer, size_t len)
 {
+  if (_buf != NULL) {
+    size_t avail = _bufEnd - _bufPos;
+    if (avail < len && len - avail < SERIALIZE_BUFFER_SIZE) {
+      // Refill.  A short read is fine; the data may end before the buffer.
+      memmove(_buf, _buf + _bufPos, avail);
+      _bufPos = 0;
+      _bufEnd = avail;
+      while (_bufEnd < len) {
+        ssize_t rc = read(_fd, _buf + _bufEnd,
+                          SERIALIZE_BUFFER_SIZE - _bufEnd);
+        if (rc == -1 && (errno == EINTR || errno == EAGAIN)) {
+          continue;
+        }
+        JASSERT(rc > 0) (filename()) (rc) (len) (JASSERT_ERRNO)
+        .Text("read() failed");
+        _bufEnd += rc;
+      }
+      avail = _bufEnd;
+    }
+    if (avail >= len) {
+      memcpy(buffer, _buf + _bufPos, len);
+      _bufPos += len;
+      _bytes += len;
+      return;
+    }
+
+    // Larger than the buffer: hand over what is buffered, and read the rest
+    // directly.
+    memcpy(buffer, _buf + _bufPos, avail);
+    _bufPos = _bufEnd = 0;
+    buffer = (char *)buffer + avail;
+    len -= avail;
+    _bytes += avail;
+  }
+
   size_t ret = jalib::readAll(_fd, buffer, len);
 
   JASSERT(ret == len) (filename()) (JASSERT_ERRNO) (ret) (len)
   .Text("read() failed");
   _bytes += len;
 }
+
+jalib::JBinarySerializeWriterMem::JBinarySerializeWriterMem(
+  const jalib::string &name)
+  : JBinarySerializer(name)
+{}
+
+void
+jalib::JBinarySerializeWriterMem::readOrWrite(void *buffer, size_t len)
+{
+  _data.append((const char *)buffer, len);
+  _bytes += len;
+}
+
+bool
+jalib::JBinarySerializeWriterMem::isReader() { return false; }
+
+void
+jalib::JBinarySerializeWriterMem::rewind()
+{
+  // clear() keeps the allocation for the next record.
+  _data.clear();
+  _bytes = 0;
+}
+
+bool
+jalib::JBinarySerializeWriterMem::isempty() { return _data.empty(); }
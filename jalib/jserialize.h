@@ -31,13 +31,19 @@
 #include <string>
 #include <vector>
 
-#define JSERIALIZE_ASSERT_POINT(str)                                \
-  { char versionCheck[] = str;                                      \
-    jalib::string correctValue = versionCheck;                      \
-    o &versionCheck;                                                \
-    JASSERT(versionCheck ==                                         \
-            correctValue)(versionCheck)(correctValue)(o.filename()) \
-    .Text("invalid file format"); }
+// Compact serializers (see JBinarySerializer::setCompact()) skip the
+// assert points.
+#define JSERIALIZE_ASSERT_POINT(str)                                  \
+  do {                                                                \
+    if (!o.isCompact()) {                                             \
+      char versionCheck[] = str;                                      \
+      jalib::string correctValue = versionCheck;                      \
+      o &versionCheck;                                                \
+      JASSERT(versionCheck ==                                         \
+              correctValue)(versionCheck)(correctValue)(o.filename()) \
+      .Text("invalid file format");                                   \
+    }                                                                 \
+  } while (0)
 
 namespace jalib
 {
@@ -52,7 +58,7 @@ class JBinarySerializer
     static void operator delete(void *p) { JALLOC_HELPER_DELETE(p); }
 #endif // ifdef JALIB_ALLOCATOR
     JBinarySerializer(const jalib::string &filename) : _filename(filename),
-      _bytes(0) {}
+      _bytes(0), _compact(false) {}
 
     virtual ~JBinarySerializer() {}
 
@@ -143,11 +149,17 @@ class JBinarySerializer
 
     size_t bytes() const { return _bytes; }
 
+    // A compact stream has no assert points.  The reader must be set to the
+    // same mode as the writer.
+    void setCompact(bool compact) { _compact = compact; }
+    bool isCompact() const { return _compact; }
+
   private:
     jalib::string _filename;
 
   protected:
     size_t _bytes;
+    bool _compact;
 };
 
 template<>
@@ -168,18 +180,28 @@ JBinarySerializer::serialize<jalib::IntVector>(jalib::IntVector &t)
   serializeVector(t);
 }
 
+// A buffered Raw serializer (see setBuffered()) reads or writes the fd in
+// large blocks instead of once per field.  The offset of the fd matches the
+// position in the stream whenever fd() is called and after the serializer is
+// destroyed, so that several serializers can share the fd in turn.
 class JBinarySerializeWriterRaw : public JBinarySerializer
 {
   public:
     JBinarySerializeWriterRaw(const jalib::string &file, int fd);
+    ~JBinarySerializeWriterRaw();
     void readOrWrite(void *buffer, size_t len);
     bool isReader();
     void rewind();
     bool isempty();
-    int fd() { return _fd; }
+    int fd() { flush(); return _fd; }
+
+    void setBuffered(bool buffered);
+    void flush();
 
   protected:
     int _fd;
+    char *_buf;
+    size_t _bufLen;
 };
 
 class JBinarySerializeWriter : public JBinarySerializeWriterRaw
@@ -189,19 +211,49 @@ class JBinarySerializeWriter : public JBinarySerializeWriterRaw
     ~JBinarySerializeWriter();
 };
 
+// Collects the stream in memory, e.g., to learn the length of a record
+// before it is written to a Raw serializer.  rewind() empties it.
+class JBinarySerializeWriterMem : public JBinarySerializer
+{
+  public:
+    JBinarySerializeWriterMem(const jalib::string &name);
+    void readOrWrite(void *buffer, size_t len);
+    bool isReader();
+    void rewind();
+    bool isempty();
+
+    const char *data() const { return _data.data(); }
+    size_t size() const { return _data.size(); }
+
+  private:
+    jalib::string _data;
+};
+
 class JBinarySerializeReaderRaw : public JBinarySerializer
 {
   public:
     JBinarySerializeReaderRaw(const jalib::string &file, int fd);
+    ~JBinarySerializeReaderRaw();
     void readOrWrite(void *buffer, size_t len);
     bool isReader();
     void rewind();
     bool isempty();
     bool isEOF();
-    int fd() { return _fd; }
+    int fd() { sync(); return _fd; }
+
+    void setBuffered(bool buffered);
+
+    // Skips the next len bytes of the stream.
+    void skip(size_t len);
 
   protected:
+    // Moves the offset of the fd back over the data read ahead.
+    void sync();
+
     int _fd;
+    char *_buf;
+    size_t _bufPos;
+    size_t _bufEnd;
 };
 
 class JBinarySerializeReader : public JBinarySerializeReaderRaw
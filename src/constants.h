@@ -104,6 +104,7 @@
 #define ENV_VAR_COMPRESSION         "DMTCP_GZIP"
 #define ENV_VAR_ALLOC_PLUGIN        "DMTCP_ALLOC_PLUGIN"
 #define ENV_VAR_DL_PLUGIN           "DMTCP_DL_PLUGIN"
+#define ENV_VAR_CORE_PLUGINS        "DMTCP_CORE_PLUGINS"
 #ifdef HBICT_DELTACOMP
   # define ENV_VAR_DELTACOMPRESSION "DMTCP_HBICT"
   # define ENV_DELTACOMPRESSION     ENV_VAR_DELTACOMPRESSION
@@ -122,7 +123,12 @@
 #define LIBDL_BASE_FUNC_STR             "dlinfo"
 #define ENV_VAR_DLSYM_OFFSET            "DMTCP_DLSYM_OFFSET"
 #define ENV_VAR_DLSYM_OFFSET_M32        "DMTCP_DLSYM_OFFSET_M32"
+#define ENV_VAR_DLSYM_CACHE_DIR         "DMTCP_DLSYM_CACHE_DIR"
 #define ENV_VAR_REMOTE_SHELL_CMD        "DMTCP_REMOTE_SHELL_CMD"
+#define ENV_VAR_TCP_REPAIR              "DMTCP_TCP_REPAIR"
+#define ENV_VAR_CKPT_FILE_STORE         "DMTCP_CKPT_FILE_STORE"
+#define ENV_VAR_UNTRACKED_PROGRAMS      "DMTCP_UNTRACKED_PROGRAMS"
+#define ENV_VAR_RESTART_ON_SAME_NODE    "DMTCP_RESTART_ON_SAME_NODE"
 
 // this list should be kept up to date with all "protected" environment vars
 #define ENV_VARS_ALL                  \
@@ -142,11 +148,17 @@
   ENV_VAR_COMPRESSION,                \
   ENV_VAR_ALLOC_PLUGIN,               \
   ENV_VAR_DL_PLUGIN,                  \
+  ENV_VAR_CORE_PLUGINS,               \
   ENV_VAR_SIGCKPT,                    \
   ENV_VAR_SCREENDIR,                  \
   ENV_VAR_DLSYM_OFFSET,               \
   ENV_VAR_DLSYM_OFFSET_M32,           \
+  ENV_VAR_DLSYM_CACHE_DIR,            \
   ENV_VAR_VIRTUAL_PID,                \
+  ENV_VAR_TCP_REPAIR,                 \
+  ENV_VAR_CKPT_FILE_STORE,            \
+  ENV_VAR_UNTRACKED_PROGRAMS,         \
+  ENV_VAR_RESTART_ON_SAME_NODE,       \
   ENV_VAR_SKIP_WRITING_TEXT_SEGMENTS, \
   ENV_DELTACOMPRESSION
 
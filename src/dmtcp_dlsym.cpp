@@ -57,10 +57,14 @@
 #ifndef _GNU_SOURCE
 # define _GNU_SOURCE
 #endif
+#include <fcntl.h>
+#include <limits.h>
 #include <link.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #ifndef _GNU_SOURCE
 # define _GNU_SOURCE
@@ -69,6 +73,7 @@
 
 #include "dmtcp_dlsym.h"
 #include "jassert.h"
+#include "syscallwrappers.h"
 #include "config.h"
 
 // ***** NOTE:  link.h invokes elf.h, which:
@@ -346,42 +351,351 @@ get_dt_tags(void *handle, dt_tag *tags)
   }
 }
 
-// Given a handle for a library (not RTLD_DEFAULT or RTLD_NEXT), retrieves the
-// default symbol for the given symbol if it exists in that library.
-// Also sets the tags and default_symbol_index for usage later
-void *
-dlsym_default_internal_library_handler(void *handle,
-                                       const char *symbol,
-                                       const char *version,
-                                       dt_tag *tags_p,
-                                       Elf32_Word *default_symbol_index_p)
+/* SYMBOL CACHE:  Looking up a symbol walks the hash chain of every library
+ * after the caller, and each process does this again for every wrapper it
+ * resolves, after every exec.  The result depends only on the contents of the
+ * library, so it is recorded in a file in the DMTCP tmpdir that is mapped by
+ * every process on the node.  An entry maps (build-id of the library, symbol,
+ * version) to the index of the default symbol in the dynamic symbol table,
+ * or to STN_UNDEF if the library has no such symbol; the latter is the common
+ * case, since RTLD_NEXT visits many libraries before the one defining the
+ * symbol.  A rebuilt library has a new build-id, and so misses in the cache.
+ * Libraries without a build-id are not cached.
+ *
+ * Entries are never removed.  A slot is claimed by a CAS on its state, filled
+ * in, and then marked valid; readers ignore slots that are not yet valid.
+ * Two processes may insert the same key into two slots, which is harmless.
+ */
+
+#define DLSYM_CACHE_FILE_PREFIX "dmtcpDlsymCache"
+#define DLSYM_CACHE_MAGIC       0x444d54435044534cULL  // "DMTCPDSL"
+#define DLSYM_CACHE_VERSION     1
+#define DLSYM_CACHE_NUM_SLOTS   8192
+#define DLSYM_CACHE_MAX_PROBES  32
+#define DLSYM_BUILD_ID_MAX      20
+#define DLSYM_VERSION_MAX       24
+#define DLSYM_SYMBOL_MAX        72
+#define DLSYM_MAX_LIBS          64
+
+enum {
+  DLSYM_SLOT_EMPTY = 0,
+  DLSYM_SLOT_FILLING,
+  DLSYM_SLOT_VALID
+};
+
+typedef struct DlsymCacheSlot {
+  uint32_t state;
+  uint32_t symIndex;
+  uint32_t buildIdLen;
+  unsigned char buildId[DLSYM_BUILD_ID_MAX];
+  char version[DLSYM_VERSION_MAX];
+  char symbol[DLSYM_SYMBOL_MAX];
+} DlsymCacheSlot;
+
+typedef struct DlsymCacheHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t numSlots;
+  char padding[48];
+} DlsymCacheHeader;
+
+typedef struct DlsymCache {
+  DlsymCacheHeader header;
+  DlsymCacheSlot slots[DLSYM_CACHE_NUM_SLOTS];
+} DlsymCache;
+
+typedef struct DlsymCacheKey {
+  uint32_t hash;
+  uint32_t buildIdLen;
+  const unsigned char *buildId;
+  const char *symbol;
+  const char *version;
+} DlsymCacheKey;
+
+// Build-ids of the libraries seen so far by this process.  An entry is
+// published by setting 'map' last.
+typedef struct DlsymBuildId {
+  struct link_map *map;
+  ElfW(Addr) addr;
+  ElfW(Dyn) *ld;
+  uint32_t len;
+  unsigned char id[DLSYM_BUILD_ID_MAX];
+} DlsymBuildId;
+
+static DlsymCache *dlsymCache = NULL;
+static DlsymBuildId buildIds[DLSYM_MAX_LIBS];
+static uint32_t numBuildIds = 0;
+
+typedef struct BuildIdSearch {
+  struct link_map *map;
+  uint32_t len;
+  unsigned char *id;
+} BuildIdSearch;
+
+static int
+find_build_id(struct dl_phdr_info *info, size_t size, void *data)
+{
+  BuildIdSearch *search = (BuildIdSearch *)data;
+  int i;
+
+  // The PT_DYNAMIC segment identifies the library uniquely, even for the
+  // executable and the vDSO, whose names and load addresses may be ambiguous.
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    if (info->dlpi_phdr[i].p_type == PT_DYNAMIC) {
+      break;
+    }
+  }
+  if (i == info->dlpi_phnum ||
+      (ElfW(Dyn) *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr) !=
+      search->map->l_ld) {
+    return 0;
+  }
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) {
+      continue;
+    }
+    size_t align = phdr->p_align == 8 ? 8 : 4;
+    char *note = (char *)(info->dlpi_addr + phdr->p_vaddr);
+    char *end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      ElfW(Nhdr) *nhdr = (ElfW(Nhdr) *)note;
+      char *name = note + sizeof(ElfW(Nhdr));
+      unsigned char *desc = (unsigned char *)
+        name + ((nhdr->n_namesz + align - 1) & ~(align - 1));
+      note = (char *)desc + ((nhdr->n_descsz + align - 1) & ~(align - 1));
+      if (nhdr->n_type == NT_GNU_BUILD_ID &&
+          nhdr->n_namesz == sizeof("GNU") &&
+          memcmp(name, "GNU", sizeof("GNU")) == 0 &&
+          nhdr->n_descsz > 0 && nhdr->n_descsz <= DLSYM_BUILD_ID_MAX &&
+          note <= end) {
+        memcpy(search->id, desc, nhdr->n_descsz);
+        search->len = nhdr->n_descsz;
+        return 1;
+      }
+    }
+  }
+  return 1;
+}
+
+// Returns the length of the build-id of the library, or 0 if it has none.
+static uint32_t
+get_build_id(struct link_map *map, unsigned char *id)
+{
+  uint32_t n = __atomic_load_n(&numBuildIds, __ATOMIC_ACQUIRE);
+  uint32_t i;
+
+  if (n > DLSYM_MAX_LIBS) {
+    n = DLSYM_MAX_LIBS;
+  }
+  for (i = 0; i < n; i++) {
+    DlsymBuildId *entry = &buildIds[i];
+    if (__atomic_load_n(&entry->map, __ATOMIC_ACQUIRE) == map &&
+        entry->addr == map->l_addr && entry->ld == map->l_ld) {
+      memcpy(id, entry->id, entry->len);
+      return entry->len;
+    }
+  }
+
+  BuildIdSearch search = { map, 0, id };
+  dl_iterate_phdr(find_build_id, &search);
+
+  i = __atomic_fetch_add(&numBuildIds, 1, __ATOMIC_ACQ_REL);
+  if (i < DLSYM_MAX_LIBS) {
+    DlsymBuildId *entry = &buildIds[i];
+    entry->addr = map->l_addr;
+    entry->ld = map->l_ld;
+    entry->len = search.len;
+    memcpy(entry->id, id, search.len);
+    __atomic_store_n(&entry->map, map, __ATOMIC_RELEASE);
+  }
+  return search.len;
+}
+
+// FNV-1a
+static uint32_t
+dlsym_cache_hash(uint32_t h, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 16777619;
+  }
+  return h;
+}
+
+// Returns false if the lookup cannot be cached.
+static bool
+dlsym_cache_make_key(void *handle,
+                     const char *symbol,
+                     const char *version,
+                     unsigned char *buildId,
+                     DlsymCacheKey *key)
+{
+  if (dlsymCache == NULL) {
+    return false;
+  }
+  if (version == NULL) {
+    version = "";
+  }
+  if (strlen(symbol) >= DLSYM_SYMBOL_MAX ||
+      strlen(version) >= DLSYM_VERSION_MAX) {
+    return false;
+  }
+  key->buildIdLen = get_build_id((struct link_map *)handle, buildId);
+  if (key->buildIdLen == 0) {
+    return false;
+  }
+  key->buildId = buildId;
+  key->symbol = symbol;
+  key->version = version;
+  key->hash = dlsym_cache_hash(2166136261U, buildId, key->buildIdLen);
+  key->hash = dlsym_cache_hash(key->hash, symbol, strlen(symbol) + 1);
+  key->hash = dlsym_cache_hash(key->hash, version, strlen(version));
+  return true;
+}
+
+static bool
+dlsym_cache_lookup(const DlsymCacheKey *key, Elf32_Word *symIndex)
+{
+  for (uint32_t i = 0; i < DLSYM_CACHE_MAX_PROBES; i++) {
+    DlsymCacheSlot *slot =
+      &dlsymCache->slots[(key->hash + i) % DLSYM_CACHE_NUM_SLOTS];
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == DLSYM_SLOT_EMPTY) {
+      return false;
+    }
+    if (state == DLSYM_SLOT_VALID &&
+        slot->buildIdLen == key->buildIdLen &&
+        memcmp(slot->buildId, key->buildId, key->buildIdLen) == 0 &&
+        strcmp(slot->symbol, key->symbol) == 0 &&
+        strcmp(slot->version, key->version) == 0) {
+      *symIndex = slot->symIndex;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+dlsym_cache_insert(const DlsymCacheKey *key, Elf32_Word symIndex)
+{
+  for (uint32_t i = 0; i < DLSYM_CACHE_MAX_PROBES; i++) {
+    DlsymCacheSlot *slot =
+      &dlsymCache->slots[(key->hash + i) % DLSYM_CACHE_NUM_SLOTS];
+    uint32_t expected = DLSYM_SLOT_EMPTY;
+    if (__atomic_compare_exchange_n(&slot->state, &expected,
+                                    DLSYM_SLOT_FILLING, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      slot->symIndex = symIndex;
+      slot->buildIdLen = key->buildIdLen;
+      memcpy(slot->buildId, key->buildId, key->buildIdLen);
+      strcpy(slot->version, key->version);
+      strcpy(slot->symbol, key->symbol);
+      __atomic_store_n(&slot->state, DLSYM_SLOT_VALID, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+/*
+ * Maps the symbol cache of the node from the given directory, replacing any
+ * earlier mapping; a NULL directory disables the cache.  It is called before
+ * the libc wrappers are resolved, and so may use only _real_open, _real_close,
+ * _real_mmap, _real_munmap and _real_syscall.
+ */
+EXTERNC void
+dmtcp_dlsym_cache_init(const char *dir)
+{
+  char path[PATH_MAX];
+  DlsymCache *cache;
+  int fd;
+
+  dlsymCache = NULL;
+  if (dir == NULL ||
+      snprintf(path, sizeof(path), "%s/%s.v%d.%d", dir,
+               DLSYM_CACHE_FILE_PREFIX, DLSYM_CACHE_VERSION,
+               (int)(8 * sizeof(void *))) >= (int)sizeof(path)) {
+    return;
+  }
+
+  fd = _real_open(path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) {
+    return;
+  }
+  // Extending the file is idempotent, and leaves existing entries intact.
+  if (_real_syscall(SYS_ftruncate, fd, sizeof(DlsymCache)) != 0) {
+    _real_close(fd);
+    return;
+  }
+  cache = (DlsymCache *)_real_mmap(NULL, sizeof(DlsymCache),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  _real_close(fd);
+  if (cache == MAP_FAILED) {
+    return;
+  }
+
+  uint64_t magic = 0;
+  __atomic_compare_exchange_n(&cache->header.magic, &magic, DLSYM_CACHE_MAGIC,
+                              false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  if (magic != 0 && magic != DLSYM_CACHE_MAGIC) {
+    _real_munmap(cache, sizeof(DlsymCache));
+    return;
+  }
+  cache->header.version = DLSYM_CACHE_VERSION;
+  cache->header.numSlots = DLSYM_CACHE_NUM_SLOTS;
+  dlsymCache = cache;
+}
+
+// Lookups made while the cache is detached just bypass it.
+EXTERNC void *
+dmtcp_dlsym_cache_detach()
+{
+  DlsymCache *cache = dlsymCache;
+
+  dlsymCache = NULL;
+  return cache;
+}
+
+EXTERNC void
+dmtcp_dlsym_cache_attach(void *cache)
+{
+  dlsymCache = (DlsymCache *)cache;
+}
+
+// Walks the hash chain of the library for the index of the default symbol
+// (or of the given version), or STN_UNDEF if the library has no such symbol.
+static Elf32_Word
+find_default_symbol_index(dt_tag *tags,
+                          const char *symbol,
+                          const char *version)
 {
-  dt_tag tags;
   Elf32_Word default_symbol_index = 0;
   Elf32_Word i;
   uint32_t numNonHiddenSymbols = 0;
 
-  get_dt_tags(handle, &tags);
-  JASSERT(tags.hash != NULL || tags.gnu_hash != NULL);
-  int use_gnu_hash = (tags.hash == NULL);
-  Elf32_Word *hash = (use_gnu_hash ? tags.gnu_hash : tags.hash);
+  JASSERT(tags->hash != NULL || tags->gnu_hash != NULL);
+  int use_gnu_hash = (tags->hash == NULL);
+  Elf32_Word *hash = (use_gnu_hash ? tags->gnu_hash : tags->hash);
   for (i = hash_first(symbol, hash, use_gnu_hash); i != STN_UNDEF;
        i = hash_next(i, hash, use_gnu_hash)) {
-    if (tags.symtab[i].st_name == 0 || tags.symtab[i].st_value == 0) {
+    if (tags->symtab[i].st_name == 0 || tags->symtab[i].st_value == 0) {
       continue;
     }
-    if (strcmp(symbol_name(i, &tags), symbol) != 0) {
+    if (strcmp(symbol_name(i, tags), symbol) != 0) {
       // If different symbol name
       continue;
     }
-    char *symversion = version_name(tags.versym[i], &tags);
+    char *symversion = version_name(tags->versym[i], tags);
     if (version && symversion && strcmp(symversion, version) == 0) {
       default_symbol_index = i;
       break;
     }
     // We have a symbol of the same name.  Let's look at the version number.
     if (version == NULL) {
-      if (!(tags.versym[i] & (1<<15))) { // If hidden bit is not set.
+      if (!(tags->versym[i] & (1<<15))) { // If hidden bit is not set.
         numNonHiddenSymbols++;
       }
       // If default symbol not set or if new version later than old one.
@@ -390,8 +704,8 @@ dlsym_default_internal_library_handler(void *handle,
       if (default_symbol_index && numNonHiddenSymbols > 1) {
         JWARNING(false)(symbol).Text("More than one default symbol version.");
       }
-      char *defaultSymVersion = version_name(tags.versym[default_symbol_index],
-                                             &tags);
+      char *defaultSymVersion = version_name(tags->versym[default_symbol_index],
+                                             tags);
       if (default_symbol_index == 0 ||
           // Could look at version dependencies, but using strcmp instead.
           (symversion && defaultSymVersion &&
@@ -400,6 +714,39 @@ dlsym_default_internal_library_handler(void *handle,
       }
     }
   }
+  return default_symbol_index;
+}
+
+// Given a handle for a library (not RTLD_DEFAULT or RTLD_NEXT), retrieves the
+// default symbol for the given symbol if it exists in that library.
+// Also sets the tags and default_symbol_index for usage later
+void *
+dlsym_default_internal_library_handler(void *handle,
+                                       const char *symbol,
+                                       const char *version,
+                                       dt_tag *tags_p,
+                                       Elf32_Word *default_symbol_index_p)
+{
+  dt_tag tags;
+  Elf32_Word default_symbol_index = 0;
+  unsigned char buildId[DLSYM_BUILD_ID_MAX];
+  DlsymCacheKey key;
+  bool cacheable;
+
+  memset(&key, 0, sizeof(key));
+
+  get_dt_tags(handle, &tags);
+  cacheable = dlsym_cache_make_key(handle, symbol, version, buildId, &key);
+  if (!cacheable || !dlsym_cache_lookup(&key, &default_symbol_index) ||
+      // Guard against a corrupt entry, or two libraries sharing a build-id.
+      (default_symbol_index != STN_UNDEF &&
+       (tags.symtab[default_symbol_index].st_value == 0 ||
+        strcmp(symbol_name(default_symbol_index, &tags), symbol) != 0))) {
+    default_symbol_index = find_default_symbol_index(&tags, symbol, version);
+    if (cacheable) {
+      dlsym_cache_insert(&key, default_symbol_index);
+    }
+  }
   *tags_p = tags;
   *default_symbol_index_p = default_symbol_index;
 
@@ -109,6 +109,20 @@ static const char *theUsage =
   "              If used with --checkpoint-open-files, allows a saved file\n"
   "              to overwrite its existing copy at original location\n"
   "              (default: file overwrites are not allowed)\n"
+  "  --ckpt-file-store (environment variable DMTCP_CKPT_FILE_STORE=[01])\n"
+  "              Save checkpointed open files as lists of chunks in a store\n"
+  "              under the checkpoint dir, shared by all processes; only\n"
+  "              new chunks are written.  (default: disabled)\n"
+  "  --tcp-repair (environment variable DMTCP_TCP_REPAIR=[01])\n"
+  "              Checkpoint TCP connections with TCP_REPAIR instead of\n"
+  "              draining them; needs CAP_NET_ADMIN.  A connection is\n"
+  "              drained unless both of its ends can use it.\n"
+  "              (default: disabled)\n"
+  "  --restart-on-same-node\n"
+  "              (environment variable DMTCP_RESTART_ON_SAME_NODE=[01])\n"
+  "              Promise that processes sharing a file mapping are restarted\n"
+  "              on the same node.  Only one of them then saves the mapping.\n"
+  "              (default: disabled; each process saves its own copy)\n"
   "  --ckpt-signal signum\n"
   "              Signal number used internally by DMTCP for checkpointing\n"
   "              (default: SIGUSR2/12).\n"
@@ -135,6 +149,11 @@ static const char *theUsage =
   "              Disable alloc plugin (default: enabled).\n"
   "  --disable-dl-plugin: (environment variable DMTCP_DL_PLUGIN=[01])\n"
   "              Disable dl plugin (default: enabled).\n"
+  "  --core-plugins: (environment variable DMTCP_CORE_PLUGINS=[01])\n"
+  "              Preload the alloc, dl, ipc, svipc, and timer plugins as a\n"
+  "              single library, libdmtcp_core.so, to reduce the startup\n"
+  "              time of each process.  Ignored if one of them is disabled.\n"
+  "              (default: disabled)\n"
   "  --disable-all-plugins (EXPERTS ONLY, FOR DEBUGGING)\n"
   "              Disable all plugins.\n"
   "\n"
@@ -145,6 +164,15 @@ static const char *theUsage =
   "               different tmpdirs.)\n"
   "  -q, --quiet (or set environment variable DMTCP_QUIET = 0, 1, or 2)\n"
   "              Skip NOTE messages; if given twice, also skip WARNINGs\n"
+  "  --untracked-programs PATTERNS\n"
+  "              (environment variable DMTCP_UNTRACKED_PROGRAMS)\n"
+  "              Colon-separated list of shell patterns (e.g. 'uname:sed:\n"
+  "              /usr/lib/*') for short-lived helper programs that are run\n"
+  "              outside of DMTCP, without its libraries or environment.\n"
+  "              A pattern containing '/' is matched against the full path,\n"
+  "              and any other pattern against the program name.  A process\n"
+  "              that execs such a program leaves the computation, and is\n"
+  "              not checkpointed or restarted.  (default: none)\n"
   "  --coord-logfile PATH (environment variable DMTCP_COORD_LOG_FILENAME\n"
   "              Coordinator will dump its logs to the given file\n"
   "  --help\n"
@@ -180,6 +208,9 @@ static bool enableIPCPlugin = true;
 static bool enableSvipcPlugin = true;
 static bool enableTimerPlugin = true;
 
+// Use libdmtcp_core.so in place of the plugins marked 'inCore' below.
+static bool enableCorePlugins = false;
+
 #ifdef UNIQUE_CHECKPOINT_FILENAMES
 static bool enableUniqueCkptPlugin = true;
 #else // ifdef UNIQUE_CHECKPOINT_FILENAMES
@@ -197,23 +228,24 @@ static string thePortFile;
 struct PluginInfo {
   bool *enabled;
   const char *lib;
+  bool inCore;
 };
 
-static struct PluginInfo pluginInfo[] = {               // Default value
-  { &enablePtracePlugin, "libdmtcp_ptrace.so" },        // Disabled
-  { &enableModifyEnvPlugin, "libdmtcp_modify-env.so" },  // Disabled
-  { &enableUniqueCkptPlugin, "libdmtcp_unique-ckpt.so" }, // Disabled
-  { &enableIB2TcpPlugin, "libdmtcp_ib2tcp.so" },        // Disabled
-  { &enableIBPlugin, "libdmtcp_infiniband.so" },        // Disabled
-  { &enableRMPlugin, "libdmtcp_batch-queue.so" },       // Disabled
-  { &enableAllocPlugin, "libdmtcp_alloc.so" },          // Enabled
-  { &enableDlPlugin, "libdmtcp_dl.so" },                // Enabled
-  { &enableIPCPlugin, "libdmtcp_ipc.so" },              // Enabled
-  { &enableSvipcPlugin, "libdmtcp_svipc.so" },          // Enabled
-  { &enableTimerPlugin, "libdmtcp_timer.so" },          // Enabled
-  { &enableLibDMTCP, "libdmtcp.so" },                   // Enabled
+static struct PluginInfo pluginInfo[] = {                      // Default value
+  { &enablePtracePlugin, "libdmtcp_ptrace.so", false },         // Disabled
+  { &enableModifyEnvPlugin, "libdmtcp_modify-env.so", false },  // Disabled
+  { &enableUniqueCkptPlugin, "libdmtcp_unique-ckpt.so", false }, // Disabled
+  { &enableIB2TcpPlugin, "libdmtcp_ib2tcp.so", false },         // Disabled
+  { &enableIBPlugin, "libdmtcp_infiniband.so", false },         // Disabled
+  { &enableRMPlugin, "libdmtcp_batch-queue.so", false },        // Disabled
+  { &enableAllocPlugin, "libdmtcp_alloc.so", true },            // Enabled
+  { &enableDlPlugin, "libdmtcp_dl.so", true },                  // Enabled
+  { &enableIPCPlugin, "libdmtcp_ipc.so", true },                // Enabled
+  { &enableSvipcPlugin, "libdmtcp_svipc.so", true },            // Enabled
+  { &enableTimerPlugin, "libdmtcp_timer.so", true },            // Enabled
+  { &enableLibDMTCP, "libdmtcp.so", false },                    // Enabled
   // PID plugin must come last.
-  { &enablePIDPlugin, "libdmtcp_pid.so" }               // Enabled
+  { &enablePIDPlugin, "libdmtcp_pid.so", false }                // Enabled
 };
 
 const size_t numLibs = sizeof(pluginInfo) / sizeof(struct PluginInfo);
@@ -312,6 +344,9 @@ processArgs(int *orig_argc,
     } else if (argc > 1 && (s == "-t" || s == "--tmpdir")) {
       tmpdir_arg = argv[1];
       shift; shift;
+    } else if (argc > 1 && s == "--untracked-programs") {
+      setenv(ENV_VAR_UNTRACKED_PROGRAMS, argv[1], 1);
+      shift; shift;
     } else if (argc > 1 && s == "--ckpt-signal") {
       setenv(ENV_VAR_SIGCKPT, argv[1], 1);
       shift; shift;
@@ -321,6 +356,15 @@ processArgs(int *orig_argc,
     } else if (s == "--allow-file-overwrite") {
       setenv(ENV_VAR_ALLOW_OVERWRITE_WITH_CKPTED_FILES, "1", 0);
       shift;
+    } else if (s == "--ckpt-file-store") {
+      setenv(ENV_VAR_CKPT_FILE_STORE, "1", 0);
+      shift;
+    } else if (s == "--tcp-repair") {
+      setenv(ENV_VAR_TCP_REPAIR, "1", 0);
+      shift;
+    } else if (s == "--restart-on-same-node") {
+      setenv(ENV_VAR_RESTART_ON_SAME_NODE, "1", 0);
+      shift;
     } else if (s == "--ptrace") {
       enablePtracePlugin = true;
       shift;
@@ -339,6 +383,9 @@ processArgs(int *orig_argc,
     } else if (s == "--disable-dl-plugin") {
       setenv(ENV_VAR_DL_PLUGIN, "0", 1);
       shift;
+    } else if (s == "--core-plugins") {
+      setenv(ENV_VAR_CORE_PLUGINS, "1", 1);
+      shift;
     } else if (s == "--no-plugins" || s == "--disable-all-plugins") {
       disableAllPlugins = true;
       shift;
@@ -804,18 +851,47 @@ setLDPreloadLibs(bool is32bitElf)
     }
   }
 
+  // Setup core plugins
+  if (getenv(ENV_VAR_CORE_PLUGINS) != NULL) {
+    const char *ptr = getenv(ENV_VAR_CORE_PLUGINS);
+    if (strcmp(ptr, "1") == 0) {
+      enableCorePlugins = true;
+    } else if (strcmp(ptr, "0") == 0) {
+      enableCorePlugins = false;
+    } else {
+      JASSERT(false) (getenv(ENV_VAR_CORE_PLUGINS))
+      .Text("Invalid value for the environment variable.");
+    }
+  }
+
+  // libdmtcp_core.so always contains all of its plugins.
+  for (size_t i = 0; i < numLibs; i++) {
+    if (pluginInfo[i].inCore && !*pluginInfo[i].enabled) {
+      enableCorePlugins = false;
+    }
+  }
+
   if (disableAllPlugins) {
     preloadLibs = Util::getPath("libdmtcp.so");
 #if defined(__x86_64__) || defined(__aarch64__)
     preloadLibs32 = Util::getPath("libdmtcp.so", true);
 #endif // if defined(__x86_64__) || defined(__aarch64__)
   } else {
+    bool addedCore = false;
     for (size_t i = 0; i < numLibs; i++) {
       struct PluginInfo *p = &pluginInfo[i];
+      const char *lib = p->lib;
+      if (enableCorePlugins && p->inCore) {
+        if (addedCore) {
+          continue;
+        }
+        lib = "libdmtcp_core.so";
+        addedCore = true;
+      }
       if (*p->enabled) {
-        preloadLibs += Util::getPath(p->lib) + ":";
+        preloadLibs += Util::getPath(lib) + ":";
 #if defined(__x86_64__) || defined(__aarch64__)
-        preloadLibs32 += Util::getPath(p->lib, true) + ":";
+        preloadLibs32 += Util::getPath(lib, true) + ":";
 #endif // if defined(__x86_64__) || defined(__aarch64__)
       }
     }
@@ -42,6 +42,7 @@ using namespace dmtcp;
 LIB_PRIVATE void pthread_atfork_prepare();
 LIB_PRIVATE void pthread_atfork_parent();
 LIB_PRIVATE void pthread_atfork_child();
+LIB_PRIVATE void initUntrackedPrograms();
 
 void pidVirt_pthread_atfork_child() __attribute__((weak));
 
@@ -225,9 +226,12 @@ prepareLogAndProcessdDataFromSerialFile()
     // of the new log file into that one.
     string prevLogFilePath = getLogFilePath();
 
-    jalib::JBinarySerializeReaderRaw rd("", PROTECTED_LIFEBOAT_FD);
-    rd.rewind();
-    UniquePid::serialize(rd);
+    {
+      jalib::JBinarySerializeReaderRaw rd("", PROTECTED_LIFEBOAT_FD);
+      rd.setBuffered(true);
+      rd.rewind();
+      UniquePid::serialize(rd);
+    }
     Util::initializeLogFile(SharedData::getTmpDir(), "", prevLogFilePath);
 
     writeCurrentLogFileNameToPrevLogFile(prevLogFilePath);
@@ -309,6 +313,9 @@ dmtcp_initialize()
   // getenv(ENV_VAR_SIGCKPT) now and cache it to avoid getenv calls later.
   DmtcpWorker::determineCkptSignal();
 
+  // Likewise, read the patterns of programs to exec outside of DMTCP.
+  initUntrackedPrograms();
+
   // Also cache programName and arguments
   string programName = jalib::Filesystem::GetProgramName();
 
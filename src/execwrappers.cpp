@@ -30,6 +30,8 @@
 #undef SYS_fork
 #define SYS_fork __NR_fork
 #endif  // ifdef __aarch64__
+#include <fnmatch.h>
+#include <spawn.h>
 #include "../jalib/jassert.h"
 #include "../jalib/jconvert.h"
 #include "../jalib/jfilesystem.h"
@@ -60,6 +62,9 @@ static bool pthread_atfork_enabled = false;
 static uint64_t child_time;
 static int childCoordinatorSocket = -1;
 
+// Shell patterns from DMTCP_UNTRACKED_PROGRAMS, or NULL if none were given.
+static vector<string> *untrackedPrograms = NULL;
+
 // Allow plugins to call fork/exec/system to perform specific tasks during
 // preCKpt/postCkpt/PostRestart etc. event.
 static bool
@@ -324,6 +329,33 @@ execShortLivedProcessAndExit(const char *path, char *const argv[])
 // FIXME:  Unify this code with code prior to execvp in dmtcp_launch.cpp
 // Can use argument to dmtcpPrepareForExec() or getenv("DMTCP_...")
 // from DmtcpWorker constructor, to distinguish the two cases.
+// Creates the unlinked file that carries the serialized state of the plugins
+// across exec.  A memfd avoids a round trip through the tmpdir filesystem;
+// older kernels fall back to a temporary file.
+static int
+createLifeBoat()
+{
+  int fd;
+
+#ifdef SYS_memfd_create
+  fd = _real_syscall(SYS_memfd_create, "dmtcpLifeBoat", 0);
+  if (fd != -1) {
+    return fd;
+  }
+#endif // ifdef SYS_memfd_create
+
+  ostringstream os;
+  os << dmtcp_get_tmpdir() << "/dmtcpLifeBoat." << UniquePid::ThisProcess()
+     << "-XXXXXX";
+  char *buf = (char *)JALLOC_HELPER_MALLOC(os.str().length() + 1);
+  strcpy(buf, os.str().c_str());
+  fd = _real_mkstemp(buf);
+  JASSERT(fd != -1) (JASSERT_ERRNO);
+  JASSERT(unlink(buf) == 0) (JASSERT_ERRNO);
+  JALLOC_HELPER_FREE(buf);
+  return fd;
+}
+
 static void
 dmtcpPrepareForExec(const char *path,
                     char *const argv[],
@@ -392,17 +424,12 @@ dmtcpPrepareForExec(const char *path,
     *newArgv = (char **)argv;
   }
 
-  ostringstream os;
-  os << dmtcp_get_tmpdir() << "/dmtcpLifeBoat." << UniquePid::ThisProcess()
-     << "-XXXXXX";
-  char *buf = (char *)JALLOC_HELPER_MALLOC(os.str().length() + 1);
-  strcpy(buf, os.str().c_str());
-  int fd = _real_mkstemp(buf);
-  JASSERT(fd != -1) (JASSERT_ERRNO);
-  JASSERT(unlink(buf) == 0) (JASSERT_ERRNO);
-  Util::changeFd(fd, PROTECTED_LIFEBOAT_FD);
-  jalib::JBinarySerializeWriterRaw wr("", PROTECTED_LIFEBOAT_FD);
-  UniquePid::serialize(wr);
+  Util::changeFd(createLifeBoat(), PROTECTED_LIFEBOAT_FD);
+  {
+    jalib::JBinarySerializeWriterRaw wr("", PROTECTED_LIFEBOAT_FD);
+    wr.setBuffered(true);
+    UniquePid::serialize(wr);
+  }
   DmtcpEventData_t edata;
   edata.serializerInfo.fd = PROTECTED_LIFEBOAT_FD;
   PluginManager::eventHook(DMTCP_EVENT_PRE_EXEC, &edata);
@@ -580,12 +607,209 @@ patchUserEnv(vector<string>env, const char *filename)
   return result;
 }
 
+/* The exec policy (dmtcp_launch --untracked-programs) names short-lived
+ * helper programs that are not worth checkpointing.  Their exec skips the
+ * lifeboat, LD_PRELOAD and our environment variables, so that the new
+ * program starts without DMTCP, at native cost.  The exec'ing process leaves
+ * the computation, as for dmtcp_nocheckpoint: it is not checkpointed, and a
+ * restarted computation does not include it.  The patterns are read once,
+ * when libdmtcp.so is initialized, as for determineCkptSignal().
+ */
+LIB_PRIVATE void
+initUntrackedPrograms()
+{
+  const char *patterns = getenv(ENV_VAR_UNTRACKED_PROGRAMS);
+
+  if (untrackedPrograms == NULL && patterns != NULL && patterns[0] != '\0') {
+    untrackedPrograms = new vector<string>(Util::tokenizeString(patterns, ":"));
+  }
+}
+
+// A pattern containing '/' is matched against the path given to exec, and
+// any other pattern against its last component.
+static bool
+isUntrackedProgram(const char *path)
+{
+  if (untrackedPrograms == NULL || path == NULL) {
+    return false;
+  }
+
+  const char *name = strrchr(path, '/');
+  name = (name == NULL) ? path : name + 1;
+  for (size_t i = 0; i < untrackedPrograms->size(); i++) {
+    const char *pattern = (*untrackedPrograms)[i].c_str();
+    const char *subject = (strchr(pattern, '/') != NULL) ? path : name;
+    if (fnmatch(pattern, subject, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A command line given to system() is run outside of DMTCP only if it runs a
+// single untracked program: no pipelines, lists, redirections, substitutions,
+// or variable assignments, any of which could start another program.
+static bool
+isUntrackedCommand(const char *line)
+{
+  if (untrackedPrograms == NULL || strpbrk(line, "|&;<>()$`\\\n") != NULL) {
+    return false;
+  }
+
+  const char *start = line + strspn(line, " \t");
+  const string program(start, strcspn(start, " \t"));
+  if (program.empty() || program.find_first_of("=\"'") != string::npos) {
+    return false;
+  }
+  return isUntrackedProgram(program.c_str());
+}
+
+// The user environment, without our variables.  LD_PRELOAD was already
+// restored to the user's value by restoreUserLDPRELOAD(), or emptied.
+static vector<string>
+untrackedEnv(char *const envp[])
+{
+  vector<string>result;
+
+  if (envp != NULL) {
+    for (size_t i = 0; envp[i] != NULL; i++) {
+      if (!isImportantEnv(envp[i]) && strcmp(envp[i], "LD_PRELOAD=") != 0) {
+        result.push_back(envp[i]);
+      }
+    }
+  }
+  return result;
+}
+
+static int
+execUntrackedProgram(const char *filename,
+                     char *const argv[],
+                     char *const envp[],
+                     bool searchPath)
+{
+  JTRACE("exec of untracked program") (filename);
+
+  const vector<string>envStrings = untrackedEnv(envp);
+  const vector<const char *>env = stringVectorToPointerArray(envStrings);
+
+  // Don't let a checkpoint start while this process leaves the computation.
+  WRAPPER_EXECUTION_GET_EXCL_LOCK();
+
+  // The process leaves the computation at exec: the coordinator must see
+  // its socket close, or it would wait at every later checkpoint for a
+  // peer that never answers.  The protected fds are closed by the exec
+  // itself, as dmtcp_nocheckpoint closes them by hand, so that a failed
+  // exec leaves the process in the computation.
+  int fdFlags[PROTECTED_FD_END - PROTECTED_FD_START];
+  for (int i = PROTECTED_FD_START; i < PROTECTED_FD_END; i++) {
+    int flags = fcntl(i, F_GETFD);
+    fdFlags[i - PROTECTED_FD_START] = flags;
+    if (flags != -1) {
+      fcntl(i, F_SETFD, flags | FD_CLOEXEC);
+    }
+  }
+
+  int retVal;
+  if (searchPath) {
+    retVal = _real_execvpe(filename, argv, (char *const *)&env[0]);
+  } else {
+    retVal = _real_execve(filename, argv, (char *const *)&env[0]);
+  }
+
+  int savedErrno = errno;
+  for (int i = PROTECTED_FD_START; i < PROTECTED_FD_END; i++) {
+    if (fdFlags[i - PROTECTED_FD_START] != -1) {
+      fcntl(i, F_SETFD, fdFlags[i - PROTECTED_FD_START]);
+    }
+  }
+  errno = savedErrno;
+
+  WRAPPER_EXECUTION_RELEASE_EXCL_LOCK();
+
+  return retVal;
+}
+
+// Runs "sh -c line" outside of DMTCP, with the semantics of glibc's system().
+// posix_spawn() creates the child with vfork semantics and without going
+// through our fork wrapper, which saves the coordinator handshake of a new
+// process, and the shell execs without our libraries.  As in
+// execShortLivedProcessAndExit(), the checkpoint is delayed until the helper
+// exits, so it never needs to be checkpointed.
+static int
+systemUntracked(const char *line)
+{
+  const vector<string>envStrings = untrackedEnv(environ);
+  const vector<const char *>env = stringVectorToPointerArray(envStrings);
+  const char *argv[] = { "sh", "-c", line, NULL };
+  struct sigaction sa, intr, quit;
+  sigset_t block, omask, sigdef;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &intr);
+  sigaction(SIGQUIT, &sa, &quit);
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &omask);
+
+  sigemptyset(&sigdef);
+  if (intr.sa_handler != SIG_IGN) {
+    sigaddset(&sigdef, SIGINT);
+  }
+  if (quit.sa_handler != SIG_IGN) {
+    sigaddset(&sigdef, SIGQUIT);
+  }
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &omask);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                                  POSIX_SPAWN_SETSIGMASK);
+
+  // The helper must not hold on to the coordinator socket or our other fds.
+  posix_spawn_file_actions_init(&actions);
+  for (int i = PROTECTED_FD_START; i < PROTECTED_FD_END; i++) {
+    if (fcntl(i, F_GETFD) != -1) {
+      posix_spawn_file_actions_addclose(&actions, i);
+    }
+  }
+
+  WRAPPER_EXECUTION_DISABLE_CKPT();
+  if (posix_spawn(&pid, "/bin/sh", &actions, &attr, (char *const *)argv,
+                  (char *const *)&env[0]) == 0) {
+    while (_real_wait4(pid, &status, 0, NULL) == -1) {
+      if (errno != EINTR) {
+        status = -1;
+        break;
+      }
+    }
+  } else {
+    status = W_EXITCODE(127, 0);
+  }
+  WRAPPER_EXECUTION_ENABLE_CKPT();
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  sigaction(SIGINT, &intr, NULL);
+  sigaction(SIGQUIT, &quit, NULL);
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+
+  return status;
+}
+
 extern "C" int
 execve(const char *filename, char *const argv[], char *const envp[])
 {
   if (isPerformingCkptRestart() || isBlacklistedProgram(filename)) {
     return _real_execve(filename, argv, envp);
   }
+  if (isUntrackedProgram(filename)) {
+    return execUntrackedProgram(filename, argv, envp, false);
+  }
   JTRACE("execve() wrapper") (filename);
 
   /* Acquire the wrapperExeution lock to prevent checkpoint to happen while
@@ -631,6 +855,9 @@ execvp(const char *filename, char *const argv[])
   if (isPerformingCkptRestart() || isBlacklistedProgram(filename)) {
     return _real_execvp(filename, argv);
   }
+  if (isUntrackedProgram(filename)) {
+    return execUntrackedProgram(filename, argv, environ, true);
+  }
   JTRACE("execvp() wrapper") (filename);
 
   /* Acquire the wrapperExeution lock to prevent checkpoint to happen while
@@ -659,6 +886,9 @@ execvpe(const char *filename, char *const argv[], char *const envp[])
   if (isPerformingCkptRestart() || isBlacklistedProgram(filename)) {
     return _real_execvpe(filename, argv, envp);
   }
+  if (isUntrackedProgram(filename)) {
+    return execUntrackedProgram(filename, argv, envp, true);
+  }
   JTRACE("execvpe() wrapper") (filename);
 
   /* Acquire the wrapperExeution lock to prevent checkpoint to happen while
@@ -856,7 +1086,12 @@ system(const char *line)
     return do_system("exit 0") == 0;
   }
 
-  int result = do_system(line);
+  int result;
+  if (isUntrackedCommand(line)) {
+    result = systemUntracked(line);
+  } else {
+    result = do_system(line);
+  }
 
   JTRACE("after system()");
 
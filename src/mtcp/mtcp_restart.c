@@ -47,6 +47,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -125,9 +126,19 @@ typedef struct RestoreInfo {
 } RestoreInfo;
 static RestoreInfo rinfo;
 
+/* The SysV shared memory segment being restored by
+ * restore_sysv_shm_area().
+ */
+typedef struct SysVShmState {
+  VA addr;     /* Where the segment is attached; NULL if it is not */
+  size_t size; /* Size of the attachment (a multiple of the page size) */
+  int existed; /* The segment existed before restart */
+} SysVShmState;
+
 /* Internal routines */
 static void readmemoryareas(int fd);
-static int read_one_memory_area(int fd);
+static int read_one_memory_area(int fd, SysVShmState *shm);
+static int restore_sysv_shm_area(int fd, Area *area, SysVShmState *shm);
 #if 0
 static void adjust_for_smaller_file_size(Area *area, int fd);
 #endif /* if 0 */
@@ -577,8 +588,9 @@ mtcp_simulateread(int fd, MtcpHeader *mtcpHdr)
     if (area.size == -1) {
       break;
     }
-    if ((area.properties & DMTCP_ZERO_PAGE) == 0 &&
-        (area.properties & DMTCP_SKIP_WRITING_TEXT_SEGMENTS) == 0) {
+    if ((area.properties & (DMTCP_ZERO_PAGE |
+                            DMTCP_SKIP_WRITING_TEXT_SEGMENTS |
+                            DMTCP_SHARED_AREA_REF)) == 0) {
       void *addr = mtcp_sys_mmap(0, area.size, PROT_WRITE | PROT_READ,
                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
       if (addr == MAP_FAILED) {
@@ -938,8 +950,10 @@ unmap_memory_areas_and_restore_vdso(RestoreInfo *rinfo)
 static void
 readmemoryareas(int fd)
 {
+  SysVShmState shm = { NULL, 0, 0 };
+
   while (1) {
-    if (read_one_memory_area(fd) == -1) {
+    if (read_one_memory_area(fd, &shm) == -1) {
       break; /* error */
     }
   }
@@ -955,7 +969,7 @@ readmemoryareas(int fd)
 
 NO_OPTIMIZE
 static int
-read_one_memory_area(int fd)
+read_one_memory_area(int fd, SysVShmState *shm)
 {
   int mtcp_sys_errno;
   int imagefd;
@@ -970,6 +984,14 @@ read_one_memory_area(int fd)
     return -1;
   }
 
+  /* CASE SYSV SHARED MEMORY: if the segment can't be recreated, fall back to
+   * restoring a private copy, which DMTCP copies into a new segment.
+   */
+  if ((area.properties & DMTCP_SYSV_SHM_AREA) != 0 &&
+      restore_sysv_shm_area(fd, &area, shm) == 0) {
+    return 0;
+  }
+
   if (area.name[0] && mtcp_strstr(area.name, "[heap]")
       && mtcp_sys_brk(NULL) != area.addr + area.size) {
     DPRINTF("WARNING: break (%p) not equal to end of heap (%p)\n",
@@ -986,8 +1008,11 @@ read_one_memory_area(int fd)
 
   /* Now mmap the data of the area into memory. */
 
-  /* CASE MAPPED AS ZERO PAGE: */
-  if ((area.properties & DMTCP_ZERO_PAGE) != 0) {
+  /* CASE MAPPED AS ZERO PAGE:
+   * A reference to a shared area saved by another process is also restored
+   * as zero pages, until the file plugin maps the file over it.
+   */
+  if ((area.properties & (DMTCP_ZERO_PAGE | DMTCP_SHARED_AREA_REF)) != 0) {
     DPRINTF("restoring non-rwx anonymous area, %p bytes at %p\n",
             area.size, area.addr);
     mmappedat = mtcp_sys_mmap(area.addr, area.size,
@@ -1129,6 +1154,77 @@ read_one_memory_area(int fd)
   return 0;
 }
 
+/* Restores an area of a SysV shared memory segment.  For the first area of
+ * the segment, recreates the segment (or finds it, if it still exists) and
+ * attaches it at its original address.  The contents are then read straight
+ * into the segment, instead of into a private copy.  Returns -1 if the area
+ * must be restored as a private copy instead.
+ */
+NO_OPTIMIZE
+static int
+restore_sysv_shm_area(int fd, Area *area, SysVShmState *shm)
+{
+#ifdef mtcp_sys_shmget
+  int mtcp_sys_errno;
+
+  if (area->addr == area->shmAddr) {
+    int shmid;
+    int shmflg = SHM_REMAP;
+    void *addr;
+
+    shm->addr = NULL;
+    shm->existed = 0;
+    shmid = mtcp_sys_shmget(area->shmKey, area->shmSize,
+                            IPC_CREAT | IPC_EXCL | area->shmMode);
+    if (shmid == -1 && mtcp_sys_errno == EEXIST) {
+      shmid = mtcp_sys_shmget(area->shmKey, area->shmSize, area->shmMode);
+      shm->existed = 1;
+    }
+    if (shmid == -1) {
+      DPRINTF("error %d recreating SysV shm segment of %p bytes at %p\n",
+              mtcp_sys_errno, area->shmSize, area->shmAddr);
+      return -1;
+    }
+
+    if (area->prot & PROT_EXEC) {
+      shmflg |= SHM_EXEC;
+    }
+    addr = mtcp_sys_shmat(shmid, area->shmAddr, shmflg);
+    if (addr != area->shmAddr) {
+      DPRINTF("error %d attaching SysV shm segment at %p\n",
+              mtcp_sys_errno, area->shmAddr);
+      if (!shm->existed) {
+        mtcp_sys_shmctl(shmid, IPC_RMID, NULL);
+      }
+      return -1;
+    }
+    shm->addr = area->shmAddr;
+    shm->size = (area->shmSize + MTCP_PAGE_SIZE - 1) & MTCP_PAGE_MASK;
+  }
+
+  if (shm->addr == NULL || area->addr < shm->addr ||
+      area->addr + area->size > shm->addr + shm->size) {
+    return -1;
+  }
+
+  DPRINTF("restoring SysV shm area, %p bytes at %p\n", area->size, area->addr);
+  if ((area->properties & DMTCP_ZERO_PAGE) == 0) {
+    mtcp_readfile(fd, area->addr, area->size);
+  } else if (shm->existed) {
+    mtcp_memset(area->addr, 0, area->size);
+  }
+  if (area->prot != (PROT_READ | PROT_WRITE) &&
+      mtcp_sys_mprotect(area->addr, area->size, area->prot) < 0) {
+    MTCP_PRINTF("error %d protecting %p bytes at %p\n",
+                mtcp_sys_errno, area->size, area->addr);
+    mtcp_abort();
+  }
+  return 0;
+#else // ifdef mtcp_sys_shmget
+  return -1;
+#endif // ifdef mtcp_sys_shmget
+}
+
 #if 0
 
 // See note above.
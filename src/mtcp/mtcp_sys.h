@@ -327,6 +327,11 @@ struct linux_dirent {
                               args)
 # define mtcp_sys_munmap(args ...)    mtcp_inline_syscall(munmap, 2, args)
 # define mtcp_sys_mprotect(args ...)  mtcp_inline_syscall(mprotect, 3, args)
+# if defined(__NR_shmget) && defined(__NR_shmat) && defined(__NR_shmctl)
+#  define mtcp_sys_shmget(args ...) mtcp_inline_syscall(shmget, 3, args)
+#  define mtcp_sys_shmat(args ...)  (void *)mtcp_inline_syscall(shmat, 3, args)
+#  define mtcp_sys_shmctl(args ...) mtcp_inline_syscall(shmctl, 3, args)
+# endif // if defined(__NR_shmget) && defined(__NR_shmat) && ...
 # define mtcp_sys_nanosleep(args ...) mtcp_inline_syscall(nanosleep, 2, args)
 # define mtcp_sys_brk(args ...)                                            \
                                       (void *)(mtcp_inline_syscall(brk, 1, \
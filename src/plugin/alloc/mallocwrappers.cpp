@@ -19,67 +19,123 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include "alloc.h"
 #include "dmtcp.h"
 
+/*
+ * Checkpoint safe-point for the allocator.
+ *
+ * A thread must not be suspended for checkpoint while it holds a malloc
+ * arena lock, since the checkpoint thread (and plugins) allocate memory
+ * while writing the checkpoint.  Instead of taking the wrapper-execution
+ * lock (DMTCP_PLUGIN_DISABLE_CKPT) around every allocation, each thread
+ * keeps a thread-local nesting depth of allocator calls.  If the checkpoint
+ * signal arrives while the depth is non-zero, stopthisthread() asks
+ * dmtcp_alloc_defer_suspend() and returns without suspending; the thread
+ * then re-raises the checkpoint signal to itself as soon as it leaves the
+ * allocator.  The checkpoint thread keeps waiting for such threads, as it
+ * does for any thread that has been signaled but is not yet suspended.
+ *
+ * Both variables are only ever accessed by the owning thread (including its
+ * signal handler), so no atomic operations are needed on the hot path.  This
+ * library is always preloaded, so the static TLS model is safe to use.
+ */
+static __thread volatile sig_atomic_t allocDepth
+  __attribute__((tls_model("initial-exec"))) = 0;
+static __thread volatile sig_atomic_t suspendPending
+  __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline void
+allocEnter()
+{
+  allocDepth++;
+  asm volatile ("" : : : "memory");
+}
+
+static inline void
+allocLeave()
+{
+  asm volatile ("" : : : "memory");
+  allocDepth--;
+  if (__builtin_expect(suspendPending, 0) && allocDepth == 0) {
+    int saved_errno = errno;
+    suspendPending = 0;
+    raise(dmtcp_get_ckpt_signal());
+    errno = saved_errno;
+  }
+}
+
 EXTERNC int
 dmtcp_alloc_enabled() { return 1; }
 
+// Called from the checkpoint-signal handler of the current thread.
+EXTERNC int
+dmtcp_alloc_defer_suspend()
+{
+  if (allocDepth > 0) {
+    suspendPending = 1;
+    return 1;
+  }
+  return 0;
+}
+
 extern "C" void *calloc(size_t nmemb, size_t size)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   void *retval = _real_calloc(nmemb, size);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
   return retval;
 }
 
 extern "C" void *malloc(size_t size)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   void *retval = _real_malloc(size);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
   return retval;
 }
 
 extern "C" void *memalign(size_t boundary, size_t size)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   void *retval = _real_memalign(boundary, size);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
   return retval;
 }
 
 extern "C" int
 posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   int retval = _real_posix_memalign(memptr, alignment, size);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
   return retval;
 }
 
 extern "C" void *valloc(size_t size)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   void *retval = _real_valloc(size);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
   return retval;
 }
 
 extern "C" void
 free(void *ptr)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   _real_free(ptr);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
 }
 
 extern "C" void *realloc(void *ptr, size_t size)
 {
-  DMTCP_PLUGIN_DISABLE_CKPT();
+  allocEnter();
   void *retval = _real_realloc(ptr, size);
-  DMTCP_PLUGIN_ENABLE_CKPT();
+  allocLeave();
   return retval;
 }
@@ -0,0 +1,113 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#include "coreplugin.h"
+
+#define DMTCP_CORE_UNRESOLVED(func) (void *)-1,
+#define DMTCP_CORE_NAME(func)       # func,
+
+void *dmtcp_core_next_fnc[DMTCP_CORE_NUM_NEXT_FNCS] = {
+  DMTCP_CORE_NEXT_FNCS(DMTCP_CORE_UNRESOLVED)
+};
+
+void *dmtcp_core_default_fnc[DMTCP_CORE_NUM_DEFAULT_FNCS] = {
+  DMTCP_CORE_DEFAULT_FNCS(DMTCP_CORE_UNRESOLVED)
+};
+
+static const char *nextFncNames[DMTCP_CORE_NUM_NEXT_FNCS] = {
+  DMTCP_CORE_NEXT_FNCS(DMTCP_CORE_NAME)
+};
+
+static const char *defaultFncNames[DMTCP_CORE_NUM_DEFAULT_FNCS] = {
+  DMTCP_CORE_DEFAULT_FNCS(DMTCP_CORE_NAME)
+};
+
+EXTERNC void dmtcp_core_register_ipcPlugins() DMTCP_CORE_HIDDEN;
+EXTERNC void dmtcp_core_register_sysvipcPlugin() DMTCP_CORE_HIDDEN;
+EXTERNC void dmtcp_core_register_timerPlugin() DMTCP_CORE_HIDDEN;
+
+// These must be called from this library for RTLD_NEXT to find the function
+// in the next library in the search order.
+static void *
+nextFnc(const char *name)
+{
+  __typeof__(&dlsym) dlsym_fnptr;
+
+  dlsym_fnptr = (__typeof__(&dlsym))dmtcp_get_libc_dlsym_addr();
+  return (*dlsym_fnptr)(RTLD_NEXT, name);
+}
+
+static void *
+defaultFnc(const char *name)
+{
+  return dmtcp_dlsym(RTLD_NEXT, name);
+}
+
+// Called by a NEXT_FNC() call site that runs before resolveAll(), as happens
+// for wrappers called while the libraries are being initialized.
+EXTERNC void
+dmtcp_core_resolve_next_fnc(int index)
+{
+  if (dmtcp_initialize) {
+    dmtcp_initialize();
+  }
+  dmtcp_core_next_fnc[index] = nextFnc(nextFncNames[index]);
+}
+
+EXTERNC void
+dmtcp_core_resolve_default_fnc(int index)
+{
+  if (dmtcp_initialize) {
+    dmtcp_initialize();
+  }
+  dmtcp_core_default_fnc[index] = defaultFnc(defaultFncNames[index]);
+}
+
+static void
+resolveAll()
+{
+  for (int i = 0; i < DMTCP_CORE_NUM_NEXT_FNCS; i++) {
+    if (dmtcp_core_next_fnc[i] == (void *)-1) {
+      dmtcp_core_next_fnc[i] = nextFnc(nextFncNames[i]);
+    }
+  }
+  for (int i = 0; i < DMTCP_CORE_NUM_DEFAULT_FNCS; i++) {
+    if (dmtcp_core_default_fnc[i] == (void *)-1) {
+      dmtcp_core_default_fnc[i] = defaultFnc(defaultFncNames[i]);
+    }
+  }
+}
+
+EXTERNC void
+dmtcp_initialize_plugin()
+{
+  resolveAll();
+
+  // Same order as the separate libraries in LD_PRELOAD.
+  dmtcp_core_register_ipcPlugins();
+  dmtcp_core_register_sysvipcPlugin();
+  dmtcp_core_register_timerPlugin();
+
+  void (*fn)() = NEXT_FNC(dmtcp_initialize_plugin);
+  if (fn != NULL) {
+    (*fn)();
+  }
+}
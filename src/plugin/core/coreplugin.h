@@ -0,0 +1,121 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+/* libdmtcp_core.so combines the alloc, dl, ipc, svipc, and timer plugins into
+ * a single library, so that a process under DMTCP maps and relocates one
+ * library instead of five.  None of these plugins wrap the same function, so
+ * their wrappers can share a library; the pid plugin wraps many of the same
+ * functions as the ipc plugin, and stays a separate library.
+ *
+ * Every source of libdmtcp_core.so is compiled with
+ *   -DDMTCP_CORE_PLUGIN -include core/coreplugin.h
+ * This header then replaces NEXT_FNC() and NEXT_FNC_DEFAULT() by lookups in
+ * tables that are filled in one pass when the plugins are initialized,
+ * instead of one dlsym() per call site on first use.  A call site reached
+ * before that falls back to resolving its own entry, as NEXT_FNC() does.
+ *
+ * A plugin source that uses NEXT_FNC() or NEXT_FNC_DEFAULT() for a function
+ * that is not listed below fails to compile here.
+ */
+
+#ifndef COREPLUGIN_H
+#define COREPLUGIN_H
+
+#include "dmtcp.h"
+#include "dmtcp_dlsym.h"
+
+#define DMTCP_CORE_NEXT_FNCS(X)                                              \
+  X(__lxstat) X(__lxstat64) X(__poll_chk) X(__xstat) X(__xstat64)            \
+  X(accept) X(accept4) X(access) X(bind) X(close) X(closedir) X(closelog)    \
+  X(connect) X(dlclose) X(dlopen) X(dmtcp_initialize_plugin) X(dup) X(dup2)  \
+  X(dup3) X(epoll_create) X(epoll_create1) X(epoll_ctl) X(epoll_pwait)       \
+  X(epoll_wait) X(eventfd) X(execve) X(execvp) X(execvpe) X(exit) X(fclose)  \
+  X(fcntl) X(fopen) X(fopen64) X(freopen) X(getaddrinfo) X(gethostbyaddr)    \
+  X(gethostbyname) X(getnameinfo) X(getpt) X(getsockopt)                     \
+  X(inotify_add_watch) X(inotify_init) X(inotify_init1) X(inotify_rm_watch)  \
+  X(listen) X(lseek) X(mkostemp) X(mkostemps) X(mkstemp) X(mkstemps)        \
+  X(mmap) X(mq_close) X(mq_notify) X(mq_open) X(mq_receive) X(mq_send)       \
+  X(mq_timedreceive) X(mq_timedsend) X(msgctl) X(msgget) X(msgrcv)           \
+  X(msgsnd) X(munmap) X(open) X(open64) X(openat) X(openat64) X(opendir)     \
+  X(openlog) X(poll) X(posix_openpt) X(pselect) X(pthread_mutex_lock)        \
+  X(pthread_mutex_unlock) X(ptsname_r) X(readlink) X(realpath) X(recv)       \
+  X(select) X(semctl) X(semget) X(semop) X(semtimedop) X(send)               \
+  X(setsockopt) X(shmat) X(shmctl) X(shmdt) X(shmget) X(signalfd) X(socket)  \
+  X(socketpair) X(syscall) X(system) X(tmpfile) X(ttyname_r) X(unsetenv)
+
+#define DMTCP_CORE_DEFAULT_FNCS(X)                                           \
+  X(__libc_memalign) X(calloc) X(clock_getcpuclockid) X(clock_getres)        \
+  X(clock_gettime) X(clock_settime) X(free) X(malloc) X(memalign) X(mmap)    \
+  X(mmap64) X(mremap) X(munmap) X(posix_memalign) X(pthread_getcpuclockid)   \
+  X(pthread_mutex_lock) X(pthread_mutex_unlock) X(realloc) X(timer_create)   \
+  X(timer_delete) X(timer_getoverrun) X(timer_gettime) X(timer_settime)      \
+  X(valloc)
+
+#define DMTCP_CORE_NEXT_INDEX(func)    DMTCP_CORE_NEXT_ ## func,
+#define DMTCP_CORE_DEFAULT_INDEX(func) DMTCP_CORE_DEFAULT_ ## func,
+
+enum {
+  DMTCP_CORE_NEXT_FNCS(DMTCP_CORE_NEXT_INDEX)
+  DMTCP_CORE_NUM_NEXT_FNCS
+};
+
+enum {
+  DMTCP_CORE_DEFAULT_FNCS(DMTCP_CORE_DEFAULT_INDEX)
+  DMTCP_CORE_NUM_DEFAULT_FNCS
+};
+
+#define DMTCP_CORE_HIDDEN __attribute__((visibility("hidden")))
+
+// Entries are (void *)-1 until resolved.
+EXTERNC void *dmtcp_core_next_fnc[DMTCP_CORE_NUM_NEXT_FNCS] DMTCP_CORE_HIDDEN;
+EXTERNC void *dmtcp_core_default_fnc[DMTCP_CORE_NUM_DEFAULT_FNCS]
+DMTCP_CORE_HIDDEN;
+
+EXTERNC void dmtcp_core_resolve_next_fnc(int index) DMTCP_CORE_HIDDEN;
+EXTERNC void dmtcp_core_resolve_default_fnc(int index) DMTCP_CORE_HIDDEN;
+
+#undef NEXT_FNC
+#define NEXT_FNC(func)                                                       \
+  ({                                                                         \
+    if (dmtcp_core_next_fnc[DMTCP_CORE_NEXT_ ## func] == (void *)-1) {       \
+      dmtcp_core_resolve_next_fnc(DMTCP_CORE_NEXT_ ## func);                 \
+    }                                                                        \
+    (__typeof__(&func))dmtcp_core_next_fnc[DMTCP_CORE_NEXT_ ## func];        \
+  })
+
+#undef NEXT_FNC_DEFAULT
+#define NEXT_FNC_DEFAULT(func)                                               \
+  ({                                                                         \
+    if (dmtcp_core_default_fnc[DMTCP_CORE_DEFAULT_ ## func] == (void *)-1) { \
+      dmtcp_core_resolve_default_fnc(DMTCP_CORE_DEFAULT_ ## func);           \
+    }                                                                        \
+    (__typeof__(&func))dmtcp_core_default_fnc[DMTCP_CORE_DEFAULT_ ## func];  \
+  })
+
+// The plugins register their descriptors through coreplugin.cpp, which
+// defines the one dmtcp_initialize_plugin() of the library.
+#undef DMTCP_DECL_PLUGIN
+#define DMTCP_DECL_PLUGIN(descr)                                             \
+  EXTERNC void dmtcp_core_register_ ## descr()                               \
+  {                                                                          \
+    dmtcp_register_plugin(descr);                                            \
+  }
+#endif // ifndef COREPLUGIN_H
@@ -84,8 +84,16 @@ using namespace dmtcp;
 // This is the first program after dmtcp_launch
 static bool freshProcess = true;
 
+// Number of slots in the first fd table; it doubles as needed.
+#define FD_TABLE_INITIAL_SIZE 1024
+
 ConnectionList::~ConnectionList()
-{}
+{
+  JALLOC_HELPER_FREE(_fdTable);
+  for (size_t i = 0; i < _oldFdTables.size(); i++) {
+    JALLOC_HELPER_FREE(_oldFdTables[i]);
+  }
+}
 
 void
 ConnectionList::eventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
@@ -103,6 +111,10 @@ ConnectionList::eventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
   case DMTCP_EVENT_PRE_EXEC:
   {
     jalib::JBinarySerializeWriterRaw wr("", data->serializerInfo.fd);
+    wr.setBuffered(true);
+#ifndef DEBUG
+    wr.setCompact(true);
+#endif
     serialize(wr);
     break;
   }
@@ -111,7 +123,11 @@ ConnectionList::eventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
   {
     freshProcess = false;
     jalib::JBinarySerializeReaderRaw rd("", data->serializerInfo.fd);
-    serialize(rd);
+    rd.setBuffered(true);
+#ifndef DEBUG
+    rd.setCompact(true);
+#endif
+    deserialize(rd);
     deleteStaleConnections();
     break;
   }
@@ -149,9 +165,9 @@ ConnectionList::deleteStaleConnections()
 {
   // build list of stale connections
   vector<int>staleFds;
-  for (FdToConMapT::iterator i = _fdToCon.begin(); i != _fdToCon.end(); ++i) {
-    if (_isBadFd(i->first)) {
-      staleFds.push_back(i->first);
+  for (size_t fd = 0; _fdTable != NULL && fd < _fdTable->size; fd++) {
+    if (_fdTable->slots[fd] != NULL && _isBadFd(fd)) {
+      staleFds.push_back(fd);
     }
   }
 
@@ -179,10 +195,16 @@ ConnectionList::deleteStaleConnections()
   }
 }
 
+/* Each connection is written as its key, type, and fds, followed by the
+ * length of the rest of its record.  The rest is serialized in memory first
+ * to learn its length.  After exec, the records of connections whose fds
+ * were all closed (e.g., by FD_CLOEXEC) are skipped without creating the
+ * connection objects.
+ */
 void
-ConnectionList::serialize(jalib::JBinarySerializer &o)
+ConnectionList::serialize(jalib::JBinarySerializeWriterRaw &o)
 {
-  JSERIALIZE_ASSERT_POINT("dmtcp-serialized-connection-table!v0.07");
+  JSERIALIZE_ASSERT_POINT("dmtcp-serialized-connection-table!v0.08");
 
   JSERIALIZE_ASSERT_POINT("ConnectionIdentifier:");
   ConnectionIdentifier::serialize(o);
@@ -192,37 +214,78 @@ ConnectionList::serialize(jalib::JBinarySerializer &o)
   uint32_t numCons = _connections.size();
   o &numCons;
 
-  if (o.isWriter()) {
-    for (iterator i = _connections.begin(); i != _connections.end(); ++i) {
-      ConnectionIdentifier key = i->first;
-      Connection &con = *i->second;
-      uint32_t type = con.conType();
+  jalib::JBinarySerializeWriterMem rec(o.filename());
+  rec.setCompact(o.isCompact());
+  for (iterator i = _connections.begin(); i != _connections.end(); ++i) {
+    ConnectionIdentifier key = i->first;
+    Connection &con = *i->second;
+    uint32_t type = con.conType();
+    vector<int32_t>fds = con.getFds();
+    uint32_t numFds = fds.size();
+
+    JSERIALIZE_ASSERT_POINT("[StartConnection]");
+    o&key &type &numFds;
+    for (size_t j = 0; j < numFds; j++) {
+      o &fds[j];
+    }
+
+    rec.rewind();
+    con.serialize(rec);
+    uint64_t len = rec.size();
+    o &len;
+    o.readOrWrite((void *)rec.data(), len);
+    JSERIALIZE_ASSERT_POINT("[EndConnection]");
+  }
+  JSERIALIZE_ASSERT_POINT("EOF");
+}
+
+void
+ConnectionList::deserialize(jalib::JBinarySerializeReaderRaw &o)
+{
+  JSERIALIZE_ASSERT_POINT("dmtcp-serialized-connection-table!v0.08");
+
+  JSERIALIZE_ASSERT_POINT("ConnectionIdentifier:");
+  ConnectionIdentifier::serialize(o);
+
+  JSERIALIZE_ASSERT_POINT("ConnectionList:");
+
+  uint32_t numCons = 0;
+  o &numCons;
 
-      JSERIALIZE_ASSERT_POINT("[StartConnection]");
-      o&key &type;
-      con.serialize(o);
-      JSERIALIZE_ASSERT_POINT("[EndConnection]");
+  size_t numSkipped = 0;
+  while (numCons-- > 0) {
+    ConnectionIdentifier key;
+    int type = -1;
+    uint32_t numFds = 0;
+    uint64_t len = 0;
+
+    JSERIALIZE_ASSERT_POINT("[StartConnection]");
+    o&key &type &numFds;
+    bool isOpen = numFds == 0;
+    for (size_t j = 0; j < numFds; j++) {
+      int32_t fd;
+      o &fd;
+      isOpen = isOpen || !_isBadFd(fd);
     }
-  } else {
-    while (numCons-- > 0) {
-      ConnectionIdentifier key;
-      int type = -1;
-      Connection *con = NULL;
-
-      JSERIALIZE_ASSERT_POINT("[StartConnection]");
-      o&key &type;
-      con = createDummyConnection(type);
+    o &len;
+
+    if (!isOpen) {
+      o.skip(len);
+      numSkipped++;
+    } else {
+      Connection *con = createDummyConnection(type);
       JASSERT(con != NULL) (key);
       con->serialize(o);
       _connections[key] = con;
       const vector<int32_t> &fds = con->getFds();
       for (size_t i = 0; i < fds.size(); i++) {
-        _fdToCon[fds[i]] = con;
+        setFdSlot(fds[i], con);
       }
-      JSERIALIZE_ASSERT_POINT("[EndConnection]");
     }
+    JSERIALIZE_ASSERT_POINT("[EndConnection]");
   }
   JSERIALIZE_ASSERT_POINT("EOF");
+  JTRACE("Skipped connections closed on exec") (numSkipped);
 }
 
 void
@@ -258,10 +321,42 @@ ConnectionList::getConnection(const ConnectionIdentifier &id)
 Connection *
 ConnectionList::getConnection(int fd)
 {
-  if (_fdToCon.find(fd) == _fdToCon.end()) {
+  FdTable *table = __atomic_load_n(&_fdTable, __ATOMIC_ACQUIRE);
+
+  if (fd < 0 || table == NULL || (size_t)fd >= table->size) {
     return NULL;
   }
-  return _fdToCon[fd];
+  return __atomic_load_n(&table->slots[fd], __ATOMIC_ACQUIRE);
+}
+
+// Called with _lock held.
+void
+ConnectionList::setFdSlot(int fd, Connection *con)
+{
+  JASSERT(fd >= 0) (fd);
+  if (_fdTable == NULL || (size_t)fd >= _fdTable->size) {
+    if (con == NULL) {
+      return;
+    }
+
+    size_t size = _fdTable == NULL ? FD_TABLE_INITIAL_SIZE
+                                   : 2 * _fdTable->size;
+    while (size <= (size_t)fd) {
+      size *= 2;
+    }
+    FdTable *table = (FdTable *)JALLOC_HELPER_MALLOC(
+        sizeof(FdTable) + (size - 1) * sizeof(Connection *));
+    JASSERT(table != NULL) (size);
+    memset(table->slots, 0, size * sizeof(Connection *));
+    if (_fdTable != NULL) {
+      memcpy(table->slots, _fdTable->slots,
+             _fdTable->size * sizeof(Connection *));
+      _oldFdTables.push_back(_fdTable);
+    }
+    table->size = size;
+    __atomic_store_n(&_fdTable, table, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&_fdTable->slots[fd], con, __ATOMIC_RELEASE);
 }
 
 void
@@ -269,7 +364,7 @@ ConnectionList::add(int fd, Connection *c)
 {
   _lock_tbl();
 
-  if (_fdToCon.find(fd) != _fdToCon.end()) {
+  if (getConnection(fd) != NULL) {
     /* In ordinary situations, we never exercise this path since we already
      * capture close() and remove the connection. However, there is one
      * particular case where this assumption fails -- when gblic opens a socket
@@ -284,16 +379,16 @@ ConnectionList::add(int fd, Connection *c)
     _connections[c->id()] = c;
   }
   c->addFd(fd);
-  _fdToCon[fd] = c;
+  setFdSlot(fd, c);
   _unlock_tbl();
 }
 
 void
 ConnectionList::processCloseWork(int fd)
 {
-  Connection *con = _fdToCon[fd];
+  Connection *con = getConnection(fd);
 
-  _fdToCon.erase(fd);
+  setFdSlot(fd, NULL);
   con->removeFd(fd);
   if (con->numFds() == 0) {
     _connections.erase(con->id());
@@ -304,8 +399,13 @@ ConnectionList::processCloseWork(int fd)
 void
 ConnectionList::processClose(int fd)
 {
+  // Most closed fds aren't in this list; don't take the lock for them.
+  if (getConnection(fd) == NULL) {
+    return;
+  }
+
   _lock_tbl();
-  if (_fdToCon.find(fd) != _fdToCon.end()) {
+  if (getConnection(fd) != NULL) {
     processCloseWork(fd);
   }
   _unlock_tbl();
@@ -314,19 +414,20 @@ ConnectionList::processClose(int fd)
 void
 ConnectionList::processDup(int oldfd, int newfd)
 {
-  if (oldfd == newfd) {
+  if (oldfd == newfd ||
+      (getConnection(oldfd) == NULL && getConnection(newfd) == NULL)) {
     return;
   }
 
   _lock_tbl();
-  if (_fdToCon.find(newfd) != _fdToCon.end()) {
+  if (getConnection(newfd) != NULL) {
     processCloseWork(newfd);
   }
 
-  // Add only if the oldfd was already in the _fdToCon table.
-  if (_fdToCon.find(oldfd) != _fdToCon.end()) {
-    Connection *con = _fdToCon[oldfd];
-    _fdToCon[newfd] = con;
+  // Add only if the oldfd was already in the fd table.
+  Connection *con = getConnection(oldfd);
+  if (con != NULL) {
+    setFdSlot(newfd, con);
     con->addFd(newfd);
   }
   _unlock_tbl();
@@ -500,12 +601,47 @@ ConnectionList::registerIncomingCons()
   }
 }
 
+// A batch of missing fds going to the same receiver; idx indexes the
+// SharedData incoming-connection maps.
+struct MissingFdBatch {
+  vector<size_t>idx;
+};
+
+// Groups the outgoing connections by receiver address, SCM_MAX_FDS per batch,
+// so that each receiver gets as few messages as possible.
+static void
+makeMissingFdBatches(SharedData::IncomingConMap *maps,
+                     const vector<size_t> &outgoingCons,
+                     vector<MissingFdBatch> *batches)
+{
+  map<string, size_t>openBatch;
+
+  for (size_t i = 0; i < outgoingCons.size(); i++) {
+    SharedData::IncomingConMap *m = &maps[outgoingCons[i]];
+    string addr((const char *)&m->addr, m->len);
+    map<string, size_t>::iterator it = openBatch.find(addr);
+    if (it == openBatch.end() ||
+        (*batches)[it->second].idx.size() == SCM_MAX_FDS) {
+      batches->push_back(MissingFdBatch());
+      openBatch[addr] = batches->size() - 1;
+      it = openBatch.find(addr);
+    }
+    (*batches)[it->second].idx.push_back(outgoingCons[i]);
+  }
+}
+
+/* Sends the fds of the connections that other processes are missing, and
+ * receives the ones this process is missing, over the protected datagram
+ * socket.  Each message carries up to SCM_MAX_FDS fds and their connection
+ * ids.  The socket is used non-blocking, so that a receiver with a full queue,
+ * or too many fds in flight, does not stop us from draining our own.
+ */
 void
 ConnectionList::sendReceiveMissingFds()
 {
   size_t i;
 
-  vector<int>outgoingCons;
+  vector<size_t>outgoingCons;
   SharedData::IncomingConMap *maps;
   uint32_t nmaps;
   SharedData::getMissingConMaps(&maps, &nmaps);
@@ -517,43 +653,71 @@ ConnectionList::sendReceiveMissingFds()
     }
   }
 
+  vector<MissingFdBatch>batches;
+  makeMissingFdBatches(maps, outgoingCons, &batches);
+  JTRACE("Exchanging missing cons")
+    (outgoingCons.size()) (batches.size()) (numIncomingCons);
+
   int restoreFd = protectedFd();
-  size_t numOutgoingCons = outgoingCons.size();
-  while (numOutgoingCons > 0 || numIncomingCons > 0) {
-    struct pollfd socketFd = { 0 };
-    if (outgoingCons.size() > 0) {
-      socketFd.fd = restoreFd;
-      socketFd.events = POLLOUT;
-    }
-    if (numIncomingCons > 0) {
-      socketFd.fd = restoreFd;
-      socketFd.events |= POLLIN;
+  ConnectionIdentifier ids[SCM_MAX_FDS];
+  int32_t fds[SCM_MAX_FDS];
+  size_t nextBatch = 0;
+  while (nextBatch < batches.size() || numIncomingCons > 0) {
+    bool sendBlocked = false;
+    for (; nextBatch < batches.size(); nextBatch++) {
+      MissingFdBatch &batch = batches[nextBatch];
+      size_t n = batch.idx.size();
+      for (i = 0; i < n; i++) {
+        ids[i] = *(ConnectionIdentifier *)maps[batch.idx[i]].id;
+        fds[i] = getConnection(ids[i])->getFds()[0];
+      }
+      SharedData::IncomingConMap *m = &maps[batch.idx[0]];
+      ssize_t ret = Util::sendFds(restoreFd, fds, n, ids, n * sizeof(ids[0]),
+                                  m->addr, m->len, MSG_DONTWAIT);
+      // ETOOMANYREFS: the fds in flight from this user exceed its
+      // RLIMIT_NOFILE.  It clears as the receivers, us included, drain their
+      // queues, so it is retried like a full queue.
+      if (ret == -1) {
+        JASSERT(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ETOOMANYREFS)
+          (JASSERT_ERRNO);
+        sendBlocked = true;
+        break;
+      }
+      JTRACE("Sent Missing Cons") (n);
     }
 
-    int ret = _real_poll(&socketFd, 1, -1);
-    JASSERT(ret != -1) (JASSERT_ERRNO);
-
-    if (numOutgoingCons > 0 && (socketFd.revents & POLLOUT)) {
-      size_t idx = outgoingCons.back();
-      outgoingCons.pop_back();
-      ConnectionIdentifier *id = (ConnectionIdentifier *)maps[idx].id;
-      Connection *con = getConnection(*id);
-      JTRACE("Sending Missing Con") (*id);
-      JASSERT(Util::sendFd(restoreFd, con->getFds()[0], id, sizeof(*id),
-                           maps[idx].addr, maps[idx].len) != -1);
-      numOutgoingCons--;
+    while (numIncomingCons > 0) {
+      size_t len = sizeof(ids);
+      ssize_t n = Util::receiveFds(restoreFd, fds, SCM_MAX_FDS, ids, &len,
+                                   MSG_DONTWAIT);
+      if (n == -1) {
+        JASSERT(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          (JASSERT_ERRNO);
+        break;
+      }
+      JASSERT(len == n * sizeof(ids[0])) (len) (n);
+      for (i = 0; i < (size_t)n; i++) {
+        Connection *con = getConnection(ids[i]);
+        JTRACE("Received Missing Con") (ids[i]);
+        JASSERT(con != NULL) (ids[i]);
+        Util::dupFds(fds[i], con->getFds());
+      }
+      JASSERT(numIncomingCons >= (size_t)n) (numIncomingCons) (n);
+      numIncomingCons -= n;
     }
 
-    if (numIncomingCons > 0 && (socketFd.revents & POLLIN)) {
-      ConnectionIdentifier id;
-      int fd = Util::receiveFd(restoreFd, &id, sizeof(id));
-      JASSERT(fd != -1);
-      Connection *con = getConnection(id);
-      JTRACE("Received Missing Con") (id);
-      JASSERT(con != NULL);
-      Util::dupFds(fd, con->getFds());
-      numIncomingCons--;
+    if (nextBatch == batches.size() && numIncomingCons == 0) {
+      break;
     }
+
+    // A datagram socket can't poll for room in the receiver's queue, so retry
+    // a blocked send after a short wait.
+    struct pollfd socketFd = { 0 };
+    socketFd.fd = restoreFd;
+    socketFd.events = numIncomingCons > 0 ? POLLIN : 0;
+    int ret = _real_poll(&socketFd, 1, sendBlocked ? 1 : -1);
+    JASSERT(ret != -1 || errno == EINTR) (JASSERT_ERRNO);
   }
   dmtcp_close_protected_fd(restoreFd);
 }
@@ -45,6 +45,7 @@ class ConnectionList
     typedef map<ConnectionIdentifier, Connection *>::iterator iterator;
 
     ConnectionList()
+      : _fdTable(NULL)
     {
       numIncomingCons = 0;
       JASSERT(pthread_mutex_init(&_lock, NULL) == 0);
@@ -63,7 +64,8 @@ class ConnectionList
     void processClose(int fd);
     void processDup(int oldfd, int newfd);
     void list();
-    void serialize(jalib::JBinarySerializer &o);
+    void serialize(jalib::JBinarySerializeWriterRaw &o);
+    void deserialize(jalib::JBinarySerializeReaderRaw &o);
 
     void eventHook(DmtcpEvent_t event, DmtcpEventData_t *data);
     virtual void scanForPreExisting() {}
@@ -100,6 +102,15 @@ class ConnectionList
     iterator end() { return _connections.end(); }
 
   private:
+    // Connections indexed by fd.  getConnection(fd) reads it without taking
+    // _lock: a full table is replaced by a larger copy rather than resized,
+    // and slots are only written with atomic stores while holding _lock.
+    struct FdTable {
+      size_t size;
+      Connection *slots[1];
+    };
+
+    void setFdSlot(int fd, Connection *con);
     void processCloseWork(int fd);
     void _lock_tbl()
     {
@@ -115,8 +126,10 @@ class ConnectionList
     typedef map<ConnectionIdentifier, Connection *>ConnectionMapT;
     ConnectionMapT _connections;
 
-    typedef map<int, Connection *>FdToConMapT;
-    FdToConMapT _fdToCon;
+    FdTable *_fdTable;
+
+    // Replaced tables; a reader might still be looking at one of them.
+    vector<FdTable *>_oldFdTables;
 
     size_t numIncomingCons;
 };
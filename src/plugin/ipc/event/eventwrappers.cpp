@@ -28,6 +28,7 @@
 /* Next three according to earlier standards */
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "jassert.h"
 #include "dmtcpalloc.h"
@@ -236,40 +237,59 @@ epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
   return ret;
 }
 
+// Returns the number of milliseconds left until the deadline, clamped to
+// [0, timeout].
+static int
+epollTimeLeft(const struct timespec *deadline, int timeout)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+            (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  if (ms < 0) {
+    return 0;
+  }
+  return ms > timeout ? timeout : ms;
+}
+
+/* epoll_wait wrapper blocks in the kernel for the full timeout and forces
+ * epoll_wait to restart after ckpt/resume or ckpt/restart.  A finite timeout
+ * is measured against the original deadline, so a restarted call does not
+ * wait longer than the application asked for.
+ */
 extern "C" int
 epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-  int readyFds = 0;
+  struct timespec deadline;
   int timeLeft = timeout;
-  int mytime;
-
-  // JTRACE("Starting to do wait on epoll fd");
-
-  if (timeout >= 0 && timeout < 1000) {
-    // Short time intervals
-    DMTCP_PLUGIN_DISABLE_CKPT();
-    readyFds = _real_epoll_wait(epfd, events, maxevents, timeout);
-    DMTCP_PLUGIN_ENABLE_CKPT();
-    return readyFds;
-  } else if (timeout >= 1000) {
-    mytime = 1000; // wait time quanta: 1000 ms
-  } else {
-    // In case of indefinite timeout, start with 0 and increment by 1ms.
-    mytime = 0;
+  int rc;
+
+  if (timeout > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
   }
 
-  do {
-    DMTCP_PLUGIN_DISABLE_CKPT();
-    readyFds = _real_epoll_wait(epfd, events, maxevents, mytime);
-    DMTCP_PLUGIN_ENABLE_CKPT();
-    if (timeout < 0 && mytime <= 100) {
-      // Increase timeout if we are going to wait forever.
-      mytime += 1;
+  while (1) {
+    uint32_t orig_generation = dmtcp_get_generation();
+    rc = _real_epoll_wait(epfd, events, maxevents, timeLeft);
+    if (rc == -1 && errno == EINTR &&
+        dmtcp_get_generation() > orig_generation) {
+      // This was a restart or resume after checkpoint.
+      if (timeout > 0) {
+        timeLeft = epollTimeLeft(&deadline, timeout);
+      }
+      continue;
     } else {
-      timeLeft -= mytime;
+      break;  // The signal interrupting us was not our checkpoint signal.
     }
-  } while ((timeLeft > 0 || timeout < 0) && readyFds == 0);
-  return readyFds;
+  }
+  return rc;
 }
 #endif // ifdef HAVE_SYS_EPOLL_H
 
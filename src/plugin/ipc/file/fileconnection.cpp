@@ -21,10 +21,13 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <linux/limits.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <termios.h>
 #include <time.h>
@@ -42,10 +45,17 @@
 #include "util.h"
 
 #include "fileconnection.h"
+#include "filestore.h"
 #include "filewrappers.h"
 
 using namespace dmtcp;
 
+// Files are compared through mappings of at most this size.
+#define COMPARE_WINDOW_SIZE (64 * 1024 * 1024)
+
+// Largest copy_file_range() request; the kernel may copy less.
+#define COPY_RANGE_SIZE     (1024 * 1024 * 1024)
+
 static void writeFileFromFd(int fd, int destFd);
 static bool areFilesEqual(int fd, int destFd, size_t size);
 
@@ -217,26 +227,39 @@ FileConnection::preCkpt()
     JASSERT(SharedData::getCkptLeaderForFile(_st_dev, _st_ino, &id));
     if (id == _id) {
       _savedFilePath = getSavedFilePath(_path);
-      JASSERT(Util::createDirectoryTree(_savedFilePath)) (_savedFilePath)
-      .Text("Unable to create directory in File Path");
-
-      int destFd = _real_open(
-          _savedFilePath.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
-          S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-      JASSERT(destFd != -1) (JASSERT_ERRNO) (_path) (_savedFilePath);
 
-      JTRACE("Saving checkpointed copy of the file") (_path) (_savedFilePath);
+      // If the file is opened() in write-only mode. Open it in readonly mode
+      // to create the ckpt copy.
+      int srcFd = _fds[0];
       if (_fcntlFlags & O_WRONLY) {
-        // If the file is opened() in write-only mode. Open it in readonly mode
-        // to create the ckpt copy.
-        int tmpfd = _real_open(_path.c_str(), O_RDONLY, 0);
-        JASSERT(tmpfd != -1);
-        writeFileFromFd(tmpfd, destFd);
-        _real_close(tmpfd);
+        srcFd = _real_open(_path.c_str(), O_RDONLY, 0);
+        JASSERT(srcFd != -1) (_path) (JASSERT_ERRNO);
+      }
+
+      if (savedCopyIsCurrent(srcFd)) {
+        JTRACE("Checkpointed copy of the file is up to date")
+          (_path) (_savedFilePath);
       } else {
-        writeFileFromFd(_fds[0], destFd);
+        JASSERT(Util::createDirectoryTree(_savedFilePath)) (_savedFilePath)
+        .Text("Unable to create directory in File Path");
+
+        JTRACE("Saving checkpointed copy of the file") (_path) (_savedFilePath);
+        if (_type != FILE_BATCH_QUEUE && FileStore::isEnabled()) {
+          FileStore::save(srcFd, _savedFilePath);
+        } else {
+          int destFd = _real_open(
+              _savedFilePath.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+              S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+          JASSERT(destFd != -1) (JASSERT_ERRNO) (_path) (_savedFilePath);
+          writeFileFromFd(srcFd, destFd);
+          _real_close(destFd);
+        }
+        rememberSavedCopy(srcFd);
+      }
+
+      if (srcFd != _fds[0]) {
+        _real_close(srcFd);
       }
-      _real_close(destFd);
     } else {
       JTRACE("Not checkpointing this file") (_path);
       _ckpted_file = false;
@@ -255,12 +278,106 @@ FileConnection::preCkpt()
   }
 }
 
-/* Given an open file-descriptor for a saved file, saves a copy
- * of its existing copy, and replaces the existing copy with the
- * saved file.
+static bool
+sameTime(const struct timespec &a, const struct timespec &b)
+{
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* True if the copy saved by the previous checkpoint of this process still
+ * matches the file, so that it need not be written again.  The file is
+ * assumed unchanged if its size, mtime and ctime are unchanged, unless they
+ * were too recent to be trusted when the copy was made: a write within the
+ * same timestamp tick leaves them unchanged.  The contents are compared in
+ * that case.
  */
+bool
+FileConnection::savedCopyIsCurrent(int srcFd)
+{
+  struct stat src;
+  struct stat copy;
+
+  if (!_hasSavedCopy || _savedFilePath != _savedCopyPath) {
+    return false;
+  }
+
+  // Flush writes through shared mappings, so that they update the mtime.
+  fsync(srcFd);
+  if (fstat(srcFd, &src) != 0 || stat(_savedFilePath.c_str(), &copy) != 0) {
+    return false;
+  }
+  if (src.st_dev != _srcStat.st_dev || src.st_ino != _srcStat.st_ino ||
+      src.st_size != _srcStat.st_size ||
+      !sameTime(src.st_mtim, _srcStat.st_mtim) ||
+      !sameTime(src.st_ctim, _srcStat.st_ctim) ||
+      copy.st_dev != _copyStat.st_dev || copy.st_ino != _copyStat.st_ino ||
+      copy.st_size != _copyStat.st_size ||
+      !sameTime(copy.st_mtim, _copyStat.st_mtim)) {
+    return false;
+  }
+  if (!_savedCopyIsRacy) {
+    return true;
+  }
+
+  bool equal = savedCopyMatches(srcFd, src.st_size);
+  if (equal) {
+    rememberSavedCopy(srcFd);
+  }
+  return equal;
+}
+
+void
+FileConnection::rememberSavedCopy(int srcFd)
+{
+  struct timespec now;
+
+  _hasSavedCopy = fstat(srcFd, &_srcStat) == 0 &&
+                  stat(_savedFilePath.c_str(), &_copyStat) == 0;
+  _savedCopyPath = _savedFilePath;
+
+  // Timestamps come from a coarse clock; allow a generous margin.
+  clock_gettime(CLOCK_REALTIME, &now);
+  _savedCopyIsRacy = _srcStat.st_mtim.tv_sec >= now.tv_sec - 1 ||
+                     _srcStat.st_ctim.tv_sec >= now.tv_sec - 1;
+}
+
+// True if the first size bytes of fd match the saved copy of the file,
+// which is either a plain copy or a file store manifest.
+bool
+FileConnection::savedCopyMatches(int fd, size_t size)
+{
+  if (FileStore::isManifest(_savedFilePath)) {
+    return FileStore::matches(_savedFilePath, fd);
+  }
+
+  int savedFd = _real_open(_savedFilePath.c_str(), O_RDONLY, 0);
+  JASSERT(savedFd != -1) (JASSERT_ERRNO) (_savedFilePath);
+  bool equal = areFilesEqual(fd, savedFd, size);
+  _real_close(savedFd);
+  return equal;
+}
+
+// Write the saved copy of the file to destFd.
 void
-FileConnection::overwriteFileWithBackup(int savedFd)
+FileConnection::restoreSavedCopy(int destFd)
+{
+  if (FileStore::isManifest(_savedFilePath)) {
+    FileStore::restore(_savedFilePath, destFd);
+    return;
+  }
+
+  int savedFd = _real_open(_savedFilePath.c_str(), O_RDONLY, 0);
+  JASSERT(savedFd != -1) (_path) (_savedFilePath) (JASSERT_ERRNO)
+  .Text("Failed to open checkpointed copy of the file.");
+  writeFileFromFd(savedFd, destFd);
+  _real_close(savedFd);
+}
+
+/* Saves a copy of the existing file, and replaces the existing copy
+ * with the saved file.
+ */
+void
+FileConnection::overwriteFileWithBackup()
 {
   char currentTimeBuff[30] = { 0 };
   time_t rawtime;
@@ -283,7 +400,7 @@ FileConnection::overwriteFileWithBackup(int savedFd)
   int destFileFd = _real_open(_path.c_str(), O_CREAT | O_WRONLY, 0640);
   JASSERT(destFileFd > 0)(JASSERT_ERRNO)(_path)
   .Text("Error opening file for overwriting");
-  writeFileFromFd(savedFd, destFileFd);
+  restoreSavedCopy(destFileFd);
   _real_close(destFileFd);
 
   // Re-open the (closed) file with the original flags
@@ -305,15 +422,12 @@ FileConnection::refill(bool isRestart)
   }
 
   if (_ckpted_file && _fileAlreadyExists) {
-    int savedFd = _real_open(_savedFilePath.c_str(), O_RDONLY, 0);
-    JASSERT(savedFd != -1) (JASSERT_ERRNO) (_savedFilePath);
-
     if (_allow_overwrite) {
       JTRACE("Copying checkpointed file to original location")
         (_savedFilePath) (_path);
-      this->overwriteFileWithBackup(savedFd);
+      this->overwriteFileWithBackup();
     } else {
-      if (!areFilesEqual(_fds[0], savedFd, _st_size)) {
+      if (!savedCopyMatches(_fds[0], _st_size)) {
         if (_type == FILE_SHM) {
           JWARNING(false) (_path) (_savedFilePath)
           .Text("\n"
@@ -331,7 +445,6 @@ FileConnection::refill(bool isRestart)
         }
       }
     }
-    _real_close(savedFd);
   }
 
   if (!_ckpted_file) {
@@ -490,13 +603,9 @@ FileConnection::postRestart()
     if (fd == -1) {
       _fileAlreadyExists = true;
     } else {
-      int srcFd = _real_open(_savedFilePath.c_str(), O_RDONLY, 0);
-      JASSERT(srcFd != -1) (_path) (_savedFilePath) (JASSERT_ERRNO)
-      .Text("Failed to open checkpointed copy of the file.");
       JTRACE("Copying saved checkpointed file to original location")
         (_savedFilePath) (_path);
-      writeFileFromFd(srcFd, fd);
-      _real_close(srcFd);
+      restoreSavedCopy(fd);
       _real_close(fd);
     }
     tempfd = openFile();
@@ -541,50 +650,87 @@ FileConnection::openFile()
 static bool
 areFilesEqual(int fd, int savedFd, size_t size)
 {
-  long page_size = sysconf(_SC_PAGESIZE);
-  const size_t bufSize = 1024 * page_size;
-  char *buf1 = (char *)JALLOC_HELPER_MALLOC(bufSize);
-  char *buf2 = (char *)JALLOC_HELPER_MALLOC(bufSize);
+  // Map both files and compare the mappings, rather than reading them into
+  // buffers first.
+  for (size_t offset = 0; offset < size; offset += COMPARE_WINDOW_SIZE) {
+    size_t len = MIN(size - offset, COMPARE_WINDOW_SIZE);
+    void *addr1 = _real_mmap(NULL, len, PROT_READ, MAP_SHARED, savedFd, offset);
+    if (addr1 == MAP_FAILED) {
+      return false;
+    }
+    void *addr2 = _real_mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    if (addr2 == MAP_FAILED) {
+      _real_munmap(addr1, len);
+      return false;
+    }
 
-  off_t offset1 = _real_lseek(fd, 0, SEEK_CUR);
-  off_t offset2 = _real_lseek(savedFd, 0, SEEK_CUR);
+    // A file that shrank since it was mapped would raise SIGBUS.
+    struct stat st1, st2;
+    bool equal = fstat(savedFd, &st1) == 0 && fstat(fd, &st2) == 0 &&
+                 (size_t)st1.st_size >= offset + len &&
+                 (size_t)st2.st_size >= offset + len &&
+                 memcmp(addr1, addr2, len) == 0;
+    _real_munmap(addr1, len);
+    _real_munmap(addr2, len);
+    if (!equal) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  JASSERT(_real_lseek(fd, 0, SEEK_SET) == 0) (fd) (JASSERT_ERRNO);
-  JASSERT(_real_lseek(savedFd, 0, SEEK_SET) == 0) (savedFd) (JASSERT_ERRNO);
+// Copy with copy_file_range(), which stays in the kernel and lets the
+// filesystem share or offload the data.  Returns false if it isn't
+// supported for these files.
+static bool
+copyFileRange(int fd, int destFd)
+{
+#ifdef SYS_copy_file_range
+  loff_t inOffset = 0;
+  loff_t outOffset = 0;
 
-  int readBytes;
-  while (size > 0) {
-    readBytes = Util::readAll(savedFd, buf1, MIN(bufSize, size));
-    JASSERT(readBytes != -1) (JASSERT_ERRNO).Text("Read Failed");
-    if (readBytes == 0) {
-      break;
-    }
-    if (Util::readAll(fd, buf2, readBytes) != readBytes) {
-      break;
+  while (1) {
+    ssize_t ret = _real_syscall(SYS_copy_file_range, fd, &inOffset,
+                                destFd, &outOffset, COPY_RANGE_SIZE, 0);
+    if (ret == 0) {
+      return true;
     }
-    if (memcmp(buf1, buf2, readBytes) != 0) {
-      break;
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      JTRACE("copy_file_range failed; copying through a buffer")
+        (fd) (destFd) (outOffset) (JASSERT_ERRNO);
+      return false;
     }
-    size -= readBytes;
   }
-  JALLOC_HELPER_FREE(buf1);
-  JALLOC_HELPER_FREE(buf2);
-  JASSERT(_real_lseek(fd, offset1, SEEK_SET) != -1);
-  JASSERT(_real_lseek(savedFd, offset2, SEEK_SET) != -1);
-  return size == 0;
+#endif // ifdef SYS_copy_file_range
+  return false;
 }
 
 static void
 writeFileFromFd(int fd, int destFd)
 {
-  long page_size = sysconf(_SC_PAGESIZE);
-  const size_t bufSize = 1024 * page_size;
-  char *buf = (char *)JALLOC_HELPER_MALLOC(bufSize);
-
   // Synchronize memory buffer with data in filesystem
   // On some Linux kernels, the shared-memory test will fail without this.
   fsync(fd);
 
+#ifdef FICLONE
+  // On a copy-on-write filesystem (btrfs, xfs), share the file's extents
+  // instead of copying them.
+  if (ioctl(destFd, FICLONE, fd) == 0) {
+    return;
+  }
+#endif // ifdef FICLONE
+
+  if (copyFileRange(fd, destFd)) {
+    return;
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  const size_t bufSize = 1024 * page_size;
+  char *buf = (char *)JALLOC_HELPER_MALLOC(bufSize);
+
   off_t offset = _real_lseek(fd, 0, SEEK_CUR);
   JASSERT(_real_lseek(fd, 0, SEEK_SET) == 0) (fd) (JASSERT_ERRNO);
   JASSERT(_real_lseek(destFd, 0, SEEK_SET) == 0) (destFd) (JASSERT_ERRNO);
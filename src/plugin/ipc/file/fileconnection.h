@@ -83,7 +83,9 @@ class FileConnection : public Connection
       FILE_BATCH_QUEUE
     };
 
-    FileConnection() {}
+    FileConnection()
+      : _hasSavedCopy(false)
+    { }
 
     FileConnection(const string &path,
                    int flags,
@@ -92,6 +94,7 @@ class FileConnection : public Connection
       : Connection(type)
       , _path(path)
       , _fileAlreadyExists(false)
+      , _hasSavedCopy(false)
     { }
 
     virtual void doLocking();
@@ -124,7 +127,11 @@ class FileConnection : public Connection
     void refreshPath();
     void calculateRelativePath();
     string getSavedFilePath(const string &path);
-    void overwriteFileWithBackup(int savedFd);
+    void overwriteFileWithBackup();
+    bool savedCopyMatches(int fd, size_t size);
+    void restoreSavedCopy(int destFd);
+    bool savedCopyIsCurrent(int srcFd);
+    void rememberSavedCopy(int srcFd);
 
     string _path;
     string _savedFilePath;
@@ -143,6 +150,14 @@ class FileConnection : public Connection
     uint64_t _st_dev;
     uint64_t _st_ino;
     int64_t _st_size;
+
+    // The file and its saved copy as of the last time this process wrote
+    // the copy.  Not serialized: after a restart the copy is written anew.
+    bool _hasSavedCopy;
+    bool _savedCopyIsRacy;
+    string _savedCopyPath;
+    struct stat _srcStat;
+    struct stat _copyStat;
 };
 
 class FifoConnection : public Connection
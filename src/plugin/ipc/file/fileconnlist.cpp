@@ -67,10 +67,12 @@
 #include <sys/types.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "../../../constants.h" // Needed for ENV_VAR_RESTART_ON_SAME_NODE
 #include "jbuffer.h"
 #include "jconvert.h"
 #include "jfilesystem.h"
 #include "fileconnection.h"
+#include "filestore.h"
 #include "filewrappers.h"
 #include "procselfmaps.h"
 #include "ptywrappers.h"
@@ -88,6 +90,9 @@ dmtcp_FileConnList_EventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
 static vector<ProcMapsArea>shmAreas;
 static vector<ProcMapsArea>unlinkedShmAreas;
 static vector<ProcMapsArea>missingUnlinkedShmFiles;
+static vector<ProcMapsArea>sharedAreaRefs;
+static vector<ProcMapsArea>sharedAreaCopies;
+static vector<ProcMapsArea>readOnlyShmAreas;
 static vector<FileConnection *>shmAreaConn;
 
 void
@@ -216,6 +221,10 @@ FileConnList::resume(bool isRestart)
 
   remapShmMaps();
 
+  if (!isRestart && FileStore::isEnabled()) {
+    FileStore::prune();
+  }
+
   if (isRestart) {
     // Now unlink the files that we created as a side-effect of restoreShmArea.
     for (size_t i = 0; i < missingUnlinkedShmFiles.size(); i++) {
@@ -227,6 +236,23 @@ FileConnList::resume(bool isRestart)
   }
 }
 
+/* Returns true if the processes were launched with --restart-on-same-node.
+ * Only then does a process leave the contents of a shared file area to the
+ * process elected to save them; otherwise each one saves its own copy, in
+ * case it is restarted on a node where the elected process is not.
+ */
+static bool
+restartOnSameNode()
+{
+  static int sameNode = -1;
+
+  if (sameNode == -1) {
+    const char *env = getenv(ENV_VAR_RESTART_ON_SAME_NODE);
+    sameNode = env != NULL && strcmp(env, "1") == 0;
+  }
+  return sameNode;
+}
+
 void
 FileConnList::prepareShmList()
 {
@@ -236,13 +262,16 @@ FileConnList::prepareShmList()
   shmAreas.clear();
   unlinkedShmAreas.clear();
   missingUnlinkedShmFiles.clear();
+  sharedAreaRefs.clear();
+  sharedAreaCopies.clear();
+  readOnlyShmAreas.clear();
   shmAreaConn.clear();
   while (procSelfMaps.getNextArea(&area)) {
     if ((area.flags & MAP_SHARED) && area.prot != 0) {
       if (strstr(area.name, "ptraceSharedInfo") != NULL ||
           strstr(area.name, "dmtcpPidMap") != NULL ||
           strstr(area.name, "dmtcpSharedArea") != NULL ||
-          strstr(area.name, "dmtcpSharedArea") != NULL ||
+          strstr(area.name, "dmtcpDlsymCache") != NULL ||
           strstr(area.name, "synchronization-log") != NULL ||
           strstr(area.name, "infiniband") != NULL ||
           strstr(area.name, "synchronization-read-log") != NULL) {
@@ -288,8 +317,18 @@ FileConnList::prepareShmList()
           JASSERT(_real_mmap(area.addr, area.size, PROT_NONE,
                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
                              -1, 0) != MAP_FAILED) (JASSERT_ERRNO);
+        } else if (SharedData::electSharedAreaLeader(area,
+                                                     dmtcp_get_uniquepid()) ||
+                   !restartOnSameNode()) {
+          /* On restart, every process maps the file again if it still
+           * exists, instead of restoring a private copy, so that they all
+           * see the same contents.
+           */
+          JTRACE("Will map shared memory area from file") (area.name);
+          readOnlyShmAreas.push_back(area);
         } else {
-          JTRACE("Will not checkpoint shared memory area") (area.name);
+          JTRACE("Shared memory area saved by another process") (area.name);
+          sharedAreaRefs.push_back(area);
         }
       } else {
         // TODO: Shared memory areas with unlinked backing files.
@@ -299,11 +338,24 @@ FileConnList::prepareShmList()
           JWARNING(false) (area.name)
           .Text("Ckpt/Restart of anonymous shared memory not supported.");
         } else {
-          JTRACE("Will recreate shm file on restart.") (area.name);
+          // Only the elected process recreates the file on restart; the
+          // others map it afterwards.
+          bool isLeader =
+            SharedData::electSharedAreaLeader(area, dmtcp_get_uniquepid());
 
           // Remove the DELETED suffix.
           area.name[strlen(area.name) - strlen(DELETED_FILE_SUFFIX)] = '\0';
-          unlinkedShmAreas.push_back(area);
+          if (isLeader) {
+            JTRACE("Will recreate shm file on restart.") (area.name);
+            unlinkedShmAreas.push_back(area);
+          } else if (!restartOnSameNode()) {
+            JTRACE("Will map shm file recreated by another process")
+              (area.name);
+            sharedAreaCopies.push_back(area);
+          } else {
+            JTRACE("Shared memory area saved by another process") (area.name);
+            sharedAreaRefs.push_back(area);
+          }
         }
       }
     }
@@ -383,6 +435,51 @@ FileConnList::remapShmMaps()
   shmAreaConn.clear();
 }
 
+/* Maps the shared file areas that were not restored by the process elected
+ * to save them.  By now, that process has recreated the files that had been
+ * unlinked, if it was restarted on this node.
+ *
+ * An area whose contents were saved only by the elected process was left as
+ * zero pages by mtcp_restart, so the file must exist.  A process that saved
+ * its own copy falls back to it: it recreates an unlinked file itself, and
+ * keeps a private copy of a read-only file that is gone.
+ */
+void
+FileConnList::mapSharedAreaRefs()
+{
+  for (size_t i = 0; i < sharedAreaRefs.size(); i++) {
+    JASSERT(jalib::Filesystem::FileExists(sharedAreaRefs[i].name))
+      (sharedAreaRefs[i].name)
+    .Text("The process that saved this shared memory area did not restore "
+          "its backing file. Processes launched with --restart-on-same-node "
+          "must be restarted on the same node.");
+    restoreShmArea(sharedAreaRefs[i]);
+  }
+  sharedAreaRefs.clear();
+
+  for (size_t i = 0; i < sharedAreaCopies.size(); i++) {
+    if (jalib::Filesystem::FileExists(sharedAreaCopies[i].name)) {
+      restoreShmArea(sharedAreaCopies[i]);
+    } else {
+      JTRACE("Recreating shm file from own copy") (sharedAreaCopies[i].name);
+      recreateShmFileAndMap(sharedAreaCopies[i]);
+      missingUnlinkedShmFiles.push_back(sharedAreaCopies[i]);
+    }
+  }
+  sharedAreaCopies.clear();
+
+  for (size_t i = 0; i < readOnlyShmAreas.size(); i++) {
+    const ProcMapsArea &area = readOnlyShmAreas[i];
+    int fd = _real_open(area.name, Util::memProtToOpenFlags(area.prot));
+    if (fd != -1) {
+      restoreShmArea(area, fd);
+    } else {
+      JTRACE("Keeping saved copy of shared memory area") (area.name);
+    }
+  }
+  readOnlyShmAreas.clear();
+}
+
 // examine /proc/self/fd for unknown connections
 void
 FileConnList::scanForPreExisting()
@@ -493,8 +590,6 @@ FileConnList::processFileConnection(int fd,
                                     int flags,
                                     mode_t mode)
 {
-  Connection *c = NULL;
-
   string device;
 
   if (path == NULL) {
@@ -506,6 +601,19 @@ FileConnList::processFileConnection(int fd,
     }
   }
 
+  addFileConnection(fd, device, flags, mode);
+}
+
+// Like processFileConnection(), for callers that have already resolved the
+// device name of fd.
+void
+FileConnList::addFileConnection(int fd,
+                                const string &device,
+                                int flags,
+                                mode_t mode)
+{
+  Connection *c = NULL;
+
   struct stat statbuf;
   JASSERT(fstat(fd, &statbuf) == 0);
 
@@ -514,7 +622,7 @@ FileConnList::processFileConnection(int fd,
     return;
   }
 
-  path = device.c_str();
+  const char *path = device.c_str();
   if (S_ISREG(statbuf.st_mode) || S_ISCHR(statbuf.st_mode) ||
       S_ISDIR(statbuf.st_mode) || S_ISBLK(statbuf.st_mode)) {
     int type = FileConnection::FILE_REGULAR;
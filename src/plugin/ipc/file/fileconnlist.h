@@ -66,6 +66,8 @@ class FileConnList : public ConnectionList
 
     static void restartRefill() { instance().refill(true); }
 
+    static void restartMapSharedAreas() { instance().mapSharedAreaRefs(); }
+
     static void restartResume() { instance().resume(true); }
 
     virtual void preLockSaveOptions();
@@ -83,9 +85,12 @@ class FileConnList : public ConnectionList
     Connection *findDuplication(int fd, const char *path);
     void processFileConnection(int fd, const char *path, int flags,
                                mode_t mode);
+    void addFileConnection(int fd, const string &device, int flags,
+                           mode_t mode);
 
     void prepareShmList();
     void remapShmMaps();
+    void mapSharedAreaRefs();
     void recreateShmFileAndMap(const ProcMapsArea &area);
     void restoreShmArea(const ProcMapsArea &area, int fd = -1);
 };
@@ -0,0 +1,474 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2010 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jassert.h"
+#include "jconvert.h"
+#include "jfilesystem.h"
+#include "../../../constants.h" // Needed for ENV_VAR_CKPT_FILE_STORE and
+                                // CKPT_FILES_SUBDIR_SUFFIX
+#include "ipc.h"
+#include "util.h"
+#include "filestore.h"
+#include "filewrappers.h"
+
+#define MANIFEST_MAGIC "DMTCP_FILE_MANIFEST_V3"
+
+using namespace dmtcp;
+
+struct ManifestHeader {
+  char magic[24];
+  uint64_t fileSize;
+  uint64_t chunkSize;
+  uint64_t numChunks;
+};
+
+struct Digest {
+  uint8_t bytes[32];
+};
+
+/* SHA-256 (FIPS 180-4). */
+static const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+rotr(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void
+sha256Block(uint32_t state[8], const uint8_t *block)
+{
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h;
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+           ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+  e = state[4]; f = state[5]; g = state[6]; h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + sha256K[i] + w[i];
+    uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void
+sha256(const char *data, size_t len, Digest *digest)
+{
+  uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  const uint8_t *p = (const uint8_t *)data;
+  uint8_t tail[128];
+  size_t full = len & ~(size_t)63;
+  size_t rest = len - full;
+  uint64_t bits = (uint64_t)len * 8;
+
+  for (size_t i = 0; i < full; i += 64) {
+    sha256Block(state, p + i);
+  }
+
+  // Pad with 0x80, zeros and the 64-bit length, to one or two blocks.
+  size_t tailLen = rest < 56 ? 64 : 128;
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p + full, rest);
+  tail[rest] = 0x80;
+  for (int i = 0; i < 8; i++) {
+    tail[tailLen - 1 - i] = (uint8_t)(bits >> (8 * i));
+  }
+  for (size_t i = 0; i < tailLen; i += 64) {
+    sha256Block(state, tail + i);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    digest->bytes[4 * i] = state[i] >> 24;
+    digest->bytes[4 * i + 1] = state[i] >> 16;
+    digest->bytes[4 * i + 2] = state[i] >> 8;
+    digest->bytes[4 * i + 3] = state[i];
+  }
+}
+
+// The store lives next to the ckpt_*_files directory holding the manifest.
+static string
+storeDir(const string &manifestPath)
+{
+  using jalib::Filesystem::DirName;
+
+  return DirName(DirName(manifestPath)) + "/" FILE_STORE_DIR;
+}
+
+// Chunks are spread over 256 subdirectories by the first byte of the digest.
+static string
+chunkPath(const string &dir, const Digest &digest)
+{
+  char hex[2 * sizeof(digest.bytes) + 1];
+
+  for (size_t i = 0; i < sizeof(digest.bytes); i++) {
+    sprintf(hex + 2 * i, "%02x", digest.bytes[i]);
+  }
+  return dir + "/" + string(hex, 2) + "/" + hex;
+}
+
+static ssize_t
+preadAll(int fd, char *buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t ret = pread(fd, buf + done, len - done, offset + done);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret == -1) {
+      return -1;
+    }
+    if (ret == 0) {
+      break;
+    }
+    done += ret;
+  }
+  return done;
+}
+
+// Write a chunk under a temporary name and rename it into place, so that
+// other processes adding the same chunk never see a partial one.
+static void
+writeChunk(const string &path, const char *buf, size_t len)
+{
+  JASSERT(Util::createDirectoryTree(path)) (path)
+  .Text("Unable to create directory in file store");
+
+  string tmpPath = path + ".tmp." + jalib::XToString(getpid());
+  int fd = _real_open(tmpPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600);
+  JASSERT(fd != -1) (tmpPath) (JASSERT_ERRNO);
+  JASSERT(Util::writeAll(fd, buf, len) == (ssize_t)len) (tmpPath)
+    (JASSERT_ERRNO);
+  _real_close(fd);
+  JASSERT(rename(tmpPath.c_str(), path.c_str()) == 0) (tmpPath) (path)
+    (JASSERT_ERRNO);
+}
+
+/* save() holds a shared lock on the store while it looks up chunks and
+ * writes the manifest, and prune() holds an exclusive one.  So a chunk is
+ * never removed between the time save() finds it and the time its manifest
+ * refers to it.  The lock file also records the generation of the last
+ * prune.  Returns -1 if operation has LOCK_NB and the lock is taken.
+ */
+static int
+lockStore(const string &dir, int operation)
+{
+  string lockPath = dir + "/lock";
+
+  JASSERT(Util::createDirectoryTree(lockPath)) (lockPath)
+  .Text("Unable to create the file store");
+  int fd = _real_open(lockPath.c_str(), O_CREAT | O_RDWR, 0600);
+  JASSERT(fd != -1) (lockPath) (JASSERT_ERRNO);
+
+  int ret;
+  do {
+    ret = flock(fd, operation);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1 && errno == EWOULDBLOCK && (operation & LOCK_NB)) {
+    _real_close(fd);
+    return -1;
+  }
+  JASSERT(ret == 0) (lockPath) (JASSERT_ERRNO);
+  return fd;
+}
+
+static bool
+readManifest(const string &path, ManifestHeader *hdr, vector<Digest> *digests)
+{
+  int fd = _real_open(path.c_str(), O_RDONLY, 0);
+
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = Util::readAll(fd, hdr, sizeof(*hdr)) == sizeof(*hdr) &&
+            strcmp(hdr->magic, MANIFEST_MAGIC) == 0;
+  if (ok && digests != NULL) {
+    digests->resize(hdr->numChunks);
+    size_t len = hdr->numChunks * sizeof(Digest);
+    ok = len == 0 || Util::readAll(fd, &(*digests)[0], len) == (ssize_t)len;
+  }
+  _real_close(fd);
+  return ok;
+}
+
+static size_t
+chunkLength(const ManifestHeader &hdr, size_t i)
+{
+  uint64_t offset = i * hdr.chunkSize;
+
+  return MIN(hdr.chunkSize, hdr.fileSize - offset);
+}
+
+bool
+FileStore::isEnabled()
+{
+  static int enabled = -1;
+
+  if (enabled == -1) {
+    const char *env = getenv(ENV_VAR_CKPT_FILE_STORE);
+    enabled = env != NULL && strcmp(env, "1") == 0;
+  }
+  return enabled;
+}
+
+bool
+FileStore::isManifest(const string &path)
+{
+  ManifestHeader hdr;
+
+  return readManifest(path, &hdr, NULL);
+}
+
+void
+FileStore::save(int fd, const string &manifestPath)
+{
+  struct stat st;
+  ManifestHeader hdr;
+  vector<Digest> digests;
+  string dir = storeDir(manifestPath);
+  size_t newChunks = 0;
+
+  int lockFd = lockStore(dir, LOCK_SH);
+  JASSERT(fstat(fd, &st) == 0) (fd) (JASSERT_ERRNO);
+  memset(&hdr, 0, sizeof(hdr));
+  strcpy(hdr.magic, MANIFEST_MAGIC);
+  hdr.fileSize = st.st_size;
+  hdr.chunkSize = FILE_STORE_CHUNK_SIZE;
+  hdr.numChunks = (hdr.fileSize + hdr.chunkSize - 1) / hdr.chunkSize;
+
+  char *buf = (char *)JALLOC_HELPER_MALLOC(FILE_STORE_CHUNK_SIZE);
+  JASSERT(buf != NULL);
+  digests.resize(hdr.numChunks);
+  for (size_t i = 0; i < hdr.numChunks; i++) {
+    size_t len = chunkLength(hdr, i);
+    JASSERT(preadAll(fd, buf, len, i * hdr.chunkSize) == (ssize_t)len)
+      (fd) (i) (len) (JASSERT_ERRNO).Text("Unable to read file to save");
+
+    sha256(buf, len, &digests[i]);
+    string path = chunkPath(dir, digests[i]);
+    struct stat chunkStat;
+    if (stat(path.c_str(), &chunkStat) != 0 ||
+        chunkStat.st_size != (off_t)len) {
+      writeChunk(path, buf, len);
+      newChunks++;
+    }
+  }
+  JALLOC_HELPER_FREE(buf);
+
+  int manifestFd = _real_open(manifestPath.c_str(),
+                              O_CREAT | O_WRONLY | O_TRUNC, 0600);
+  JASSERT(manifestFd != -1) (manifestPath) (JASSERT_ERRNO);
+  size_t len = hdr.numChunks * sizeof(Digest);
+  JASSERT(Util::writeAll(manifestFd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+          (len == 0 ||
+           Util::writeAll(manifestFd, &digests[0], len) == (ssize_t)len))
+    (manifestPath) (JASSERT_ERRNO);
+  _real_close(manifestFd);
+  _real_close(lockFd);
+
+  JTRACE("Saved file to the file store")
+    (manifestPath) (hdr.fileSize) (hdr.numChunks) (newChunks);
+}
+
+void
+FileStore::restore(const string &manifestPath, int destFd)
+{
+  ManifestHeader hdr;
+  vector<Digest> digests;
+  string dir = storeDir(manifestPath);
+
+  JASSERT(readManifest(manifestPath, &hdr, &digests)) (manifestPath)
+  .Text("Unable to read file store manifest");
+
+  char *buf = (char *)JALLOC_HELPER_MALLOC(hdr.chunkSize);
+  JASSERT(buf != NULL);
+  JASSERT(_real_lseek(destFd, 0, SEEK_SET) == 0) (destFd) (JASSERT_ERRNO);
+  for (size_t i = 0; i < hdr.numChunks; i++) {
+    size_t len = chunkLength(hdr, i);
+    string path = chunkPath(dir, digests[i]);
+    int fd = _real_open(path.c_str(), O_RDONLY, 0);
+    JASSERT(fd != -1) (path) (manifestPath) (JASSERT_ERRNO)
+    .Text("Missing chunk in file store");
+    JASSERT(Util::readAll(fd, buf, len) == (ssize_t)len) (path) (len)
+      (JASSERT_ERRNO);
+    _real_close(fd);
+    JASSERT(Util::writeAll(destFd, buf, len) == (ssize_t)len) (destFd)
+      (JASSERT_ERRNO);
+  }
+  JALLOC_HELPER_FREE(buf);
+  JTRACE("Restored file from the file store") (manifestPath) (hdr.fileSize);
+}
+
+bool
+FileStore::matches(const string &manifestPath, int fd)
+{
+  ManifestHeader hdr;
+  vector<Digest> digests;
+  struct stat st;
+  bool equal = true;
+
+  if (!readManifest(manifestPath, &hdr, &digests) || fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_size != hdr.fileSize) {
+    return false;
+  }
+
+  char *buf = (char *)JALLOC_HELPER_MALLOC(hdr.chunkSize);
+  JASSERT(buf != NULL);
+  for (size_t i = 0; equal && i < hdr.numChunks; i++) {
+    size_t len = chunkLength(hdr, i);
+    Digest digest;
+    equal = preadAll(fd, buf, len, i * hdr.chunkSize) == (ssize_t)len;
+    if (equal) {
+      sha256(buf, len, &digest);
+      equal = memcmp(&digest, &digests[i], sizeof(digest)) == 0;
+    }
+  }
+  JALLOC_HELPER_FREE(buf);
+  return equal;
+}
+
+void
+FileStore::prune()
+{
+  string ckptDir =
+    jalib::Filesystem::DirName(dmtcp_get_ckpt_files_subdir());
+  string dir = ckptDir + "/" FILE_STORE_DIR;
+
+  if (!jalib::Filesystem::FileExists(dir)) {
+    return;
+  }
+
+  // Another process of the computation is pruning, or already did so for
+  // this checkpoint.
+  int lockFd = lockStore(dir, LOCK_EX | LOCK_NB);
+  if (lockFd == -1) {
+    return;
+  }
+  uint32_t generation = dmtcp_get_generation();
+  uint32_t prunedGeneration = 0;
+  if (Util::readAll(lockFd, &prunedGeneration, sizeof(prunedGeneration)) ==
+      sizeof(prunedGeneration) && prunedGeneration >= generation) {
+    _real_close(lockFd);
+    return;
+  }
+
+  // The chunks that are still in use are those that the manifests in the
+  // ckpt_*_files directories refer to.
+  set<string> live;
+  DIR *ckptDirp = _real_opendir(ckptDir.c_str());
+  JASSERT(ckptDirp != NULL) (ckptDir) (JASSERT_ERRNO);
+  struct dirent *entry;
+  while ((entry = readdir(ckptDirp)) != NULL) {
+    if (!Util::strEndsWith(entry->d_name, CKPT_FILES_SUBDIR_SUFFIX)) {
+      continue;
+    }
+    string filesDir = ckptDir + "/" + entry->d_name;
+    DIR *filesDirp = _real_opendir(filesDir.c_str());
+    if (filesDirp == NULL) {
+      continue;
+    }
+    struct dirent *file;
+    while ((file = readdir(filesDirp)) != NULL) {
+      ManifestHeader hdr;
+      vector<Digest> digests;
+      if (readManifest(filesDir + "/" + file->d_name, &hdr, &digests)) {
+        for (size_t i = 0; i < digests.size(); i++) {
+          live.insert(chunkPath(dir, digests[i]));
+        }
+      }
+    }
+    closedir(filesDirp);
+  }
+  closedir(ckptDirp);
+
+  // Remove the other chunks, along with any temporary file left by a
+  // process that died while writing a chunk.
+  size_t removed = 0;
+  for (int i = 0; i < 256; i++) {
+    char name[3];
+    sprintf(name, "%02x", i);
+    string chunkDir = dir + "/" + name;
+    DIR *chunkDirp = _real_opendir(chunkDir.c_str());
+    if (chunkDirp == NULL) {
+      continue;
+    }
+    while ((entry = readdir(chunkDirp)) != NULL) {
+      string path = chunkDir + "/" + entry->d_name;
+      if (entry->d_name[0] != '.' && live.find(path) == live.end() &&
+          unlink(path.c_str()) == 0) {
+        removed++;
+      }
+    }
+    closedir(chunkDirp);
+  }
+
+  JASSERT(pwrite(lockFd, &generation, sizeof(generation), 0) ==
+          sizeof(generation)) (dir) (JASSERT_ERRNO);
+  _real_close(lockFd);
+  JTRACE("Pruned the file store") (dir) (live.size()) (removed);
+}
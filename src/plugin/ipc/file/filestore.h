@@ -0,0 +1,66 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2010 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#pragma once
+#ifndef FILESTORE_H
+# define FILESTORE_H
+
+# include "dmtcpalloc.h"
+
+// Name of the store directory, created next to the ckpt_*_files directories
+// so that all processes checkpointing into the same directory share it.
+# define FILE_STORE_DIR        "dmtcp_file_store"
+
+// Saved files are split into chunks of this size, each stored once under
+// the SHA-256 digest of its contents.
+# define FILE_STORE_CHUNK_SIZE (1024 * 1024)
+
+namespace dmtcp
+{
+// A content-addressed store for the checkpointed copies of open files.
+// Instead of a full copy, the saved file is a manifest listing the digests
+// of the file's chunks; only chunks not already in the store are written.
+// After each checkpoint, prune() removes the chunks that no manifest in the
+// checkpoint directory refers to any more.
+namespace FileStore
+{
+// True if DMTCP_CKPT_FILE_STORE=1.
+bool isEnabled();
+
+// True if path holds a manifest written by save(), not a plain copy.
+bool isManifest(const string &path);
+
+// Add the chunks of fd that are missing from the store, and write the list
+// of chunks to manifestPath.
+void save(int fd, const string &manifestPath);
+
+// Write the file described by manifestPath to destFd.
+void restore(const string &manifestPath, int destFd);
+
+// True if the contents of fd match the manifest.  Only fd is read.
+bool matches(const string &manifestPath, int fd);
+
+// Remove the unused chunks from the store of this process's checkpoint
+// directory.  Only one process of the computation does the work.
+void prune();
+}
+}
+#endif // ifndef FILESTORE_H
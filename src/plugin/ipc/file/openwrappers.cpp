@@ -87,7 +87,7 @@ processConnection(int fd, const char *path, int flags, mode_t mode)
   if (Util::isPseudoTty(device)) {
     PtyConnList::instance().processPtyConnection(fd, path, flags, mode);
   } else {
-    FileConnList::instance().processFileConnection(fd, path, flags, mode);
+    FileConnList::instance().addFileConnection(fd, device, flags, mode);
   }
 }
 
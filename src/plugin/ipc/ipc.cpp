@@ -76,6 +76,12 @@ static DmtcpBarrier fileBarriers[] = {
     "RESTART_NS_SEND_QUERIES" },
   { DMTCP_LOCAL_BARRIER_RESTART, FileConnList::restartRefill,
     "RESTART_REFILL" },
+
+  // Shared file mappings saved by another process are mapped only after that
+  // process has recreated the file in refill() and before it unlinks the file
+  // again in resume().
+  { DMTCP_LOCAL_BARRIER_RESTART, FileConnList::restartMapSharedAreas,
+    "RESTART_MAP_SHARED_AREAS" },
   { DMTCP_LOCAL_BARRIER_RESTART, FileConnList::restartResume, "RESTART_RESUME" }
 };
 
@@ -215,8 +221,8 @@ DmtcpPluginDescriptor_t ipcPlugin = {
   ipc_event_hook
 };
 
-EXTERNC void
-dmtcp_initialize_plugin()
+static void
+registerIpcPlugins()
 {
   /* A note on the ordering of plugins:
    * 1. The file, pty, and socket plugins are independent of each other. Thus the
@@ -234,12 +240,28 @@ dmtcp_initialize_plugin()
   dmtcp_register_plugin(filePlugin);
   dmtcp_register_plugin(ptyPlugin);
   dmtcp_register_plugin(socketPlugin);
+}
+
+#ifdef DMTCP_CORE_PLUGIN
+// See core/coreplugin.h.
+EXTERNC void
+dmtcp_core_register_ipcPlugins()
+{
+  registerIpcPlugins();
+}
+
+#else // ifdef DMTCP_CORE_PLUGIN
+EXTERNC void
+dmtcp_initialize_plugin()
+{
+  registerIpcPlugins();
 
   void (*fn)() = NEXT_FNC(dmtcp_initialize_plugin);
   if (fn != NULL) {
     (*fn)();
   }
 }
+#endif // ifdef DMTCP_CORE_PLUGIN
 
 /*
  *
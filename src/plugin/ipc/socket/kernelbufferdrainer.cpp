@@ -19,9 +19,12 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include "kernelbufferdrainer.h"
 #include "../jalib/jassert.h"
 #include "../jalib/jbuffer.h"
+#include "../jalib/jsocket.h"
 #include "connectionlist.h"
 #include "connectionmessage.h"
 #include "socketwrappers.h"
@@ -52,6 +55,15 @@ scaleSendBuffers(int fd, double factor)
                            len) == 0);
 }
 
+static double
+secondsSince(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static KernelBufferDrainer *theDrainer = NULL;
 KernelBufferDrainer&
 KernelBufferDrainer::instance()
@@ -62,108 +74,270 @@ KernelBufferDrainer::instance()
   return *theDrainer;
 }
 
+KernelBufferDrainer::KernelBufferDrainer()
+  : _numPending(0),
+  _epollFd(-1),
+  _timeoutCount(0)
+{
+  memset(&_stats, 0, sizeof(_stats));
+  memset(&_startTime, 0, sizeof(_startTime));
+}
+
+KernelBufferDrainer::~KernelBufferDrainer()
+{
+  for (size_t i = 0; i < _sockets.size(); i++) {
+    releaseChunks(&_sockets[i]);
+  }
+  for (size_t i = 0; i < _chunkPool.size(); i++) {
+    JALLOC_HELPER_FREE(_chunkPool[i]);
+  }
+}
+
+char *
+KernelBufferDrainer::getChunk()
+{
+  if (_chunkPool.empty()) {
+    char *chunk = (char *)JALLOC_HELPER_MALLOC(DRAIN_CHUNK_SIZE);
+    JASSERT(chunk != NULL);
+    return chunk;
+  }
+  char *chunk = _chunkPool.back();
+  _chunkPool.pop_back();
+  return chunk;
+}
+
 void
-KernelBufferDrainer::onConnect(const jalib::JSocket &sock,
-                               const struct sockaddr *remoteAddr,
-                               socklen_t remoteLen)
+KernelBufferDrainer::releaseChunks(DrainedSocket *ds)
 {
-  JWARNING(false) (sock.sockfd())
-  .Text("we don't yet support checkpointing non-accepted connections..."
-        " restore will likely fail.. closing connection");
-  jalib::JSocket(sock).close();
+  _chunkPool.insert(_chunkPool.end(), ds->chunks.begin(), ds->chunks.end());
+  _chunkPool.insert(_chunkPool.end(),
+                    ds->peerChunks.begin(), ds->peerChunks.end());
+  ds->chunks.clear();
+  ds->peerChunks.clear();
+  ds->size = 0;
 }
 
 void
-KernelBufferDrainer::onData(jalib::JReaderInterface *sock)
+KernelBufferDrainer::appendData(vector<char *> *chunks,
+                                size_t *size,
+                                const char *buf,
+                                size_t len)
 {
-  vector<char> &buffer = _drainedData[sock->socket().sockfd()];
-  buffer.resize(buffer.size() + sock->bytesRead());
-  int startIdx = buffer.size() - sock->bytesRead();
-  memcpy(&buffer[startIdx], sock->buffer(), sock->bytesRead());
+  // All chunks but the last are full.
+  while (len > 0) {
+    size_t offset = *size % DRAIN_CHUNK_SIZE;
+    if (*size == chunks->size() * DRAIN_CHUNK_SIZE) {
+      chunks->push_back(getChunk());
+    }
+    size_t n = DRAIN_CHUNK_SIZE - offset;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(chunks->back() + offset, buf, n);
+    *size += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+// If the drained data ends with the magic cookie, strip it and return true.
+bool
+KernelBufferDrainer::removeCookie(DrainedSocket *ds)
+{
+  const size_t cookieLen = sizeof(theMagicDrainCookie);
+  char tail[sizeof(theMagicDrainCookie)];
 
-  // JTRACE("got buffer chunk") (sock->bytesRead());
-  sock->reset();
+  if (ds->size < cookieLen) {
+    return false;
+  }
+
+  // The cookie may straddle the last two chunks.
+  size_t pos = ds->size - cookieLen;
+  for (size_t i = 0; i < cookieLen; i++, pos++) {
+    tail[i] = ds->chunks[pos / DRAIN_CHUNK_SIZE][pos % DRAIN_CHUNK_SIZE];
+  }
+  if (memcmp(tail, theMagicDrainCookie, cookieLen) != 0) {
+    return false;
+  }
+
+  ds->size -= cookieLen;
+  while (ds->chunks.size() * DRAIN_CHUNK_SIZE >= ds->size + DRAIN_CHUNK_SIZE) {
+    _chunkPool.push_back(ds->chunks.back());
+    ds->chunks.pop_back();
+  }
+  return true;
 }
 
 void
-KernelBufferDrainer::onDisconnect(jalib::JReaderInterface *sock)
+KernelBufferDrainer::updateEvents(DrainedSocket *ds)
 {
-  int fd;
+  struct epoll_event ev;
 
-  errno = 0;
-  fd = sock->socket().sockfd();
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if (ds->cookieBytesSent < sizeof(theMagicDrainCookie)) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.ptr = ds;
+  JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_MOD, ds->fd, &ev) == 0)
+    (ds->fd) (JASSERT_ERRNO);
+}
+
+// Write (the rest of) the cookie without blocking; if the kernel send
+// buffer is full, the remainder is written once the socket is writable.
+void
+KernelBufferDrainer::sendCookie(DrainedSocket *ds)
+{
+  while (ds->cookieBytesSent < sizeof(theMagicDrainCookie)) {
+    ssize_t ret = _real_send(ds->fd,
+                             theMagicDrainCookie + ds->cookieBytesSent,
+                             sizeof(theMagicDrainCookie) - ds->cookieBytesSent,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret > 0) {
+      ds->cookieBytesSent += ret;
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      // The peer is gone; the read side will notice the disconnect.
+      JTRACE("failed to send drain cookie") (ds->fd) (JASSERT_ERRNO);
+      ds->cookieBytesSent = sizeof(theMagicDrainCookie);
+    }
+  }
+}
+
+void
+KernelBufferDrainer::readData(DrainedSocket *ds, char *buf)
+{
+  ssize_t ret = _real_recv(ds->fd, buf, DRAIN_READ_SIZE, MSG_DONTWAIT);
 
-  // check if this was on purpose
-  if (fd < 0) {
+  if (ret > 0) {
+    _stats.numReads++;
+    _stats.bytesDrained += ret;
+
+    // Usually the cookie arrives on its own, with nothing drained before it.
+    if (ds->size == 0 && (size_t)ret == sizeof(theMagicDrainCookie) &&
+        memcmp(buf, theMagicDrainCookie, sizeof(theMagicDrainCookie)) == 0) {
+      onDrainComplete(ds);
+      return;
+    }
+    appendData(&ds->chunks, &ds->size, buf, ret);
+    if (removeCookie(ds)) {
+      onDrainComplete(ds);
+    }
+  } else if (ret == -1 &&
+             (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
     return;
+  } else {
+    onDisconnect(ds);
   }
+}
+
+void
+KernelBufferDrainer::onDrainComplete(DrainedSocket *ds)
+{
+  JTRACE("buffer drain complete") (ds->fd) (ds->size) (_numPending);
+  JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_DEL, ds->fd, NULL) == 0)
+    (ds->fd) (JASSERT_ERRNO);
+  ds->done = true;
+  _numPending--;
+
+  double latency = secondsSince(&_startTime);
+  if (latency > _stats.maxLatency) {
+    _stats.maxLatency = latency;
+  }
+}
+
+void
+KernelBufferDrainer::onConnect(DrainedSocket *ds)
+{
+  jalib::JSocket listenSock(ds->fd);
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  jalib::JSocket sock = listenSock.accept(&addr, &addrlen);
+
+  if (!sock.isValid()) {
+    return;
+  }
+  JWARNING(false) (sock.sockfd())
+  .Text("we don't yet support checkpointing non-accepted connections..."
+        " restore will likely fail.. closing connection");
+  sock.close();
+}
+
+void
+KernelBufferDrainer::onDisconnect(DrainedSocket *ds)
+{
   JTRACE("found disconnected socket... marking it dead")
-    (fd) (_reverseLookup[fd]) (JASSERT_ERRNO);
-  _disconnectedSockets[_reverseLookup[fd]] = _drainedData[fd];
+    (ds->fd) (ds->id) (JASSERT_ERRNO);
+
+  vector<char> &buffer = _disconnectedSockets[ds->id];
+  buffer.resize(ds->size);
+  for (size_t i = 0, pos = 0; i < ds->chunks.size(); i++) {
+    size_t n = ds->size - pos < DRAIN_CHUNK_SIZE ? ds->size - pos
+                                                 : DRAIN_CHUNK_SIZE;
+    memcpy(&buffer[pos], ds->chunks[i], n);
+    pos += n;
+  }
+  releaseChunks(ds);
 
-  // _drainedData is used to refill socket buffers. Remove the disconnected
-  // socket from this list. Disconnected sockets are refilled when they are
-  // recreated by _makeDeadSocket().
-  _drainedData.erase(fd);
+  // Disconnected sockets are refilled when they are recreated by
+  // _makeDeadSocket(), not by refillAllSockets().
+  ds->done = true;
+  ds->disconnected = true;
+  _numPending--;
+
+  // Closing the socket also removes it from the epoll set.
+  _real_close(ds->fd);
 }
 
 void
 KernelBufferDrainer::onTimeoutInterval()
 {
-  int count = 0;
-
-  for (size_t i = 0; i < _dataSockets.size(); ++i) {
-    if (_dataSockets[i]->bytesRead() > 0) {
-      onData(_dataSockets[i]);
-    }
-    vector<char> &buffer = _drainedData[_dataSockets[i]->socket().sockfd()];
-    if (buffer.size() >= sizeof(theMagicDrainCookie)
-        && memcmp(&buffer[buffer.size() - sizeof(theMagicDrainCookie)],
-                  theMagicDrainCookie,
-                  sizeof(theMagicDrainCookie)) == 0) {
-      buffer.resize(buffer.size() - sizeof(theMagicDrainCookie));
-      JTRACE("buffer drain complete") (_dataSockets[i]->socket().sockfd())
-        (buffer.size()) ((_dataSockets.size()));
-      _dataSockets[i]->socket() = -1; // poison socket
-    } else {
-      ++count;
-    }
+  const static int WARN_INTERVAL_TICKS =
+    (int)(DRAINER_WARNING_FREQ / DRAINER_CHECK_FREQ + 0.5);
+  const static float WARN_INTERVAL_SEC =
+    WARN_INTERVAL_TICKS * DRAINER_CHECK_FREQ;
+
+  if (_timeoutCount++ <= WARN_INTERVAL_TICKS) {
+    return;
   }
+  _timeoutCount = 0;
 
-  if (count == 0) {
-    _listenSockets.clear();
-  } else {
-    const static int WARN_INTERVAL_TICKS =
-      (int)(DRAINER_WARNING_FREQ / DRAINER_CHECK_FREQ + 0.5);
-    const static float WARN_INTERVAL_SEC =
-      WARN_INTERVAL_TICKS * DRAINER_CHECK_FREQ;
-    if (_timeoutCount++ > WARN_INTERVAL_TICKS) {
-      _timeoutCount = 0;
-      for (size_t i = 0; i < _dataSockets.size(); ++i) {
-        vector<char> &buffer = _drainedData[_dataSockets[i]->socket().sockfd()];
-        JWARNING(false) (_dataSockets[i]->socket().sockfd())
-          (buffer.size()) (WARN_INTERVAL_SEC)
-        .Text("Still draining socket... "
-              "perhaps remote host is not running under DMTCP?");
+  for (size_t i = 0; i < _sockets.size(); ++i) {
+    DrainedSocket *ds = &_sockets[i];
+    if (ds->done) {
+      continue;
+    }
+    JWARNING(false) (ds->fd) (ds->size) (WARN_INTERVAL_SEC)
+    .Text("Still draining socket... "
+          "perhaps remote host is not running under DMTCP?");
 #ifdef CERN_CMS
-        JNOTE("\n*** Closing this socket (to database?).  Please use dmtcp \n"
-              "***  plugins to gracefully handle such sockets, and re-run.\n"
-              "***  Trying a workaround for now, and hoping it doesn't fail.\n"
-             );
-        _real_close(_dataSockets[i]->socket().sockfd());
-
-        // it does it by creating a socket pair and closing one side
-        int sp[2] = { -1, -1 };
-        JASSERT(_real_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0)
-          (JASSERT_ERRNO).Text("socketpair() failed");
-        JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
-        .Text("socketpair() failed");
-        _real_close(sp[1]);
-        JTRACE("created dead socket") (sp[0]);
-        _real_dup2(sp[0], _dataSockets[i]->socket().sockfd());
+    JNOTE("\n*** Closing this socket (to database?).  Please use dmtcp \n"
+          "***  plugins to gracefully handle such sockets, and re-run.\n"
+          "***  Trying a workaround for now, and hoping it doesn't fail.\n"
+         );
+    _real_close(ds->fd);
+
+    // it does it by creating a socket pair and closing one side
+    int sp[2] = { -1, -1 };
+    JASSERT(_real_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0)
+      (JASSERT_ERRNO).Text("socketpair() failed");
+    JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
+    .Text("socketpair() failed");
+    _real_close(sp[1]);
+    JTRACE("created dead socket") (sp[0]);
+    _real_dup2(sp[0], ds->fd);
+
+    // Closing the old socket dropped it from the epoll set; watch the dead
+    // one instead so that the disconnect is noticed.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ds;
+    _real_epoll_ctl(_epollFd, EPOLL_CTL_ADD, ds->fd, &ev);
 #endif // ifdef CERN_CMS
-      }
-    }
   }
 }
 
@@ -171,72 +345,376 @@ void
 KernelBufferDrainer::beginDrainOf(int fd, const ConnectionIdentifier &id)
 {
   // JTRACE("will drain socket") (fd);
-  _drainedData[fd]; // create buffer
-  // this is the simple way:  jalib::JSocket(fd) << theMagicDrainCookie;
-  // instead used delayed write in case kernel buffer is full:
-  addWrite(new jalib::JChunkWriter(fd, theMagicDrainCookie,
-                                   sizeof theMagicDrainCookie));
+  DrainedSocket ds;
+
+  ds.fd = fd;
+  ds.isListen = false;
+  ds.done = false;
+  ds.disconnected = false;
+  ds.cookieBytesSent = 0;
+  ds.size = 0;
+  ds.id = id;
+  ds.bytesSent = 0;
+  ds.bytesRecvd = 0;
+  ds.peerSize = 0;
+  _sockets.push_back(ds);
+}
+
+void
+KernelBufferDrainer::addListenSocket(int fd)
+{
+  DrainedSocket ds;
+
+  ds.fd = fd;
+  ds.isListen = true;
+  ds.done = false;
+  ds.disconnected = false;
+  ds.cookieBytesSent = 0;
+  ds.size = 0;
+  ds.bytesSent = 0;
+  ds.bytesRecvd = 0;
+  ds.peerSize = 0;
+  _listenSockets.push_back(ds);
+}
 
-  // now setup a reader:
-  addDataSocket(new jalib::JChunkReader(fd, 512));
+void
+KernelBufferDrainer::drainAllSockets()
+{
+  struct epoll_event events[DRAIN_MAX_EVENTS];
+  struct timespec lastTick;
+  const int timeoutMs = (int)(DRAINER_CHECK_FREQ * 1000);
+
+  clock_gettime(CLOCK_MONOTONIC, &_startTime);
+  lastTick = _startTime;
+  _stats.numSockets = _sockets.size();
+  _numPending = _sockets.size();
+  if (_numPending == 0) {
+    return;
+  }
 
-  // insert it in reverse lookup
-  _reverseLookup[fd] = id;
+  _epollFd = _real_epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(_epollFd != -1) (JASSERT_ERRNO);
+
+  // Send all the cookies up front; most of them fit in the send buffer.
+  for (size_t i = 0; i < _sockets.size(); i++) {
+    DrainedSocket *ds = &_sockets[i];
+    struct epoll_event ev;
+
+    sendCookie(ds);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (ds->cookieBytesSent < sizeof(theMagicDrainCookie)) {
+      ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = ds;
+    JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_ADD, ds->fd, &ev) == 0)
+      (ds->fd) (JASSERT_ERRNO);
+  }
+
+  for (size_t i = 0; i < _listenSockets.size(); i++) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &_listenSockets[i];
+    JWARNING(_real_epoll_ctl(_epollFd, EPOLL_CTL_ADD,
+                             _listenSockets[i].fd, &ev) == 0)
+      (_listenSockets[i].fd) (JASSERT_ERRNO);
+  }
+
+  char *buf = (char *)JALLOC_HELPER_MALLOC(DRAIN_READ_SIZE);
+  JASSERT(buf != NULL);
+
+  while (_numPending > 0) {
+    int n = _real_epoll_wait(_epollFd, events, DRAIN_MAX_EVENTS, timeoutMs);
+
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      JWARNING(false) (_numPending) (JASSERT_ERRNO).Text("epoll_wait failed");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      DrainedSocket *ds = (DrainedSocket *)events[i].data.ptr;
+
+      if (ds->isListen) {
+        onConnect(ds);
+        continue;
+      }
+      if (ds->done) {
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        sendCookie(ds);
+        if (ds->cookieBytesSent == sizeof(theMagicDrainCookie)) {
+          updateEvents(ds);
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        readData(ds, buf);
+      }
+    }
+
+    if (n == 0 || secondsSince(&lastTick) >= DRAINER_CHECK_FREQ) {
+      clock_gettime(CLOCK_MONOTONIC, &lastTick);
+      onTimeoutInterval();
+    }
+  }
+
+  JALLOC_HELPER_FREE(buf);
+  _real_close(_epollFd);
+  _epollFd = -1;
+
+  double seconds = secondsSince(&_startTime);
+  JTRACE("socket drain complete")
+    (_stats.numSockets) (_stats.bytesDrained) (_stats.numReads)
+    (_disconnectedSockets.size()) (seconds) (_stats.maxLatency)
+    (seconds > 0 ? _stats.bytesDrained / seconds / (1024 * 1024) : 0.0);
+}
+
+// Find the next contiguous piece of the outgoing refill stream.  Returns
+// false if nothing can be sent until more of the peer's data arrives.
+bool
+KernelBufferDrainer::getRefillData(DrainedSocket *ds,
+                                   const char **buf,
+                                   size_t *len)
+{
+  const size_t hdrLen = sizeof(ds->sendMsg);
+  const vector<char *> *chunks;
+  size_t pos = ds->bytesSent;
+  size_t avail;
+
+  if (pos < hdrLen) {
+    *buf = (const char *)&ds->sendMsg + pos;
+    *len = hdrLen - pos;
+    return true;
+  }
+  pos -= hdrLen;
+  if (pos < ds->size) {
+    chunks = &ds->chunks;
+    avail = ds->size;
+  } else {
+    pos -= ds->size;
+    chunks = &ds->peerChunks;
+    avail = ds->bytesRecvd > hdrLen ? ds->bytesRecvd - hdrLen : 0;
+    if (pos >= avail) {
+      return false;
+    }
+  }
+  *buf = (*chunks)[pos / DRAIN_CHUNK_SIZE] + pos % DRAIN_CHUNK_SIZE;
+  *len = DRAIN_CHUNK_SIZE - pos % DRAIN_CHUNK_SIZE;
+  if (*len > avail - pos) {
+    *len = avail - pos;
+  }
+  return true;
 }
 
 void
-KernelBufferDrainer::refillAllSockets()
+KernelBufferDrainer::sendRefillData(DrainedSocket *ds)
+{
+  const char *buf;
+  size_t len;
+
+  while (!ds->done && getRefillData(ds, &buf, &len)) {
+    ssize_t ret = _real_send(ds->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret > 0) {
+      ds->bytesSent += ret;
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      onRefillError(ds);
+    }
+  }
+}
+
+// Read the header and then exactly the number of bytes the peer announced;
+// anything after that is the echo of our own data.
+void
+KernelBufferDrainer::recvRefillData(DrainedSocket *ds, char *buf)
 {
-  JTRACE("refilling socket buffers") (_drainedData.size());
+  const size_t hdrLen = sizeof(ds->recvMsg);
+
+  while (!ds->done &&
+         (ds->bytesRecvd < hdrLen || ds->bytesRecvd < hdrLen + ds->peerSize)) {
+    char *dst = buf;
+    size_t len;
+
+    if (ds->bytesRecvd < hdrLen) {
+      dst = (char *)&ds->recvMsg + ds->bytesRecvd;
+      len = hdrLen - ds->bytesRecvd;
+    } else {
+      len = hdrLen + ds->peerSize - ds->bytesRecvd;
+      if (len > DRAIN_READ_SIZE) {
+        len = DRAIN_READ_SIZE;
+      }
+    }
 
-  // write all buffers out
-  map<int, vector<char> >::iterator i;
-  for (i = _drainedData.begin(); i != _drainedData.end(); ++i) {
-    int size = i->second.size();
-    JWARNING(size >= 0) (size).Text("a failed drain is in our table???");
-    if (size < 0) {
-      size = 0;
+    ssize_t ret = _real_recv(ds->fd, dst, len, MSG_DONTWAIT);
+    if (ret > 0) {
+      if (ds->bytesRecvd >= hdrLen) {
+        size_t stored = ds->bytesRecvd - hdrLen;
+        appendData(&ds->peerChunks, &stored, buf, ret);
+      }
+      ds->bytesRecvd += ret;
+      if (ds->bytesRecvd == hdrLen) {
+        ds->recvMsg.assertValid(ConnMsg::REFILL);
+        ds->peerSize = ds->recvMsg.extraBytes;
+        JTRACE("repeating buffer back to peer") (ds->fd) (ds->peerSize);
+      }
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      onRefillError(ds);
     }
+  }
+}
+
+void
+KernelBufferDrainer::updateRefillEvents(DrainedSocket *ds)
+{
+  const size_t hdrLen = sizeof(ds->recvMsg);
+  bool recvDone = ds->bytesRecvd >= hdrLen &&
+                  ds->bytesRecvd == hdrLen + ds->peerSize;
+  const char *buf;
+  size_t len;
+  struct epoll_event ev;
+
+  if (ds->done) {
+    return;
+  }
+  if (recvDone && ds->bytesSent == hdrLen + ds->size + ds->peerSize) {
+    onRefillComplete(ds);
+    return;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  if (!recvDone) {
+    ev.events |= EPOLLIN;
+  }
+  if (getRefillData(ds, &buf, &len)) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.ptr = ds;
+  JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_MOD, ds->fd, &ev) == 0)
+    (ds->fd) (JASSERT_ERRNO);
+}
+
+void
+KernelBufferDrainer::onRefillComplete(DrainedSocket *ds)
+{
+  JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_DEL, ds->fd, NULL) == 0)
+    (ds->fd) (JASSERT_ERRNO);
+
+  // Reset the send buffer
+  scaleSendBuffers(ds->fd, 0.5);
+  releaseChunks(ds);
+  ds->done = true;
+  _numPending--;
+}
+
+void
+KernelBufferDrainer::onRefillError(DrainedSocket *ds)
+{
+  JWARNING(false) (ds->fd) (ds->id) (ds->bytesSent) (ds->bytesRecvd)
+    (JASSERT_ERRNO)
+  .Text("Lost connection while refilling socket buffers");
+  onRefillComplete(ds);
+}
 
-    // Double the send buffer
-    scaleSendBuffers(i->first, 2);
-    ConnMsg msg(ConnMsg::REFILL);
-    msg.extraBytes = size;
-    jalib::JSocket sock(i->first);
-    if (size > 0) {
-      JTRACE("requesting repeat buffer...") (sock.sockfd()) (size);
+void
+KernelBufferDrainer::refillAllSockets()
+{
+  struct epoll_event events[DRAIN_MAX_EVENTS];
+  struct timespec start, lastWarning;
+  const int timeoutMs = (int)(DRAINER_CHECK_FREQ * 1000);
+  size_t bytesRefilled = 0;
+
+  JTRACE("refilling socket buffers") (_sockets.size());
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  lastWarning = start;
+
+  _epollFd = _real_epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(_epollFd != -1) (JASSERT_ERRNO);
+
+  _numPending = 0;
+  for (size_t i = 0; i < _sockets.size(); i++) {
+    DrainedSocket *ds = &_sockets[i];
+    if (ds->disconnected) {
+      continue;
     }
-    sock << msg;
-    if (size > 0) {
-      sock.writeAll(&i->second[0], size);
+
+    ds->done = false;
+    ds->bytesSent = 0;
+    ds->bytesRecvd = 0;
+    ds->peerSize = 0;
+    ds->sendMsg = ConnMsg(ConnMsg::REFILL);
+    ds->sendMsg.extraBytes = ds->size;
+    bytesRefilled += ds->size;
+    if (ds->size > 0) {
+      JTRACE("requesting repeat buffer...") (ds->fd) (ds->size);
     }
-    i->second.clear();
+
+    // Double the send buffer, so that the echoed data fits in the kernel
+    // buffers while the peer isn't reading.
+    scaleSendBuffers(ds->fd, 2);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = ds;
+    JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_ADD, ds->fd, &ev) == 0)
+      (ds->fd) (JASSERT_ERRNO);
+    _numPending++;
+
+    sendRefillData(ds);
+    updateRefillEvents(ds);
   }
 
-  // JTRACE("repeating our friends buffers...");
+  char *buf = (char *)JALLOC_HELPER_MALLOC(DRAIN_READ_SIZE);
+  JASSERT(buf != NULL);
+
+  while (_numPending > 0) {
+    int n = _real_epoll_wait(_epollFd, events, DRAIN_MAX_EVENTS, timeoutMs);
+
+    if (n == -1) {
+      JASSERT(errno == EINTR) (_numPending) (JASSERT_ERRNO)
+      .Text("epoll_wait failed");
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      DrainedSocket *ds = (DrainedSocket *)events[i].data.ptr;
 
-  // read all buffers in
-  for (i = _drainedData.begin(); i != _drainedData.end(); ++i) {
-    ConnMsg msg;
-    msg.poison();
-    jalib::JSocket sock(i->first);
-    sock >> msg;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        recvRefillData(ds, buf);
+      }
 
-    msg.assertValid(ConnMsg::REFILL);
-    int size = msg.extraBytes;
-    JTRACE("repeating buffer back to peer") (size);
-    if (size > 0) {
-      // echo it back...
-      jalib::JBuffer tmp(size);
-      sock.readAll(tmp, size);
-      sock.writeAll(tmp, size);
+      // Newly received data can be echoed right away.
+      sendRefillData(ds);
+      updateRefillEvents(ds);
     }
 
-    // Reset the send buffer
-    scaleSendBuffers(i->first, 0.5);
+    if (secondsSince(&lastWarning) >= DRAINER_WARNING_FREQ) {
+      clock_gettime(CLOCK_MONOTONIC, &lastWarning);
+      for (size_t i = 0; i < _sockets.size(); i++) {
+        DrainedSocket *ds = &_sockets[i];
+        JWARNING(ds->done) (ds->fd) (ds->bytesSent) (ds->bytesRecvd)
+          (ds->size) (ds->peerSize)
+        .Text("Still refilling socket buffers...");
+      }
+    }
   }
 
-  JTRACE("buffers refilled");
+  JALLOC_HELPER_FREE(buf);
+  _real_close(_epollFd);
+  _epollFd = -1;
+
+  JTRACE("buffers refilled") (bytesRefilled) (secondsSince(&start));
 
   // Free up the object
   delete theDrainer;
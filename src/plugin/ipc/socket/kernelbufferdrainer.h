@@ -23,31 +23,55 @@
 #ifndef KERNELBUFFERDRAINER_H
 # define KERNELBUFFERDRAINER_H
 
+# include <time.h>
 # include <map>
 # include <vector>
 
-# include "../jalib/jsocket.h"
 # include "connectionidentifier.h"
+# include "connectionmessage.h"
 # include "dmtcpalloc.h"
 
+// Drained data is kept in fixed-size chunks recycled through a per-drainer
+// pool, instead of in a vector<char> that is reallocated as it grows.
+# define DRAIN_CHUNK_SIZE (64 * 1024)
+
+// Each readable socket is drained with a single read of up to this size,
+// which normally empties the whole kernel receive buffer at once.
+# define DRAIN_READ_SIZE  (1024 * 1024)
+
+// Maximum number of events returned by one epoll_wait() call.
+# define DRAIN_MAX_EVENTS 256
+
 namespace dmtcp
 {
-class KernelBufferDrainer : public jalib::JMultiSocketProgram
+class KernelBufferDrainer
 {
   public:
-    KernelBufferDrainer() : _timeoutCount(0) {}
+# ifdef JALIB_ALLOCATOR
+    static void *operator new(size_t nbytes, void *p) { return p; }
+
+    static void *operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+
+    static void operator delete(void *p) { JALLOC_HELPER_DELETE(p); }
+# endif // ifdef JALIB_ALLOCATOR
+
+    KernelBufferDrainer();
+    ~KernelBufferDrainer();
 
     static KernelBufferDrainer &instance();
 
-    // void drainAllSockets();
     void beginDrainOf(int fd, const ConnectionIdentifier &id);
+    void addListenSocket(int fd);
+
+    // Blocks until the drain cookie has been read from every socket passed
+    // to beginDrainOf(), or the socket was found disconnected.
+    void drainAllSockets();
+
+    // Sends the drained data back through every socket at once: each side
+    // sends a REFILL header and its drained data, and echoes the data it
+    // receives from the peer, which lands in the peer's receive buffer.
+    // Blocks until this has completed on every socket.
     void refillAllSockets();
-    virtual void onData(jalib::JReaderInterface *sock);
-    virtual void onConnect(const jalib::JSocket &sock,
-                           const struct sockaddr *remoteAddr,
-                           socklen_t remoteLen);
-    virtual void onTimeoutInterval();
-    virtual void onDisconnect(jalib::JReaderInterface *sock);
 
     const map<ConnectionIdentifier,
               vector<char> > &getDisconnectedSockets() const
@@ -58,10 +82,68 @@ class KernelBufferDrainer : public jalib::JMultiSocketProgram
     const vector<char> &getDrainedData(ConnectionIdentifier id);
 
   private:
-    map<int, vector<char> >_drainedData;
-    map<int, ConnectionIdentifier>_reverseLookup;
+    struct DrainedSocket {
+      int fd;
+      bool isListen;
+      bool done;
+      bool disconnected;
+      size_t cookieBytesSent;
+      size_t size;
+      vector<char *>chunks;
+      ConnectionIdentifier id;
+
+      // Refill progress.  The outgoing stream is sendMsg, our drained data,
+      // then the peer's data; the incoming one is recvMsg then the peer's
+      // data.  Only the peer's data is read, so that the echo of our own
+      // data stays in the kernel buffer.
+      ConnMsg sendMsg;
+      ConnMsg recvMsg;
+      size_t bytesSent;
+      size_t bytesRecvd;
+      size_t peerSize;
+      vector<char *>peerChunks;
+    };
+
+    struct DrainStats {
+      size_t numSockets;
+      size_t numReads;
+      size_t bytesDrained;
+      double maxLatency; // seconds from start of drain to last cookie
+    };
+
+    char *getChunk();
+    void releaseChunks(DrainedSocket *ds);
+    void appendData(vector<char *> *chunks,
+                    size_t *size,
+                    const char *buf,
+                    size_t len);
+    bool removeCookie(DrainedSocket *ds);
+    void sendCookie(DrainedSocket *ds);
+    void readData(DrainedSocket *ds, char *buf);
+    void onConnect(DrainedSocket *ds);
+    void onDisconnect(DrainedSocket *ds);
+    void onDrainComplete(DrainedSocket *ds);
+    void onTimeoutInterval();
+    void updateEvents(DrainedSocket *ds);
+
+    bool getRefillData(DrainedSocket *ds, const char **buf, size_t *len);
+    void sendRefillData(DrainedSocket *ds);
+    void recvRefillData(DrainedSocket *ds, char *buf);
+    void updateRefillEvents(DrainedSocket *ds);
+    void onRefillComplete(DrainedSocket *ds);
+    void onRefillError(DrainedSocket *ds);
+
+    // Not modified once drainAllSockets() starts; the epoll events point
+    // into these arrays.
+    vector<DrainedSocket>_sockets;
+    vector<DrainedSocket>_listenSockets;
+    vector<char *>_chunkPool;
     map<ConnectionIdentifier, vector<char> >_disconnectedSockets;
+    size_t _numPending;
+    int _epollFd;
     int _timeoutCount;
+    struct timespec _startTime;
+    DrainStats _stats;
 };
 }
 #endif // ifndef KERNELBUFFERDRAINER_H
@@ -493,6 +493,108 @@ TcpConnection::recvPeerInformation()
   }
 }
 
+// Both ends of a connection must be saved the same way, since an end that
+// drains waits for a cookie that an end in repair mode never sends.  Each end
+// that saved the connection with TCP_REPAIR registers the addresses as it
+// sees them, and then looks for the peer under the same addresses swapped.
+struct TcpRepairPeerKey {
+  struct sockaddr_storage local;
+  struct sockaddr_storage remote;
+};
+
+// A socket in repair mode sends no data, but its kernel still acknowledges
+// data that arrives after the dump.  If the sender dumped after seeing such
+// an acknowledgement, that data is in neither snapshot, and the connection
+// is drained instead.
+struct TcpRepairPeerSeq {
+  uint32_t sendUna;     // First byte not acknowledged by the peer.
+  uint32_t recvNxt;     // First byte not received from the peer.
+};
+
+static void
+getTcpRepairPeerSeq(const TcpRepairState &state, TcpRepairPeerSeq *seq)
+{
+  seq->sendUna = state.sendSeq - state.sendQueue.size();
+  seq->recvNxt = state.recvSeq;
+}
+
+static bool
+isTcpRepairConsistent(const TcpRepairPeerSeq &local,
+                      const TcpRepairPeerSeq &remote)
+{
+  // Sequence numbers wrap around.
+  return (int32_t)(remote.sendUna - local.recvNxt) <= 0 &&
+         (int32_t)(local.sendUna - remote.recvNxt) <= 0;
+}
+
+static void
+makeTcpRepairPeerKey(TcpRepairPeerKey *key,
+                     const struct sockaddr_storage &local,
+                     socklen_t localLen,
+                     const struct sockaddr_storage &remote,
+                     socklen_t remoteLen)
+{
+  memset(key, 0, sizeof(*key));
+  memcpy(&key->local, &local, localLen);
+  memcpy(&key->remote, &remote, remoteLen);
+}
+
+void
+TcpConnection::dumpWithTcpRepair()
+{
+  TcpRepairPeerKey key;
+  TcpRepairPeerSeq val;
+
+  _tcpRepair.clear();
+  if ((_type != TCP_CONNECT && _type != TCP_ACCEPT) ||
+      dmtcp_no_coordinator() || !useTcpRepair()) {
+    return;
+  }
+
+  // On success, the socket stays in repair mode, sending nothing, until
+  // refill() after the checkpoint image is written.
+  if (!TcpRepair::dump(_fds[0], &_tcpRepair)) {
+    return;
+  }
+  makeTcpRepairPeerKey(&key,
+                       _tcpRepair.localAddr, _tcpRepair.localAddrLen,
+                       _tcpRepair.remoteAddr, _tcpRepair.remoteAddrLen);
+  getTcpRepairPeerSeq(_tcpRepair, &val);
+  dmtcp_send_key_val_pair_to_coordinator("TcpRepair",
+                                         &key, sizeof(key),
+                                         &val, sizeof(val));
+}
+
+void
+TcpConnection::agreeOnTcpRepair()
+{
+  TcpRepairPeerKey key;
+  TcpRepairPeerSeq local;
+  TcpRepairPeerSeq remote;
+  uint32_t vallen = sizeof(remote);
+
+  if (!_tcpRepair.valid) {
+    return;
+  }
+  makeTcpRepairPeerKey(&key,
+                       _tcpRepair.remoteAddr, _tcpRepair.remoteAddrLen,
+                       _tcpRepair.localAddr, _tcpRepair.localAddrLen);
+  getTcpRepairPeerSeq(_tcpRepair, &local);
+  if (dmtcp_send_query_to_coordinator("TcpRepair", &key, sizeof(key),
+                                      &remote, &vallen) != 0 &&
+      vallen == sizeof(remote) && isTcpRepairConsistent(local, remote)) {
+    JTRACE("Saved socket with TCP_REPAIR")
+      (_fds[0]) (_id) (_tcpRepair.sendQueue.size())
+      (_tcpRepair.recvQueue.size());
+    return;
+  }
+
+  JTRACE("Peer did not save the same state with TCP_REPAIR;"
+         " socket will be drained") (_fds[0]) (_id);
+  JWARNING(TcpRepair::finish(_fds[0])) (_fds[0]) (JASSERT_ERRNO);
+  _tcpRepair.clear();
+}
+
 void
 TcpConnection::onError()
 {
@@ -557,6 +659,10 @@ TcpConnection::drain()
   // might be some stale data on it.
   case TCP_CONNECT:
   case TCP_ACCEPT:
+    if (_tcpRepair.valid) {
+      // Saved by dumpWithTcpRepair(), and so is its peer.
+      break;
+    }
     JTRACE("Will drain socket") (_hasLock) (_fds[0]) (_id) (_remotePeerId);
     KernelBufferDrainer::instance().beginDrainOf(_fds[0], _id);
     break;
@@ -578,6 +684,10 @@ TcpConnection::drain()
 void
 TcpConnection::doSendHandshakes(const ConnectionIdentifier &coordId)
 {
+  if (_tcpRepair.valid) {
+    // The peer is not involved in restoring this connection.
+    return;
+  }
   switch (_type) {
   case TCP_CONNECT:
   case TCP_ACCEPT:
@@ -593,6 +703,9 @@ TcpConnection::doSendHandshakes(const ConnectionIdentifier &coordId)
 void
 TcpConnection::doRecvHandshakes(const ConnectionIdentifier &coordId)
 {
+  if (_tcpRepair.valid) {
+    return;
+  }
   switch (_type) {
   case TCP_CONNECT:
   case TCP_ACCEPT:
@@ -608,6 +721,15 @@ TcpConnection::doRecvHandshakes(const ConnectionIdentifier &coordId)
 void
 TcpConnection::refill(bool isRestart)
 {
+  if (_tcpRepair.valid) {
+    // The checkpoint image has been written, and on restart, every peer has
+    // restored its end of the connection.
+    if (_type != TCP_ERROR) {
+      JWARNING(TcpRepair::finish(_fds[0], isRestart ? &_tcpRepair : NULL))
+        (_fds[0]) (JASSERT_ERRNO);
+    }
+    _tcpRepair.clear();
+  }
   if ((_fcntlFlags & O_ASYNC) != 0) {
     JTRACE("Re-adding O_ASYNC flag.") (_fds[0]) (id());
     restoreSocketOptions(_fds);
@@ -617,12 +739,45 @@ TcpConnection::refill(bool isRestart)
   }
 }
 
+bool
+TcpConnection::useTcpRepair() const
+{
+  return (_sockDomain == AF_INET || _sockDomain == AF_INET6) &&
+         (_sockType & 077) == SOCK_STREAM &&
+         TcpRepair::isEnabled();
+}
+
+void
+TcpConnection::restoreWithTcpRepair()
+{
+  int fd = TcpRepair::restore(_tcpRepair, _sockDomain, _sockType,
+                              _sockProtocol);
+
+  if (fd == -1) {
+    JWARNING(false) (id()) (_fds[0])
+    .Text("Could not restore the connection with TCP_REPAIR;"
+          " it will be restored as a dead socket.");
+    _type = TCP_ERROR;
+    fd = _makeDeadSocket(_tcpRepair.recvQueue.empty() ? NULL
+                                                      : &_tcpRepair.recvQueue[0],
+                         _tcpRepair.recvQueue.size());
+  } else {
+    JTRACE("Restored socket with TCP_REPAIR") (id()) (_fds[0]);
+  }
+  Util::dupFds(fd, _fds);
+}
+
 void
 TcpConnection::postRestart()
 {
   int fd;
 
   JASSERT(_fds.size() > 0);
+  if (_tcpRepair.valid && (_type == TCP_CONNECT || _type == TCP_ACCEPT)) {
+    restoreWithTcpRepair();
+    return;
+  }
+
   switch (_type) {
   case TCP_PREEXISTING:
   case TCP_INVALID:
@@ -817,6 +972,7 @@ TcpConnection::serializeSubClass(jalib::JBinarySerializer &o)
 {
   JSERIALIZE_ASSERT_POINT("TcpConnection");
   o&_listenBacklog&_bindAddrlen&_bindAddr &_remotePeerId;
+  _tcpRepair.serialize(o);
   SocketConnection::serialize(o);
 }
 
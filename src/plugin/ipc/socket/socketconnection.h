@@ -36,6 +36,7 @@
 # include "jbuffer.h"
 
 # include "connection.h"
+# include "tcprepair.h"
 
 namespace dmtcp
 {
@@ -114,6 +115,11 @@ class TcpConnection : public Connection, public SocketConnection
 
     void recvPeerInformation();
 
+    // Saves the connection with TCP_REPAIR, and then keeps it saved that
+    // way only if its peer did too.
+    void dumpWithTcpRepair();
+    void agreeOnTcpRepair();
+
     // basic commands for updating state from wrappers
 
     /*onSocket*/
@@ -149,6 +155,12 @@ class TcpConnection : public Connection, public SocketConnection
 
   private:
     TcpConnection &asTcp();
+    bool useTcpRepair() const;
+    void restoreWithTcpRepair();
+
+    // Valid only if the connection was saved with TCP_REPAIR instead of
+    // being drained.
+    TcpRepairState _tcpRepair;
 };
 
 class RawSocketConnection : public Connection, public SocketConnection
@@ -54,6 +54,7 @@ SocketConnList::preCkptRegisterNSData()
     con->checkLocking();
     if (con->hasLock() && con->conType() == Connection::TCP) {
       ((TcpConnection *)con)->sendPeerInformation();
+      ((TcpConnection *)con)->dumpWithTcpRepair();
     }
   }
 }
@@ -65,6 +66,7 @@ SocketConnList::preCkptSendQueries()
     Connection *con = i->second;
     if (con->hasLock() && con->conType() == Connection::TCP) {
       ((TcpConnection *)con)->recvPeerInformation();
+      ((TcpConnection *)con)->agreeOnTcpRepair();
     }
   }
 }
@@ -76,7 +78,7 @@ SocketConnList::drain()
   ConnectionList::drain();
 
   // this will block until draining is complete
-  KernelBufferDrainer::instance().monitorSockets(DRAINER_CHECK_FREQ);
+  KernelBufferDrainer::instance().drainAllSockets();
 
   // handle disconnected sockets
   const map<ConnectionIdentifier, vector<char> > &discn =
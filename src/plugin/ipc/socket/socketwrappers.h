@@ -40,4 +40,9 @@
 # define _real_gethostbyname NEXT_FNC(gethostbyname)
 # define _real_gethostbyaddr NEXT_FNC(gethostbyaddr)
 # define _real_poll          NEXT_FNC(poll)
+# define _real_recv          NEXT_FNC(recv)
+# define _real_send          NEXT_FNC(send)
+# define _real_epoll_create1 NEXT_FNC(epoll_create1)
+# define _real_epoll_ctl     NEXT_FNC(epoll_ctl)
+# define _real_epoll_wait    NEXT_FNC(epoll_wait)
 #endif // SOCKET_WRAPPERS_H
@@ -0,0 +1,418 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2010 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#include <errno.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "jassert.h"
+#include "../../../constants.h" // Needed for ENV_VAR_TCP_REPAIR
+#include "ipc.h"
+#include "socketwrappers.h"
+#include "tcprepair.h"
+
+using namespace dmtcp;
+
+void
+TcpRepairState::clear()
+{
+  valid = 0;
+  sendSeq = recvSeq = 0;
+  mss = options = sndWscale = rcvWscale = timestamp = 0;
+  hasWindow = 0;
+  sendUnsent = 0;
+  sndWl1 = sndWnd = maxWindow = rcvWnd = rcvWup = 0;
+  localAddrLen = remoteAddrLen = 0;
+  memset(&localAddr, 0, sizeof(localAddr));
+  memset(&remoteAddr, 0, sizeof(remoteAddr));
+  sendQueue.clear();
+  recvQueue.clear();
+}
+
+static void
+serializeQueue(jalib::JBinarySerializer &o, vector<char> &queue)
+{
+  uint32_t len = queue.size();
+
+  o & len;
+  queue.resize(len);
+  if (len > 0) {
+    o.readOrWrite(&queue[0], len);
+  }
+}
+
+void
+TcpRepairState::serialize(jalib::JBinarySerializer &o)
+{
+  JSERIALIZE_ASSERT_POINT("TcpRepairState");
+  o & valid;
+  if (!valid) {
+    return;
+  }
+  o & sendSeq & recvSeq & mss & options & sndWscale & rcvWscale & timestamp;
+  o & hasWindow & sndWl1 & sndWnd & maxWindow & rcvWnd & rcvWup;
+  o & sendUnsent;
+  o & localAddrLen & remoteAddrLen & localAddr & remoteAddr;
+  serializeQueue(o, sendQueue);
+  serializeQueue(o, recvQueue);
+}
+
+#ifdef TCP_REPAIR
+static int
+setRepair(int fd, int val)
+{
+  return _real_setsockopt(fd, SOL_TCP, TCP_REPAIR, &val, sizeof(val));
+}
+
+static int
+setRepairQueue(int fd, int queue)
+{
+  return _real_setsockopt(fd, SOL_TCP, TCP_REPAIR_QUEUE, &queue, sizeof(queue));
+}
+
+// Read the contents of the selected queue without consuming it.
+static bool
+peekQueue(int fd, int queue, size_t len, uint32_t *seq, vector<char> *data)
+{
+  socklen_t optlen = sizeof(*seq);
+
+  if (setRepairQueue(fd, queue) != 0 ||
+      _real_getsockopt(fd, SOL_TCP, TCP_QUEUE_SEQ, seq, &optlen) != 0) {
+    return false;
+  }
+
+  data->resize(len);
+  if (len == 0) {
+    return true;
+  }
+  ssize_t ret = _real_recv(fd, &(*data)[0], len, MSG_PEEK | MSG_DONTWAIT);
+  return ret == (ssize_t)len;
+}
+
+// Write the first len bytes of data into the selected queue of a socket in
+// repair mode.
+static bool
+fillQueue(int fd, int queue, const vector<char> &data, size_t len)
+{
+  size_t off = 0;
+
+  if (setRepairQueue(fd, queue) != 0) {
+    return false;
+  }
+  while (off < len) {
+    ssize_t ret = _real_send(fd, &data[off], len - off, 0);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    off += ret;
+  }
+  return true;
+}
+
+static bool
+dumpRepairing(int fd, TcpRepairState *state)
+{
+  struct tcp_info info;
+  socklen_t optlen = sizeof(info);
+  int outq;
+  int inq;
+
+  if (_real_getsockopt(fd, SOL_TCP, TCP_INFO, &info, &optlen) != 0 ||
+      info.tcpi_state != TCP_ESTABLISHED) {
+    return false;
+  }
+
+  state->localAddrLen = sizeof(state->localAddr);
+  state->remoteAddrLen = sizeof(state->remoteAddr);
+  if (getsockname(fd, (struct sockaddr *)&state->localAddr,
+                  &state->localAddrLen) != 0 ||
+      getpeername(fd, (struct sockaddr *)&state->remoteAddr,
+                  &state->remoteAddrLen) != 0) {
+    return false;
+  }
+
+  if (ioctl(fd, SIOCOUTQ, &outq) != 0 || ioctl(fd, SIOCINQ, &inq) != 0) {
+    return false;
+  }
+
+  // The send queue holds data sent but not yet acknowledged, followed by
+  // data not sent yet.  Without SIOCOUTQNSD, all of it is restored as sent,
+  // and the peer gets the unsent part by retransmission.
+  int unsent = 0;
+# ifdef SIOCOUTQNSD
+  if (ioctl(fd, SIOCOUTQNSD, &unsent) != 0 || unsent < 0 || unsent > outq) {
+    return false;
+  }
+# endif // ifdef SIOCOUTQNSD
+  state->sendUnsent = unsent;
+  if (!peekQueue(fd, TCP_SEND_QUEUE, outq, &state->sendSeq,
+                 &state->sendQueue) ||
+      !peekQueue(fd, TCP_RECV_QUEUE, inq, &state->recvSeq,
+                 &state->recvQueue)) {
+    setRepairQueue(fd, TCP_NO_QUEUE);
+    return false;
+  }
+  setRepairQueue(fd, TCP_NO_QUEUE);
+
+  optlen = sizeof(state->mss);
+  if (_real_getsockopt(fd, SOL_TCP, TCP_MAXSEG, &state->mss, &optlen) != 0) {
+    return false;
+  }
+  state->options = info.tcpi_options;
+  state->sndWscale = info.tcpi_snd_wscale;
+  state->rcvWscale = info.tcpi_rcv_wscale;
+
+  if (state->options & TCPI_OPT_TIMESTAMPS) {
+    optlen = sizeof(state->timestamp);
+    if (_real_getsockopt(fd, SOL_TCP, TCP_TIMESTAMP, &state->timestamp,
+                         &optlen) != 0) {
+      return false;
+    }
+  }
+
+# ifdef TCP_REPAIR_WINDOW
+  struct tcp_repair_window window;
+  optlen = sizeof(window);
+  if (_real_getsockopt(fd, SOL_TCP, TCP_REPAIR_WINDOW, &window,
+                       &optlen) == 0) {
+    state->hasWindow = 1;
+    state->sndWl1 = window.snd_wl1;
+    state->sndWnd = window.snd_wnd;
+    state->maxWindow = window.max_window;
+    state->rcvWnd = window.rcv_wnd;
+    state->rcvWup = window.rcv_wup;
+  }
+# endif // ifdef TCP_REPAIR_WINDOW
+
+  state->valid = 1;
+  return true;
+}
+
+static bool
+restoreRepairing(int fd, const TcpRepairState &state)
+{
+  uint32_t seq;
+
+  // The sequence numbers are set before connect(); the queued data is
+  // written afterwards, which advances them to the dumped values.
+  if (state.sendUnsent > state.sendQueue.size()) {
+    return false;
+  }
+  seq = state.sendSeq - state.sendQueue.size();
+  if (setRepairQueue(fd, TCP_SEND_QUEUE) != 0 ||
+      _real_setsockopt(fd, SOL_TCP, TCP_QUEUE_SEQ, &seq, sizeof(seq)) != 0) {
+    return false;
+  }
+  seq = state.recvSeq - state.recvQueue.size();
+  if (setRepairQueue(fd, TCP_RECV_QUEUE) != 0 ||
+      _real_setsockopt(fd, SOL_TCP, TCP_QUEUE_SEQ, &seq, sizeof(seq)) != 0) {
+    return false;
+  }
+
+  // In repair mode, connect() doesn't send anything; it only sets up the
+  // connection with the given endpoints.  Repair mode also lets bind() reuse
+  // the port of a listening socket; setting SO_REUSEADDR would undo that.
+  if (_real_bind(fd, (struct sockaddr *)&state.localAddr,
+                 state.localAddrLen) != 0 ||
+      _real_connect(fd, (struct sockaddr *)&state.remoteAddr,
+                    state.remoteAddrLen) != 0) {
+    return false;
+  }
+
+  struct tcp_repair_opt opts[4];
+  int numOpts = 0;
+  opts[numOpts].opt_code = TCPOPT_MAXSEG;
+  opts[numOpts++].opt_val = state.mss;
+  if (state.options & TCPI_OPT_WSCALE) {
+    opts[numOpts].opt_code = TCPOPT_WINDOW;
+    opts[numOpts++].opt_val = state.sndWscale + (state.rcvWscale << 16);
+  }
+  if (state.options & TCPI_OPT_TIMESTAMPS) {
+    opts[numOpts].opt_code = TCPOPT_TIMESTAMP;
+    opts[numOpts++].opt_val = 0;
+  }
+  if (state.options & TCPI_OPT_SACK) {
+    opts[numOpts].opt_code = TCPOPT_SACK_PERMITTED;
+    opts[numOpts++].opt_val = 0;
+  }
+  if (_real_setsockopt(fd, SOL_TCP, TCP_REPAIR_OPTIONS, opts,
+                       numOpts * sizeof(opts[0])) != 0) {
+    return false;
+  }
+
+  if ((state.options & TCPI_OPT_TIMESTAMPS) &&
+      _real_setsockopt(fd, SOL_TCP, TCP_TIMESTAMP, &state.timestamp,
+                       sizeof(state.timestamp)) != 0) {
+    return false;
+  }
+
+
+  // Only the data that had been sent goes into the send queue now; finish()
+  // queues the rest.
+  if (!fillQueue(fd, TCP_RECV_QUEUE, state.recvQueue,
+                 state.recvQueue.size()) ||
+      !fillQueue(fd, TCP_SEND_QUEUE, state.sendQueue,
+                 state.sendQueue.size() - state.sendUnsent)) {
+    return false;
+  }
+  setRepairQueue(fd, TCP_NO_QUEUE);
+
+  // The kernel checks the window against rcv_nxt, which is only right once
+  // the receive queue has been refilled.
+# ifdef TCP_REPAIR_WINDOW
+  if (state.hasWindow) {
+    struct tcp_repair_window window;
+    window.snd_wl1 = state.sndWl1;
+    window.snd_wnd = state.sndWnd;
+    window.max_window = state.maxWindow;
+    window.rcv_wnd = state.rcvWnd;
+    window.rcv_wup = state.rcvWup;
+    JWARNING(_real_setsockopt(fd, SOL_TCP, TCP_REPAIR_WINDOW, &window,
+                              sizeof(window)) == 0) (fd) (JASSERT_ERRNO);
+  }
+# endif // ifdef TCP_REPAIR_WINDOW
+  return true;
+}
+#endif // ifdef TCP_REPAIR
+
+bool
+TcpRepair::isEnabled()
+{
+  static int enabled = -1;
+
+  if (enabled != -1) {
+    return enabled;
+  }
+
+  const char *env = getenv(ENV_VAR_TCP_REPAIR);
+  enabled = 0;
+  if (env == NULL || strcmp(env, "1") != 0) {
+    return enabled;
+  }
+
+#ifdef TCP_REPAIR
+  int fd = _real_socket(AF_INET, SOCK_STREAM, 0);
+  if (fd != -1) {
+    enabled = setRepair(fd, 1) == 0;
+    _real_close(fd);
+  }
+#endif // ifdef TCP_REPAIR
+  JWARNING(enabled) (JASSERT_ERRNO)
+  .Text("TCP_REPAIR is not available (it needs CAP_NET_ADMIN);"
+        " TCP sockets will be drained instead.");
+  return enabled;
+}
+
+bool
+TcpRepair::dump(int fd, TcpRepairState *state)
+{
+  state->clear();
+#ifdef TCP_REPAIR
+  if (setRepair(fd, 1) != 0) {
+    return false;
+  }
+  if (!dumpRepairing(fd, state)) {
+    JTRACE("TCP_REPAIR dump failed; socket will be drained") (fd);
+    JASSERT(setRepair(fd, 0) == 0) (fd) (JASSERT_ERRNO);
+    state->clear();
+    return false;
+  }
+  return true;
+#else // ifdef TCP_REPAIR
+  return false;
+#endif // ifdef TCP_REPAIR
+}
+
+int
+TcpRepair::restore(const TcpRepairState &state,
+                   int domain,
+                   int type,
+                   int protocol)
+{
+#ifdef TCP_REPAIR
+  int fd = _real_socket(domain, type, protocol);
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (setRepair(fd, 1) != 0 || !restoreRepairing(fd, state)) {
+    JWARNING(false) (fd) (JASSERT_ERRNO).Text("TCP_REPAIR restore failed");
+    _real_close(fd);
+    return -1;
+  }
+  return fd;
+#else // ifdef TCP_REPAIR
+  return -1;
+#endif // ifdef TCP_REPAIR
+}
+
+bool
+TcpRepair::finish(int fd, const TcpRepairState *restored)
+{
+#ifdef TCP_REPAIR
+  // Leaving repair mode sends a window probe, so the peer resumes sending
+  // where it left off and learns our current receive window.
+  if (setRepair(fd, 0) != 0) {
+    return false;
+  }
+  if (restored == NULL || restored->sendUnsent == 0) {
+    return true;
+  }
+
+  // The send buffer held this data at checkpoint time, so there is room for
+  // it once the peer acknowledges the data restored as sent.
+  size_t off = restored->sendQueue.size() - restored->sendUnsent;
+  while (off < restored->sendQueue.size()) {
+    ssize_t ret = _real_send(fd, &restored->sendQueue[off],
+                             restored->sendQueue.size() - off,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = { 0 };
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      int ready = _real_poll(&pfd, 1, 10 * 1000);
+      if (ready == 0 || (ready == -1 && errno != EINTR)) {
+        return false;
+      }
+      continue;
+    }
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    off += ret;
+  }
+  return true;
+#else // ifdef TCP_REPAIR
+  return false;
+#endif // ifdef TCP_REPAIR
+}
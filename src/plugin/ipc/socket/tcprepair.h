@@ -0,0 +1,99 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2010 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#pragma once
+#ifndef TCPREPAIR_H
+# define TCPREPAIR_H
+
+# include <stdint.h>
+# include <sys/socket.h>
+
+# include "jserialize.h"
+# include "dmtcpalloc.h"
+
+namespace dmtcp
+{
+// State of an established TCP connection, read with the socket in TCP_REPAIR
+// mode: both queues, their sequence numbers, the window and the options
+// negotiated at connect time.  It is enough to recreate the connection on
+// restart without any help from the peer.
+struct TcpRepairState {
+# ifdef JALIB_ALLOCATOR
+  static void *operator new(size_t nbytes, void *p) { return p; }
+
+  static void *operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+
+  static void operator delete(void *p) { JALLOC_HELPER_DELETE(p); }
+# endif // ifdef JALIB_ALLOCATOR
+
+  TcpRepairState() { clear(); }
+
+  void clear();
+  void serialize(jalib::JBinarySerializer &o);
+
+  int32_t valid;
+  uint32_t sendSeq;
+  uint32_t recvSeq;
+  uint32_t mss;
+  uint32_t options;     // TCPI_OPT_* flags
+  uint32_t sndWscale;
+  uint32_t rcvWscale;
+  uint32_t timestamp;
+  int32_t hasWindow;
+  uint32_t sndWl1;
+  uint32_t sndWnd;
+  uint32_t maxWindow;
+  uint32_t rcvWnd;
+  uint32_t rcvWup;
+  uint32_t sendUnsent;  // Bytes at the end of sendQueue never sent.
+  socklen_t localAddrLen;
+  socklen_t remoteAddrLen;
+  struct sockaddr_storage localAddr;
+  struct sockaddr_storage remoteAddr;
+  vector<char>sendQueue;
+  vector<char>recvQueue;
+};
+
+namespace TcpRepair
+{
+// True if DMTCP_TCP_REPAIR=1 and this process may put sockets into repair
+// mode (CAP_NET_ADMIN in its network namespace).
+bool isEnabled();
+
+// Snapshot an established connection.  On success, the socket stays in
+// repair mode, so that it sends nothing that the peer could take as newer
+// than the snapshot; call finish() once the checkpoint image is written.
+// Returns false if the socket can't be repaired; the caller should drain it.
+bool dump(int fd, TcpRepairState *state);
+
+// Recreate the connection described by state.  Returns the new fd, or -1.
+// The socket stays in repair mode, so that it sends nothing while the peer
+// may not have been restored yet.
+int restore(const TcpRepairState &state, int domain, int type, int protocol);
+
+// Take a dumped or restored socket out of repair mode.  After restore(), call
+// it only once the peer socket exists again, or the peer's kernel will answer
+// with a reset, and pass the restored state: the data that had never been
+// sent is queued only now, as if the application had just written it.
+bool finish(int fd, const TcpRepairState *restored = NULL);
+}
+}
+#endif // ifndef TCPREPAIR_H
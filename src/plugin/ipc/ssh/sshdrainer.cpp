@@ -6,6 +6,10 @@
 
 #define SOCKET_DRAIN_MAGIC_COOKIE_STR "[dmtcp{v0<DRAIN!"
 
+// Drain the ssh streams in large reads; a stream may hold up to a pipe's or a
+// socket's worth of data (64 KB or more) at checkpoint time.
+#define SSH_DRAIN_CHUNK_SIZE          (64 * 1024)
+
 using namespace dmtcp;
 
 const char theMagicDrainCookie[] = SOCKET_DRAIN_MAGIC_COOKIE_STR;
@@ -21,9 +25,8 @@ void
 SSHDrainer::onData(jalib::JReaderInterface *sock)
 {
   vector<char> &buffer = _drainedData[sock->socket().sockfd()];
-  buffer.resize(buffer.size() + sock->bytesRead());
-  int startIdx = buffer.size() - sock->bytesRead();
-  memcpy(&buffer[startIdx], sock->buffer(), sock->bytesRead());
+  buffer.insert(buffer.end(), sock->buffer(),
+                sock->buffer() + sock->bytesRead());
 
   // JTRACE("got buffer chunk") (sock->bytesRead());
   sock->reset();
@@ -101,7 +104,7 @@ SSHDrainer::beginDrainOf(int fd, int refillFd)
     // Need to relay the read data to the refillFd.
     _drainedData[fd]; // create buffer
     _refillFd[fd] = refillFd;
-    addDataSocket(new jalib::JChunkReader(fd, 512));
+    addDataSocket(new jalib::JChunkReader(fd, SSH_DRAIN_CHUNK_SIZE));
   }
 }
 
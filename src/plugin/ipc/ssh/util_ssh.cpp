@@ -1,17 +1,29 @@
 #include <assert.h>
-#include <poll.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/errno.h>
-#include <sys/fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <vector>
 
 #define MAX_BUFFER_SIZE (64 * 1024)
-
+#define MAX_SPLICE_SIZE (1024 * 1024)
+
+/* Each of stdin, stdout, and stderr is relayed between a pipe to or from the
+ * local child (ssh, or the remote command) and the corresponding stream of
+ * this process.  Since one end is always a pipe, the data is moved with
+ * splice(), without copying it through user space.  For the other end,
+ * splice() fails with EINVAL on a few file types (e.g. some terminals); the
+ * relay then falls back to read() and write() through a buffer.
+ *
+ * A relay waits for its input to become readable, and then moves as much as
+ * the output takes.  If the output is full, it waits for the output to become
+ * writable instead.  Data that has not been relayed stays in the pipes and
+ * sockets, where the checkpoint drains it.
+ */
 struct Buffer {
   char *buf;
   int off;
@@ -19,15 +31,28 @@ struct Buffer {
   int len;
 };
 
+struct Relay {
+  int in;
+  int out;
+  bool useSplice;
+  bool blocked;       // Waiting for 'out' to become writable.
+  bool eof;           // 'in' reached end-of-file.
+  bool done;          // ... and everything read from it was written.
+  bool closeOut;      // Close 'out' when done, to pass on the end-of-file.
+  bool inPollable;    // False for files and /dev/null, which epoll rejects.
+  bool outPollable;
+  struct Buffer buffer;
+};
+
 static void buffer_init(struct Buffer *buf);
 static void buffer_free(struct Buffer *buf);
-static void buffer_read(struct Buffer *buf, int fd);
+static bool buffer_read(struct Buffer *buf, int fd);
 static void buffer_write(struct Buffer *buf, int fd);
 
 int quit_pending = 0;
 pid_t childPid = -1;
 int remoteSock;
-static struct Buffer stdin_buffer, stdout_buffer, stderr_buffer;
+static struct Relay stdin_relay, stdout_relay, stderr_relay;
 
 static void
 buffer_init(struct Buffer *buf)
@@ -56,14 +81,8 @@ buffer_readjust(struct Buffer *buf)
   buf->off = 0;
 }
 
+// Returns false on end-of-file or error.
 static bool
-buffer_ready_for_read(struct Buffer *buf)
-{
-  assert(buf->buf != NULL && buf->len != 0);
-  return buf->end < buf->len - 1;
-}
-
-static void
 buffer_read(struct Buffer *buf, int fd)
 {
   assert(buf->buf != NULL && buf->len != 0);
@@ -71,19 +90,21 @@ buffer_read(struct Buffer *buf, int fd)
   if (buf->end < buf->len) {
     size_t max = buf->len - buf->end;
     ssize_t rc = read(fd, &buf->buf[buf->end], max);
-    if (rc == 0 || (rc == -1 && errno != EINTR)) {
-      quit_pending = 1;
-      return;
+    if (rc == -1 && (errno == EINTR || errno == EAGAIN)) {
+      return true;
+    }
+    if (rc == 0 || rc == -1) {
+      return false;
     }
     buf->end += rc;
   }
+  return true;
 }
 
 static bool
 buffer_ready_for_write(struct Buffer *buf)
 {
-  assert(buf->buf != NULL && buf->len != 0);
-  return buf->end > buf->off;
+  return buf->buf != NULL && buf->end > buf->off;
 }
 
 static void
@@ -94,7 +115,10 @@ buffer_write(struct Buffer *buf, int fd)
   assert(buf->end > buf->off);
   size_t max = buf->end - buf->off;
   ssize_t rc = write(fd, &buf->buf[buf->off], max);
-  if (rc == -1 && errno != EINTR) {
+  if (rc == -1 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+  if (rc == -1) {
     quit_pending = 1;
     return;
   }
@@ -133,20 +157,162 @@ signal_handler(int sig)
   }
 }
 
+static void
+relay_init(struct Relay *relay, int in, int out, bool closeOut)
+{
+  relay->in = in;
+  relay->out = out;
+  relay->useSplice = true;
+  relay->blocked = false;
+  relay->eof = false;
+  relay->done = false;
+  relay->closeOut = closeOut;
+  relay->inPollable = true;
+  relay->outPollable = true;
+  relay->buffer.buf = NULL;
+  relay->buffer.len = 0;
+}
+
+/* Moves the available data from relay->in to relay->out, and then waits for
+ * whichever end is needed to move more.
+ */
+static void
+relay_transfer(struct Relay *relay)
+{
+  if (relay->useSplice) {
+    ssize_t rc = splice(relay->in, NULL, relay->out, NULL, MAX_SPLICE_SIZE,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rc > 0) {
+      relay->blocked = false;
+      return;
+    }
+    if (rc == 0) {
+      relay->eof = true;
+      relay->done = true;
+      return;
+    }
+    if (errno == EINTR) {
+      return;
+    }
+    if (errno == EAGAIN) {
+      // We were woken by one end; so it is the other one that is not ready.
+      relay->blocked = !relay->blocked;
+      return;
+    }
+    if (errno != EINVAL) {
+      quit_pending = 1;
+      return;
+    }
+    relay->useSplice = false;
+    buffer_init(&relay->buffer);
+  }
+
+  if (!relay->blocked && !relay->eof &&
+      !buffer_read(&relay->buffer, relay->in)) {
+    // End-of-file (or an error) on relay->in; keep relaying the others.
+    relay->eof = true;
+  }
+  if (buffer_ready_for_write(&relay->buffer)) {
+    buffer_write(&relay->buffer, relay->out);
+  }
+  relay->blocked = buffer_ready_for_write(&relay->buffer);
+
+  // The rest of the buffer is written first, waiting on relay->out.
+  if (relay->eof && !relay->blocked) {
+    relay->done = true;
+  }
+}
+
+/* Watches only the end that the relay waits for; epoll reports EPOLLHUP and
+ * EPOLLERR even for an fd with no events requested, which would wake the
+ * relay for the wrong end.
+ */
+static void
+relay_watch(int epfd, struct Relay *relay, int op, bool blocked)
+{
+  struct epoll_event ev;
+  int fd = blocked ? relay->out : relay->in;
+
+  if (blocked ? !relay->outPollable : !relay->inPollable) {
+    return;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = blocked ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = relay;
+  epoll_ctl(epfd, op, fd, &ev);
+}
+
+static bool
+is_pollable(int epfd, int fd)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    if (errno != EPERM) {
+      perror("epoll_ctl failed");
+    }
+    return false;
+  }
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  return true;
+}
+
+static void
+relay_register(int epfd, struct Relay *relay)
+{
+  relay->inPollable = is_pollable(epfd, relay->in);
+  relay->outPollable = is_pollable(epfd, relay->out);
+  relay_watch(epfd, relay, EPOLL_CTL_ADD, relay->blocked);
+}
+
+static void
+relay_update(int epfd, struct Relay *relay, bool wasBlocked)
+{
+  if (relay->done || relay->blocked != wasBlocked) {
+    relay_watch(epfd, relay, EPOLL_CTL_DEL, wasBlocked);
+    if (!relay->done) {
+      relay_watch(epfd, relay, EPOLL_CTL_ADD, relay->blocked);
+    }
+  }
+}
+
+/* True if the end that the relay waits for cannot be watched by epoll, and
+ * must be tried on every iteration.
+ */
+static bool
+relay_always_ready(struct Relay *relay)
+{
+  if (relay->done) {
+    return false;
+  }
+  return relay->blocked ? !relay->outPollable : !relay->inPollable;
+}
+
 void
 client_loop(int ssh_stdin, int ssh_stdout, int ssh_stderr, int sock)
 {
+  struct Relay *relays[] = { &stdin_relay, &stdout_relay, &stderr_relay };
+  const int numRelays = sizeof(relays) / sizeof(relays[0]);
+  struct epoll_event events[numRelays * 2 + 1];
+  struct epoll_event ev;
+  int epfd;
+
   remoteSock = sock;
 
-  /* Initialize buffers. */
-  buffer_init(&stdin_buffer);
-  buffer_init(&stdout_buffer);
-  buffer_init(&stderr_buffer);
+  // The remote command sees the end of its stdin only when ssh_stdin is
+  // closed.
+  relay_init(&stdin_relay, STDIN_FILENO, ssh_stdin, true);
+  relay_init(&stdout_relay, ssh_stdout, STDOUT_FILENO, false);
+  relay_init(&stderr_relay, ssh_stderr, STDERR_FILENO, false);
 
   /* enable nonblocking unless tty */
   set_nonblock(fileno(stdin));
   set_nonblock(fileno(stdout));
   set_nonblock(fileno(stderr));
+  set_nonblock(ssh_stdin);
+  set_nonblock(ssh_stdout);
+  set_nonblock(ssh_stderr);
 
   /*
    * Set signal handlers, (e.g. to restore non-blocking mode)
@@ -167,109 +333,88 @@ client_loop(int ssh_stdin, int ssh_stdout, int ssh_stderr, int sock)
 
   // signal(SIGWINCH, window_change_handler);
 
-  std::vector<struct pollfd>fds;
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    perror("epoll_create1 failed");
+    return;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLRDHUP;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, remoteSock, &ev) == -1) {
+    perror("epoll_ctl failed");
+  }
+  for (int i = 0; i < numRelays; i++) {
+    relay_register(epfd, relays[i]);
+  }
 
   /* Main loop of the client for the interactive session mode. */
-  while (!quit_pending) {
-    struct pollfd socketFd = { 0 };
-
-    fds.clear();
-    socketFd.fd = remoteSock;
-    socketFd.events = POLLRDHUP;
-    fds.push_back(socketFd);
-
-    if (buffer_ready_for_read(&stdin_buffer)) {
-      socketFd.fd = STDIN_FILENO;
-      socketFd.events = POLLIN;
-      fds.push_back(socketFd);
-    }
-    if (buffer_ready_for_read(&stdout_buffer)) {
-      socketFd.fd = ssh_stdout;
-      socketFd.events = POLLIN;
-      fds.push_back(socketFd);
-    }
-    if (buffer_ready_for_read(&stderr_buffer)) {
-      socketFd.fd = ssh_stderr;
-      socketFd.events = POLLIN;
-      fds.push_back(socketFd);
-    }
-
-    if (buffer_ready_for_write(&stdin_buffer)) {
-      socketFd.fd = ssh_stdin;
-      socketFd.events = POLLOUT;
-      fds.push_back(socketFd);
-    }
-    if (buffer_ready_for_write(&stdout_buffer)) {
-      socketFd.fd = STDOUT_FILENO;
-      socketFd.events = POLLOUT;
-      fds.push_back(socketFd);
-    }
-    if (buffer_ready_for_write(&stderr_buffer)) {
-      socketFd.fd = STDERR_FILENO;
-      socketFd.events = POLLOUT;
-      fds.push_back(socketFd);
+  while (!quit_pending && !(stdout_relay.done && stderr_relay.done)) {
+    int timeout = 10 * 1000;
+    for (int i = 0; i < numRelays; i++) {
+      if (relay_always_ready(relays[i])) {
+        timeout = 0;
+      }
     }
 
-    int ret = poll((struct pollfd *)&fds[0], fds.size(), 10 * 1000);
+    int ret = epoll_wait(epfd, events, numRelays * 2 + 1, timeout);
     if (ret == -1 && errno == EINTR) {
       continue;
     }
     if (ret == -1) {
-      perror("poll failed");
-      return;
+      perror("epoll_wait failed");
+      break;
     }
 
     if (quit_pending) {
       break;
     }
 
-    std::vector<struct pollfd>::iterator it;
-    for (it = fds.begin(); it != fds.end(); it++) {
-      // Read from our STDIN or stdout/err of ssh
-      if (it->fd == STDIN_FILENO && it->revents & POLLIN) {
-        buffer_read(&stdin_buffer, STDIN_FILENO);
-      }
-      if (it->fd == ssh_stdout && it->revents & POLLIN) {
-        buffer_read(&stdout_buffer, ssh_stdout);
-      }
-      if (it->fd == ssh_stderr && it->revents & POLLIN) {
-        buffer_read(&stderr_buffer, ssh_stderr);
-      }
-
-      // Write to our stdout/err or stdin of ssh
-      if (it->fd == ssh_stdin && it->revents & POLLOUT) {
-        buffer_write(&stdin_buffer, ssh_stdin);
-      }
-      if (it->fd == STDOUT_FILENO && it->revents & POLLOUT) {
-        buffer_write(&stdout_buffer, STDOUT_FILENO);
-      }
-      if (it->fd == STDERR_FILENO && it->revents & POLLOUT) {
-        buffer_write(&stderr_buffer, STDERR_FILENO);
+    bool ready[numRelays];
+    for (int i = 0; i < numRelays; i++) {
+      ready[i] = relay_always_ready(relays[i]);
+    }
+    for (int i = 0; i < ret; i++) {
+      if (events[i].data.ptr == NULL) {
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+          goto end;
+        }
+        continue;
       }
-
-      if (it->fd == remoteSock &&
-          (it->revents & (POLLHUP | POLLERR | POLLNVAL))) {
-        goto end;
+      for (int j = 0; j < numRelays; j++) {
+        if (events[i].data.ptr == relays[j]) {
+          ready[j] = true;
+        }
       }
     }
 
-    if (quit_pending) {
-      break;
+    for (int i = 0; i < numRelays; i++) {
+      if (ready[i] && !relays[i]->done) {
+        bool wasBlocked = relays[i]->blocked;
+        relay_transfer(relays[i]);
+        relay_update(epfd, relays[i], wasBlocked);
+        if (relays[i]->done && relays[i]->closeOut) {
+          close(relays[i]->out);
+        }
+      }
     }
   }
 
 end:
 
   /* Write pending data to our stdout/stderr */
-  if (buffer_ready_for_write(&stdout_buffer)) {
-    buffer_write(&stdout_buffer, STDOUT_FILENO);
+  if (buffer_ready_for_write(&stdout_relay.buffer)) {
+    buffer_write(&stdout_relay.buffer, STDOUT_FILENO);
   }
-  if (buffer_ready_for_write(&stderr_buffer)) {
-    buffer_write(&stderr_buffer, STDERR_FILENO);
+  if (buffer_ready_for_write(&stderr_relay.buffer)) {
+    buffer_write(&stderr_relay.buffer, STDERR_FILENO);
   }
 
   /* Clear and free any buffers. */
-  buffer_free(&stdin_buffer);
-  buffer_free(&stdout_buffer);
-  buffer_free(&stderr_buffer);
+  for (int i = 0; i < numRelays; i++) {
+    if (relays[i]->buffer.buf != NULL) {
+      buffer_free(&relays[i]->buffer);
+    }
+  }
+  close(epfd);
 }
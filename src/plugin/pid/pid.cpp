@@ -106,6 +106,7 @@ pidVirt_PrepareForExec(DmtcpEventData_t *data)
 
   JASSERT(data != NULL);
   jalib::JBinarySerializeWriterRaw wr("", data->serializerInfo.fd);
+  wr.setBuffered(true);
   VirtualPidTable::instance().serialize(wr);
 }
 
@@ -114,6 +115,7 @@ pidVirt_PostExec(DmtcpEventData_t *data)
 {
   JASSERT(data != NULL);
   jalib::JBinarySerializeReaderRaw rd("", data->serializerInfo.fd);
+  rd.setBuffered(true);
   VirtualPidTable::instance().serialize(rd);
   VirtualPidTable::instance().refresh();
 }
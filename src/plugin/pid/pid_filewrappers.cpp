@@ -37,6 +37,7 @@
 #define readlink readlink_always_inline
 #define realpath realpath_always_inline
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -53,45 +54,137 @@
 #include "dmtcp.h"
 #include "pid.h"
 #include "pidwrappers.h"
+#include "shareddata.h"
 #include "util.h"
 #include "virtualpidtable.h"
 
-#define PROC_PREFIX "/proc/"
+#define PROC_PREFIX     "/proc/"
+#define PROC_PREFIX_LEN (sizeof(PROC_PREFIX) - 1)
+
+// Number of entries in each thread's cache of /proc/<pid> translations.  Must
+// be a power of two.
+#define PROC_PID_CACHE_SIZE 8
 
 using namespace dmtcp;
 
-// FIXME:  This function needs third argument newpathsize, or assume PATH_MAX
+/* A cached translation of a virtual pid, valid while neither this process's
+ * pid table nor the node-wide pid map in SharedData changed since.
+ */
+struct ProcPidCacheEntry {
+  pid_t virtualPid;
+  pid_t realPid;
+  uint32_t tableSeq;
+  uint32_t mapVersion;
+};
+
+static __thread ProcPidCacheEntry procPidCache[PROC_PID_CACHE_SIZE];
+
+/* Returns the pid in a path of the form /proc/<pid>[/...], and sets *rest to
+ * the rest of the path, or returns 0 (also if <pid> does not fit in a
+ * pid_t).  Wrappers call this for every path, so that most paths are
+ * rejected by the first few bytes.
+ */
+static inline pid_t
+procPathPid(const char *path, const char **rest)
+{
+  if (path == NULL || path[0] != '/' || path[1] != 'p' ||
+      strncmp(path, PROC_PREFIX, PROC_PREFIX_LEN) != 0) {
+    return 0;
+  }
+
+  const char *p = path + PROC_PREFIX_LEN;
+  if (*p < '1' || *p > '9') {
+    return 0;
+  }
+  // Accumulate in a long and give up past INT_MAX, so that a long run of
+  // digits cannot overflow; no pid is that large.
+  long pid = 0;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    pid = pid * 10 + (*p - '0');
+    if (pid > INT_MAX) {
+      return 0;
+    }
+  }
+  *rest = p;
+  return (pid_t)pid;
+}
+
+static pid_t
+cachedVirtualToRealPid(pid_t virtualPid)
+{
+  ProcPidCacheEntry *entry =
+    &procPidCache[virtualPid & (PROC_PID_CACHE_SIZE - 1)];
+  uint32_t tableSeq = VirtualPidTable::instance().sequence();
+  uint32_t mapVersion = SharedData::getPidMapVersion();
+
+  if (entry->virtualPid == virtualPid && entry->tableSeq == tableSeq &&
+      entry->mapVersion == mapVersion && (tableSeq & 1) == 0) {
+    return entry->realPid;
+  }
+
+  pid_t realPid = VIRTUAL_TO_REAL_PID(virtualPid);
+  entry->virtualPid = virtualPid;
+  entry->realPid = realPid;
+  entry->tableSeq = tableSeq;
+  entry->mapVersion = mapVersion;
+  return realPid;
+}
+
+// Writes "/proc/<pid><rest>" to buf.  Returns false if it does not fit.
+static bool
+formatProcPath(char *buf, size_t size, pid_t pid, const char *rest)
+{
+  char digits[16];
+  size_t numDigits = 0;
+
+  do {
+    digits[numDigits++] = '0' + pid % 10;
+    pid /= 10;
+  } while (pid > 0);
+
+  size_t restLen = strlen(rest);
+  if (PROC_PREFIX_LEN + numDigits + restLen >= size) {
+    return false;
+  }
+  memcpy(buf, PROC_PREFIX, PROC_PREFIX_LEN);
+  buf += PROC_PREFIX_LEN;
+  while (numDigits > 0) {
+    *buf++ = digits[--numDigits];
+  }
+  memcpy(buf, rest, restLen + 1);
+  return true;
+}
+
+/* Sets *newpath to path, with the virtual pid in a /proc/<pid> path replaced
+ * by the real one.  *newpath must point to a buffer of PATH_MAX bytes, which
+ * is only written if the pids differ; otherwise, *newpath is set to path.
+ */
 static void
 updateProcPathVirtualToReal(const char *path, char **newpath)
 {
-  if (Util::strStartsWith(path, PROC_PREFIX)) {
-    int index = strlen(PROC_PREFIX);
-    char *rest;
-    pid_t virtualPid = strtol(&path[index], &rest, 0);
-    // WAS: if (realPid > 0 && *rest == '/')
-    // Removing the "*rest ..." check to handle /proc/<pid>
-    if (virtualPid > 0) {
-      pid_t realPid = VIRTUAL_TO_REAL_PID(virtualPid);
-      sprintf(*newpath, "/proc/%d%s", realPid, rest);
+  const char *rest;
+  pid_t virtualPid = procPathPid(path, &rest);
+
+  if (virtualPid > 0) {
+    pid_t realPid = cachedVirtualToRealPid(virtualPid);
+    if (realPid != virtualPid &&
+        formatProcPath(*newpath, PATH_MAX, realPid, rest)) {
       return;
     }
   }
   *newpath = (char *)path;
 }
 
-// FIXME:  This function needs third argument newpathsize, or assume PATH_MAX
 static void
 updateProcPathRealToVirtual(const char *path, char **newpath)
 {
-  if (Util::strStartsWith(path, PROC_PREFIX)) {
-    int index = strlen(PROC_PREFIX);
-    char *rest;
-    pid_t realPid = strtol(&path[index], &rest, 0);
-    // WAS: if (realPid > 0 && *rest == '/')
-    // Removing the "*rest ..." check to handle /proc/<pid>
-    if (realPid > 0) {
-      pid_t virtualPid = REAL_TO_VIRTUAL_PID(realPid);
-      sprintf(*newpath, "/proc/%d%s", virtualPid, rest);
+  const char *rest;
+  pid_t realPid = procPathPid(path, &rest);
+
+  if (realPid > 0) {
+    pid_t virtualPid = REAL_TO_VIRTUAL_PID(realPid);
+    if (virtualPid != realPid &&
+        formatProcPath(*newpath, PATH_MAX, virtualPid, rest)) {
       return;
     }
   }
@@ -304,7 +397,9 @@ extern "C" char *realpath(const char *path, char *resolved_path)
   char *retval = NEXT_FNC_DEFAULT(realpath) (newpath, resolved_path);
   if (retval != NULL) {
     updateProcPathRealToVirtual(retval, &newpath);
-    strcpy(retval, newpath);
+    if (newpath != retval) {
+      strcpy(retval, newpath);
+    }
   }
   return retval;
 }
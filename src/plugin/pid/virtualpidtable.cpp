@@ -61,7 +61,7 @@ VirtualPidTable::postRestart()
 {
   VirtualIdTable<pid_t>::postRestart();
   _do_lock_tbl();
-  _idMapTable[getpid()] = _real_getpid();
+  _addMappingLocked(getpid(), _real_getpid());
   _do_unlock_tbl();
 }
 
@@ -69,19 +69,21 @@ void
 VirtualPidTable::refresh()
 {
   id_iterator i;
-  id_iterator next;
+  vector<pid_t> staleIds;
   pid_t _real_pid = _real_getpid();
 
   JASSERT(getpid() != -1);
 
   _do_lock_tbl();
-  for (i = _idMapTable.begin(), next = i; i != _idMapTable.end(); i = next) {
-    next++;
+  for (i = _idMapTable.begin(); i != _idMapTable.end(); ++i) {
     if (isIdCreatedByCurrentProcess(i->second)
         && _real_tgkill(_real_pid, i->second, 0) == -1) {
-      _idMapTable.erase(i);
+      staleIds.push_back(i->first);
     }
   }
+  for (size_t j = 0; j < staleIds.size(); j++) {
+    _eraseMappingLocked(staleIds[j]);
+  }
   _do_unlock_tbl();
   printMaps();
 }
@@ -106,7 +108,9 @@ VirtualPidTable::resetOnFork()
 {
   VirtualIdTable<pid_t>::resetOnFork(getpid());
   _numTids = 1;
-  _idMapTable[getpid()] = _real_getpid();
+  _do_lock_tbl();
+  _addMappingLocked(getpid(), _real_getpid());
+  _do_unlock_tbl();
   refresh();
   printMaps();
 }
@@ -116,7 +120,7 @@ VirtualPidTable::updateMapping(pid_t virtualId, pid_t realId)
 {
   if (virtualId > 0 && realId > 0) {
     _do_lock_tbl();
-    _idMapTable[virtualId] = realId;
+    _addMappingLocked(virtualId, realId);
     _do_unlock_tbl();
   }
 }
@@ -22,7 +22,9 @@
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/msg.h>
 #include <sys/sem.h>
+#include <time.h>
 #include <unistd.h>
 #include <fstream>
 #include <ios>
@@ -35,6 +37,7 @@
 #include "jserialize.h"
 #include "config.h"
 #include "dmtcp.h"
+#include "procselfmaps.h"
 #include "shareddata.h"
 #include "util.h"
 
@@ -48,11 +51,10 @@ using namespace dmtcp;
 /*
  * Algorithm for properly checkpointing shared memory segments.
  *  1. BARRIER -- SUSPENDED
- *  2. Call shmat() and shmdt() for each shm-object. This way the last process
- *     to call shmdt() is elected as the ckptLeader.
+ *  2. Each process claims each shm-object in the node-wide SharedData area.
+ *     The first process to claim an object is elected as the ckptLeader.
  *  3. BARRIER -- LOCKED
- *  4. Each process marks itself as ckptLeader if it was elected ckptLeader.
- *     If the ckptLeader doesn't have the shm object mapped, map it now.
+ *  4. If the ckptLeader doesn't have the shm object mapped, map it now.
  *  6. BARRIER -- DRAINED
  *  7. For each shm-object, the ckptLeader unmaps all-but-first shmat() address.
  *  8. Non ckptLeader processes unmap all shmat() addresses corresponding to
@@ -89,6 +91,10 @@ using namespace dmtcp;
 /* TODO: Handle the case when the segment is marked for removal at ckpt time.
  */
 
+#ifndef MSG_COPY
+# define MSG_COPY 040000
+#endif // ifndef MSG_COPY
+
 static pthread_mutex_t tblLock = PTHREAD_MUTEX_INITIALIZER;
 
 static void
@@ -168,6 +174,7 @@ sysvipc_event_hook(DmtcpEvent_t event, DmtcpEventData_t *data)
   case DMTCP_EVENT_PRE_EXEC:
   {
     jalib::JBinarySerializeWriterRaw wr("", data->serializerInfo.fd);
+    wr.setBuffered(true);
     SysVShm::instance().serialize(wr);
     SysVSem::instance().serialize(wr);
     SysVMsq::instance().serialize(wr);
@@ -177,6 +184,7 @@ sysvipc_event_hook(DmtcpEvent_t event, DmtcpEventData_t *data)
   case DMTCP_EVENT_POST_EXEC:
   {
     jalib::JBinarySerializeReaderRaw rd("", data->serializerInfo.fd);
+    rd.setBuffered(true);
     SysVShm::instance().serialize(rd);
     SysVSem::instance().serialize(rd);
     SysVMsq::instance().serialize(rd);
@@ -333,7 +341,19 @@ SysVIPC::leaderElection()
   /* Remove all invalid/removed shm segments*/
   removeStaleObjects();
 
-  for (Iterator i = _map.begin(); i != _map.end(); ++i) {
+  if (_map.empty()) {
+    return;
+  }
+
+  // The first process to claim an object saves it.  Start claiming at a
+  // different object in each process, so that the objects shared by many
+  // processes, and the work of saving them, are spread over the processes.
+  Iterator start = _map.begin();
+  std::advance(start, getpid() % _map.size());
+  for (Iterator i = start; i != _map.end(); ++i) {
+    i->second->leaderElection();
+  }
+  for (Iterator i = _map.begin(); i != start; ++i) {
     i->second->leaderElection();
   }
 }
@@ -558,6 +578,43 @@ SysVSem::on_semop(int semid, struct sembuf *sops, unsigned nsops)
 /*
  * Message Queue
  */
+void
+SysVMsq::preCheckpoint()
+{
+  struct timespec start, end;
+  size_t numQueues = 0;
+  size_t numMessages = 0;
+  size_t numBytes = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  SysVIPC::preCheckpoint();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (Iterator i = _map.begin(); i != _map.end(); ++i) {
+    MsgQueue *msq = (MsgQueue *)i->second;
+    if (msq->isCkptLeader()) {
+      numQueues++;
+      numMessages += msq->numSavedMessages();
+      numBytes += msq->numSavedBytes();
+    }
+  }
+  double seconds = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1e9;
+  JTRACE("Saved SysV message queues")
+    (numQueues) (numMessages) (numBytes) (seconds);
+
+#ifdef TIMING
+  if (numQueues > 0) {
+    char logFilename[5000] = { 0 };
+    snprintf(logFilename, sizeof(logFilename), "%s/timings.%s.csv",
+             dmtcp_get_ckpt_dir(), dmtcp_get_uniquepid_str());
+    std::ofstream lfile(logFilename, std::ios::out | std::ios::app);
+    lfile << "SysV msq save," << seconds << ','
+          << numQueues << ',' << numMessages << ',' << numBytes << std::endl;
+  }
+#endif // ifdef TIMING
+}
+
 void
 SysVMsq::on_msgget(int msqid, key_t key, int msgflg)
 {
@@ -683,31 +740,18 @@ ShmSegment::isStale()
 void
 ShmSegment::leaderElection()
 {
-  /* We attach and detach to the shmid object to set the shm_lpid to our pid.
-   * The process who calls the last shmdt() is declared the leader.
-   */
-  void *addr = _real_shmat(_realId, NULL, 0);
-
-  JASSERT(addr != (void *)-1) (_id) (JASSERT_ERRNO)
-  .Text("_real_shmat() failed");
-
-  JASSERT(_real_shmdt(addr) == 0) (_id) (addr) (JASSERT_ERRNO);
+  _isCkptLeader = SharedData::electSysVLeader(SYSV_SHM_ID, _realId,
+                                              dmtcp_get_uniquepid());
 }
 
 void
 ShmSegment::preCkptDrain()
 {
-  struct shmid_ds info;
-
-  JASSERT(_real_shmctl(_realId, IPC_STAT, &info) != -1);
-
   /* If we are the ckptLeader for this object, map it now, if not mapped already.
    */
   _dmtcpMappedAddr = false;
-  _isCkptLeader = false;
 
-  if (info.shm_lpid == getpid()) {
-    _isCkptLeader = true;
+  if (_isCkptLeader) {
     if (_shmaddrToFlag.size() == 0) {
       void *addr = _real_shmat(_realId, NULL, 0);
       JASSERT(addr != (void *)-1);
@@ -742,6 +786,23 @@ ShmSegment::preCheckpoint()
   }
 }
 
+// Returns the real shmid of the SysV shared memory segment attached at addr,
+// or -1 if addr is not the start of one.
+static int
+attachedShmid(const void *addr)
+{
+  ProcSelfMaps procSelfMaps;
+  ProcMapsArea area;
+
+  while (procSelfMaps.getNextArea(&area)) {
+    if (area.addr == addr) {
+      // The inode number of a SysV shared memory mapping is its shmid.
+      return Util::isSysVShmArea(area) ? (int)area.inodenum : -1;
+    }
+  }
+  return -1;
+}
+
 void
 ShmSegment::postRestart()
 {
@@ -749,13 +810,25 @@ ShmSegment::postRestart()
     return;
   }
 
+  ShmaddrToFlagIter i = _shmaddrToFlag.begin();
+  int restoredId = attachedShmid(i->first);
+  if (restoredId != -1) {
+    // mtcp_restart recreated the segment and restored its contents in place.
+    _realId = restoredId;
+    SysVShm::instance().updateMapping(_id, _realId);
+    if (_dmtcpMappedAddr) {
+      JASSERT(_real_shmdt(i->first) == 0) (_id) (JASSERT_ERRNO);
+    }
+    JTRACE("Shared memory segment restored in place") (_id) (_realId);
+    return;
+  }
+
   _realId = _real_shmget(_key, _size, _flags);
   JASSERT(_realId != -1);
   SysVShm::instance().updateMapping(_id, _realId);
 
   // Re-map first address for owner on restart
   JASSERT(_isCkptLeader);
-  ShmaddrToFlagIter i = _shmaddrToFlag.begin();
   void *tmpaddr = _real_shmat(_realId, NULL, 0);
   JASSERT(tmpaddr != (void *)-1) (_realId)(JASSERT_ERRNO);
   huge_memcpy((char *)tmpaddr, (char *)i->first, _size);
@@ -870,34 +943,17 @@ void
 Semaphore::leaderElection()
 {
   JASSERT(_realId != -1);
-
-  /* Every process increments and decrements the semaphore value by 1 in order
-   * to update the sempid value. The process who performs the last semop is
-   * elected the leader.
-   */
-  struct sembuf sops;
-  sops.sem_num = 0;
-  sops.sem_op = 1;
-  sops.sem_flg = 0;
-  int ret = _real_semtimedop(_realId, &sops, 1, NULL);
-  if (ret == 0) {
-    sops.sem_num = 0;
-    sops.sem_op = -1;
-    sops.sem_flg = 0;
-    JASSERT(_real_semtimedop(_realId, &sops, 1,
-                             NULL) == 0) (JASSERT_ERRNO) (_id);
-  }
+  _isCkptLeader = SharedData::electSysVLeader(SYSV_SEM_ID, _realId,
+                                              dmtcp_get_uniquepid());
 }
 
 void
 Semaphore::preCkptDrain()
 {
-  _isCkptLeader = false;
-  if (getpid() == _real_semctl(_realId, 0, GETPID)) {
+  if (_isCkptLeader) {
     union semun info;
     info.array = _semval;
-    JASSERT(_real_semctl(_realId, 0, GETALL, info) != -1);
-    _isCkptLeader = true;
+    JASSERT(_real_semctl(_realId, 0, GETALL, info) != -1) (_id) (JASSERT_ERRNO);
   }
 }
 
@@ -967,9 +1023,20 @@ MsgQueue::MsgQueue(int msqid, int realMsqid, key_t key, int msgflg)
     _key = buf.msg_perm.__key;
     _flags = buf.msg_perm.mode;
   }
+  _msgBuf = NULL;
+  _msgBufLen = 0;
+  _qnum = 0;
+  _drained = false;
   JTRACE("New MsgQueue Created") (_key) (_flags) (_id);
 }
 
+MsgQueue::~MsgQueue()
+{
+  if (_msgBuf != NULL) {
+    JALLOC_HELPER_FREE(_msgBuf);
+  }
+}
+
 bool
 MsgQueue::isStale()
 {
@@ -983,61 +1050,91 @@ MsgQueue::isStale()
   return false;
 }
 
-void
-MsgQueue::leaderElection()
+msgqnum_t
+MsgQueue::queueLength()
 {
-  // Leader election is done in preCkptDrain(), here we just fetch the number
-  // of messages in the queue.
   struct msqid_ds buf;
 
   JASSERT(_real_msgctl(_realId, IPC_STAT, &buf) == 0) (_id) (JASSERT_ERRNO);
+  return buf.msg_qnum;
+}
 
-  _qnum = buf.msg_qnum;
+void
+MsgQueue::leaderElection()
+{
+  _isCkptLeader = SharedData::electSysVLeader(SYSV_MSQ_ID, _realId,
+                                              dmtcp_get_uniquepid());
 }
 
 void
 MsgQueue::preCkptDrain()
-{
-  // This is where we elect the leader
+{}
 
-  /* Every process send a message to the queue. Later on, these excess messages
-   * will be removed by the ckptLeader before the user threads are allowed to
-   * resume.
-   * The process whose pid matches the msg_lspid is the leader.
-   */
-  struct msgbuf msg;
+// Each message is saved in _msgBuf as its length (the msgsz of msgsnd()),
+// followed by the struct msgbuf, padded to a multiple of sizeof(size_t).
+static inline size_t
+msgRecordSize(size_t msgsz)
+{
+  size_t len = sizeof(size_t) + sizeof(long) + msgsz;
 
-  msg.mtype = getpid();
-  JASSERT(_real_msgsnd(_realId, &msg, 0,
-                       IPC_NOWAIT) == 0) (_id) (JASSERT_ERRNO);
-  _isCkptLeader = false;
+  return (len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
 }
 
 void
 MsgQueue::preCheckpoint()
 {
-  struct msqid_ds buf;
+  if (!_isCkptLeader) {
+    return;
+  }
 
-  memset(&buf, 0, sizeof buf);
+  struct msqid_ds buf;
   JASSERT(_real_msgctl(_realId, IPC_STAT, &buf) == 0) (_id) (JASSERT_ERRNO);
+  _qnum = buf.msg_qnum;
 
-  if (buf.msg_lspid == getpid()) {
-    size_t size = buf.__msg_cbytes;
-    void *msgBuf = JALLOC_HELPER_MALLOC(size);
-    _isCkptLeader = true;
-    _msgInQueue.clear();
-    for (size_t i = 0; i < _qnum; i++) {
-      ssize_t numBytes = _real_msgrcv(_realId, msgBuf, size, 0, 0);
-      JASSERT(numBytes != -1) (_id) (JASSERT_ERRNO);
-      _msgInQueue.push_back(jalib::JBuffer((const char *)msgBuf,
-                                           numBytes + sizeof(long)));
+  size_t capacity = _qnum * msgRecordSize(sizeof(size_t)) + buf.__msg_cbytes;
+  if (_msgBuf != NULL) {
+    JALLOC_HELPER_FREE(_msgBuf);
+  }
+  _msgBuf = (char *)JALLOC_HELPER_MALLOC(capacity);
+  saveMessages(capacity);
+}
+
+/* Copies the messages into _msgBuf with msgrcv(MSG_COPY), which leaves them
+ * in the queue, so that nothing needs to be done on resume.  If the kernel
+ * lacks MSG_COPY (before Linux 3.8, or without CONFIG_CHECKPOINT_RESTORE),
+ * the messages are received instead, and sent again in refill().
+ */
+void
+MsgQueue::saveMessages(size_t capacity)
+{
+  _msgBufLen = 0;
+  _drained = false;
+  for (size_t i = 0; i < _qnum; i++) {
+    char *record = _msgBuf + _msgBufLen;
+    void *msg = record + sizeof(size_t);
+    size_t maxSize = capacity - _msgBufLen - sizeof(size_t) - sizeof(long);
+    ssize_t numBytes = -1;
+
+    if (!_drained) {
+      numBytes = _real_msgrcv(_realId, msg, maxSize, i, IPC_NOWAIT | MSG_COPY);
+      if (numBytes == -1) {
+        JASSERT(i == 0) (_id) (i) (JASSERT_ERRNO);
+        JTRACE("msgrcv(MSG_COPY) failed; receiving the messages instead")
+          (_id) (JASSERT_ERRNO);
+        _drained = true;
+      } else if (i == 0 && queueLength() != _qnum) {
+        // Older kernels ignore MSG_COPY; the first message was received.
+        _drained = true;
+      }
     }
-    JASSERT(_msgInQueue.size() == _qnum) (_qnum);
+    if (numBytes == -1) {
+      numBytes = _real_msgrcv(_realId, msg, maxSize, 0, IPC_NOWAIT);
+    }
+    JASSERT(numBytes != -1) (_id) (i) (_qnum) (JASSERT_ERRNO);
 
-    // Now remove all the messages that were sent during preCkptDrain phase.
-    while (_real_msgrcv(_realId, msgBuf, size, 0, IPC_NOWAIT) != -1) {}
-    JALLOC_HELPER_FREE(msgBuf);
-  } else {}
+    *(size_t *)record = numBytes;
+    _msgBufLen += msgRecordSize(numBytes);
+  }
 }
 
 void
@@ -1047,31 +1144,37 @@ MsgQueue::postRestart()
     _realId = _real_msgget(_key, _flags);
     JASSERT(_realId != -1) (JASSERT_ERRNO);
     SysVMsq::instance().updateMapping(_id, _realId);
-    JASSERT(_msgInQueue.size() == _qnum) (_msgInQueue.size()) (_qnum);
   }
 }
 
 void
 MsgQueue::refill(bool isRestart)
 {
-  if (_isCkptLeader) {
-    struct msqid_ds buf;
-    JASSERT(_real_msgctl(_realId, IPC_STAT, &buf) == 0) (_id) (JASSERT_ERRNO);
+  if (_isCkptLeader && (isRestart || _drained)) {
     if (isRestart) {
-      // Now remove all the messages that were sent during preCkptDrain phase.
-      size_t size = buf.__msg_cbytes;
-      void *msgBuf = JALLOC_HELPER_MALLOC(size);
-      while (_real_msgrcv(_realId, msgBuf, size, 0, IPC_NOWAIT) != -1) {}
-      JALLOC_HELPER_FREE(msgBuf);
+      // If the queue outlived the computation, remove the messages that were
+      // left in it.
+      long mtype;
+      while (_real_msgrcv(_realId, &mtype, 0, 0,
+                          IPC_NOWAIT | MSG_NOERROR) != -1) {}
     } else {
-      JASSERT(buf.msg_qnum == 0);
+      JASSERT(queueLength() == 0) (_id);
     }
 
+    size_t offset = 0;
     for (size_t i = 0; i < _qnum; i++) {
-      JASSERT(_real_msgsnd(_realId, _msgInQueue[i].buffer(),
-                           _msgInQueue[i].size(), IPC_NOWAIT) == 0);
+      size_t msgsz = *(size_t *)(_msgBuf + offset);
+      JASSERT(_real_msgsnd(_realId, _msgBuf + offset + sizeof(size_t), msgsz,
+                           IPC_NOWAIT) == 0) (_id) (i) (JASSERT_ERRNO);
+      offset += msgRecordSize(msgsz);
     }
+    JASSERT(offset == _msgBufLen) (offset) (_msgBufLen);
+  }
+
+  if (_msgBuf != NULL) {
+    JALLOC_HELPER_FREE(_msgBuf);
+    _msgBuf = NULL;
   }
-  _msgInQueue.clear();
+  _msgBufLen = 0;
   _qnum = 0;
 }
@@ -165,6 +165,7 @@ class SysVMsq : public SysVIPC
       : SysVIPC("SysVMsq", getpid(), SYSV_MSQ_ID) {}
 
     static SysVMsq &instance();
+    void preCheckpoint();
     virtual void on_msgget(int msqid, key_t key, int msgflg);
     virtual void on_msgctl(int msqid, int cmd, struct msqid_ds *buf);
     virtual void on_msgsnd(int msqid, const void *msgp, size_t msgsz,
@@ -301,6 +302,7 @@ class MsgQueue : public SysVObj
     static void operator delete(void *p) { JALLOC_HELPER_DELETE(p); }
 #endif // ifdef JALIB_ALLOCATOR
     MsgQueue(int msqid, int realMsqid, key_t key, int msgflg);
+    ~MsgQueue();
 
     virtual bool isStale();
     virtual void resetOnFork() {}
@@ -312,9 +314,22 @@ class MsgQueue : public SysVObj
     virtual void refill(bool isRestart);
     virtual void preResume() {}
 
+    msgqnum_t numSavedMessages() { return _isCkptLeader ? _qnum : 0; }
+
+    size_t numSavedBytes() { return _isCkptLeader ? _msgBufLen : 0; }
+
   private:
-    vector<jalib::JBuffer>_msgInQueue;
+    msgqnum_t queueLength();
+    void saveMessages(size_t capacity);
+
+    // The messages in the queue at checkpoint time, in queue order.  See
+    // MsgQueue::saveMessages().
+    char *_msgBuf;
+    size_t _msgBufLen;
     msgqnum_t _qnum;
+
+    // True if the messages were removed from the queue when saving them.
+    bool _drained;
 };
 }
 #endif // ifndef SYSVIPC_H
@@ -142,11 +142,15 @@ TimerList::removeStaleClockIds()
 void
 TimerList::resetOnFork()
 {
-  _timerInfo.clear();
+  // Timers are not inherited by the child of fork().
+  for (size_t i = 0; i < _numSlots; i++) {
+    slotAt(i)->inUse = false;
+  }
+  _numSlots = 0;
+  _freeSlots.clear();
 
   // _clockPidList.clear();
   // _clockPthreadList.clear();
-  _timerVirtIdTable.clear();
   pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
   timerLock = lock;
   _clockVirtIdTable.resetOnFork((clockid_t)(unsigned)getpid());
@@ -156,16 +160,27 @@ void
 TimerList::preCheckpoint()
 {
   removeStaleClockIds();
-  for (_iter = _timerInfo.begin(); _iter != _timerInfo.end(); _iter++) {
-    timer_t virtId = _iter->first;
-    timer_t realId = VIRTUAL_TO_REAL_TIMER_ID(virtId);
-    TimerInfo &tinfo = _iter->second;
-    JASSERT(_real_timer_gettime(realId, &tinfo.curr_timerspec) == 0)
-      (virtId) (realId) (JASSERT_ERRNO);
-    tinfo.overrun = _real_timer_getoverrun(realId);
+  for (size_t i = 0; i < _numSlots; i++) {
+    TimerSlot *slot = slotAt(i);
+    if (!slot->inUse) {
+      continue;
+    }
+    TimerInfo &tinfo = slot->info;
+    JASSERT(_real_timer_gettime(slot->realId, &tinfo.curr_timerspec) == 0)
+      (i + 1) (slot->realId) (JASSERT_ERRNO);
+    tinfo.ckpt_overrun = _real_timer_getoverrun(slot->realId);
   }
 }
 
+// The clocks measuring CPU time start over in the restarted process.
+static bool
+isCpuClock(clockid_t realClockId)
+{
+  return realClockId == CLOCK_PROCESS_CPUTIME_ID ||
+         realClockId == CLOCK_THREAD_CPUTIME_ID ||
+         realClockId < 0;  // From clock_getcpuclockid() and the like.
+}
+
 void
 TimerList::postRestart()
 {
@@ -189,49 +204,65 @@ TimerList::postRestart()
     _clockVirtIdTable.updateMapping(virtId, realId);
   }
 
-  // Refresh timers
-  for (_iter = _timerInfo.begin(); _iter != _timerInfo.end(); _iter++) {
-    timer_t realId;
-    timer_t virtId = _iter->first;
+  // Recreate all timers first, and arm them after, in a single pass.  The
+  // relative timers then keep their phase with respect to each other,
+  // instead of drifting apart by the cost of the timer_create() calls
+  // between them.
+  vector<size_t>armed;
+  for (size_t i = 0; i < _numSlots; i++) {
+    TimerSlot *slot = slotAt(i);
+    if (!slot->inUse) {
+      continue;
+    }
     struct sigevent *sevp = NULL;
-    TimerInfo &tinfo = _iter->second;
+    TimerInfo &tinfo = slot->info;
     clockid_t clockid = VIRTUAL_TO_REAL_CLOCK_ID(tinfo.clockid);
     if (!tinfo.sevp_null) {
       sevp = &tinfo.sevp;
     }
-    JASSERT(_real_timer_create(clockid, sevp, &realId) == 0)
-      (virtId) (JASSERT_ERRNO);
-    _timerVirtIdTable.updateMapping(virtId, realId);
-    if (tinfo.curr_timerspec.it_value.tv_sec != 0 ||
-        tinfo.curr_timerspec.it_value.tv_nsec != 0) {
-      struct itimerspec tspec;
-      if (tinfo.flags & TIMER_ABSTIME) {
-        // The timer should expire when the clock time equals the time
-        // specified in initial_timerspec.
-        // FIXME: For clocks measugin CPU time for processes and threads, such
-        // as CLOCK_PROCESS_CPUTIME_ID and CLOCK_THREAD_CPUTIME_ID, we need to
-        // adjust the value of initial_timerspec to allow
-        // the changes on the time on these clocks after restart.
-        tspec = tinfo.initial_timerspec;
-      } else {
-        tspec = tinfo.curr_timerspec;
-      }
-      JASSERT(_real_timer_settime(realId, tinfo.flags, &tspec, NULL) == 0)
-        (virtId) (JASSERT_ERRNO);
-      JTRACE("Restoring timer") (realId) (virtId);
+    JASSERT(_real_timer_create(clockid, sevp, &slot->realId) == 0)
+      (i + 1) (JASSERT_ERRNO);
+
+    tinfo.overrun += tinfo.ckpt_overrun;
+    tinfo.ckpt_overrun = 0;
+    if (tinfo.curr_timerspec.it_value.tv_sec == 0 &&
+        tinfo.curr_timerspec.it_value.tv_nsec == 0) {
+      continue;
     }
+    if ((tinfo.flags & TIMER_ABSTIME) && !isCpuClock(clockid)) {
+      // The timer should expire when the clock time equals the time
+      // specified in initial_timerspec.  The expirations missed while the
+      // process was not running are reported as one, with an overrun, and
+      // the later ones keep the phase of initial_timerspec.
+      tinfo.curr_timerspec = tinfo.initial_timerspec;
+    } else {
+      // A relative timer resumes with the time that was left at checkpoint,
+      // and so does a timer on a CPU-time clock, whose absolute expiration
+      // time is meaningless for the clock of the new process.
+      tinfo.flags &= ~TIMER_ABSTIME;
+    }
+    armed.push_back(i);
+  }
+
+  for (size_t i = 0; i < armed.size(); i++) {
+    TimerSlot *slot = slotAt(armed[i]);
+    TimerInfo &tinfo = slot->info;
+    JASSERT(_real_timer_settime(slot->realId, tinfo.flags,
+                                &tinfo.curr_timerspec, NULL) == 0)
+      (armed[i] + 1) (JASSERT_ERRNO);
   }
+  JTRACE("Restored timers") (armed.size());
 }
 
 int
 TimerList::getoverrun(timer_t id)
 {
-  _do_lock_tbl();
-  JASSERT(_timerInfo.find(id) != _timerInfo.end());
-  int ret = _timerInfo[id].overrun;
-  _timerInfo[id].overrun = 0;
-  _do_unlock_tbl();
-  return ret;
+  TimerSlot *slot = getSlot(id);
+
+  if (slot == NULL) {
+    return 0;
+  }
+  return __atomic_exchange_n(&slot->info.overrun, 0, __ATOMIC_ACQ_REL);
 }
 
 timer_t
@@ -239,15 +270,27 @@ TimerList::on_timer_create(timer_t realId,
                            clockid_t clockid,
                            struct sigevent *sevp)
 {
-  TimerInfo tinfo;
-  timer_t virtId;
+  size_t index;
 
   _do_lock_tbl();
-  JASSERT(!_timerVirtIdTable.realIdExists(realId)) (realId);
-
-  JASSERT(_timerVirtIdTable.getNewVirtualId(&virtId));
-  _timerVirtIdTable.updateMapping(virtId, realId);
+  if (!_freeSlots.empty()) {
+    index = _freeSlots.back();
+    _freeSlots.pop_back();
+  } else {
+    JASSERT(_numSlots < TIMER_MAX_SLOTS) (_numSlots)
+      .Text("Too many timers");
+    index = _numSlots++;
+    TimerSlot **chunk = &_chunks[index / TIMER_SLOTS_PER_CHUNK];
+    if (*chunk == NULL) {
+      size_t size = TIMER_SLOTS_PER_CHUNK * sizeof(TimerSlot);
+      TimerSlot *newChunk = (TimerSlot *)JALLOC_HELPER_MALLOC(size);
+      memset(newChunk, 0, size);
+      __atomic_store_n(chunk, newChunk, __ATOMIC_RELEASE);
+    }
+  }
 
+  TimerSlot *slot = slotAt(index);
+  TimerInfo &tinfo = slot->info;
   memset(&tinfo, 0, sizeof(tinfo));
   tinfo.clockid = clockid;
   if (sevp == NULL) {
@@ -256,32 +299,35 @@ TimerList::on_timer_create(timer_t realId,
     tinfo.sevp_null = false;
     tinfo.sevp = *sevp;
   }
-
-  _timerInfo[virtId] = tinfo;
+  slot->realId = realId;
+  __atomic_store_n(&slot->inUse, true, __ATOMIC_RELEASE);
   _do_unlock_tbl();
-  return virtId;
+  return (timer_t)(index + 1);
 }
 
 void
 TimerList::on_timer_delete(timer_t timerid)
 {
   _do_lock_tbl();
-  _timerVirtIdTable.erase(timerid);
-  JASSERT(_timerInfo.find(timerid) != _timerInfo.end());
-  _timerInfo.erase(timerid);
+  TimerSlot *slot = getSlot(timerid);
+  JASSERT(slot != NULL) (timerid);
+  __atomic_store_n(&slot->inUse, false, __ATOMIC_RELEASE);
+  _freeSlots.push_back((size_t)timerid - 1);
   _do_unlock_tbl();
 }
 
+// Called only by timer_settime(), with checkpointing disabled.  The table
+// lock isn't needed: the slot stays in use until timer_delete().
 void
 TimerList::on_timer_settime(timer_t timerid,
                             int flags,
                             const struct itimerspec *new_value)
 {
-  _do_lock_tbl();
-  JASSERT(_timerInfo.find(timerid) != _timerInfo.end());
-  _timerInfo[timerid].flags = flags;
-  _timerInfo[timerid].initial_timerspec = *new_value;
-  _do_unlock_tbl();
+  TimerSlot *slot = getSlot(timerid);
+
+  JASSERT(slot != NULL) (timerid);
+  slot->info.flags = flags;
+  slot->info.initial_timerspec = *new_value;
 }
 
 clockid_t
@@ -30,8 +30,6 @@
 #include "dmtcpalloc.h"
 #include "virtualidtable.h"
 
-# define REAL_TO_VIRTUAL_TIMER_ID(id) \
-  TimerList::instance().realToVirtualTimerId(id)
 # define VIRTUAL_TO_REAL_TIMER_ID(id) \
   TimerList::instance().virtualToRealTimerId(id)
 
@@ -46,6 +44,12 @@
 # define VIRTUAL_TO_REAL_CLOCK_ID(virtId) \
   TimerList::instance().virtualToRealClockId(virtId)
 
+// Virtual timer ids index a table of slots, allocated in chunks that are
+// never moved or freed.  This allows up to 1M timers, as before.
+# define TIMER_SLOTS_PER_CHUNK 256
+# define TIMER_MAX_CHUNKS      4096
+# define TIMER_MAX_SLOTS       (TIMER_SLOTS_PER_CHUNK * TIMER_MAX_CHUNKS)
+
 namespace dmtcp
 {
 typedef struct TimerInfo {
@@ -55,10 +59,27 @@ typedef struct TimerInfo {
   int flags;
   struct itimerspec initial_timerspec;
   struct itimerspec curr_timerspec;
+
+  // Overrun of the real timer at checkpoint time.  After restart, it is
+  // reported by the next timer_getoverrun(), as 'overrun'.
+  int ckpt_overrun;
   int overrun;
 } TimerInfo;
 
+typedef struct TimerSlot {
+  timer_t realId;
+  bool inUse;
+  TimerInfo info;
+} TimerSlot;
 
+
+/*
+ * Virtual timer id N is slot N-1 of the table, so that no virtual id is NULL.
+ * The wrappers translate a virtual id with two loads and no lock; only
+ * timer_create() and timer_delete() take the table lock, to allocate and
+ * free slots.  The real ids only change in postRestart(), while the user
+ * threads are suspended.
+ */
 class TimerList
 {
   public:
@@ -71,8 +92,11 @@ class TimerList
 # endif // ifdef JALIB_ALLOCATOR
 
     TimerList()
-      : _timerVirtIdTable("Timer", (timer_t)NULL, 999999)
-      , _clockVirtIdTable("Clock", (clockid_t)(unsigned)getpid()) {}
+      : _numSlots(0)
+      , _clockVirtIdTable("Clock", (clockid_t)(unsigned)getpid())
+    {
+      memset(_chunks, 0, sizeof(_chunks));
+    }
 
     static TimerList &instance();
 
@@ -82,12 +106,12 @@ class TimerList
 
     timer_t virtualToRealTimerId(timer_t virtId)
     {
-      return _timerVirtIdTable.virtualToReal(virtId);
-    }
+      TimerSlot *slot = getSlot(virtId);
 
-    timer_t realToVirtualTimerId(timer_t realId)
-    {
-      return _timerVirtIdTable.realToVirtual(realId);
+      if (slot == NULL) {
+        return virtId;
+      }
+      return __atomic_load_n(&slot->realId, __ATOMIC_ACQUIRE);
     }
 
     clockid_t virtualToRealClockId(clockid_t virtId)
@@ -115,14 +139,41 @@ class TimerList
     clockid_t on_pthread_getcpuclockid(pthread_t thread, clockid_t clock_id);
 
   private:
+    // Returns NULL if 'virtId' is not a timer created by this process.
+    TimerSlot *getSlot(timer_t virtId)
+    {
+      size_t index = (size_t)virtId - 1;
+
+      if (index >= TIMER_MAX_SLOTS) {
+        return NULL;
+      }
+      TimerSlot *chunk = __atomic_load_n(&_chunks[index /
+                                                  TIMER_SLOTS_PER_CHUNK],
+                                         __ATOMIC_ACQUIRE);
+      if (chunk == NULL) {
+        return NULL;
+      }
+      TimerSlot *slot = &chunk[index % TIMER_SLOTS_PER_CHUNK];
+      if (!__atomic_load_n(&slot->inUse, __ATOMIC_ACQUIRE)) {
+        return NULL;
+      }
+      return slot;
+    }
+
+    TimerSlot *slotAt(size_t index)
+    {
+      return &_chunks[index / TIMER_SLOTS_PER_CHUNK]
+             [index % TIMER_SLOTS_PER_CHUNK];
+    }
+
     void removeStaleClockIds();
 
-    map<timer_t, TimerInfo>_timerInfo;
-    map<timer_t, TimerInfo>::iterator _iter;
+    TimerSlot *_chunks[TIMER_MAX_CHUNKS];
+    size_t _numSlots;
+    vector<size_t>_freeSlots;
     map<clockid_t, pid_t>_clockPidList;
     map<clockid_t, pthread_t>_clockPthreadList;
 
-    VirtualIdTable<timer_t>_timerVirtIdTable;
     VirtualIdTable<clockid_t>_clockVirtIdTable;
 };
 }
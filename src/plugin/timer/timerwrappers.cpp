@@ -102,7 +102,9 @@ timer_getoverrun(timer_t timerid)
   int ret = _real_timer_getoverrun(realId);
 
   // If there was some overrun at checkpoint time, add it to the current value
-  ret += TimerList::instance().getoverrun(timerid);
+  if (ret != -1) {
+    ret += TimerList::instance().getoverrun(timerid);
+  }
   DMTCP_PLUGIN_ENABLE_CKPT();
   return ret;
 }
@@ -6,6 +6,7 @@
 #include "dmtcpalloc.h"
 #include "jtimer.h"
 #include "plugininfo.h"
+#include "threadlist.h"
 #include "util.h"
 
 static const char *firstRestartBarrier = "DMTCP::RESTART";
@@ -151,6 +152,8 @@ PluginManager::logCkptResumeBarrierOverhead()
 
   double writeTime = 0.0;
   JTIMER_GETDELTA(writeTime, ckptWriteTime);
+  lfile << "Suspend-threads time," << ThreadList::lastSuspendTime()
+        << std::endl;
   lfile << "Ckpt-write time," << writeTime << std::endl;
 
   for (int i = pluginManager->pluginInfos.size() - 1; i >= 0; i--) {
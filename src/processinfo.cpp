@@ -83,6 +83,7 @@ processInfo_EventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
   case DMTCP_EVENT_PRE_EXEC:
   {
     jalib::JBinarySerializeWriterRaw wr("", data->serializerInfo.fd);
+    wr.setBuffered(true);
     ProcessInfo::instance().refresh();
     ProcessInfo::instance().serialize(wr);
     break;
@@ -91,6 +92,7 @@ processInfo_EventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
   case DMTCP_EVENT_POST_EXEC:
   {
     jalib::JBinarySerializeReaderRaw rd("", data->serializerInfo.fd);
+    rd.setBuffered(true);
     ProcessInfo::instance().serialize(rd);
     ProcessInfo::instance().postExec();
     break;
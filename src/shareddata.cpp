@@ -20,10 +20,12 @@
  ****************************************************************************/
 
 #include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <syscall.h>
 #include <sys/ipc.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <linux/futex.h>
 
@@ -51,6 +53,220 @@ static const SharedData::DMTCP_ARCH_MODE archMode = SharedData::DMTCP_ARCH_32;
 static const SharedData::DMTCP_ARCH_MODE archMode = SharedData::DMTCP_ARCH_64;
 #endif
 
+/*
+ * The pid, SysV IPC-id and inode-to-connection-id maps are kept in
+ * fixed-capacity open-addressing hash tables (linear probing) inside the
+ * shared area.  Each slot begins with a 32-bit tag.  A writer claims an empty
+ * slot by swapping its tag to 'busy' with a compare-and-swap, fills in the
+ * key and value, and then publishes the slot by setting the tag to 'ready'.
+ * Entries are never removed, so readers walk the probe sequence without
+ * taking the PROTECTED_SHM_FD file lock; they only wait on a slot that is
+ * still being filled in.
+ *
+ * Tags are relative to an epoch: any tag below the epoch's 'busy' value
+ * denotes an empty slot.  The inode table uses the computation generation as
+ * its epoch, which resets it on every checkpoint without clearing it.
+ *
+ * Slots hold only fixed-width fields (no pointers), so a table can be shared
+ * by 32-bit and 64-bit processes (DMTCP_ARCH_MIXED).
+ */
+static inline uint32_t
+slotBusyTag(uint32_t epoch)
+{
+  return 2 * epoch + 1;
+}
+
+static inline uint32_t
+slotReadyTag(uint32_t epoch)
+{
+  return 2 * epoch + 2;
+}
+
+static inline uint32_t
+hashId(uint32_t key)
+{
+  // Knuth's multiplicative hash; a bijection on the low bits, so consecutive
+  // ids land in consecutive buckets without clustering on top of each other.
+  return key * 2654435761U;
+}
+
+static inline uint32_t
+hashInode(uint64_t devnum, uint64_t inode)
+{
+  uint64_t key = inode ^ (devnum * 0x9E3779B97F4A7C15ULL);
+  return hashId((uint32_t)(key ^ (key >> 32)));
+}
+
+static inline bool
+slotMatches(const SharedData::PidMap &slot, const SharedData::PidMap &key)
+{
+  return slot.virt == key.virt;
+}
+
+static inline void
+slotFill(SharedData::PidMap *slot, const SharedData::PidMap &key)
+{
+  slot->virt = key.virt;
+  slot->real = key.real;
+}
+
+static inline bool
+slotMatches(const SharedData::IPCIdMap &slot, const SharedData::IPCIdMap &key)
+{
+  return slot.virt == key.virt;
+}
+
+static inline void
+slotFill(SharedData::IPCIdMap *slot, const SharedData::IPCIdMap &key)
+{
+  slot->virt = key.virt;
+  slot->real = key.real;
+}
+
+static inline bool
+slotMatches(const SharedData::InodeConnIdSlot &slot,
+            const SharedData::InodeConnIdSlot &key)
+{
+  return slot.map.devnum == key.map.devnum && slot.map.inode == key.map.inode;
+}
+
+static inline void
+slotFill(SharedData::InodeConnIdSlot *slot,
+         const SharedData::InodeConnIdSlot &key)
+{
+  slot->map = key.map;
+}
+
+static inline bool
+slotMatches(const SharedData::SharedAreaSlot &slot,
+            const SharedData::SharedAreaSlot &key)
+{
+  return slot.map.devnum == key.map.devnum &&
+         slot.map.inode == key.map.inode &&
+         slot.map.offset == key.map.offset &&
+         slot.map.size == key.map.size;
+}
+
+static inline void
+slotFill(SharedData::SharedAreaSlot *slot,
+         const SharedData::SharedAreaSlot &key)
+{
+  slot->map = key.map;
+}
+
+static inline uint32_t
+hashSharedArea(const SharedData::SharedAreaMap &map)
+{
+  return hashInode(map.devnum, map.inode ^ (map.offset >> 12));
+}
+
+static inline bool
+slotMatches(const SharedData::SysVLeaderSlot &slot,
+            const SharedData::SysVLeaderSlot &key)
+{
+  return slot.type == key.type && slot.realId == key.realId;
+}
+
+static inline void
+slotFill(SharedData::SysVLeaderSlot *slot,
+         const SharedData::SysVLeaderSlot &key)
+{
+  slot->type = key.type;
+  slot->realId = key.realId;
+  slot->leader = key.leader;
+}
+
+static void
+sharedAreaKey(const ProcMapsArea &area, SharedData::SharedAreaSlot *key)
+{
+  memset(key, 0, sizeof(*key));
+  key->map.devnum = makedev(area.devmajor, area.devminor);
+  key->map.inode = area.inodenum;
+  key->map.offset = area.offset;
+  key->map.size = area.size;
+}
+
+// Returns the slot holding 'key'.  If there is none and 'insert' is true, a
+// new slot is claimed and filled in from 'key', and '*inserted' is set.
+// Returns NULL if the key was not found (or the table is full).
+template<typename SlotType>
+static SlotType *
+findOrInsertSlot(SlotType *table,
+                 uint32_t size,
+                 uint32_t hash,
+                 const SlotType &key,
+                 uint32_t epoch,
+                 bool insert,
+                 bool *inserted)
+{
+  const uint32_t busy = slotBusyTag(epoch);
+  const uint32_t ready = slotReadyTag(epoch);
+  uint32_t idx = hash & (size - 1);
+
+  if (inserted != NULL) {
+    *inserted = false;
+  }
+
+  for (uint32_t probes = 0; probes < size;) {
+    SlotType *slot = &table[idx];
+    volatile uint32_t *tagPtr = &slot->tag;
+    uint32_t tag = *tagPtr;
+
+    if (tag < busy) {
+      if (!insert) {
+        return NULL;
+      }
+      if (!__sync_bool_compare_and_swap(&slot->tag, tag, busy)) {
+        // Another process claimed this slot first; examine it again.
+        continue;
+      }
+      slotFill(slot, key);
+      WMB;
+      *tagPtr = ready;
+      if (inserted != NULL) {
+        *inserted = true;
+      }
+      return slot;
+    }
+
+    while (tag == busy) {
+      sched_yield();
+      tag = *tagPtr;
+    }
+    RMB;
+
+    if (tag == ready && slotMatches(*slot, key)) {
+      return slot;
+    }
+    idx = (idx + 1) & (size - 1);
+    probes++;
+  }
+  return NULL;
+}
+
+static SharedData::IPCIdMap *
+getIPCIdMapTable(int type, uint32_t **nmaps)
+{
+  switch (type) {
+  case SYSV_SHM_ID:
+    *nmaps = &sharedDataHeader->numSysVShmIdMaps;
+    return sharedDataHeader->sysvShmIdMap;
+
+  case SYSV_SEM_ID:
+    *nmaps = &sharedDataHeader->numSysVSemIdMaps;
+    return sharedDataHeader->sysvSemIdMap;
+
+  case SYSV_MSQ_ID:
+    *nmaps = &sharedDataHeader->numSysVMsqIdMaps;
+    return sharedDataHeader->sysvMsqIdMap;
+
+  default:
+    JASSERT(false) (type).Text("Unknown IPC-Id type.");
+    break;
+  }
+  return NULL;
+}
+
 void
 SharedData::initializeHeader(const char *tmpDir,
                              const char *installDir,
@@ -226,6 +442,8 @@ SharedData::prepareForCkpt()
 {
   nextVirtualPtyId = sharedDataHeader->nextVirtualPtyId;
   sharedDataHeader->numInodeConnIdMaps = 0;
+  sharedDataHeader->numSharedAreaMaps = 0;
+  sharedDataHeader->numSysVLeaders = 0;
   sharedDataHeader->numIncomingConMaps = 0;
 
   initializeBarrier();
@@ -471,129 +689,89 @@ SharedData::getDlsymOffset_m32(void)
 pid_t
 SharedData::getRealPid(pid_t virt)
 {
-  pid_t res = -1;
-
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
-  for (size_t i = 0; i < sharedDataHeader->numPidMaps; i++) {
-    if (sharedDataHeader->pidMap[i].virt == virt) {
-      res = sharedDataHeader->pidMap[i].real;
-    }
+  PidMap key = { 0, virt, -1, 0 };
+  PidMap *slot = findOrInsertSlot(sharedDataHeader->pidMap,
+                                  PID_MAP_TABLE_SIZE,
+                                  hashId(virt), key, 0, false, NULL);
+  if (slot == NULL) {
+    return -1;
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
-  return res;
+  return *(volatile pid_t *)&slot->real;
 }
 
 void
 SharedData::setPidMap(pid_t virt, pid_t real)
 {
-  size_t i;
+  bool inserted;
 
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
-  for (i = 0; i < sharedDataHeader->numPidMaps; i++) {
-    if (sharedDataHeader->pidMap[i].virt == virt) {
-      sharedDataHeader->pidMap[i].real = real;
-      break;
-    }
+  PidMap key = { 0, virt, real, 0 };
+  PidMap *slot = findOrInsertSlot(sharedDataHeader->pidMap,
+                                  PID_MAP_TABLE_SIZE,
+                                  hashId(virt), key, 0, true, &inserted);
+  JASSERT(slot != NULL) (virt) (real).Text("Pid map table is full.");
+  if (inserted) {
+    uint32_t n = __sync_add_and_fetch(&sharedDataHeader->numPidMaps, 1);
+    JASSERT(n <= MAX_PID_MAPS) (n);
+  } else {
+    *(volatile pid_t *)&slot->real = real;
   }
-  if (i == sharedDataHeader->numPidMaps) {
-    JASSERT(sharedDataHeader->numPidMaps < MAX_PID_MAPS);
-    sharedDataHeader->pidMap[i].virt = virt;
-    sharedDataHeader->pidMap[i].real = real;
-    sharedDataHeader->numPidMaps++;
+  __sync_add_and_fetch(&sharedDataHeader->pidMapVersion, 1);
+}
+
+// Lets callers cache translations from getRealPid() until the map changes.
+uint32_t
+SharedData::getPidMapVersion()
+{
+  if (sharedDataHeader == NULL) {
+    initialize();
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
+  return *(volatile uint32_t *)&sharedDataHeader->pidMapVersion;
 }
 
 int32_t
 SharedData::getRealIPCId(int type, int32_t virt)
 {
-  int32_t res = -1;
-  uint32_t nmaps = 0;
-  IPCIdMap *map = NULL;
+  uint32_t *nmaps = NULL;
 
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
-  switch (type) {
-  case SYSV_SHM_ID:
-    nmaps = sharedDataHeader->numSysVShmIdMaps;
-    map = sharedDataHeader->sysvShmIdMap;
-    break;
-
-  case SYSV_SEM_ID:
-    nmaps = sharedDataHeader->numSysVSemIdMaps;
-    map = sharedDataHeader->sysvSemIdMap;
-    break;
-
-  case SYSV_MSQ_ID:
-    nmaps = sharedDataHeader->numSysVMsqIdMaps;
-    map = sharedDataHeader->sysvMsqIdMap;
-    break;
-
-  default:
-    JASSERT(false) (type).Text("Unknown IPC-Id type.");
-    break;
-  }
-  for (size_t i = 0; i < nmaps; i++) {
-    if (map[i].virt == virt) {
-      res = map[i].real;
-    }
+  IPCIdMap *map = getIPCIdMapTable(type, &nmaps);
+  IPCIdMap key = { 0, virt, -1, 0 };
+  IPCIdMap *slot = findOrInsertSlot(map, IPC_ID_MAP_TABLE_SIZE,
+                                    hashId(virt), key, 0, false, NULL);
+  if (slot == NULL) {
+    return -1;
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
-  return res;
+  return *(volatile int32_t *)&slot->real;
 }
 
 void
 SharedData::setIPCIdMap(int type, int32_t virt, int32_t real)
 {
-  size_t i;
   uint32_t *nmaps = NULL;
-  IPCIdMap *map = NULL;
+  bool inserted;
 
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
-  switch (type) {
-  case SYSV_SHM_ID:
-    nmaps = &sharedDataHeader->numSysVShmIdMaps;
-    map = sharedDataHeader->sysvShmIdMap;
-    break;
-
-  case SYSV_SEM_ID:
-    nmaps = &sharedDataHeader->numSysVSemIdMaps;
-    map = sharedDataHeader->sysvSemIdMap;
-    break;
-
-  case SYSV_MSQ_ID:
-    nmaps = &sharedDataHeader->numSysVMsqIdMaps;
-    map = sharedDataHeader->sysvMsqIdMap;
-    break;
-
-  default:
-    JASSERT(false) (type).Text("Unknown IPC-Id type.");
-    break;
-  }
-  for (i = 0; i < *nmaps; i++) {
-    if (map[i].virt == virt) {
-      map[i].real = real;
-      break;
-    }
-  }
-  if (i == *nmaps) {
-    JASSERT(*nmaps < MAX_IPC_ID_MAPS);
-    map[i].virt = virt;
-    map[i].real = real;
-    *nmaps += 1;
+  IPCIdMap *map = getIPCIdMapTable(type, &nmaps);
+  IPCIdMap key = { 0, virt, real, 0 };
+  IPCIdMap *slot = findOrInsertSlot(map, IPC_ID_MAP_TABLE_SIZE,
+                                    hashId(virt), key, 0, true, &inserted);
+  JASSERT(slot != NULL) (type) (virt) (real).Text("IPC-Id table is full.");
+  if (inserted) {
+    uint32_t n = __sync_add_and_fetch(nmaps, 1);
+    JASSERT(n <= MAX_IPC_ID_MAPS) (type) (n);
+  } else {
+    *(volatile int32_t *)&slot->real = real;
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
 }
 
 pid_t
@@ -724,14 +902,19 @@ SharedData::registerIncomingCons(vector<const char *> &ids,
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
+
+  // Reserve a contiguous range of entries; the entries themselves are only
+  // read after a barrier, so they can be filled in without the file lock.
+  size_t startIdx = __sync_fetch_and_add(&sharedDataHeader->numIncomingConMaps,
+                                         ids.size());
+  JASSERT(startIdx + ids.size() <= MAX_INCOMING_CONNECTIONS)
+    (startIdx) (ids.size());
   for (size_t i = 0; i < ids.size(); i++) {
-    size_t n = sharedDataHeader->numIncomingConMaps++;
+    size_t n = startIdx + i;
     memcpy(sharedDataHeader->incomingConMap[n].id, ids[i], CON_ID_LEN);
     memcpy(&sharedDataHeader->incomingConMap[n].addr, &receiverAddr, len);
     sharedDataHeader->incomingConMap[n].len = len;
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
 }
 
 void
@@ -744,19 +927,31 @@ SharedData::getMissingConMaps(IncomingConMap **map, uint32_t *nmaps)
   *nmaps = sharedDataHeader->numIncomingConMaps;
 }
 
+// The first process to insert a given (devnum, inode) in the current
+// generation becomes the checkpoint leader for that file.
 void
 SharedData::insertInodeConnIdMaps(vector<InodeConnIdMap> &maps)
 {
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
-  size_t startIdx = sharedDataHeader->numInodeConnIdMaps;
-  sharedDataHeader->numInodeConnIdMaps += maps.size();
-  Util::unlockFile(PROTECTED_SHM_FD);
-
+  uint32_t epoch = sharedDataHeader->compId._computation_generation;
   for (size_t i = 0; i < maps.size(); i++) {
-    sharedDataHeader->inodeConnIdMap[startIdx + i] = maps[i];
+    InodeConnIdSlot key;
+    bool inserted;
+    key.map = maps[i];
+    InodeConnIdSlot *slot =
+      findOrInsertSlot(sharedDataHeader->inodeConnIdMap,
+                       INODE_CONN_ID_TABLE_SIZE,
+                       hashInode(maps[i].devnum, maps[i].inode),
+                       key, epoch, true, &inserted);
+    JASSERT(slot != NULL) (maps[i].devnum) (maps[i].inode)
+    .Text("Inode-ConnId table is full.");
+    if (inserted) {
+      uint32_t n =
+        __sync_add_and_fetch(&sharedDataHeader->numInodeConnIdMaps, 1);
+      JASSERT(n <= MAX_INODE_PID_MAPS) (n);
+    }
   }
 }
 
@@ -767,14 +962,104 @@ SharedData::getCkptLeaderForFile(dev_t devnum, ino_t inode, void *id)
     initialize();
   }
   JASSERT(id != NULL);
-  if (sharedDataHeader->numInodeConnIdMaps > 0) {
-    for (int i = sharedDataHeader->numInodeConnIdMaps - 1; i >= 0; i--) {
-      InodeConnIdMap &map = sharedDataHeader->inodeConnIdMap[i];
-      if (map.devnum == devnum && map.inode == inode) {
-        memcpy(id, map.id, sizeof(map.id));
-        return true;
-      }
-    }
+  InodeConnIdSlot key;
+  key.map.devnum = devnum;
+  key.map.inode = inode;
+  InodeConnIdSlot *slot =
+    findOrInsertSlot(sharedDataHeader->inodeConnIdMap,
+                     INODE_CONN_ID_TABLE_SIZE,
+                     hashInode(devnum, inode), key,
+                     sharedDataHeader->compId._computation_generation,
+                     false, NULL);
+  if (slot == NULL) {
+    return false;
+  }
+  memcpy(id, slot->map.id, sizeof(slot->map.id));
+  return true;
+}
+
+// The first process to claim a given range of a shared file mapping in the
+// current generation writes its contents into its checkpoint image; the
+// other processes that map the same range record only a reference to it.
+bool
+SharedData::electSharedAreaLeader(const ProcMapsArea &area,
+                                  const DmtcpUniqueProcessId &candidate)
+{
+  if (sharedDataHeader == NULL) {
+    initialize();
+  }
+  SharedAreaSlot key;
+  bool inserted;
+  sharedAreaKey(area, &key);
+  key.map.leader = candidate;
+  SharedAreaSlot *slot =
+    findOrInsertSlot(sharedDataHeader->sharedAreaMap,
+                     SHARED_AREA_TABLE_SIZE,
+                     hashSharedArea(key.map), key,
+                     sharedDataHeader->compId._computation_generation,
+                     true, &inserted);
+  if (slot == NULL) {
+    // The table is full; every process saves its own copy.
+    return true;
+  }
+  if (inserted) {
+    __sync_add_and_fetch(&sharedDataHeader->numSharedAreaMaps, 1);
+    return true;
+  }
+  return slot->map.leader == candidate;
+}
+
+bool
+SharedData::getSharedAreaLeader(const ProcMapsArea &area,
+                                DmtcpUniqueProcessId *leader)
+{
+  if (sharedDataHeader == NULL) {
+    initialize();
+  }
+  JASSERT(leader != NULL);
+  SharedAreaSlot key;
+  sharedAreaKey(area, &key);
+  SharedAreaSlot *slot =
+    findOrInsertSlot(sharedDataHeader->sharedAreaMap,
+                     SHARED_AREA_TABLE_SIZE,
+                     hashSharedArea(key.map), key,
+                     sharedDataHeader->compId._computation_generation,
+                     false, NULL);
+  if (slot == NULL) {
+    return false;
+  }
+  *leader = slot->map.leader;
+  return true;
+}
+
+// The first process to claim a SysV IPC object in the current generation
+// saves it.  This replaces electing the leader through the object itself
+// (shm_lpid, sempid or msg_lspid), which took one or two system calls per
+// object in every process, plus a message per process for each queue.
+bool
+SharedData::electSysVLeader(int type,
+                            int32_t realId,
+                            const DmtcpUniqueProcessId &candidate)
+{
+  if (sharedDataHeader == NULL) {
+    initialize();
+  }
+  SysVLeaderSlot key;
+  bool inserted;
+  memset(&key, 0, sizeof(key));
+  key.type = type;
+  key.realId = realId;
+  key.leader = candidate;
+  SysVLeaderSlot *slot =
+    findOrInsertSlot(sharedDataHeader->sysvLeaderMap,
+                     SYSV_LEADER_TABLE_SIZE,
+                     hashId((uint32_t)realId ^ ((uint32_t)type << 24)), key,
+                     sharedDataHeader->compId._computation_generation,
+                     true, &inserted);
+  JASSERT(slot != NULL) (type) (realId).Text("SysV leader table is full.");
+  if (inserted) {
+    __sync_add_and_fetch(&sharedDataHeader->numSysVLeaders, 1);
+    return true;
   }
-  return false;
+  return slot->leader == candidate;
 }
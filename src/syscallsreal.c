@@ -248,6 +248,17 @@ static int dmtcp_wrappers_initialized = 0;
 static void
 initialize_libc_wrappers()
 {
+  const char *cacheDir = getenv(ENV_VAR_DLSYM_CACHE_DIR);
+
+  // The symbol cache is mapped with these, and then speeds up the rest.
+  if (cacheDir != NULL) {
+    GET_FUNC_ADDR(open);
+    GET_FUNC_ADDR(close);
+    GET_FUNC_ADDR(mmap);
+    GET_FUNC_ADDR(munmap);
+    GET_FUNC_ADDR(syscall);
+    dmtcp_dlsym_cache_init(cacheDir);
+  }
   FOREACH_DMTCP_WRAPPER(GET_FUNC_ADDR);
 #ifdef __i386__
 
@@ -94,8 +94,8 @@ struct Thread {
    */
   double ckptReadTime;
 
-  Thread *next;
-  Thread *prev;
+  Thread *next;         // link in the freelist
+  size_t activeIdx;     // index in the array of active threads
 };
 
 #ifdef __cplusplus
@@ -1,3 +1,5 @@
+#include <limits.h>
+#include <linux/futex.h>
 #include <linux/version.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -5,6 +7,7 @@
 #include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "config.h"
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 11) || \
@@ -16,6 +19,7 @@
 #include "jassert.h"
 #include "ckptserializer.h"
 #include "dmtcpalloc.h"
+#include "dmtcp_dlsym.h"
 #include "dmtcpworker.h"
 #include "mtcp/mtcp_header.h"
 #include "pluginmanager.h"
@@ -49,15 +53,35 @@ void **motherofall_saved_sp = NULL;
 ThreadTLSInfo *motherofall_tlsInfo = NULL;
 pid_t motherpid = 0;
 sigset_t sigpending_global;
-Thread *activeThreads = NULL;
 void *saved_sysinfo;
 MYINFO_GS_T myinfo_gs __attribute__((visibility("hidden")));
 
 static const char *DMTCP_PRGNAME_PREFIX = "DMTCP:";
 
+// Active thread descriptors are kept in a contiguous array (rather than a
+// linked list) so that suspendThreads() walks memory linearly even with
+// thousands of threads.  The tids are mirrored in a parallel array; the
+// duplicate-tid check in addToActiveList() scans only that.
+#define ACTIVE_THREADS_INITIAL_SIZE 64
+
+// Zombie descriptors are swept from addToActiveList() only once there are
+// this many of them (and at least as many as were left after the last sweep),
+// so that the cost of the sweep is amortized over thread creations.
+#define ZOMBIE_SWEEP_MIN            32
+
+// While waiting for threads to suspend, rescan for threads that exited after
+// being signaled at this interval.
+#define SUSPEND_RESCAN_NSEC         (10 * 1000 * 1000)
+
+static Thread **activeThreads = NULL;
+static pid_t *activeTids = NULL;
+static size_t numActiveThreads = 0;
+static size_t activeThreadsSize = 0;
+static volatile int numZombieThreads = 0;
+static int nextZombieSweep = ZOMBIE_SWEEP_MIN;
+
 static Thread *threads_freelist = NULL;
 static pthread_mutex_t threadlistLock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t threadStateLock = PTHREAD_MUTEX_INITIALIZER;
 
 static pthread_rwlock_t threadResumeLock = PTHREAD_RWLOCK_INITIALIZER;
 
@@ -66,6 +90,13 @@ static Thread *ckptThread = NULL;
 static int numUserThreads = 0;
 static bool originalstartup;
 
+// User threads increment numSuspendedThreads once they have saved their
+// context.  It doubles as the futex word the checkpoint thread sleeps on; a
+// thread only issues FUTEX_WAKE once the count reaches suspendTarget.
+static volatile int numSuspendedThreads = 0;
+static volatile int suspendTarget = INT_MAX;
+static double suspendTime = 0.0;
+
 extern bool sem_launch_first_time;
 extern sem_t sem_launch; // allocated in coordinatorapi.cpp
 static sem_t semNotifyCkptThread;
@@ -83,7 +114,7 @@ static void Thread_RestoreSigState(Thread *th);
 
 /*****************************************************************************
  *
- * Lock and unlock the 'activeThreads' list
+ * Lock and unlock the 'activeThreads' array
  *
  *****************************************************************************/
 static void
@@ -129,17 +160,18 @@ save_sp(void **sp)
 
 /*****************************************************************************
  *
- * New process. Empty the activeThreads list
+ * New process. Empty the activeThreads array
  *
  *****************************************************************************/
 void
 ThreadList::resetOnFork()
 {
   lock_threads();
-  while (activeThreads != NULL) {
-    ThreadList::threadIsDead(activeThreads); // takes care of updating
-                                             // "activeThreads" ptr.
+  while (numActiveThreads > 0) {
+    ThreadList::threadIsDead(activeThreads[numActiveThreads - 1]);
   }
+  numZombieThreads = 0;
+  nextZombieSweep = ZOMBIE_SWEEP_MIN;
   unlk_threads();
   init();
 }
@@ -241,6 +273,9 @@ ThreadList::initThread(Thread *th, int (*fn)(
 void
 ThreadList::threadExit()
 {
+  // Count the zombie first, so that threadIsDead() never sees ST_ZOMBIE
+  // without the matching increment.
+  __sync_add_and_fetch(&numZombieThreads, 1);
   curThread->state = ST_ZOMBIE;
 }
 
@@ -314,7 +349,7 @@ prepareMtcpHeader(MtcpHeader *mtcpHdr)
 void
 ThreadList::writeCkpt()
 {
-  // Remove stale threads from activeThreads list.
+  // Free the descriptors of threads removed from activeThreads.
   emptyFreeList();
   SigInfo::saveSigHandlers();
 
@@ -431,92 +466,163 @@ checkpointhread(void *dummy)
   return NULL;
 }
 
+/*************************************************************************
+ *
+ *  Count the threads that still have to report in as suspended.  Threads
+ *  that exited after being signaled are removed here; a thread that called
+ *  threadExit() after being signaled will never suspend and is not counted.
+ *  Must be called with the thread list locked.
+ *
+ *************************************************************************/
+static int
+countSuspendingThreads()
+{
+  int count = 0;
+  size_t i = 0;
+
+  while (i < numActiveThreads) {
+    Thread *thread = activeThreads[i];
+
+    switch (thread->state) {
+    case ST_SIGNALED:
+      if (THREAD_TGKILL(motherpid, thread->tid, 0) == -1 && errno == ESRCH) {
+        ThreadList::threadIsDead(thread);
+        continue; // Slot i now holds a different thread.
+      }
+      count++;
+      break;
+
+    case ST_SUSPINPROG:
+    case ST_SUSPENDED:
+      count++;
+      break;
+
+    default:
+      break;
+    }
+    i++;
+  }
+  return count;
+}
+
+static double
+timespecDiff(const struct timespec *end, const struct timespec *start)
+{
+  return (end->tv_sec - start->tv_sec) +
+         (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static void
 suspendThreads()
 {
-  int needrescan;
-  Thread *thread;
-  Thread *next;
+  struct timespec startTime;
+  struct timespec endTime;
+  size_t i;
+  int numSignaled = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
 
   JASSERT(pthread_rwlock_destroy(&threadResumeLock) == 0) (JASSERT_ERRNO);
   JASSERT(pthread_rwlock_init(&threadResumeLock, NULL) == 0)
     (JASSERT_ERRNO);
   JASSERT(_real_pthread_rwlock_wrlock(&threadResumeLock) == 0) (JASSERT_ERRNO);
 
-  /* Halt all other threads - force them to call stopthisthread
-   * If any have blocked checkpointing, wait for them to unblock before
-   * signalling
+  numSuspendedThreads = 0;
+  suspendTarget = INT_MAX;
+  __sync_synchronize();
+
+  /* Halt all other threads - force them to call stopthisthread.  Every
+   * running thread is signaled exactly once, in a single pass; we then sleep
+   * until the last of them reports in, instead of rescanning the list.
    */
   lock_threads();
-  do {
-    needrescan = 0;
-    numUserThreads = 0;
-    for (thread = activeThreads; thread != NULL; thread = next) {
-      next = thread->next;
-      int ret;
-
-      /* Do various things based on thread's state */
-      switch (thread->state) {
-      case ST_RUNNING:
-
-        /* Thread is running. Send it a signal so it will call stopthisthread.
-         * We will need to rescan (hopefully it will be suspended by then)
-         */
-        if (Thread_UpdateState(thread, ST_SIGNALED, ST_RUNNING)) {
-          if (THREAD_TGKILL(motherpid, thread->tid,
-                            SigInfo::ckptSignal()) < 0) {
-            JASSERT(errno == ESRCH) (JASSERT_ERRNO) (thread->tid)
-            .Text("error signalling thread");
-            ThreadList::threadIsDead(thread);
-          } else {
-            needrescan = 1;
-          }
-        }
-        break;
-
-      case ST_ZOMBIE:
-        ret = THREAD_TGKILL(motherpid, thread->tid, 0);
-        JASSERT(ret == 0 || errno == ESRCH);
-        if (ret == -1 && errno == ESRCH) {
-          ThreadList::threadIsDead(thread);
-        }
-        break;
-
-      case ST_SIGNALED:
-        if (THREAD_TGKILL(motherpid, thread->tid, 0) == -1 && errno == ESRCH) {
-          ThreadList::threadIsDead(thread);
-        } else {
-          needrescan = 1;
-        }
-        break;
-
-      case ST_SUSPINPROG:
-        numUserThreads++;
-        break;
-
-      case ST_SUSPENDED:
-        numUserThreads++;
-        break;
-
-      case ST_CKPNTHREAD:
-        break;
-
-      default:
-        JASSERT(false);
+  i = 0;
+  while (i < numActiveThreads) {
+    Thread *thread = activeThreads[i];
+    int ret;
+
+    /* Do various things based on thread's state */
+    switch (thread->state) {
+    case ST_RUNNING:
+
+      /* Thread is running. Send it a signal so it will call stopthisthread.
+       * If the state changed under us (the thread is exiting), look at this
+       * slot again.
+       */
+      if (!Thread_UpdateState(thread, ST_SIGNALED, ST_RUNNING)) {
+        continue;
       }
+      if (THREAD_TGKILL(motherpid, thread->tid, SigInfo::ckptSignal()) < 0) {
+        JASSERT(errno == ESRCH) (JASSERT_ERRNO) (thread->tid)
+        .Text("error signalling thread");
+        ThreadList::threadIsDead(thread);
+        continue;
+      }
+      numSignaled++;
+      break;
+
+    case ST_ZOMBIE:
+      ret = THREAD_TGKILL(motherpid, thread->tid, 0);
+      JASSERT(ret == 0 || errno == ESRCH);
+      if (ret == -1 && errno == ESRCH) {
+        ThreadList::threadIsDead(thread);
+        continue;
+      }
+      break;
+
+    case ST_SIGNALED:
+    case ST_SUSPINPROG:
+    case ST_SUSPENDED:
+      numSignaled++;
+      break;
+
+    case ST_CKPNTHREAD:
+      break;
+
+    default:
+      JASSERT(false);
     }
-    if (needrescan) {
-      usleep(10);
-    }
-  } while (needrescan);
+    i++;
+  }
   unlk_threads();
 
-  for (int i = 0; i < numUserThreads; i++) {
-    sem_wait(&semNotifyCkptThread);
+  /* Publish the target before re-reading the counter; a thread that arrives
+   * after this point sees the target and wakes us, and one that arrived
+   * earlier is already included in the count we read below.
+   */
+  suspendTarget = numSignaled;
+  __sync_synchronize();
+
+  while (1) {
+    int numSuspended = numSuspendedThreads;
+    if (numSuspended >= suspendTarget) {
+      break;
+    }
+
+    struct timespec timeout = { 0, SUSPEND_RESCAN_NSEC };
+    if (_real_syscall(SYS_futex, &numSuspendedThreads, FUTEX_WAIT_PRIVATE,
+                      numSuspended, &timeout, NULL, 0) == -1 &&
+        errno == ETIMEDOUT) {
+      // Some signaled thread may have exited instead of suspending.
+      lock_threads();
+      suspendTarget = countSuspendingThreads();
+      unlk_threads();
+      __sync_synchronize();
+    }
   }
+  numUserThreads = suspendTarget;
 
-  JASSERT(activeThreads != NULL);
-  JTRACE("everything suspended") (numUserThreads);
+  clock_gettime(CLOCK_MONOTONIC, &endTime);
+  suspendTime = timespecDiff(&endTime, &startTime);
+
+  JASSERT(numActiveThreads > 0);
+  JTRACE("everything suspended") (numUserThreads) (suspendTime);
+}
+
+double
+ThreadList::lastSuspendTime()
+{
+  return suspendTime;
 }
 
 /* Resume all threads. */
@@ -559,6 +665,13 @@ stopthisthread(int signum)
    * sigaction(STOPSIGNAL, stopthisthread) to discard all pending signals.
    */
 
+  // If this thread is inside the allocator (alloc plugin), it re-raises the
+  // signal once it leaves; until then it stays in ST_SIGNALED and the
+  // checkpoint thread keeps waiting for it.
+  if (dmtcp_alloc_defer_suspend != NULL && dmtcp_alloc_defer_suspend()) {
+    return;
+  }
+
   // make sure we don't get called twice for same thread
   if (Thread_UpdateState(curThread, ST_SUSPINPROG, ST_SIGNALED)) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 11)
@@ -589,7 +702,10 @@ stopthisthread(int signum)
 
       /* Tell the checkpoint thread that we're all saved away */
       JASSERT(Thread_UpdateState(curThread, ST_SUSPENDED, ST_SUSPINPROG));
-      sem_post(&semNotifyCkptThread);
+      if (__sync_add_and_fetch(&numSuspendedThreads, 1) >= suspendTarget) {
+        _real_syscall(SYS_futex, &numSuspendedThreads, FUTEX_WAKE_PRIVATE,
+                      1, NULL, NULL, 0);
+      }
 
       /* Then wait for the ckpt thread to write the ckpt file then wake us up */
       JTRACE("User thread suspended") (curThread->tid);
@@ -756,6 +872,7 @@ ThreadList::postRestart(double readTime)
   }
 
   SharedData::postRestart();
+  dmtcp_dlsym_cache_init(SharedData::getTmpDir().c_str());
 
   /* Fill in the new mother process id */
   motherpid = THREAD_REAL_TID();
@@ -766,7 +883,8 @@ ThreadList::postRestart(double readTime)
   Util::allowGdbDebug(DEBUG_POST_RESTART);
 
   sigfillset(&tmp);
-  for (thread = activeThreads; thread != NULL; thread = thread->next) {
+  for (size_t i = 0; i < numActiveThreads; i++) {
+    thread = activeThreads[i];
     struct MtcpRestartThreadArg mtcpRestartThreadArg;
     sigandset(&sigpending_global, &tmp, &(thread->sigpending));
     tmp = sigpending_global;
@@ -818,6 +936,7 @@ restarthread(void *threadv)
   Thread *thread = (Thread *)threadv;
 
   thread->tid = THREAD_REAL_TID();
+  activeTids[thread->activeIdx] = thread->tid;
 
   // This function and related ones are defined in src/mtcp/restore_libc.c
   TLSInfo_RestoreTLSState(&thread->tlsInfo);
@@ -867,15 +986,9 @@ restarthread(void *threadv)
 int
 Thread_UpdateState(Thread *th, ThreadState newval, ThreadState oldval)
 {
-  int res = 0;
-
-  JASSERT(_real_pthread_mutex_lock(&threadStateLock) == 0);
-  if (oldval == th->state) {
-    th->state = newval;
-    res = 1;
-  }
-  JASSERT(_real_pthread_mutex_unlock(&threadStateLock) == 0);
-  return res;
+  // A compare-and-swap on the descriptor itself; with thousands of threads
+  // entering stopthisthread() at once, a global state lock serializes them.
+  return __sync_bool_compare_and_swap(&th->state, oldval, newval);
 }
 
 /*****************************************************************************
@@ -933,8 +1046,7 @@ void
 ThreadList::addToActiveList(Thread *th)
 {
   int tid;
-  Thread *thread;
-  Thread *next_thread;
+  size_t i;
 
   lock_threads();
 
@@ -960,49 +1072,77 @@ ThreadList::addToActiveList(Thread *th)
   tid = curThread->tid;
   JASSERT(tid != 0);
 
-  // First remove duplicate descriptors.
-  for (thread = activeThreads; thread != NULL; thread = next_thread) {
-    next_thread = thread->next;
-    if (thread != curThread && thread->tid == tid) {
-      JTRACE("Removing duplicate thread descriptor")
-        (thread->tid) (thread->virtual_tid);
+  if (curThread->activeIdx < numActiveThreads &&
+      activeThreads[curThread->activeIdx] == curThread) {
+    // Already on the array; just refresh the tid.
+    activeTids[curThread->activeIdx] = tid;
+    unlk_threads();
+    return;
+  }
 
-      // There will be at most one duplicate descriptor.
-      threadIsDead(thread);
-      continue;
+  // First remove duplicate descriptors.  There will be at most one.
+  for (i = 0; i < numActiveThreads; i++) {
+    if (activeTids[i] == tid && activeThreads[i] != curThread) {
+      JTRACE("Removing duplicate thread descriptor")
+        (activeThreads[i]->tid) (activeThreads[i]->virtual_tid);
+      threadIsDead(activeThreads[i]);
+      break;
     }
+  }
 
-    // FIXME:  This causes segfault on second restart.  Why?
-    // JASSERT(thread != curThread)(thread)
-    // .Text("adding curThread, but it's already on activeThreads");
+  /* NOTE:  ST_ZOMBIE is used only for the sake of efficiency.  We
+   *   test threads in state ST_ZOMBIE using tgkill to remove them
+   *   early (before reaching a checkpoint) so that the
+   *   thread descriptor array does not grow too long.
+   */
+  if (numZombieThreads >= nextZombieSweep) {
+    i = 0;
+    while (i < numActiveThreads) {
+      Thread *thread = activeThreads[i];
 
-    /* NOTE:  ST_ZOMBIE is used only for the sake of efficiency.  We
-     *   test threads in state ST_ZOMBIE using tgkill to remove them
-     *   early (before reaching a checkpoint) so that the
-     *   threadrdescriptor list does not grow too long.
-     */
-    if (thread->state == ST_ZOMBIE) {
       /* if no thread with this tid, then we can remove zombie descriptor */
-      if (-1 == THREAD_TGKILL(motherpid, thread->tid, 0)) {
+      if (thread->state == ST_ZOMBIE &&
+          THREAD_TGKILL(motherpid, thread->tid, 0) == -1) {
         JTRACE("Killing zombie thread") (thread->tid);
         threadIsDead(thread);
+        continue; // Slot i now holds a different thread.
       }
+      i++;
     }
+    nextZombieSweep = 2 * numZombieThreads + ZOMBIE_SWEEP_MIN;
   }
 
-  curThread->next = activeThreads;
-  curThread->prev = NULL;
-  if (activeThreads != NULL) {
-    activeThreads->prev = curThread;
+  if (numActiveThreads == activeThreadsSize) {
+    size_t newSize = activeThreadsSize == 0 ? ACTIVE_THREADS_INITIAL_SIZE
+                                            : 2 * activeThreadsSize;
+    Thread **newThreads =
+      (Thread **)JALLOC_HELPER_MALLOC(newSize * sizeof(Thread *));
+    pid_t *newTids = (pid_t *)JALLOC_HELPER_MALLOC(newSize * sizeof(pid_t));
+    JASSERT(newThreads != NULL && newTids != NULL);
+    if (numActiveThreads > 0) {
+      memcpy(newThreads, activeThreads, numActiveThreads * sizeof(Thread *));
+      memcpy(newTids, activeTids, numActiveThreads * sizeof(pid_t));
+    }
+    if (activeThreads != NULL) {
+      JALLOC_HELPER_FREE(activeThreads);
+      JALLOC_HELPER_FREE(activeTids);
+    }
+    activeThreads = newThreads;
+    activeTids = newTids;
+    activeThreadsSize = newSize;
   }
-  activeThreads = curThread;
+
+  curThread->activeIdx = numActiveThreads;
+  activeThreads[numActiveThreads] = curThread;
+  activeTids[numActiveThreads] = tid;
+  numActiveThreads++;
 
   unlk_threads();
 }
 
 /*****************************************************************************
  *
- *  Thread has exited - move it from activeThreads list to freelist.
+ *  Thread has exited - move it from activeThreads array to freelist.
  *
  *  threadisdead() used to free() the Thread struct before returning. However,
  *  if we do that while in the middle of a checkpoint, the call to free() might
@@ -1012,6 +1152,9 @@ ThreadList::addToActiveList(Thread *th)
  *  This has an added benefit of reduced number of calls to malloc() as the
  *  Thread structs in the freelist can be recycled.
  *
+ *  The last thread of the array is moved into the vacated slot, so callers
+ *  iterating over activeThreads must look at the same index again.
+ *
  *****************************************************************************/
 void
 ThreadList::threadIsDead(Thread *thread)
@@ -1019,15 +1162,20 @@ ThreadList::threadIsDead(Thread *thread)
   JASSERT(thread != NULL);
   JTRACE("Putting thread on freelist") (thread->tid);
 
-  /* Remove thread block from 'threads' list */
-  if (thread->prev != NULL) {
-    thread->prev->next = thread->next;
-  }
-  if (thread->next != NULL) {
-    thread->next->prev = thread->prev;
+  size_t idx = thread->activeIdx;
+  JASSERT(idx < numActiveThreads && activeThreads[idx] == thread)
+    (idx) (numActiveThreads) (thread->tid);
+
+  /* Remove thread block from 'activeThreads' array */
+  numActiveThreads--;
+  if (idx != numActiveThreads) {
+    activeThreads[idx] = activeThreads[numActiveThreads];
+    activeTids[idx] = activeTids[numActiveThreads];
+    activeThreads[idx]->activeIdx = idx;
   }
-  if (thread == activeThreads) {
-    activeThreads = activeThreads->next;
+
+  if (thread->state == ST_ZOMBIE) {
+    __sync_sub_and_fetch(&numZombieThreads, 1);
   }
 
   thread->next = threads_freelist;
@@ -50,6 +50,7 @@ void emptyFreeList();
 
 void suspendThreads();
 void resumeThreads();
+double lastSuspendTime();
 void waitForAllRestored(Thread *thisthread);
 void writeCkpt();
 void postRestart(double readTime = 0.0);
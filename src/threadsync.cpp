@@ -19,10 +19,15 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <linux/futex.h>
 
 #include "jassert.h"
 #include "dmtcpworker.h"
@@ -59,6 +64,20 @@ using namespace dmtcp;
  *
  * XXX: Currently this security is provided only for the clone wrapper; this
  * should be extended to other calls as well.           -- KAPIL
+ *
+ * Reader bias:
+ *   Acquiring the read lock on every wrapper call makes all threads write to
+ *     the same cache line inside _wrapperExecutionLock.  Instead, while the
+ *     lock is "reader-biased", a reader only marks a slot in
+ *     _wrapperExecutionLockReaders (one cache line per slot; each thread is
+ *     assigned a slot on first use) and then re-checks the bias flag.
+ *   A writer (the checkpoint thread, or a fork/exec wrapper in exclusive
+ *     mode) first acquires the write lock, then revokes the bias and waits
+ *     for all reader slots to drain.  Readers that find the bias revoked, or
+ *     their slot taken by another thread, fall back to the rwlock.
+ *   When the rwlock is busy because a writer holds it (or is about to), the
+ *     reader waits on a futex that the last writer wakes up on release,
+ *     instead of retrying after a fixed sleep.
  */
 
 // NOTE: PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP is not POSIX.
@@ -82,7 +101,27 @@ static bool _checkpointThreadInitialized = false;
 
 static pthread_mutex_t preResumeThreadCountLock = PTHREAD_MUTEX_INITIALIZER;
 
+// Must be a power of two.
+#define WRAPPER_LOCK_READER_SLOTS 512
+
+struct WrapperLockReaderSlot {
+  volatile int32_t held;
+  char pad[64 - sizeof(int32_t)];
+} __attribute__((aligned(64)));
+
+static WrapperLockReaderSlot
+  _wrapperExecutionLockReaders[WRAPPER_LOCK_READER_SLOTS];
+static volatile int32_t _wrapperExecutionLockReaderBias = 1;
+
+// Number of threads holding or waiting for the write lock; readers wait on
+// this as a futex.
+static volatile int32_t _wrapperExecutionLockNumWriters = 0;
+static uint32_t _nextWrapperLockReaderSlot = 0;
+
 static __thread int _wrapperExecutionLockLockCount = 0;
+static __thread int _wrapperLockReaderSlotIdx = -1;
+static __thread bool _wrapperLockHeldViaReaderSlot = false;
+static __thread bool _wrapperLockHeldExcl = false;
 static __thread int _threadCreationLockLockCount = 0;
 #if TRACK_DLOPEN_DLSYM_FOR_LOCKS
 static __thread bool _threadPerformingDlopenDlsym = false;
@@ -116,6 +155,9 @@ ThreadSync::initThread()
   // pthread_start -> threadFinishedInitialization -> stopthisthread ->
   // callbackHoldsAnyLocks -> JASSERT().
   _wrapperExecutionLockLockCount = 0;
+  _wrapperLockReaderSlotIdx = -1;
+  _wrapperLockHeldViaReaderSlot = false;
+  _wrapperLockHeldExcl = false;
   _threadCreationLockLockCount = 0;
 #if TRACK_DLOPEN_DLSYM_FOR_LOCKS
   _threadPerformingDlopenDlsym = false;
@@ -124,6 +166,114 @@ ThreadSync::initThread()
   _hasThreadFinishedInitialization = false;
 }
 
+static void
+wrapperExecutionLockWakeReaders()
+{
+  _real_syscall(SYS_futex, &_wrapperExecutionLockNumWriters,
+                FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void
+wrapperExecutionLockWaitForWriters()
+{
+  int32_t numWriters = _wrapperExecutionLockNumWriters;
+
+  if (numWriters == 0) {
+    // The writer has already left (or the rwlock was only momentarily busy).
+    sched_yield();
+    return;
+  }
+
+  // Returns on wake-up, on EAGAIN if the writer count changed, or on EINTR.
+  _real_syscall(SYS_futex, &_wrapperExecutionLockNumWriters,
+                FUTEX_WAIT_PRIVATE, numWriters, NULL, NULL, 0);
+}
+
+// Fast path for readers while the lock is reader-biased.  Returns false if
+// the caller must use the rwlock instead.
+static bool
+wrapperExecutionLockReaderSlotLock()
+{
+  if (!_wrapperExecutionLockReaderBias) {
+    return false;
+  }
+
+  if (_wrapperLockReaderSlotIdx == -1) {
+    _wrapperLockReaderSlotIdx =
+      __sync_fetch_and_add(&_nextWrapperLockReaderSlot, 1) &
+      (WRAPPER_LOCK_READER_SLOTS - 1);
+  }
+
+  WrapperLockReaderSlot *slot =
+    &_wrapperExecutionLockReaders[_wrapperLockReaderSlotIdx];
+  if (!__sync_bool_compare_and_swap(&slot->held, 0, 1)) {
+    return false;
+  }
+
+  // The CAS above is a full barrier; a writer that revoked the bias after
+  // this point will wait for our slot to be released.
+  if (!_wrapperExecutionLockReaderBias) {
+    __sync_lock_release(&slot->held);
+    return false;
+  }
+  _wrapperLockHeldViaReaderSlot = true;
+  return true;
+}
+
+static void
+wrapperExecutionLockReaderSlotUnlock()
+{
+  __sync_lock_release(
+    &_wrapperExecutionLockReaders[_wrapperLockReaderSlotIdx].held);
+  _wrapperLockHeldViaReaderSlot = false;
+}
+
+// Called by a writer after it acquired the rwlock in write mode.
+static void
+wrapperExecutionLockRevokeReaderBias()
+{
+  int ownSlot = _wrapperLockHeldViaReaderSlot ? _wrapperLockReaderSlotIdx : -1;
+
+  _wrapperExecutionLockReaderBias = 0;
+  __sync_synchronize();
+
+  for (int i = 0; i < WRAPPER_LOCK_READER_SLOTS; i++) {
+    int spins = 0;
+    while (i != ownSlot && _wrapperExecutionLockReaders[i].held) {
+      if (++spins < 100) {
+        sched_yield();
+      } else {
+        struct timespec sleepTime = { 0, 1000 * 1000 };
+        nanosleep(&sleepTime, NULL);
+      }
+    }
+  }
+}
+
+static int
+wrapperExecutionLockWrLock()
+{
+  __sync_fetch_and_add(&_wrapperExecutionLockNumWriters, 1);
+  int retVal = _real_pthread_rwlock_wrlock(&_wrapperExecutionLock);
+  if (retVal == 0) {
+    wrapperExecutionLockRevokeReaderBias();
+  } else {
+    __sync_fetch_and_sub(&_wrapperExecutionLockNumWriters, 1);
+  }
+  return retVal;
+}
+
+static int
+wrapperExecutionLockWrUnlock()
+{
+  _wrapperExecutionLockReaderBias = 1;
+  int retVal = _real_pthread_rwlock_unlock(&_wrapperExecutionLock);
+  if (__sync_sub_and_fetch(&_wrapperExecutionLockNumWriters, 1) == 0) {
+    wrapperExecutionLockWakeReaders();
+  }
+  return retVal;
+}
+
 void
 ThreadSync::initMotherOfAll()
 {
@@ -156,7 +306,7 @@ ThreadSync::acquireLocks()
   _threadCreationLockAcquiredByCkptThread = true;
 
   JTRACE("Waiting for other threads to exit DMTCP-Wrappers");
-  JASSERT(_real_pthread_rwlock_wrlock(&_wrapperExecutionLock) == 0)
+  JASSERT(wrapperExecutionLockWrLock() == 0)
     (JASSERT_ERRNO);
   _wrapperExecutionLockAcquiredByCkptThread = true;
 
@@ -174,7 +324,7 @@ ThreadSync::releaseLocks()
   JASSERT(WorkerState::currentState() == WorkerState::SUSPENDED);
 
   JTRACE("Releasing ThreadSync locks");
-  JASSERT(_real_pthread_rwlock_unlock(&_wrapperExecutionLock) == 0)
+  JASSERT(wrapperExecutionLockWrUnlock() == 0)
     (JASSERT_ERRNO);
   _wrapperExecutionLockAcquiredByCkptThread = false;
   JASSERT(_real_pthread_rwlock_unlock(&_threadCreationLock) == 0)
@@ -195,7 +345,14 @@ ThreadSync::resetLocks()
   _wrapperExecutionLock = newLock;
   _threadCreationLock = newLock;
 
+  // Threads of the parent process that held reader slots don't exist here.
+  memset(_wrapperExecutionLockReaders, 0, sizeof(_wrapperExecutionLockReaders));
+  _wrapperExecutionLockReaderBias = 1;
+  _wrapperExecutionLockNumWriters = 0;
+
   _wrapperExecutionLockLockCount = 0;
+  _wrapperLockHeldViaReaderSlot = false;
+  _wrapperLockHeldExcl = false;
   _threadCreationLockLockCount = 0;
 #if TRACK_DLOPEN_DLSYM_FOR_LOCKS
   _threadPerformingDlopenDlsym = false;
@@ -386,11 +543,14 @@ ThreadSync::wrapperExecutionLockLock()
         isOkToGrabLock() == true &&
         _wrapperExecutionLockLockCount == 0) {
       incrementWrapperExecutionLockLockCount();
+      if (wrapperExecutionLockReaderSlotLock()) {
+        lockAcquired = true;
+        break;
+      }
       int retVal = _real_pthread_rwlock_tryrdlock(&_wrapperExecutionLock);
       if (retVal != 0 && retVal == EBUSY) {
         decrementWrapperExecutionLockLockCount();
-        struct timespec sleepTime = { 0, 100 * 1000 * 1000 };
-        nanosleep(&sleepTime, NULL);
+        wrapperExecutionLockWaitForWriters();
         continue;
       }
       if (retVal != 0 && retVal != EDEADLK) {
@@ -458,7 +618,7 @@ ThreadSync::wrapperExecutionLockLockExcl()
   }
   if (WorkerState::currentState() == WorkerState::RUNNING) {
     incrementWrapperExecutionLockLockCount();
-    int retVal = _real_pthread_rwlock_wrlock(&_wrapperExecutionLock);
+    int retVal = wrapperExecutionLockWrLock();
     if (retVal != 0 && retVal != EDEADLK) {
       fprintf(stderr, "ERROR %s:%d %s: Failed to acquire lock\n",
               __FILE__, __LINE__, __PRETTY_FUNCTION__);
@@ -468,6 +628,7 @@ ThreadSync::wrapperExecutionLockLockExcl()
     if (!lockAcquired) {
       decrementWrapperExecutionLockLockCount();
     }
+    _wrapperLockHeldExcl = lockAcquired;
   }
   errno = saved_errno;
   return lockAcquired;
@@ -503,7 +664,18 @@ ThreadSync::wrapperExecutionLockUnlock()
   if (DmtcpWorker::exitInProgress()) {
     return;
   }
-  if (_real_pthread_rwlock_unlock(&_wrapperExecutionLock) != 0) {
+
+  int retVal;
+  if (_wrapperLockHeldExcl) {
+    _wrapperLockHeldExcl = false;
+    retVal = wrapperExecutionLockWrUnlock();
+  } else if (_wrapperLockHeldViaReaderSlot) {
+    wrapperExecutionLockReaderSlotUnlock();
+    retVal = 0;
+  } else {
+    retVal = _real_pthread_rwlock_unlock(&_wrapperExecutionLock);
+  }
+  if (retVal != 0) {
     fprintf(stderr, "ERROR %s:%d %s: Failed to release lock\n",
             __FILE__, __LINE__, __PRETTY_FUNCTION__);
     _exit(DMTCP_FAIL_RC);
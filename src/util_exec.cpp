@@ -439,6 +439,9 @@ Util::prepareDlsymWrapper()
   setenv(ENV_VAR_DLSYM_OFFSET, str, 1);
   sprintf(str, "%d", offset_m32);
   setenv(ENV_VAR_DLSYM_OFFSET_M32, str, 1);
+
+  // Lets the new process resolve its wrappers from the node's symbol cache.
+  setenv(ENV_VAR_DLSYM_CACHE_DIR, SharedData::getTmpDir().c_str(), 1);
 }
 
 static int32_t
@@ -28,10 +28,13 @@
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include "jassert.h"
 #include "constants.h"
 #include "dmtcp.h"
+#include "dmtcp_dlsym.h"
 #include "processinfo.h"
 #include "procmapsarea.h"
 #include "procselfmaps.h"
@@ -49,12 +52,14 @@
 
 #define _real_open           NEXT_FNC(open)
 #define _real_close          NEXT_FNC(close)
+#define _real_shmctl         NEXT_FNC(shmctl)
 
 using namespace dmtcp;
 
 EXTERNC int dmtcp_infiniband_enabled(void) __attribute__((weak));
 
 static bool skipWritingTextSegments = false;
+static bool restartOnSameNode = false;
 
 // FIXME:  Why do we create two global variable here?  They should at least
 // be static (file-private), and preferably local to a function.
@@ -78,6 +83,9 @@ static void writememoryarea(int fd, Area *area, int stack_was_seen);
 
 static void remap_nscd_areas(const vector<ProcMapsArea> &areas);
 
+static void mark_sysv_shm_area(Area *area);
+static bool is_shared_area_ref(const Area *area);
+
 /*****************************************************************************
  *
  *  This routine is called from time-to-time to write a new checkpoint file.
@@ -99,9 +107,15 @@ mtcp_writememoryareas(int fd)
   if (getenv(ENV_VAR_SKIP_WRITING_TEXT_SEGMENTS) != NULL) {
     skipWritingTextSegments = true;
   }
+  const char *sameNode = getenv(ENV_VAR_RESTART_ON_SAME_NODE);
+  restartOnSameNode = sameNode != NULL && strcmp(sameNode, "1") == 0;
 
   JTRACE("Performing checkpoint.");
 
+  // The image must not point to the dlsym cache, which is not saved in it.
+  // A restarted process maps the cache again in ThreadList::postRestart().
+  void *dlsymCache = dmtcp_dlsym_cache_detach();
+
   // Here we want to sync the shared memory pages with the backup files
   // FIXME: Why do we need this?
   // JTRACE("syncing shared memory with backup files");
@@ -159,7 +173,8 @@ mtcp_writememoryareas(int fd)
         (area.size)
         (ProcessInfo::instance().restoreBufLen());
       continue;
-    } else if (SharedData::isSharedDataRegion(area.addr)) {
+    } else if (SharedData::isSharedDataRegion(area.addr) ||
+               (dlsymCache != NULL && area.addr == (VA)dlsymCache)) {
       continue;
     }
 
@@ -245,6 +260,7 @@ mtcp_writememoryareas(int fd)
       area.name[0] = '\0';
     } else if (Util::isSysVShmArea(area)) {
       JTRACE("saving area as Anonymous") (area.name);
+      mark_sysv_shm_area(&area);
       area.flags = MAP_PRIVATE | MAP_ANONYMOUS;
       area.name[0] = '\0';
     } else if (Util::isNscdArea(area)) {
@@ -303,6 +319,33 @@ mtcp_writememoryareas(int fd)
 
   /* That's all folks */
   JASSERT(_real_close(fd) == 0);
+
+  dmtcp_dlsym_cache_attach(dlsymCache);
+}
+
+/* Records the SysV shared memory segment that area belongs to, so that
+ * mtcp_restart can recreate and attach the segment first, and then read the
+ * contents straight into it.  Otherwise, the contents are restored to a
+ * private anonymous area, which the SysV IPC plugin copies into a new segment.
+ */
+static void
+mark_sysv_shm_area(Area *area)
+{
+#if defined(SYS_shmget) && defined(SYS_shmat) && defined(SYS_shmctl)
+  struct shmid_ds info;
+
+  // The inode number of a SysV shared memory mapping is its real shmid.
+  if (_real_shmctl(area->inodenum, IPC_STAT, &info) == -1) {
+    JTRACE("shmctl(IPC_STAT) failed; saving a private copy")
+      (area->inodenum) (JASSERT_ERRNO);
+    return;
+  }
+  area->properties |= DMTCP_SYSV_SHM_AREA;
+  area->shmAddr = area->addr - area->offset;
+  area->shmSize = info.shm_segsz;
+  area->shmKey = info.shm_perm.__key;
+  area->shmMode = info.shm_perm.mode & 0777;
+#endif // if defined(SYS_shmget) && defined(SYS_shmat) && ...
 }
 
 static void
@@ -397,7 +440,8 @@ mtcp_write_non_rwx_and_anonymous_pages(int fd, Area *orig_area)
       mtcp_get_next_page_range(&a, &size, &is_zero);
     }
 
-    a.properties = is_zero ? DMTCP_ZERO_PAGE : 0;
+    a.properties = (area.properties & DMTCP_SYSV_SHM_AREA) |
+                   (is_zero ? DMTCP_ZERO_PAGE : 0);
     a.size = size;
 
     Util::writeAll(fd, &a, sizeof(a));
@@ -422,6 +466,23 @@ mtcp_write_non_rwx_and_anonymous_pages(int fd, Area *orig_area)
   }
 }
 
+/* True if the file plugin elected another process to save this range of a
+ * MAP_SHARED file mapping.  See FileConnList::prepareShmList().  Unless the
+ * processes will be restarted on the same node, each one saves its own copy.
+ */
+static bool
+is_shared_area_ref(const Area *area)
+{
+  DmtcpUniqueProcessId leader;
+
+  if (!restartOnSameNode ||
+      (area->flags & MAP_SHARED) == 0 || area->name[0] != '/') {
+    return false;
+  }
+  return SharedData::getSharedAreaLeader(*area, &leader) &&
+         leader != ProcessInfo::instance().upid().upid();
+}
+
 static void
 writememoryarea(int fd, Area *area, int stack_was_seen)
 {
@@ -461,6 +522,15 @@ writememoryarea(int fd, Area *area, int stack_was_seen)
      * mappings only
      */
     mtcp_write_non_rwx_and_anonymous_pages(fd, area);
+  } else if (is_shared_area_ref(area)) {
+    /* Another process on this node maps the same range of the file and
+     * writes its contents.  On restart, the file plugin maps the range from
+     * the file that the other process restores.
+     */
+    area->properties |= DMTCP_SHARED_AREA_REF;
+    Util::writeAll(fd, area, sizeof(*area));
+    JTRACE("Skipping over shared area saved by another process")
+      (area->name) ((void *)area->addr) (area->size);
   } else {
     /* Anonymous sections need to have their data copied to the file,
      *   as there is no file that contains their data
@@ -726,6 +726,16 @@ resource.setrlimit(resource.RLIMIT_STACK, [newCurrLimit, oldLimit[1]])
 runTest("dmtcp5",        2, ["./test/dmtcp5"])
 resource.setrlimit(resource.RLIMIT_STACK, oldLimit)
 
+# The basic tests again, with the core plugins loaded from the single
+# combined library, libdmtcp_core.so, instead of one library per plugin.
+runTest("dmtcp1-core-plugins", 1, ["--core-plugins ./test/dmtcp1"])
+
+runTest("dmtcp2-core-plugins", 1, ["--core-plugins ./test/dmtcp2"])
+
+runTest("dmtcp3-core-plugins", 1, ["--core-plugins ./test/dmtcp3"])
+
+runTest("dmtcp4-core-plugins", 1, ["--core-plugins ./test/dmtcp4"])
+
 # Test for a bunch of system calls. We want to use the 'xc' mode for
 # checkpointing so that the process is killed right after checkpoint. Otherwise
 # the syscall-tester could fail in the following case:
@@ -753,6 +763,11 @@ S=10*DEFAULT_S
 runTest("file2",         1, ["./test/file2"])
 S=DEFAULT_S
 
+# Saves unlinked files through the content-addressed file store.
+os.environ['DMTCP_CKPT_FILE_STORE'] = "1"
+runTest("file3",         1, ["./test/file3"])
+del os.environ['DMTCP_CKPT_FILE_STORE']
+
 # Test for normal file, /dev/tty, proc file, and illegal pathname
 runTest("stat",         1, ["./test/stat"])
 
@@ -844,6 +859,27 @@ if not USE_M32:  # waitpid forks a 64-bit child process, /bin/sleep
 
 runTest("client-server", 2, ["./test/client-server"])
 
+# TCP_REPAIR needs CAP_NET_ADMIN, as root or in a user and net namespace.
+def hasTcpRepair():
+  TCP_REPAIR = 19
+  s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  try:
+    try:
+      s.setsockopt(socket.IPPROTO_TCP, TCP_REPAIR, 1)
+      return True
+    except socket.error:
+      return False
+  finally:
+    s.close()
+
+if hasTcpRepair():
+  os.environ['DMTCP_TCP_REPAIR'] = "1"
+  runTest("tcprepair1",    2, ["./test/tcprepair1"])
+  runTest("client-server-tcprepair", 2, ["./test/client-server"])
+  del os.environ['DMTCP_TCP_REPAIR']
+else:
+  print "Skipping tcprepair tests; TCP_REPAIR needs CAP_NET_ADMIN"
+
 # frisbee creates three processes, each with 14 MB, if no gzip is used
 os.environ['DMTCP_GZIP'] = "1"
 POST_LAUNCH_SLEEP=2
@@ -858,12 +894,16 @@ os.environ['DMTCP_GZIP'] = "0"
 S=10*DEFAULT_S
 runTest("shared-memory1", 2, ["./test/shared-memory1"])
 runTest("shared-memory2", 2, ["./test/shared-memory2"])
+runTest("shared-memory3", 2, ["./test/shared-memory3"])
 S=DEFAULT_S
 
 runTest("sysv-shm1",     2, ["./test/sysv-shm1"])
 runTest("sysv-shm2",     2, ["./test/sysv-shm2"])
 runTest("sysv-sem",      2, ["./test/sysv-sem"])
 runTest("sysv-msg",      2, ["./test/sysv-msg"])
+runTest("sysv-msg2",     2, ["./test/sysv-msg2"])
+runTest("sysv-shm3",     2, ["./test/sysv-shm3"])
+runTest("sysv-shm4",     1, ["./test/sysv-shm4"])
 
 # Makefile compiles cma only for Linux 3.2 and higher.
 if HAS_CMA == "yes":
@@ -883,8 +923,14 @@ runTest("pty2",   2, ["./test/pty2"])
 #Invoke this test when support for timers is added to DMTCP.
 runTest("timer1",   1, ["./test/timer1"])
 runTest("timer2",   1, ["./test/timer2"])
+runTest("timer3",   1, ["./test/timer3"])
 runTest("clock",   1, ["./test/clock"])
 
+# printenv runs outside of DMTCP, and so without LD_PRELOAD.
+os.environ['DMTCP_UNTRACKED_PROGRAMS'] = "printenv"
+runTest("untracked1", 1, ["./test/untracked1"])
+del os.environ['DMTCP_UNTRACKED_PROGRAMS']
+
 old_ld_library_path = os.getenv("LD_LIBRARY_PATH")
 if old_ld_library_path:
   os.environ['LD_LIBRARY_PATH'] += ':' + os.getenv("PWD") + \
@@ -0,0 +1,104 @@
+/* Measures the throughput of the jalib allocator (JAlloc), which DMTCP uses
+ * for its internal strings, maps and vectors, from many threads.  Each thread
+ * keeps a working set of chunks of mixed sizes and repeatedly frees and
+ * reallocates a random one of them:
+ *   ./test/bench-jalloc [num-threads] [seconds]
+ * Defaults to 16 threads for 5 seconds.  Prints the per-size-class
+ * statistics at the end.  Unlike the benchmarks in bench.c, it links in its
+ * own copy of jalib, and so it is not run under DMTCP.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "bench.h"
+#include "jalib.h"
+#include "jalloc.h"
+
+#define DEFAULT_THREADS 16
+#define DEFAULT_SECONDS 5
+#define WORKING_SET     64
+
+static volatile int done = 0;
+
+// Mostly small sizes, like strings and map nodes.
+static const size_t sizes[] = { 16, 24, 40, 48, 64, 100, 200, 500, 1000, 3000 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// Called by jalib on first use.  Outside of DMTCP, jalib can call libc
+// directly.
+extern "C" void
+initializeJalib()
+{
+  JalibFuncPtrs jalibFuncPtrs;
+
+  memset(&jalibFuncPtrs, 0, sizeof(jalibFuncPtrs));
+  jalibFuncPtrs.open = open;
+  jalibFuncPtrs.close = close;
+  jalibFuncPtrs.dup = dup;
+  jalibFuncPtrs.dup2 = dup2;
+  jalibFuncPtrs.readlink = readlink;
+  jalibFuncPtrs.mmap = mmap;
+  jalibFuncPtrs.munmap = munmap;
+  jalibFuncPtrs.read = read;
+  jalibFuncPtrs.write = write;
+  jalibFuncPtrs.pthread_mutex_lock = pthread_mutex_lock;
+  jalibFuncPtrs.pthread_mutex_trylock = pthread_mutex_trylock;
+  jalibFuncPtrs.pthread_mutex_unlock = pthread_mutex_unlock;
+  jalibFuncPtrs.writeAll = write;
+  jalibFuncPtrs.readAll = read;
+  jalib_init(jalibFuncPtrs, "", 2, -1, 1);
+}
+
+static void *
+threadMain(void *arg)
+{
+  unsigned long *count = (unsigned long *)arg;
+  void *chunks[WORKING_SET];
+  unsigned int seed = (unsigned int)(unsigned long)arg;
+  int i;
+
+  for (i = 0; i < WORKING_SET; i++) {
+    chunks[i] = jalib::JAllocDispatcher::malloc(sizes[i % NUM_SIZES]);
+  }
+
+  while (!done) {
+    i = rand_r(&seed) % WORKING_SET;
+    jalib::JAllocDispatcher::free(chunks[i]);
+    chunks[i] = jalib::JAllocDispatcher::malloc(sizes[rand_r(&seed) %
+                                                      NUM_SIZES]);
+    *count += 1;
+  }
+
+  for (i = 0; i < WORKING_SET; i++) {
+    jalib::JAllocDispatcher::free(chunks[i]);
+  }
+  return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int numThreads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  int seconds = argc > 2 ? atoi(argv[2]) : DEFAULT_SECONDS;
+  unsigned long total;
+  double elapsed;
+
+  if (numThreads < 1 || seconds < 1) {
+    fprintf(stderr, "Usage: %s [num-threads] [seconds]\n", argv[0]);
+    return 1;
+  }
+
+  total = runThreads(numThreads, seconds, threadMain, &done, &elapsed);
+  reportThreads(numThreads, "free+malloc pairs", total, elapsed);
+
+  for (size_t c = 0; c < jalib::JAllocDispatcher::numSizeClasses(); c++) {
+    jalib::JAllocStats stats;
+    jalib::JAllocDispatcher::getStats(c, &stats);
+    printf("chunk size %5zu: expands %zu  bytes mapped %zu  refills %zu"
+           "  flushes %zu\n",
+           stats.chunkSize, stats.numExpands, stats.bytesMapped,
+           stats.numRefills, stats.numFlushes);
+  }
+  return 0;
+}
@@ -0,0 +1,609 @@
+/* Micro-benchmarks for DMTCP.  These are not run by autotest.py.  Each one is
+ * run by name, natively and under dmtcp_launch to compare:
+ *   ./test/bench NAME [args...]
+ * Without arguments, lists the benchmarks with their arguments and defaults.
+ * The benchmarks that start dmtcp_launch themselves (exec, launch) must be
+ * run from the top directory.  bench-jalloc is separate, since it links in
+ * its own copy of jalib.
+ */
+
+// _GNU_SOURCE for syscall
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "dmtcp.h"
+
+#define MAX_ARGS 32
+
+static volatile int done = 0;
+
+static int
+compareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Runs argv to completion; returns the elapsed seconds.
+static double
+timeRun(char **argv)
+{
+  double start = now();
+  int status;
+  pid_t pid = fork();
+
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    execv(argv[0], argv);
+    perror("execv");
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) == -1 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s failed\n", argv[0]);
+    exit(1);
+  }
+  return now() - start;
+}
+
+// Fills launchArgv with "bin/dmtcp_launch --no-coordinator", then the
+// NULL-terminated extra options, the numOpts options in opts, and the
+// NULL-terminated command.
+static void
+makeLaunchArgv(char **launchArgv, char **extra, char **opts, int numOpts,
+               char **cmd)
+{
+  int n = 0;
+  int i;
+
+  launchArgv[n++] = "bin/dmtcp_launch";
+  launchArgv[n++] = "--no-coordinator";
+  for (i = 0; extra[i] != NULL; i++) {
+    launchArgv[n++] = extra[i];
+  }
+  for (i = 0; i < numOpts; i++) {
+    launchArgv[n++] = opts[i];
+  }
+  for (i = 0; cmd[i] != NULL; i++) {
+    launchArgv[n++] = cmd[i];
+  }
+  launchArgv[n] = NULL;
+}
+
+/*
+ * epoll: wake-up latency of a thread blocked in epoll_wait() with an infinite
+ * timeout, and the CPU time it uses while idle.  A client thread sends a byte
+ * over a socketpair every gap-us microseconds; the server thread waits for it
+ * with epoll_wait() and echoes it back.
+ */
+
+#define EPOLL_IDLE_SECONDS 2
+
+static int sv[2];
+
+static void *
+epollServer(void *arg)
+{
+  double *idleCpu = (double *)arg;
+  struct epoll_event ev;
+  int epfd = epoll_create1(0);
+  char c;
+
+  ev.events = EPOLLIN;
+  ev.data.fd = sv[1];
+  if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, sv[1], &ev) != 0) {
+    perror("epoll");
+    exit(1);
+  }
+
+  // The first byte arrives after EPOLL_IDLE_SECONDS; until then, the thread
+  // should not use any CPU time.
+  double start = threadCpuSeconds();
+  while (1) {
+    int n = epoll_wait(epfd, &ev, 1, -1);
+    if (n == -1) {
+      perror("epoll_wait");
+      exit(1);
+    }
+    if (*idleCpu < 0) {
+      *idleCpu = threadCpuSeconds() - start;
+    }
+    if (read(sv[1], &c, 1) != 1 || c == 'q') {
+      break;
+    }
+    if (write(sv[1], &c, 1) != 1) {
+      perror("write");
+      exit(1);
+    }
+  }
+  close(epfd);
+  return NULL;
+}
+
+static int
+benchEpoll(int argc, char *argv[])
+{
+  int roundTrips = argc > 1 ? atoi(argv[1]) : 2000;
+  int gapUs = argc > 2 ? atoi(argv[2]) : 1000;
+  double idleCpu = -1;
+  double *latencies;
+  double total = 0;
+  pthread_t server;
+  char c = 'p';
+  int i;
+
+  if (roundTrips < 1 || gapUs < 0) {
+    return -1;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+  latencies = malloc(roundTrips * sizeof(double));
+  pthread_create(&server, NULL, epollServer, &idleCpu);
+  sleep(EPOLL_IDLE_SECONDS);
+
+  for (i = 0; i < roundTrips; i++) {
+    double start = now();
+    if (write(sv[0], &c, 1) != 1 || read(sv[0], &c, 1) != 1) {
+      perror("ping");
+      return 1;
+    }
+    latencies[i] = (now() - start) * 1e6;
+    total += latencies[i];
+    if (gapUs > 0) {
+      usleep(gapUs);
+    }
+  }
+
+  c = 'q';
+  if (write(sv[0], &c, 1) != 1) {
+    perror("write");
+    return 1;
+  }
+  pthread_join(server, NULL);
+
+  qsort(latencies, roundTrips, sizeof(double), compareDoubles);
+  printf("round trips: %d  gap us: %d  latency us: mean %.1f  p50 %.1f"
+         "  p99 %.1f  max %.1f\n",
+         roundTrips, gapUs, total / roundTrips,
+         latencies[roundTrips / 2], latencies[roundTrips * 99 / 100],
+         latencies[roundTrips - 1]);
+  printf("idle server CPU time over %d s: %.3f ms\n",
+         EPOLL_IDLE_SECONDS, idleCpu * 1e3);
+  free(latencies);
+  return 0;
+}
+
+/*
+ * exec: cost of exec under DMTCP, with a shell loop that runs a pipeline of
+ * three /bin/true processes, each of which forks and execs.  The loop is
+ * timed natively, under "dmtcp_launch --no-coordinator", and again with
+ * "--untracked-programs true", which runs /bin/true outside of DMTCP.
+ */
+
+#define EXEC_PIPELINE_LENGTH 3
+
+static int
+benchExec(int argc, char *argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  char script[256];
+  char *nativeArgv[] = { "/bin/sh", "-c", script, NULL };
+  char *noExtra[] = { NULL };
+  char *untrackedExtra[] = { "--untracked-programs", "true", NULL };
+  char *launchArgv[MAX_ARGS];
+  char *untrackedArgv[MAX_ARGS];
+  int numExecs;
+  double native, launched, untracked;
+
+  if (iterations < 1 || argc > MAX_ARGS - 8) {
+    return -1;
+  }
+
+  snprintf(script, sizeof(script),
+           "i=0; while [ $i -lt %d ]; do"
+           " /bin/true | /bin/true | /bin/true; i=$((i+1)); done",
+           iterations);
+  numExecs = iterations * EXEC_PIPELINE_LENGTH;
+  makeLaunchArgv(launchArgv, noExtra, argv + 2, argc - 2, nativeArgv);
+  makeLaunchArgv(untrackedArgv, untrackedExtra, argv + 2, argc - 2,
+                 nativeArgv);
+
+  native = timeRun(nativeArgv);
+  launched = timeRun(launchArgv);
+  untracked = timeRun(untrackedArgv);
+
+  printf("execs: %d  native: %.3f ms/exec  dmtcp_launch: %.3f ms/exec"
+         "  overhead: %.3f ms/exec\n",
+         numExecs, native * 1e3 / numExecs, launched * 1e3 / numExecs,
+         (launched - native) * 1e3 / numExecs);
+  printf("untracked /bin/true: %.3f ms/exec  overhead: %.3f ms/exec\n",
+         untracked * 1e3 / numExecs, (untracked - native) * 1e3 / numExecs);
+  return 0;
+}
+
+/*
+ * launch: startup latency of short processes, by running
+ * "dmtcp_launch --no-coordinator /bin/true" in a loop.  Compare with and
+ * without --core-plugins.  /bin/true is also timed without DMTCP.
+ */
+
+static int
+benchLaunch(int argc, char *argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  char *nativeArgv[] = { "/bin/true", NULL };
+  char *noExtra[] = { NULL };
+  char *launchArgv[MAX_ARGS];
+  double native = 0;
+  double launched = 0;
+  int i;
+
+  if (iterations < 1 || argc > MAX_ARGS - 4) {
+    return -1;
+  }
+  makeLaunchArgv(launchArgv, noExtra, argv + 2, argc - 2, nativeArgv);
+
+  for (i = 0; i < iterations; i++) {
+    native += timeRun(nativeArgv);
+  }
+  for (i = 0; i < iterations; i++) {
+    launched += timeRun(launchArgv);
+  }
+  native /= iterations;
+  launched /= iterations;
+
+  printf("iterations: %d  native: %.3f ms  dmtcp_launch: %.3f ms"
+         "  overhead: %.3f ms\n",
+         iterations, native * 1e3, launched * 1e3, (launched - native) * 1e3);
+  return 0;
+}
+
+/*
+ * pidvirt: throughput of the pid-translating wrappers kill() and tgkill()
+ * from many threads.
+ */
+
+static pid_t childPid;
+
+static void *
+pidvirtThread(void *arg)
+{
+  unsigned long *count = (unsigned long *)arg;
+  pid_t pid = getpid();
+  pid_t tid = syscall(SYS_gettid);
+
+  while (!done) {
+    // Translates a pid of another process.
+    if (kill(childPid, 0) != 0) {
+      perror("kill");
+      exit(1);
+    }
+
+    // Translates our own pid and tid.
+    if (syscall(SYS_tgkill, pid, tid, 0) != 0) {
+      perror("tgkill");
+      exit(1);
+    }
+    *count += 2;
+  }
+  return NULL;
+}
+
+static int
+benchPidvirt(int argc, char *argv[])
+{
+  int numThreads = argc > 1 ? atoi(argv[1]) : 64;
+  int seconds = argc > 2 ? atoi(argv[2]) : 5;
+  unsigned long total;
+  double elapsed;
+
+  if (numThreads < 1 || seconds < 1) {
+    return -1;
+  }
+
+  childPid = fork();
+  if (childPid == 0) {
+    while (1) {
+      pause();
+    }
+  }
+
+  total = runThreads(numThreads, seconds, pidvirtThread, &done, &elapsed);
+
+  kill(childPid, SIGKILL);
+  waitpid(childPid, NULL, 0);
+
+  reportThreads(numThreads, "calls", total, elapsed);
+  return 0;
+}
+
+/*
+ * procpath: cost of the path-based wrappers open() and stat() on a regular
+ * file and on a /proc/<pid> file, which the pid plugin translates.  The time
+ * is split evenly between the four measurements.
+ */
+
+static void
+procpathOpen(const char *label, const char *path, double seconds)
+{
+  unsigned long count = 0;
+  double start = now();
+  double elapsed;
+
+  do {
+    int i;
+    for (i = 0; i < 1000; i++) {
+      int fd = open(path, O_RDONLY);
+      if (fd == -1) {
+        perror("open");
+        exit(1);
+      }
+      close(fd);
+    }
+    count += 1000;
+    elapsed = now() - start;
+  } while (elapsed < seconds);
+
+  printf("open+close %-8s calls: %lu  calls/sec: %.0f  ns/call: %.1f\n",
+         label, count, count / elapsed, elapsed * 1e9 / count);
+}
+
+static void
+procpathStat(const char *label, const char *path, double seconds)
+{
+  unsigned long count = 0;
+  double start = now();
+  double elapsed;
+  struct stat st;
+
+  do {
+    int i;
+    for (i = 0; i < 1000; i++) {
+      if (stat(path, &st) != 0) {
+        perror("stat");
+        exit(1);
+      }
+    }
+    count += 1000;
+    elapsed = now() - start;
+  } while (elapsed < seconds);
+
+  printf("stat       %-8s calls: %lu  calls/sec: %.0f  ns/call: %.1f\n",
+         label, count, count / elapsed, elapsed * 1e9 / count);
+}
+
+static int
+benchProcpath(int argc, char *argv[])
+{
+  int seconds = argc > 1 ? atoi(argv[1]) : 5;
+  char regularPath[] = "/tmp/bench-procpath-XXXXXX";
+  char procPath[64];
+  int fd;
+
+  if (seconds < 1) {
+    return -1;
+  }
+
+  fd = mkstemp(regularPath);
+  if (fd == -1) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  snprintf(procPath, sizeof(procPath), "/proc/%d/status", (int)getpid());
+
+  procpathOpen("regular", regularPath, seconds / 4.0);
+  procpathOpen("proc", procPath, seconds / 4.0);
+  procpathStat("regular", regularPath, seconds / 4.0);
+  procpathStat("proc", procPath, seconds / 4.0);
+
+  unlink(regularPath);
+  return 0;
+}
+
+/*
+ * threads: how long a checkpoint takes with many threads, which block on a
+ * condition variable while checkpoints are requested through the DMTCP API.
+ * Run natively, it only reports the thread creation time.  With
+ * --enable-timing, the per-process suspend latency is also logged to
+ * timings.<upid>.csv in the ckpt dir.
+ */
+
+#define THREADS_STACK_SIZE (64 * 1024)
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static void *
+threadsWaiter(void *arg)
+{
+  pthread_mutex_lock(&mutex);
+  while (!done) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static int
+benchThreads(int argc, char *argv[])
+{
+  int numThreads = argc > 1 ? atoi(argv[1]) : 10000;
+  int numCkpts = argc > 2 ? atoi(argv[2]) : 3;
+  pthread_t *threads;
+  pthread_attr_t attr;
+  double start;
+  int i;
+
+  if (numThreads < 1 || numCkpts < 0) {
+    return -1;
+  }
+
+  threads = malloc(numThreads * sizeof(pthread_t));
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREADS_STACK_SIZE);
+
+  start = now();
+  for (i = 0; i < numThreads; i++) {
+    if (pthread_create(&threads[i], &attr, threadsWaiter, NULL) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  printf("threads: %d  create seconds: %.3f\n", numThreads, now() - start);
+
+  if (!dmtcp_is_enabled()) {
+    printf("not running under DMTCP; skipping checkpoints\n");
+    numCkpts = 0;
+  }
+
+  for (i = 0; i < numCkpts; i++) {
+    int ret;
+
+    start = now();
+    ret = dmtcp_checkpoint();
+    if (ret == DMTCP_AFTER_RESTART) {
+      printf("restarted\n");
+      break;
+    }
+    printf("ckpt %d: %.3f seconds\n", i, now() - start);
+  }
+
+  pthread_mutex_lock(&mutex);
+  done = 1;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  for (i = 0; i < numThreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  return 0;
+}
+
+/*
+ * timer: cost of the POSIX timer calls that the timer plugin wraps, with many
+ * timers in use.  Every timer is armed far in the future, and then
+ * timer_settime(), timer_gettime() and timer_getoverrun() are called on each
+ * of them in turn.
+ */
+
+static int
+benchTimer(int argc, char *argv[])
+{
+  int numTimers = argc > 1 ? atoi(argv[1]) : 4000;
+  int seconds = argc > 2 ? atoi(argv[2]) : 3;
+  struct itimerspec value = { { 1000, 0 }, { 1000, 0 } };
+  struct itimerspec curr;
+  struct sigevent sev;
+  unsigned long count = 0;
+  timer_t *timers;
+  double start, elapsed;
+  int i;
+
+  if (numTimers < 1 || seconds < 1) {
+    return -1;
+  }
+
+  signal(SIGUSR1, SIG_IGN);
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGUSR1;
+
+  timers = malloc(numTimers * sizeof(timer_t));
+  start = now();
+  for (i = 0; i < numTimers; i++) {
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timers[i]) != 0) {
+      perror("timer_create");
+      return 1;
+    }
+  }
+  printf("timer_create  timers: %d  us/call: %.2f\n",
+         numTimers, (now() - start) * 1e6 / numTimers);
+
+  start = now();
+  do {
+    for (i = 0; i < numTimers; i++) {
+      if (timer_settime(timers[i], 0, &value, NULL) != 0 ||
+          timer_gettime(timers[i], &curr) != 0 ||
+          timer_getoverrun(timers[i]) == -1) {
+        perror("timer");
+        return 1;
+      }
+    }
+    count += numTimers;
+    elapsed = now() - start;
+  } while (elapsed < seconds);
+
+  printf("settime+gettime+getoverrun  rounds: %lu  ns/round: %.1f\n",
+         count, elapsed * 1e9 / count);
+
+  for (i = 0; i < numTimers; i++) {
+    timer_delete(timers[i]);
+  }
+  free(timers);
+  return 0;
+}
+
+static struct {
+  const char *name;
+  const char *args;
+  int (*run)(int argc, char *argv[]);
+} benchmarks[] = {
+  { "epoll", "[round-trips=2000] [gap-us=1000]", benchEpoll },
+  { "exec", "[iterations=200] [dmtcp_launch options...]", benchExec },
+  { "launch", "[iterations=200] [dmtcp_launch options...]", benchLaunch },
+  { "pidvirt", "[num-threads=64] [seconds=5]", benchPidvirt },
+  { "procpath", "[seconds=5]", benchProcpath },
+  { "threads", "[num-threads=10000] [num-ckpts=3]", benchThreads },
+  { "timer", "[timers=4000] [seconds=3]", benchTimer },
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void
+usage(const char *prog)
+{
+  size_t i;
+
+  fprintf(stderr, "Usage: %s NAME [args...]\n", prog);
+  for (i = 0; i < NUM_BENCHMARKS; i++) {
+    fprintf(stderr, "  %-9s %s\n", benchmarks[i].name, benchmarks[i].args);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t i;
+
+  for (i = 0; argc > 1 && i < NUM_BENCHMARKS; i++) {
+    if (strcmp(argv[1], benchmarks[i].name) == 0) {
+      int ret = benchmarks[i].run(argc - 1, argv + 1);
+      if (ret == -1) {
+        fprintf(stderr, "Usage: %s %s %s\n",
+                argv[0], benchmarks[i].name, benchmarks[i].args);
+        return 1;
+      }
+      return ret;
+    }
+  }
+  usage(argv[0]);
+  return 1;
+}
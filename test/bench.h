@@ -0,0 +1,79 @@
+/* Timing helpers shared by the benchmarks in bench.c and bench-jalloc.cpp.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds on the monotonic clock.
+static inline double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU seconds used by the calling thread.
+static inline double
+threadCpuSeconds()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs threadMain in numThreads threads for the given number of seconds, and
+// then sets *done.  Each thread gets a pointer to its own counter, on its own
+// cache line.  Returns the sum of the counters and sets *elapsed.
+static inline unsigned long
+runThreads(int numThreads, int seconds, void *(*threadMain)(void *),
+           volatile int *done, double *elapsed)
+{
+  pthread_t *threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+  unsigned long *counts =
+    (unsigned long *)calloc(numThreads * 16, sizeof(unsigned long));
+  unsigned long total = 0;
+  double start = now();
+  int i;
+
+  for (i = 0; i < numThreads; i++) {
+    if (pthread_create(&threads[i], NULL, threadMain, &counts[i * 16]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  sleep(seconds);
+  *done = 1;
+
+  for (i = 0; i < numThreads; i++) {
+    pthread_join(threads[i], NULL);
+    total += counts[i * 16];
+  }
+  *elapsed = now() - start;
+
+  free(threads);
+  free(counts);
+  return total;
+}
+
+// Prints the throughput of the operations counted by runThreads().
+static inline void
+reportThreads(int numThreads, const char *ops, unsigned long total,
+              double elapsed)
+{
+  printf("threads: %d  %s: %lu  seconds: %.3f  %s/sec: %.0f"
+         "  ns/op/thread: %.1f\n",
+         numThreads, ops, total, elapsed, ops, total / elapsed,
+         elapsed * 1e9 * numThreads / (total ? total : 1));
+}
+
+#endif // ifndef BENCH_H
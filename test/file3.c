@@ -0,0 +1,100 @@
+/* Run by autotest.py with DMTCP_CKPT_FILE_STORE=1.  Keeps two unlinked
+ * files open, so that their contents are saved at checkpoint time.  Both
+ * start with the same few megabytes, so they share chunks in the file
+ * store.  Every second, one file grows and the other changes in place, and
+ * both are compared with a copy kept in memory.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SIZE     (3 * 1024 * 1024 + 12345)
+#define MAX_SIZE (SIZE + 1024 * 1024)
+
+static int
+createFile(const char *dir)
+{
+  char filename[256];
+  int fd;
+
+  snprintf(filename, sizeof(filename), "%s/dmtcp_file3_XXXXXX", dir);
+  fd = mkstemp(filename);
+  if (fd == -1) {
+    perror("mkstemp");
+    exit(1);
+  }
+  unlink(filename);
+  return fd;
+}
+
+static void
+writeAt(int fd, const char *buf, size_t len, off_t offset)
+{
+  if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+    perror("pwrite");
+    exit(1);
+  }
+}
+
+static void
+check(int fd, const char *expected, size_t len, const char *name)
+{
+  static char buf[MAX_SIZE];
+
+  if (lseek(fd, 0, SEEK_END) != (off_t)len ||
+      pread(fd, buf, len, 0) != (ssize_t)len ||
+      memcmp(buf, expected, len) != 0) {
+    fprintf(stderr, "Contents of the %s file changed\n", name);
+    abort();
+  }
+}
+
+int
+main()
+{
+  char *growing = malloc(MAX_SIZE);
+  char *changing = malloc(SIZE);
+  size_t growingLen = SIZE;
+  unsigned long count;
+  int growingFd, changingFd;
+  size_t i;
+
+  char *dir = getenv("DMTCP_TMPDIR");
+  if (!dir) {
+    dir = getenv("TMPDIR");
+  }
+  if (!dir) {
+    dir = "/tmp";
+  }
+
+  for (i = 0; i < SIZE; i++) {
+    growing[i] = changing[i] = (char)(i * 7 + i / 4096);
+  }
+  growingFd = createFile(dir);
+  changingFd = createFile(dir);
+  writeAt(growingFd, growing, SIZE, 0);
+  writeAt(changingFd, changing, SIZE, 0);
+
+  for (count = 1;; count++) {
+    if (growingLen + sizeof(count) <= MAX_SIZE) {
+      memcpy(growing + growingLen, &count, sizeof(count));
+      writeAt(growingFd, growing + growingLen, sizeof(count), growingLen);
+      growingLen += sizeof(count);
+    }
+
+    // Change the second chunk only; the others stay shared.
+    memcpy(changing + 1024 * 1024 + 100, &count, sizeof(count));
+    writeAt(changingFd, changing + 1024 * 1024 + 100, sizeof(count),
+            1024 * 1024 + 100);
+
+    check(growingFd, growing, growingLen, "growing");
+    check(changingFd, changing, SIZE, "changing");
+    printf("%lu ", count);
+    fflush(stdout);
+    sleep(1);
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+/* Checks MAP_SHARED file mappings that two processes share.  A parent and
+ * its child map the same unlinked file, and pass a counter back and forth
+ * through it.  Both also map a second file read-only.  After a restart, both
+ * must still see each other's writes and the original contents of both
+ * files.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define SIZE (64 * 1024)
+
+// The counter is at the start of the writable mapping; the pattern follows.
+#define HEADER sizeof(unsigned long)
+
+static int
+createFile(char *filename)
+{
+  char buf[SIZE];
+  int fd;
+  int i;
+
+  fd = mkstemp(filename);
+  if (fd == -1) {
+    perror("mkstemp");
+    exit(1);
+  }
+  unlink(filename);
+  for (i = 0; i < SIZE; i++) {
+    buf[i] = (char)(i % 253);
+  }
+  if (write(fd, buf, SIZE) != SIZE) {
+    perror("write");
+    exit(1);
+  }
+  return fd;
+}
+
+static void
+checkPattern(const char *addr, size_t start, const char *what)
+{
+  size_t i;
+
+  for (i = start; i < SIZE; i++) {
+    if (addr[i] != (char)(i % 253)) {
+      fprintf(stderr, "%d: %s: bad byte at offset %zu\n",
+              getpid(), what, i);
+      abort();
+    }
+  }
+}
+
+// The parent writes odd values and the child even ones.  Each waits for the
+// other to take its turn, for at most 10 seconds outside of a checkpoint.
+static void
+pingPong(volatile unsigned long *counter, const char *shared,
+         const char *readOnly, int isParent)
+{
+  while (1) {
+    unsigned long value = *counter;
+    int waited = 0;
+
+    while (value % 2 != (unsigned long)(isParent ? 0 : 1)) {
+      usleep(10 * 1000);
+      if (++waited > 1000) {
+        fprintf(stderr, "%d: peer did not answer; counter is %lu\n",
+                getpid(), value);
+        abort();
+      }
+      value = *counter;
+    }
+
+    checkPattern(shared, HEADER, "shared mapping");
+    checkPattern(readOnly, 0, "read-only mapping");
+    if (isParent) {
+      printf("%lu ", value);
+      fflush(stdout);
+    }
+    *counter = value + 1;
+    usleep(100 * 1000);
+  }
+}
+
+int
+main()
+{
+  char filename[] = "dmtcp-shared-memory.XXXXXX";
+  char filename2[] = "dmtcp-shared-memory.XXXXXX";
+  char *shared;
+  char *readOnly;
+  int fd, fd2;
+  pid_t pid;
+
+  fd = createFile(filename);
+  fd2 = createFile(filename2);
+
+  shared = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  readOnly = mmap(NULL, SIZE, PROT_READ, MAP_SHARED, fd2, 0);
+  if (readOnly == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memset(shared, 0, HEADER);
+
+  pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  pingPong((volatile unsigned long *)shared, shared, readOnly, pid != 0);
+  return 0;
+}
@@ -0,0 +1,131 @@
+/* Keeps a SysV message queue full of messages of different sizes while it is
+ * checkpointed and restarted.  Two processes take messages off the queue,
+ * check their contents, and put them back, so that no message may be lost,
+ * duplicated or changed.
+ */
+
+// msgrcv, msgsnd require _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define NUM_MSGS 32
+#define MAX_SIZE 400
+
+struct my_msgbuf {
+  long mtype;
+  char buf[MAX_SIZE];
+};
+
+static size_t
+msg_size(int id)
+{
+  return sizeof(int) + (id * 37) % (MAX_SIZE - sizeof(int));
+}
+
+static void
+msg_snd(int msqid, int id)
+{
+  struct my_msgbuf msg;
+  size_t i;
+
+  msg.mtype = id + 1;
+  memcpy(msg.buf, &id, sizeof(id));
+  for (i = sizeof(id); i < msg_size(id); i++) {
+    msg.buf[i] = (char)(id + i);
+  }
+  if (msgsnd(msqid, &msg, msg_size(id), 0) == -1) {
+    perror("msgsnd failed");
+    exit(1);
+  }
+}
+
+static void
+msg_check(int msqid)
+{
+  struct my_msgbuf msg;
+  struct msqid_ds ds;
+  ssize_t len;
+  size_t i;
+  int id;
+
+  len = msgrcv(msqid, &msg, sizeof(msg.buf), 0, 0);
+  if (len == -1) {
+    perror("msgrcv failed");
+    exit(1);
+  }
+  memcpy(&id, msg.buf, sizeof(id));
+  if (id < 0 || id >= NUM_MSGS || msg.mtype != id + 1 ||
+      (size_t)len != msg_size(id)) {
+    fprintf(stderr, "Bad message: id %d, type %ld, size %zd\n",
+            id, msg.mtype, len);
+    abort();
+  }
+  for (i = sizeof(id); i < (size_t)len; i++) {
+    if (msg.buf[i] != (char)(id + i)) {
+      fprintf(stderr, "Message %d corrupted at byte %zu\n", id, i);
+      abort();
+    }
+  }
+
+  // Each of the two processes holds at most one message.
+  if (msgctl(msqid, IPC_STAT, &ds) == -1) {
+    perror("msgctl failed");
+    exit(1);
+  }
+  if (ds.msg_qnum < NUM_MSGS - 2 || ds.msg_qnum > NUM_MSGS - 1) {
+    fprintf(stderr, "Queue has %lu messages; expected %d\n",
+            (unsigned long)ds.msg_qnum, NUM_MSGS - 1);
+    abort();
+  }
+  msg_snd(msqid, id);
+}
+
+static void
+rotate(int msqid, const char *name)
+{
+  int i;
+
+  for (i = 1;; i++) {
+    msg_check(msqid);
+    if (i % 1000 == 0) {
+      printf("%s: %d\n", name, i);
+      fflush(stdout);
+    }
+    usleep(1000);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int msqid;
+  int i;
+
+  // Start from an empty queue.
+  msqid = msgget((key_t)9976, IPC_CREAT | 0666);
+  if (msqid != -1) {
+    msgctl(msqid, IPC_RMID, NULL);
+  }
+  msqid = msgget((key_t)9976, IPC_CREAT | 0666);
+  if (msqid == -1) {
+    perror("msgget failed");
+    exit(1);
+  }
+
+  for (i = 0; i < NUM_MSGS; i++) {
+    msg_snd(msqid, i);
+  }
+
+  if (fork() == 0) {
+    rotate(msqid, "Client");
+  } else {
+    rotate(msqid, "Server");
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+/* Checkpoints several SysV shared memory segments attached by two processes,
+ * so that each process saves some of them.  Each process checks that the
+ * contents of every segment, and its own counter in it, survive a restart.
+ */
+
+// shmget() needs sysv/ipc.h, which needs _XOPEN_SOURCE
+#define _XOPEN_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define NUM_SEGS 8
+#define SIZE     (64 * 1024)
+
+struct seg_header {
+  int counter[2];
+};
+
+static char *segs[NUM_SEGS];
+
+static char
+pattern(int seg, size_t i)
+{
+  return (char)(seg * 31 + i);
+}
+
+static void
+check(int proc, int round)
+{
+  int seg;
+  size_t i;
+
+  for (seg = 0; seg < NUM_SEGS; seg++) {
+    struct seg_header *hdr = (struct seg_header *)segs[seg];
+    if (hdr->counter[proc] != round) {
+      fprintf(stderr, "Segment %d: counter %d; expected %d\n",
+              seg, hdr->counter[proc], round);
+      abort();
+    }
+    for (i = sizeof(*hdr); i < SIZE; i++) {
+      if (segs[seg][i] != pattern(seg, i)) {
+        fprintf(stderr, "Segment %d corrupted at byte %zu\n", seg, i);
+        abort();
+      }
+    }
+    hdr->counter[proc] = round + 1;
+  }
+}
+
+static void
+run(int proc, const char *name)
+{
+  int round;
+
+  for (round = 0;; round++) {
+    check(proc, round);
+    printf("%s: %d\n", name, round);
+    fflush(stdout);
+    sleep(1);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int seg;
+  size_t i;
+
+  for (seg = 0; seg < NUM_SEGS; seg++) {
+    int shmid = shmget((key_t)(9990 + seg), SIZE, IPC_CREAT | 0666);
+    if (shmid == -1) {
+      perror("shmget");
+      exit(1);
+    }
+    segs[seg] = shmat(shmid, NULL, 0);
+    if (segs[seg] == (void *)-1) {
+      perror("shmat");
+      exit(1);
+    }
+    memset(segs[seg], 0, sizeof(struct seg_header));
+    for (i = sizeof(struct seg_header); i < SIZE; i++) {
+      segs[seg][i] = pattern(seg, i);
+    }
+  }
+
+  // The child inherits the attached segments.
+  if (fork() == 0) {
+    run(1, "Client");
+  } else {
+    run(0, "Server");
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+/* Checks that a SysV shm segment restored in place is still the segment
+ * named by its key: every second, it updates the segment through the first
+ * attach, attaches it again through shmget(), and checks that the new attach
+ * sees the same data and size.  The segment outlives the test, as in
+ * sysv-shm1; the next run removes it.
+ */
+
+// shmget() needs sysv/ipc.h, which needs _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define KEY  ((key_t)9989)
+#define SIZE (1024 * 1024)
+
+static void
+checkPattern(const unsigned char *addr, const char *what)
+{
+  size_t i;
+
+  for (i = sizeof(unsigned long); i < SIZE; i++) {
+    if (addr[i] != (unsigned char)(i % 251)) {
+      fprintf(stderr, "%s: bad byte at offset %zu\n", what, i);
+      abort();
+    }
+  }
+}
+
+int
+main()
+{
+  unsigned char *addr;
+  unsigned long count;
+  int shmid;
+  size_t i;
+
+  // Remove a segment left behind by an earlier run.
+  if ((shmid = shmget(KEY, 0, 0)) != -1) {
+    shmctl(shmid, IPC_RMID, NULL);
+  }
+  if ((shmid = shmget(KEY, SIZE, IPC_CREAT | IPC_EXCL | 0666)) < 0) {
+    perror("shmget");
+    exit(1);
+  }
+  addr = (unsigned char *)shmat(shmid, NULL, 0);
+  if (addr == (void *)-1) {
+    perror("shmat");
+    exit(1);
+  }
+  for (i = 0; i < SIZE; i++) {
+    addr[i] = (unsigned char)(i % 251);
+  }
+
+  for (count = 1;; count++) {
+    struct shmid_ds ds;
+    unsigned char *addr2;
+    int shmid2;
+
+    memcpy(addr, &count, sizeof(count));
+    checkPattern(addr, "first attach");
+
+    if ((shmid2 = shmget(KEY, 0, 0)) != shmid) {
+      fprintf(stderr, "Key maps to shmid %d; expected %d\n", shmid2, shmid);
+      abort();
+    }
+    if (shmctl(shmid2, IPC_STAT, &ds) == -1) {
+      perror("shmctl");
+      abort();
+    }
+    if (ds.shm_segsz != SIZE) {
+      fprintf(stderr, "Segment size is %zu; expected %d\n",
+              (size_t)ds.shm_segsz, SIZE);
+      abort();
+    }
+
+    addr2 = (unsigned char *)shmat(shmid2, NULL, SHM_RDONLY);
+    if (addr2 == (void *)-1) {
+      perror("shmat");
+      abort();
+    }
+    if (memcmp(addr2, &count, sizeof(count)) != 0) {
+      fprintf(stderr, "Second attach does not see the first one's writes\n");
+      abort();
+    }
+    checkPattern(addr2, "second attach");
+    if (shmdt(addr2) == -1) {
+      perror("shmdt");
+      abort();
+    }
+
+    printf("%lu ", count);
+    fflush(stdout);
+    sleep(1);
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+/* Run by autotest.py with DMTCP_TCP_REPAIR=1, when TCP_REPAIR is available.
+ * A child streams a byte pattern to its parent over a loopback TCP
+ * connection as fast as it can, while the parent reads it slowly.  So at
+ * checkpoint time, both the receive queue and the send queue are full, and
+ * part of the send queue has not been sent yet.  The parent checks that no
+ * byte is lost, duplicated or reordered.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static void
+writer(int sd)
+{
+  unsigned char buf[4096];
+  unsigned long offset = 0;
+
+  while (1) {
+    size_t i;
+    ssize_t ret;
+
+    for (i = 0; i < sizeof(buf); i++) {
+      buf[i] = (unsigned char)((offset + i) % 251);
+    }
+    ret = write(sd, buf, sizeof(buf));
+    if (ret <= 0) {
+      perror("write");
+      exit(1);
+    }
+    offset += ret;
+  }
+}
+
+static void
+reader(int sd)
+{
+  unsigned char buf[1024];
+  unsigned long offset = 0;
+  unsigned long nextReport = 0;
+
+  while (1) {
+    ssize_t ret = read(sd, buf, sizeof(buf));
+    ssize_t i;
+
+    if (ret <= 0) {
+      perror("read");
+      abort();
+    }
+    for (i = 0; i < ret; i++) {
+      if (buf[i] != (unsigned char)((offset + i) % 251)) {
+        fprintf(stderr, "Wrong byte at offset %lu\n", offset + i);
+        abort();
+      }
+    }
+    offset += ret;
+    if (offset >= nextReport) {
+      printf("%lu ", offset);
+      fflush(stdout);
+      nextReport += 1024 * 1024;
+    }
+    usleep(1000);
+  }
+}
+
+int
+main()
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int listener, sd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener == -1 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      getsockname(listener, (struct sockaddr *)&addr, &len) == -1 ||
+      listen(listener, 1) == -1) {
+    perror("listener");
+    return 1;
+  }
+
+  if (fork() == 0) {
+    close(listener);
+    sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd == -1 ||
+        connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      perror("connect");
+      return 1;
+    }
+    writer(sd);
+  }
+
+  sd = accept(listener, NULL, NULL);
+  if (sd == -1) {
+    perror("accept");
+    return 1;
+  }
+  close(listener);
+  reader(sd);
+  return 0;
+}
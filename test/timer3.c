@@ -0,0 +1,163 @@
+/* Checks that POSIX timers are re-armed with their remaining time after a
+ * restart.  Every second, it checks that:
+ * - a periodic timer keeps firing, and timer_getoverrun() still works on it;
+ * - one-shot timers armed an hour ahead, a relative one on CLOCK_MONOTONIC
+ *   and an absolute one on the process CPU-time clock, are still armed, and
+ *   never have more time left than at the previous check;
+ * - a disarmed timer stays disarmed;
+ * - a timer created in the slot of a deleted timer still works.
+ */
+
+// _POSIX_C_SOURCE is for timer_create()
+#define _POSIX_C_SOURCE 199309L
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define errExit(msg) \
+  do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+static volatile sig_atomic_t expirations = 0;
+
+static void
+handler(int sig)
+{
+  expirations++;
+}
+
+static double
+toSeconds(const struct timespec *ts)
+{
+  return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static timer_t
+createTimer(clockid_t clockid, int notify)
+{
+  struct sigevent sev;
+  timer_t timerid;
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = notify;
+  sev.sigev_signo = SIGUSR1;
+  if (timer_create(clockid, &sev, &timerid) == -1) {
+    errExit("timer_create");
+  }
+  return timerid;
+}
+
+static void
+armTimer(timer_t timerid, int flags, time_t value, long interval_ns)
+{
+  struct itimerspec its;
+
+  its.it_value.tv_sec = value;
+  its.it_value.tv_nsec = interval_ns;
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = interval_ns;
+  if (timer_settime(timerid, flags, &its, NULL) == -1) {
+    errExit("timer_settime");
+  }
+}
+
+// Returns the time left on the timer.
+static double
+timeLeft(timer_t timerid)
+{
+  struct itimerspec its;
+
+  if (timer_gettime(timerid, &its) == -1) {
+    errExit("timer_gettime");
+  }
+  return toSeconds(&its.it_value);
+}
+
+static void
+checkOneShot(timer_t timerid, const char *name, double *prev)
+{
+  double left = timeLeft(timerid);
+
+  if (left <= 0 || left > *prev) {
+    fprintf(stderr, "%s: %.3f s left; %.3f s at the previous check\n",
+            name, left, *prev);
+    abort();
+  }
+  *prev = left;
+}
+
+int
+main()
+{
+  struct sigaction sa;
+  struct timespec now;
+  timer_t periodic, monotonic, cputime, disarmed, deleted, reused;
+  double monotonicLeft = 3600, cputimeLeft = 3600;
+  sig_atomic_t lastExpirations = 0;
+  int i;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+    errExit("sigaction");
+  }
+
+  // Fires every 100 ms.
+  periodic = createTimer(CLOCK_MONOTONIC, SIGEV_SIGNAL);
+  armTimer(periodic, 0, 0, 100 * 1000 * 1000);
+
+  monotonic = createTimer(CLOCK_MONOTONIC, SIGEV_NONE);
+  armTimer(monotonic, 0, 3600, 0);
+
+  cputime = createTimer(CLOCK_PROCESS_CPUTIME_ID, SIGEV_NONE);
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now) == -1) {
+    errExit("clock_gettime");
+  }
+  armTimer(cputime, TIMER_ABSTIME, now.tv_sec + 3600, 0);
+
+  disarmed = createTimer(CLOCK_MONOTONIC, SIGEV_NONE);
+
+  deleted = createTimer(CLOCK_MONOTONIC, SIGEV_NONE);
+  if (timer_delete(deleted) == -1) {
+    errExit("timer_delete");
+  }
+  reused = createTimer(CLOCK_MONOTONIC, SIGEV_NONE);
+  armTimer(reused, 0, 3600, 0);
+
+  for (i = 1;; i++) {
+    struct timespec ts = { 1, 0 };
+    while (nanosleep(&ts, &ts) == -1) {
+      continue;
+    }
+
+    if (expirations <= lastExpirations) {
+      fprintf(stderr, "Periodic timer stopped after %d expirations\n",
+              (int)expirations);
+      abort();
+    }
+    lastExpirations = expirations;
+    if (timer_getoverrun(periodic) == -1) {
+      errExit("timer_getoverrun");
+    }
+
+    checkOneShot(monotonic, "CLOCK_MONOTONIC timer", &monotonicLeft);
+    checkOneShot(cputime, "CLOCK_PROCESS_CPUTIME_ID timer", &cputimeLeft);
+    if (timeLeft(disarmed) != 0) {
+      fprintf(stderr, "Disarmed timer is armed\n");
+      abort();
+    }
+    if (timeLeft(reused) <= 0) {
+      fprintf(stderr, "Timer in a reused slot is not armed\n");
+      abort();
+    }
+
+    printf("%d: expirations: %d  one-shot left: %.1f s\n",
+           i, (int)expirations, monotonicLeft);
+    fflush(stdout);
+  }
+  return 0;
+}
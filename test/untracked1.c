@@ -0,0 +1,32 @@
+/* Run by autotest.py with DMTCP_UNTRACKED_PROGRAMS=printenv.  Checks that
+ * system() of an untracked program runs it outside of DMTCP, before and
+ * after a restart: printenv exits with status 1 when LD_PRELOAD is unset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int
+main()
+{
+  int count = 1;
+
+  while (1) {
+    int status = system("printenv LD_PRELOAD > /dev/null");
+
+    if (status == -1 || !WIFEXITED(status)) {
+      fprintf(stderr, "system() failed: status %d\n", status);
+      abort();
+    }
+    if (WEXITSTATUS(status) != 1) {
+      fprintf(stderr, "Untracked program ran with LD_PRELOAD set\n");
+      abort();
+    }
+    printf("%d ", count++);
+    fflush(stdout);
+    sleep(1);
+  }
+  return 0;
+}